@@ -1,17 +1,34 @@
 #ifndef MUTEX_H
 #define MUTEX_H
 
-typedef volatile long mutex_t;
+#include <stdint.h>
+
+// Ticket spinlock, for short critical sections. Waiters get the lock in the order they arrived, so none of them can starve.
+// The holder cant be preempted, otherwise a waiter could spin on the lock while the holder never gets to run again.
+// Locks that IRQ handlers or tasklets take too have to be taken with interrupts disabled everywhere.
+// Anything that is held for long, like around disk I/O, should use the sleeping locks in processes/sync.h instead.
+struct mutex_t {
+	constexpr mutex_t(int = 0) { }
+	uint32_t next = 0; // Next ticket to hand out
+	uint32_t owner = 0; // Ticket that holds the lock
+};
+
+// Defined by the scheduler
+void preempt_disable();
+void preempt_enable();
 
 static inline void acquire(mutex_t* mutex) {
-	while(!__sync_bool_compare_and_swap(mutex, 0, 1)) {
-		asm("pause");
+	preempt_disable();
+	uint32_t ticket = __atomic_fetch_add(&mutex->next, 1, __ATOMIC_RELAXED);
+	while(__atomic_load_n(&mutex->owner, __ATOMIC_ACQUIRE) != ticket) {
+		asm volatile("pause");
 	}
 }
- 
+
 static inline void release(mutex_t* mutex) {
-	__sync_synchronize();
-	*mutex = 0;
+	// Only the holder writes owner
+	__atomic_store_n(&mutex->owner, __atomic_load_n(&mutex->owner, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+	preempt_enable();
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -15,6 +15,15 @@ isr\n:
     jmp isr_common
 .endm
 
+.macro int_msi n
+.align 16
+.global msi\n
+msi\n:
+	push $0
+	pushq $\n
+    jmp msi_common
+.endm
+
 .macro int_irq n
 .align 16
 .global irq\n
@@ -47,6 +56,9 @@ isr_common:
 	mov %rsp, %rdi
 .extern isr_main
 	call isr_main
+// New threads start here, with the frame they should run with on their stack (see Scheduler::PrepareStack)
+.global interrupt_return
+interrupt_return:
 	popq %r15
 	popq %r14
 	popq %r13
@@ -105,6 +117,45 @@ irq_common:
 	add $16, %rsp // Info field
 	iretq
     
+msi_common:
+    // Push all registers
+	pushq %rbp
+	pushq %rdi
+	pushq %rsi
+	pushq %rdx
+	pushq %rcx
+	pushq %rbx
+	pushq %rax
+	pushq %r8
+	pushq %r9
+	pushq %r10
+	pushq %r11
+	pushq %r12
+	pushq %r13
+	pushq %r14
+	pushq %r15
+
+	mov %rsp, %rdi
+.extern msi_main
+	call msi_main
+	popq %r15
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %r11
+	popq %r10
+	popq %r9
+	popq %r8
+	popq %rax
+	popq %rbx
+	popq %rcx
+	popq %rdx
+	popq %rsi
+	popq %rdi
+	popq %rbp
+	add $16, %rsp // Info field
+	iretq
+
 int_noerr 0
 int_noerr 1
 int_noerr 2
@@ -156,3 +207,172 @@ int_irq 14
 int_irq 15
 
 int_noerr 128
+
+// Vectors that are handed out for MSI and MSI-X
+int_msi 48
+int_msi 49
+int_msi 50
+int_msi 51
+int_msi 52
+int_msi 53
+int_msi 54
+int_msi 55
+int_msi 56
+int_msi 57
+int_msi 58
+int_msi 59
+int_msi 60
+int_msi 61
+int_msi 62
+int_msi 63
+int_msi 64
+int_msi 65
+int_msi 66
+int_msi 67
+int_msi 68
+int_msi 69
+int_msi 70
+int_msi 71
+int_msi 72
+int_msi 73
+int_msi 74
+int_msi 75
+int_msi 76
+int_msi 77
+int_msi 78
+int_msi 79
+int_msi 80
+int_msi 81
+int_msi 82
+int_msi 83
+int_msi 84
+int_msi 85
+int_msi 86
+int_msi 87
+int_msi 88
+int_msi 89
+int_msi 90
+int_msi 91
+int_msi 92
+int_msi 93
+int_msi 94
+int_msi 95
+int_msi 96
+int_msi 97
+int_msi 98
+int_msi 99
+int_msi 100
+int_msi 101
+int_msi 102
+int_msi 103
+int_msi 104
+int_msi 105
+int_msi 106
+int_msi 107
+int_msi 108
+int_msi 109
+int_msi 110
+int_msi 111
+int_msi 112
+int_msi 113
+int_msi 114
+int_msi 115
+int_msi 116
+int_msi 117
+int_msi 118
+int_msi 119
+int_msi 120
+int_msi 121
+int_msi 122
+int_msi 123
+int_msi 124
+int_msi 125
+int_msi 126
+int_msi 127
+
+// Spurious interrupts from the local APIC
+int_noerr 255
+
+.section .data
+.global msi_stubs
+msi_stubs:
+	.quad msi48
+	.quad msi49
+	.quad msi50
+	.quad msi51
+	.quad msi52
+	.quad msi53
+	.quad msi54
+	.quad msi55
+	.quad msi56
+	.quad msi57
+	.quad msi58
+	.quad msi59
+	.quad msi60
+	.quad msi61
+	.quad msi62
+	.quad msi63
+	.quad msi64
+	.quad msi65
+	.quad msi66
+	.quad msi67
+	.quad msi68
+	.quad msi69
+	.quad msi70
+	.quad msi71
+	.quad msi72
+	.quad msi73
+	.quad msi74
+	.quad msi75
+	.quad msi76
+	.quad msi77
+	.quad msi78
+	.quad msi79
+	.quad msi80
+	.quad msi81
+	.quad msi82
+	.quad msi83
+	.quad msi84
+	.quad msi85
+	.quad msi86
+	.quad msi87
+	.quad msi88
+	.quad msi89
+	.quad msi90
+	.quad msi91
+	.quad msi92
+	.quad msi93
+	.quad msi94
+	.quad msi95
+	.quad msi96
+	.quad msi97
+	.quad msi98
+	.quad msi99
+	.quad msi100
+	.quad msi101
+	.quad msi102
+	.quad msi103
+	.quad msi104
+	.quad msi105
+	.quad msi106
+	.quad msi107
+	.quad msi108
+	.quad msi109
+	.quad msi110
+	.quad msi111
+	.quad msi112
+	.quad msi113
+	.quad msi114
+	.quad msi115
+	.quad msi116
+	.quad msi117
+	.quad msi118
+	.quad msi119
+	.quad msi120
+	.quad msi121
+	.quad msi122
+	.quad msi123
+	.quad msi124
+	.quad msi125
+	.quad msi126
+	.quad msi127
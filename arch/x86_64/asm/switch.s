@@ -0,0 +1,24 @@
+// Kernel stack switching between threads
+.section .text
+
+// void switch_to(uint64_t* prev_rsp, uint64_t next_rsp)
+// Saves the callee saved registers on the stack of the current thread, stores its stack pointer in prev_rsp,
+// and continues the thread that saved next_rsp where it left off. Everything else was already saved by the C++
+// caller or the interrupt entry, and stays on the stacks.
+.global switch_to
+switch_to:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    mov %rsp, (%rdi)
+    mov %rsi, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
@@ -3,11 +3,14 @@
 #include <debug/klog.h>
 #include <stdarg.h>
 #include <CPP/string.h>
+#include <hardware/instructions.h>
 
 namespace Kernel {
 
 void KLog::printf(const char* fmt, ...) {
     // This printf is very simple, so we dont really care much about it
+    // IRQ handlers log too, so the mutex is only taken with interrupts disabled
+    unsigned long flags = save_irqdisable();
     acquire(&mutex);
     puts("\033[35m[KLog] \033[37m");
     va_list args;
@@ -27,7 +30,7 @@ void KLog::printf(const char* fmt, ...) {
             }
             ptr++;
             switch(*ptr) {
-                case '\0': return;
+                case '\0': ptr--; break;
                 case 'i':
                 case 'd': {
                     char buf[32];
@@ -72,13 +75,17 @@ void KLog::printf(const char* fmt, ...) {
     }
     puts("\033[37m");
     release(&mutex);
+    irqrestore(flags);
 }
 
 void KLog::userDebug(const char* str) {
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
     puts("\033[33m[uDbg] \033[37m");
     puts(str);
     puts("\033[37m\n\r");
     release(&mutex);
+    irqrestore(flags);
 }
 
 void KLog::puts(const char* str) {
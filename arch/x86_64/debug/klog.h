@@ -3,6 +3,7 @@
 
 #include <CPP/vector.h>
 #include <CPP/mutex.h>
+#include <hardware/instructions.h>
 
 
 namespace Kernel {
@@ -11,13 +12,16 @@ namespace Kernel {
         void printf(const char* fmt, ...);
         void userDebug(const char* str);
         void registerCallback(void (*callback)(void*, const char*), void* arg) {
+            unsigned long flags = save_irqdisable();
             acquire(&mutex);
             callbacks.push_back(callback);
             arguments.push_back(arg);
             release(&mutex);
+            irqrestore(flags);
         }
 
         void deregisterCallback(void (*callback)(void*, const char*)) {
+            unsigned long flags = save_irqdisable();
             acquire(&mutex);
             for(size_t i = 0; i < callbacks.size(); i++) {
                 if(callbacks.at(i) == callback) {
@@ -26,6 +30,7 @@ namespace Kernel {
                 }
             }
             release(&mutex);
+            irqrestore(flags);
         }
 
         static KLog& the() {
@@ -34,7 +39,7 @@ namespace Kernel {
         }
     private:
         void puts(const char* str);
-        // Mutex for printf
+        // Mutex for printf, only taken with interrupts disabled
         mutex_t mutex;
 
         // List of drivers we have to emit to
@@ -0,0 +1,83 @@
+#include <hardware/acpi.h>
+#include <mem/VM/virtmem.h>
+#include <debug/klog.h>
+#include <CPP/vector.h>
+#include <mem.h>
+
+namespace Kernel {
+    namespace ACPI {
+        struct RSDP {
+            char signature[8];
+            uint8_t checksum;
+            char oem_id[6];
+            uint8_t revision;
+            uint32_t rsdt_address;
+            // Only valid from revision 2 on
+            uint32_t length;
+            uint64_t xsdt_address;
+            uint8_t extended_checksum;
+            uint8_t reserved[3];
+        } __attribute__((packed));
+
+        // Every table the XSDT (or RSDT) points to, mapped
+        Vector<SDTHeader*> tables;
+
+        static bool ChecksumValid(void* data, size_t len) {
+            uint8_t sum = 0;
+            for(size_t i = 0; i < len; i++) { sum += ((uint8_t*)data)[i]; }
+            return sum == 0;
+        }
+
+        // The tables can be outside of the memory map, so they are mapped as IO space instead of going through the HHDM
+        static SDTHeader* MapTable(uint64_t phys) {
+            SDTHeader* header = (SDTHeader*)VM::MapIOSpace(phys, sizeof(SDTHeader));
+            uint32_t length = header->length;
+            if(length < sizeof(SDTHeader)) { return NULL; }
+            return (SDTHeader*)VM::MapIOSpace(phys, length);
+        }
+
+        void Init(uint64_t rsdp) {
+            if(!rsdp) {
+                KLog::the().printf("ACPI: no RSDP\n\r");
+                return;
+            }
+            // The bootloader might hand us a higher half pointer
+            if(rsdp >= VM::GetVirtualOffset()) { rsdp -= VM::GetVirtualOffset(); }
+            RSDP* rsdp_table = (RSDP*)VM::MapIOSpace(rsdp, sizeof(RSDP));
+            if(!ChecksumValid(rsdp_table, 20)) {
+                KLog::the().printf("ACPI: RSDP checksum is wrong\n\r");
+                return;
+            }
+            // Use the XSDT if there is one, it has 64 bit pointers
+            bool xsdt = rsdp_table->revision >= 2 && rsdp_table->xsdt_address && ChecksumValid(rsdp_table, sizeof(RSDP));
+            SDTHeader* root_table = MapTable(xsdt ? rsdp_table->xsdt_address : rsdp_table->rsdt_address);
+            if(!root_table || !ChecksumValid(root_table, root_table->length)) {
+                KLog::the().printf("ACPI: root table is invalid\n\r");
+                return;
+            }
+            uint8_t* entries = (uint8_t*)root_table + sizeof(SDTHeader);
+            size_t entry_size = xsdt ? 8 : 4;
+            size_t entry_count = (root_table->length - sizeof(SDTHeader)) / entry_size;
+            for(size_t i = 0; i < entry_count; i++) {
+                // The entries are not aligned
+                uint64_t phys = 0;
+                memcopy(entries + (i * entry_size), &phys, entry_size);
+                SDTHeader* table = MapTable(phys);
+                if(!table || !ChecksumValid(table, table->length)) { continue; }
+                tables.push_back(table);
+            }
+            KLog::the().printf("ACPI: %s lists %i valid tables\n\r", xsdt ? "XSDT" : "RSDT", tables.size());
+        }
+
+        SDTHeader* FindTable(const char* signature, size_t index) {
+            for(size_t i = 0; i < tables.size(); i++) {
+                SDTHeader* table = tables.at(i);
+                if(table->signature[0] != signature[0] || table->signature[1] != signature[1]
+                    || table->signature[2] != signature[2] || table->signature[3] != signature[3]) { continue; }
+                if(index == 0) { return table; }
+                index--;
+            }
+            return NULL;
+        }
+    }
+}
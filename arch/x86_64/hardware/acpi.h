@@ -0,0 +1,30 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace Kernel {
+    namespace ACPI {
+        // Header every system description table starts with
+        struct SDTHeader {
+            char signature[4];
+            uint32_t length;
+            uint8_t revision;
+            uint8_t checksum;
+            char oem_id[6];
+            char oem_table_id[8];
+            uint32_t oem_revision;
+            uint32_t creator_id;
+            uint32_t creator_revision;
+        } __attribute__((packed));
+
+        // Map every table the root table points to. rsdp is the address given by the bootloader, 0 if there is none.
+        void Init(uint64_t rsdp);
+        // Find the index-th table with the 4 character signature.
+        // Returns NULL if there is no such table. Tables with a wrong checksum are skipped.
+        SDTHeader* FindTable(const char* signature, size_t index = 0);
+    }
+}
+
+#endif
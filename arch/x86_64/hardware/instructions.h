@@ -51,10 +51,26 @@ static inline void irqrestore(unsigned long flags)
     asm ("push %0\n\tpopf" : : "rm"(flags) : "memory","cc");
 }
 
+static inline bool interrupts_enabled() {
+    unsigned long flags;
+    asm volatile ("pushf\n\tpop %0" : "=r"(flags));
+    return flags & (1 << 9);
+}
+
 static inline void write_msr(uint64_t msr, uint64_t data) {
     uint64_t rax = data & 0xFFFFFFFF;
     uint64_t rdx = data >> 32;
     asm("wrmsr" :: "a" (rax), "d" (rdx), "c"(msr));
 }
 
+static inline uint64_t read_msr(uint64_t msr) {
+    uint32_t rax, rdx;
+    asm volatile("rdmsr" : "=a" (rax), "=d" (rdx) : "c"(msr));
+    return ((uint64_t)rdx << 32) | rax;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    asm volatile("cpuid" : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "a" (leaf), "c" (0));
+}
+
 #endif
\ No newline at end of file
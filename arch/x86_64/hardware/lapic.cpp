@@ -0,0 +1,56 @@
+#include <hardware/lapic.h>
+#include <hardware/instructions.h>
+#include <mem/VM/virtmem.h>
+#include <debug/klog.h>
+
+namespace Kernel {
+    namespace LAPIC {
+        enum Registers {
+            LAPIC_ID = 0x20,
+            LAPIC_EOI = 0xB0,
+            LAPIC_SVR = 0xF0,
+            LAPIC_LVT_LINT0 = 0x350,
+            LAPIC_LVT_LINT1 = 0x360
+        };
+
+        const uint64_t apic_base_msr = 0x1B;
+
+        static volatile uint8_t* registers = NULL;
+        static uint32_t id = 0;
+
+        static inline volatile uint32_t& Register(uint32_t reg) { return *(volatile uint32_t*)(registers + reg); }
+
+        bool Init() {
+            uint32_t eax, ebx, ecx, edx;
+            cpuid(1, &eax, &ebx, &ecx, &edx);
+            if(!(edx & (1 << 9))) {
+                KLog::the().printf("LAPIC: not present\n\r");
+                return false;
+            }
+            uint64_t base = read_msr(apic_base_msr);
+            // Make sure it is globally enabled
+            if(!(base & (1 << 11))) { write_msr(apic_base_msr, base | (1 << 11)); }
+            registers = (volatile uint8_t*)VM::MapIOSpace(base & ~0xFFFULL, 0x1000);
+            id = Register(LAPIC_ID) >> 24;
+
+            uint32_t svr = Register(LAPIC_SVR);
+            if(!(svr & (1 << 8))) {
+                // The firmware left it software disabled, which masks the LVTs.
+                // Set up virtual wire mode, so the PIC still reaches us through LINT0, and NMIs through LINT1.
+                Register(LAPIC_SVR) = (1 << 8) | spurious_vector;
+                Register(LAPIC_LVT_LINT0) = 0x700; // ExtINT
+                Register(LAPIC_LVT_LINT1) = 0x400; // NMI
+            } else {
+                Register(LAPIC_SVR) = (svr & ~0xFF) | spurious_vector;
+            }
+            KLog::the().printf("LAPIC: id %i at %x\n\r", id, base & ~0xFFFULL);
+            return true;
+        }
+
+        bool Present() { return registers != NULL; }
+
+        uint32_t ID() { return id; }
+
+        void EOI() { Register(LAPIC_EOI) = 0; }
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef LAPIC_H
+#define LAPIC_H
+
+#include <stdint.h>
+
+namespace Kernel {
+    namespace LAPIC {
+        // Enable the local APIC, so it accepts MSIs. The 8259 PIC keeps delivering the legacy IRQs through LINT0.
+        // Returns false if there is no local APIC.
+        bool Init();
+        bool Present();
+        uint32_t ID();
+        // Signal the end of a interrupt the local APIC delivered. Not needed for the PIC IRQs.
+        void EOI();
+
+        // The vector the APIC uses for spurious interrupts, these need no EOI
+        const uint8_t spurious_vector = 0xFF;
+
+        // MSI address and data that deliver vector to this CPU, edge triggered
+        inline uint64_t MSIAddress() { return 0xFEE00000 | ((uint64_t)(ID() & 0xFF) << 12); }
+        inline uint32_t MSIData(uint8_t vector) { return vector; }
+    }
+}
+
+#endif
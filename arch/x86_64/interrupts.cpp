@@ -6,6 +6,9 @@
 #include <processes/syscalls/syscall.h>
 #include <processes/scheduler.h>
 #include <mem/PM/physalloc.h>
+#include <hardware/lapic.h>
+#include <softirq.h>
+#include <errno.h>
 
 // Interrupts from CPU (Page fault, GPF, ...)
 extern "C" void isr0 ();
@@ -62,15 +65,29 @@ extern "C" void irq15();
 // Syscall interrupt
 extern "C" void isr128();
 
+// Spurious interrupts from the local APIC
+extern "C" void isr255();
+
+// MSI vectors, from first_msi_vector on
+extern "C" void (*msi_stubs[])();
+
 
 // C-to-Cpp function jump basically
+// Threads of killed processes exit here, on their way back to user mode
 extern "C" void isr_main(Kernel::Interrupts::ISRRegisters* registers) {
     Kernel::Interrupts::the().HandleISR(registers);
+    Kernel::Processes::Scheduler::the().ExitPoint(registers);
 }
 
 // TODO
 extern "C" void irq_main(Kernel::Interrupts::ISRRegisters* registers) {
     Kernel::Interrupts::the().HandleIRQ(registers);
+    Kernel::Processes::Scheduler::the().ExitPoint(registers);
+}
+
+extern "C" void msi_main(Kernel::Interrupts::ISRRegisters* registers) {
+    Kernel::Interrupts::the().HandleMSI(registers);
+    Kernel::Processes::Scheduler::the().ExitPoint(registers);
 }
 
 namespace Kernel {
@@ -151,8 +168,8 @@ namespace Kernel {
                 if(registers->error & 0b100) {
                     Debug::SerialPrint("Killing current process due to page fault\r\n");
                     Processes::Scheduler::the().KillCurrentProcess();
-                    Processes::Scheduler::the().Schedule(registers);
                     Debug::SerialPrint("----------\r\n\r\n");
+                    // The thread exits instead of returning to the faulting instruction
                     return;
                 }
 
@@ -176,8 +193,8 @@ namespace Kernel {
                 if((registers->cs & 0b11) == 0b11) {
                     Debug::SerialPrint("Killing current process due to GPF\r\n");
                     Processes::Scheduler::the().KillCurrentProcess();
-                    Processes::Scheduler::the().Schedule(registers);
                     Debug::SerialPrintf("------------------------\r\n\r\n");
+                    // The thread exits instead of returning to the faulting instruction
                     return;
                 }
                 Kernel::Debug::Panic("General protection fault");
@@ -190,8 +207,12 @@ namespace Kernel {
             // Syscalls
             case 0x80: {
                 SyscallHandler::the().HandleSyscall(registers);
+                // Going back to user mode is always a good point to switch
+                Processes::Scheduler::the().PreemptPoint();
                 break;
             }
+            // Spurious interrupts dont need a EOI, and there is nothing to handle
+            case LAPIC::spurious_vector: { break; }
 
             default: {
                 Debug::SerialPrint("UNHANDLED INTERRUPT: "); Debug::SerialPrintInt(registers->int_num, 10); Debug::SerialPrint("\n\r");
@@ -212,18 +233,87 @@ namespace Kernel {
         irq_handlers[irq_number] = NULL;
     }
 
+    void Interrupts::RegisterThreadedIRQHandler(int irq_number, irq_handler_t hard, void (*thread)(void* data), void* data) {
+        if(irq_number >= 16) {
+            Debug::Panic("invalid irq");
+        }
+        ThreadedIRQ* threaded = new ThreadedIRQ;
+        threaded->hard = hard;
+        threaded->thread = thread;
+        threaded->data = data;
+        threaded->pending = false;
+        threaded->task = NULL;
+        Processes::Scheduler::the().CreateKernelTask(ThreadedIRQTask, threaded, 4);
+        threaded_irqs[irq_number] = threaded;
+    }
+
+    void Interrupts::ThreadedIRQTask(void* arg) {
+        ThreadedIRQ* threaded = (ThreadedIRQ*)arg;
+        threaded->task = Processes::Scheduler::the().CurrentThread();
+        // IRQ threads should run as soon as their IRQ comes in, ahead of everything that is not real time
+        Processes::Scheduler::the().SetScheduling(threaded->task, Processes::SchedPolicy::FIFO, 50, 0);
+        for(;;) {
+            // Check and block with interrupts off, so the IRQ cant wake us up in between
+            unsigned long flags = save_irqdisable();
+            if(!threaded->pending) { Processes::Scheduler::the().SleepCurrent(); }
+            threaded->pending = false;
+            irqrestore(flags);
+            threaded->thread(threaded->data);
+        }
+    }
+
     void Interrupts::HandleIRQ(ISRRegisters* registers) {
         // Check if a handler exists
         // Debug::SerialPrint("irq: got irq "); Debug::SerialPrintInt(registers->int_num, 10); Debug::SerialPrint("\n\r");
-        if(irq_handlers[registers->int_num] == NULL) {
+        // Send EOI first. Handlers like the timer can switch to another thread, which must not run with the IRQ unacknowledged.
+        if(registers->int_num >= 8) { outb(pic2_io_command, 0x20); }
+        outb(pic1_io_command, 0x20);
+
+        ThreadedIRQ* threaded = threaded_irqs[registers->int_num];
+        if(threaded) {
+            if(threaded->hard) { threaded->hard(registers); }
+            threaded->pending = true;
+            if(threaded->task) { Processes::Scheduler::the().WakeUp(threaded->task); }
+        } else if(irq_handlers[registers->int_num] == NULL) {
             Debug::SerialPrint("irq: no handler registered for irq "); Debug::SerialPrintInt(registers->int_num, 10); Debug::SerialPrint("\n\r");
         } else {
             irq_handlers[registers->int_num](registers);
         }
-    
-        // Send EOI
-        if(registers->int_num >= 8) { outb(pic2_io_data, 0x20); }
-        outb(pic1_io_command, 0x20);
+
+        SoftIRQ::the().Run();
+        // A tick or a wake up might want another thread to run
+        Processes::Scheduler::the().PreemptPoint();
+    }
+
+    int Interrupts::AllocateVector(msi_handler_t handler, void* context) {
+        unsigned long flags = save_irqdisable();
+        for(int i = 0; i <= (last_msi_vector - first_msi_vector); i++) {
+            if(msi_handlers[i].handler) { continue; }
+            msi_handlers[i].handler = handler;
+            msi_handlers[i].context = context;
+            irqrestore(flags);
+            return first_msi_vector + i;
+        }
+        irqrestore(flags);
+        return -ENOSPC;
+    }
+
+    void Interrupts::FreeVector(int vector) {
+        if(vector < first_msi_vector || vector > last_msi_vector) { return; }
+        unsigned long flags = save_irqdisable();
+        msi_handlers[vector - first_msi_vector].handler = NULL;
+        msi_handlers[vector - first_msi_vector].context = NULL;
+        irqrestore(flags);
+    }
+
+    void Interrupts::HandleMSI(ISRRegisters* registers) {
+        MSIHandler* msi = &msi_handlers[registers->int_num - first_msi_vector];
+        if(msi->handler) { msi->handler(registers, msi->context); }
+        else { Debug::SerialPrintf("msi: no handler registered for vector %i\n\r", registers->int_num); }
+        LAPIC::EOI();
+
+        SoftIRQ::the().Run();
+        Processes::Scheduler::the().PreemptPoint();
     }
 
     void Interrupts::CreateEntry(int entry, void(*handler)(), uint8_t options) {
@@ -305,9 +395,14 @@ namespace Kernel {
         CreateEntry(46, irq14, InterruptGate);
         CreateEntry(47, irq15, InterruptGate);
 
+        // MSI vectors
+        for(int i = first_msi_vector; i <= last_msi_vector; i++) { CreateEntry(i, msi_stubs[i - first_msi_vector], InterruptGate); }
+
         // Syscall ISR
         CreateEntry(0x80, isr128, 0xee);
 
+        CreateEntry(LAPIC::spurious_vector, isr255, InterruptGate);
+
         // Setup IDT pointer
         idt_pointer.base = (uint64_t)&idt;
         idt_pointer.size = sizeof(idt);
@@ -317,6 +412,8 @@ namespace Kernel {
 
         // Zero the IRQ Handlers
         memset((void*)irq_handlers, 0x00, sizeof(irq_handlers));
+        memset((void*)threaded_irqs, 0x00, sizeof(threaded_irqs));
+        memset((void*)msi_handlers, 0x00, sizeof(msi_handlers));
     }
 
 }
\ No newline at end of file
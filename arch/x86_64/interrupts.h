@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 namespace Kernel {
+   namespace Processes { struct Thread; }
+
    class Interrupts {
    public:
       struct ISRRegisters {
@@ -41,10 +43,22 @@ namespace Kernel {
       typedef void (*irq_handler_t)(struct ISRRegisters*);
       void RegisterIRQHandler(int irq_number, irq_handler_t handler);
       void DeregisterIRQHandler(int irq_number);
+      // Register a threaded IRQ handler. hard runs in the IRQ, and should only acknowledge the device (it can be NULL).
+      // thread then runs in its own kernel task, where it can take its time and take any lock.
+      void RegisterThreadedIRQHandler(int irq_number, irq_handler_t hard, void (*thread)(void* data), void* data);
+
+      // Dedicated vectors for MSI and MSI-X. These are not shared, so every vector has one handler.
+      typedef void (*msi_handler_t)(struct ISRRegisters*, void* context);
+      static const int first_msi_vector = 48;
+      static const int last_msi_vector = 127;
+      // Returns the vector, or a negative errno if all of them are in use
+      int AllocateVector(msi_handler_t handler, void* context);
+      void FreeVector(int vector);
       
       // Proper Interrupt handlers
       void HandleISR(ISRRegisters* registers);
       void HandleIRQ(ISRRegisters* registers);
+      void HandleMSI(ISRRegisters* registers);
 
       // Singleton
       static Interrupts& the() {
@@ -59,6 +73,25 @@ namespace Kernel {
       // Registered IRQ Handlers
       irq_handler_t irq_handlers[16];
 
+      struct ThreadedIRQ {
+         irq_handler_t hard;
+         void (*thread)(void* data);
+         void* data;
+         // Set by the IRQ, cleared by the task before it calls thread
+         volatile bool pending;
+         // The kernel task, once it is running
+         Processes::Thread* volatile task;
+      };
+      ThreadedIRQ* threaded_irqs[16];
+      static void ThreadedIRQTask(void* arg);
+
+      struct MSIHandler {
+         msi_handler_t handler;
+         void* context;
+      };
+      // Registered MSI handlers, indexed from first_msi_vector. A NULL handler means the vector is free.
+      MSIHandler msi_handlers[last_msi_vector - first_msi_vector + 1];
+
 
       // PIC IO addresses
       const uint16_t pic1_io_command = 0x20;
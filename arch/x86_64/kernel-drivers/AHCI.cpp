@@ -0,0 +1,461 @@
+#include <kernel-drivers/AHCI.h>
+#include <mem/PM/physalloc.h>
+#include <mem/VM/virtmem.h>
+#include <hardware/instructions.h>
+#include <debug/klog.h>
+#include <errno.h>
+#include <mem.h>
+
+namespace Kernel {
+
+Vector<AHCIController*> ahci_controllers;
+
+bool AHCIController::Initialize() {
+    KLog::the().printf("AHCI: initializing AHCI controller at %i:%i.%i\n\r", bus, slot, function);
+    // The HBA registers are in BAR5, which has to be memory space
+    if(bars[5].io || !bars[5].address) {
+        KLog::the().printf("AHCI: BAR5 is not a memory BAR\n\r");
+        return false;
+    }
+    abar = (uint8_t*)VM::MapIOSpace(barAddress(5), 0x1100);
+    // Enable memory space access and bus mastering
+    uint16_t command = PCI::the().configRead(bus, slot, function, 0x4);
+    PCI::the().configWrite(bus, slot, function, 0x4, command | 0x6);
+    // Take the HBA over from the firmware, if it supports handoff
+    if(HBARegister(HBA_CAP2) & 0x1) {
+        HBARegister(HBA_BOHC) = HBARegister(HBA_BOHC) | (1 << 1);
+        while(HBARegister(HBA_BOHC) & (1 << 0)) { asm volatile("pause"); }
+    }
+    // Switch to AHCI mode
+    HBARegister(HBA_GHC) = HBARegister(HBA_GHC) | (1U << 31);
+    uint32_t cap = HBARegister(HBA_CAP);
+    slot_count = ((cap >> 8) & 0x1F) + 1;
+    supports_ncq = cap & (1U << 30);
+    addressing_64 = cap & (1U << 31);
+    KLog::the().printf("AHCI: version %x, %i command slots, NCQ: %s, 64 bit: %s\n\r", HBARegister(HBA_VS), slot_count, supports_ncq ? "yes" : "no", addressing_64 ? "yes" : "no");
+
+    uint32_t implemented = HBARegister(HBA_PI);
+    bool found = false;
+    for(int i = 0; i < 32; i++) {
+        if(!(implemented & (1U << i))) { continue; }
+        if(InitPort(i)) { found = true; }
+    }
+    if(!found) { return false; }
+
+    // Prefer a MSI, otherwise use the legacy interrupt line. If there is neither, we poll.
+    HBARegister(HBA_IS) = 0xFFFFFFFF;
+    if(EnableMSI(1) > 0) {
+        HBARegister(HBA_GHC) = HBARegister(HBA_GHC) | (1 << 1);
+        KLog::the().printf("AHCI: using MSI vector %i\n\r", msiVector(0));
+        return true;
+    }
+    uint8_t line = PCI::the().configRead(bus, slot, function, 0x3C) & 0xFF;
+    if(line < 16) {
+        irq = line;
+        ahci_controllers.push_back(this);
+        Interrupts::the().RegisterIRQHandler(irq, AHCIInterrupt);
+        HBARegister(HBA_GHC) = HBARegister(HBA_GHC) | (1 << 1);
+        KLog::the().printf("AHCI: using IRQ %i\n\r", irq);
+    }
+    return true;
+}
+
+void AHCIController::StopPort(int port) {
+    PortRegister(port, PORT_CMD) = PortRegister(port, PORT_CMD) & ~PORT_CMD_ST;
+    while(PortRegister(port, PORT_CMD) & PORT_CMD_CR) { asm volatile("pause"); }
+    PortRegister(port, PORT_CMD) = PortRegister(port, PORT_CMD) & ~PORT_CMD_FRE;
+    while(PortRegister(port, PORT_CMD) & PORT_CMD_FR) { asm volatile("pause"); }
+}
+
+void AHCIController::StartPort(int port) {
+    while(PortRegister(port, PORT_CMD) & PORT_CMD_CR) { asm volatile("pause"); }
+    PortRegister(port, PORT_CMD) = PortRegister(port, PORT_CMD) | PORT_CMD_FRE;
+    PortRegister(port, PORT_CMD) = PortRegister(port, PORT_CMD) | PORT_CMD_ST;
+}
+
+bool AHCIController::InitPort(int i) {
+    // Check if there is a device, and that the link is up
+    uint32_t ssts = PortRegister(i, PORT_SSTS);
+    if((ssts & 0xF) != 3 || ((ssts >> 8) & 0xF) != 1) { return false; }
+    uint32_t signature = PortRegister(i, PORT_SIG);
+    if(signature != 0x00000101) {
+        KLog::the().printf("AHCI: port %i has a non ATA device (signature %x), treating as not attached\n\r", i, signature);
+        return false;
+    }
+    StopPort(i);
+
+    AHCIPort* port = new AHCIPort;
+    port->controller = this;
+    port->port = i;
+    port->slot_count = slot_count;
+    // The command list (1KiB) and the received FIS area (256 bytes) share a page,
+    // every slot gets a 1KiB command table
+    port->command_list_phys = PM::AllocatePages();
+    port->fis_phys = port->command_list_phys + 1024;
+    port->command_tables_phys = PM::AllocatePages((32 * sizeof(AHCICommandTable)) / 4096);
+    if(!addressing_64 && ((port->command_list_phys >> 32) || (port->command_tables_phys >> 32))) {
+        KLog::the().printf("AHCI: port %i structures are above 4GiB, but the HBA cant do 64 bit addressing\n\r", i);
+        PM::FreePages(port->command_list_phys);
+        PM::FreePages(port->command_tables_phys, (32 * sizeof(AHCICommandTable)) / 4096);
+        delete port;
+        return false;
+    }
+    port->command_list = (AHCICommandHeader*)(port->command_list_phys + VM::GetVirtualOffset());
+    port->command_tables = (AHCICommandTable*)(port->command_tables_phys + VM::GetVirtualOffset());
+    memset(port->command_list, 0, 4096);
+    memset(port->command_tables, 0, 32 * sizeof(AHCICommandTable));
+    for(int slot = 0; slot < 32; slot++) {
+        uint64_t table = port->command_tables_phys + (slot * sizeof(AHCICommandTable));
+        port->command_list[slot].ctba = table & 0xFFFFFFFF;
+        port->command_list[slot].ctbau = table >> 32;
+    }
+    PortRegister(i, PORT_CLB) = port->command_list_phys & 0xFFFFFFFF;
+    PortRegister(i, PORT_CLBU) = port->command_list_phys >> 32;
+    PortRegister(i, PORT_FB) = port->fis_phys & 0xFFFFFFFF;
+    PortRegister(i, PORT_FBU) = port->fis_phys >> 32;
+    // Clear old errors and interrupts, and enable the ones we care about
+    PortRegister(i, PORT_SERR) = 0xFFFFFFFF;
+    PortRegister(i, PORT_IS) = 0xFFFFFFFF;
+    PortRegister(i, PORT_IE) = PORT_IS_DHRS | PORT_IS_PSS | PORT_IS_DSS | PORT_IS_SDBS | PORT_IS_TFES;
+    StartPort(i);
+
+    if(!Identify(port)) {
+        StopPort(i);
+        for(int slot = 0; slot < 32; slot++) {
+            if(!port->bounce[slot]) { continue; }
+            VM::FreePages(port->bounce[slot], max_prdt_entries);
+            delete[] port->bounce_pages[slot];
+        }
+        PM::FreePages(port->command_list_phys);
+        PM::FreePages(port->command_tables_phys, (32 * sizeof(AHCICommandTable)) / 4096);
+        delete port;
+        return false;
+    }
+    ports[i] = port;
+    BlockManager::the().RegisterBlockDevice(port);
+    return true;
+}
+
+bool AHCIController::Identify(AHCIPort* port) {
+    // The data goes into the bounce buffer of the slot, which the HBA is known to be able to reach
+    int slot = port->allocateSlot();
+    int err = port->allocateBounce(slot);
+    if(err < 0) {
+        KLog::the().printf("AHCI: port %i could not get a buffer for IDENTIFY\n\r", port->port);
+        port->freeSlot(slot);
+        return false;
+    }
+    err = port->execute(slot, ATA_CMD_IDENTIFY, 0, 0, port->bounce_pages[slot], 512, false);
+    uint32_t transferred = port->command_list[slot].prdbc;
+    uint16_t ident_info[256];
+    memcopy(port->bounce[slot], ident_info, 512);
+    port->freeSlot(slot);
+    if(err < 0 || transferred < 512) {
+        KLog::the().printf("AHCI: port %i errored during IDENTIFY\n\r", port->port);
+        return false;
+    }
+    // If the device gave a checksum, all 512 bytes have to add up to 0
+    if((ident_info[255] & 0xFF) == 0xA5) {
+        uint8_t sum = 0;
+        for(size_t i = 0; i < 512; i++) { sum += ((uint8_t*)ident_info)[i]; }
+        if(sum) {
+            KLog::the().printf("AHCI: port %i returned IDENTIFY data with a bad checksum\n\r", port->port);
+            return false;
+        }
+    }
+    // We only support LBA48
+    if(!(ident_info[83] & (1 << 10))) {
+        KLog::the().printf("AHCI: port %i does not support LBA48\n\r", port->port);
+        return false;
+    }
+    uint64_t lba_sector_count = 0;
+    lba_sector_count |= ident_info[100];
+    lba_sector_count |= ((uint64_t)(ident_info[101]) << 16);
+    lba_sector_count |= ((uint64_t)(ident_info[102]) << 32);
+    lba_sector_count |= ((uint64_t)(ident_info[103]) << 48);
+    if(!lba_sector_count) {
+        KLog::the().printf("AHCI: port %i reports no sectors\n\r", port->port);
+        return false;
+    }
+    port->len = lba_sector_count * 512;
+    // Use NCQ if both sides support it, limited to the queue depth of the drive
+    if(supports_ncq && (ident_info[76] & (1 << 8))) {
+        port->ncq = true;
+        int depth = (ident_info[75] & 0x1F) + 1;
+        if(depth < port->slot_count) { port->slot_count = depth; }
+    }
+    KLog::the().printf("AHCI: port %i: %x sectors, NCQ: %s, %i slots\n\r", port->port, lba_sector_count, port->ncq ? "yes" : "no", port->slot_count);
+    return true;
+}
+
+void AHCIController::IRQ() {
+    uint32_t pending = HBARegister(HBA_IS);
+    if(!pending) { return; }
+    for(int i = 0; i < 32; i++) {
+        if(!(pending & (1U << i)) || !ports[i]) { continue; }
+        acquire(&ports[i]->mutex);
+        uint32_t completed = ports[i]->checkCompletion();
+        release(&ports[i]->mutex);
+        ports[i]->endTransfers(completed);
+    }
+    HBARegister(HBA_IS) = pending;
+}
+
+void AHCIController::IRQTasklet(void* data) {
+    // The port mutexes are taken with interrupts disabled everywhere else
+    unsigned long flags = save_irqdisable();
+    ((AHCIController*)data)->IRQ();
+    irqrestore(flags);
+}
+
+uint32_t AHCIPort::checkCompletion() {
+    uint32_t issued = slots_issued;
+    uint32_t is = controller->PortRegister(port, AHCIController::PORT_IS);
+    controller->PortRegister(port, AHCIController::PORT_IS) = is;
+    if(is & AHCIController::PORT_IS_TFES) {
+        // A error aborts everything that is outstanding; fail all of it and restart the port
+        KLog::the().printf("AHCI: port %i task file error, TFD %x\n\r", port, controller->PortRegister(port, AHCIController::PORT_TFD));
+        slots_failed |= slots_issued;
+        slots_issued = 0;
+        controller->StopPort(port);
+        controller->PortRegister(port, AHCIController::PORT_SERR) = 0xFFFFFFFF;
+        controller->PortRegister(port, AHCIController::PORT_IS) = 0xFFFFFFFF;
+        controller->StartPort(port);
+    } else {
+        // Commands that are done have their bit cleared in both CI and SACT
+        uint32_t active = controller->PortRegister(port, AHCIController::PORT_CI) | controller->PortRegister(port, AHCIController::PORT_SACT);
+        slots_issued &= active;
+    }
+    uint32_t completed = issued & ~slots_issued;
+    if(!completed) { return 0; }
+    slot_waiters.wakeAll();
+    uint32_t async = 0;
+    for(int slot = 0; slot < 32; slot++) {
+        if((completed & (1U << slot)) && transfers[slot].request) { async |= (1U << slot); }
+    }
+    return async;
+}
+
+void AHCIPort::endTransfers(uint32_t completed) {
+    for(int slot = 0; completed; slot++) {
+        uint32_t bit = 1U << slot;
+        if(!(completed & bit)) { continue; }
+        completed &= ~bit;
+        asyncTransfer transfer = transfers[slot];
+        transfers[slot].request = NULL;
+        unsigned long flags = save_irqdisable();
+        acquire(&mutex);
+        bool failed = slots_failed & bit;
+        slots_failed &= ~bit;
+        release(&mutex);
+        irqrestore(flags);
+        if(!failed && !transfer.write) { memcopy(bounce[slot], transfer.buf, transfer.len); }
+        freeSlot(slot);
+        queue->endTransfer(transfer.request, failed ? -EIO : (int)transfer.len);
+    }
+}
+
+int AHCIPort::allocateSlot() {
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
+    for(;;) {
+        for(int slot = 0; slot < slot_count; slot++) {
+            if(slots_used & (1U << slot)) { continue; }
+            slots_used |= (1U << slot);
+            release(&mutex);
+            irqrestore(flags);
+            return slot;
+        }
+        // All slots are busy, wait until someone finishes
+        slot_waiters.wait(&mutex);
+    }
+}
+
+void AHCIPort::freeSlot(int slot) {
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
+    slots_used &= ~(1U << slot);
+    slot_waiters.wakeAll();
+    release(&mutex);
+    irqrestore(flags);
+}
+
+int AHCIPort::allocateBounce(int slot) {
+    if(bounce[slot]) { return 0; }
+    uint8_t* buffer = (uint8_t*)VM::AllocatePages(AHCIController::max_prdt_entries);
+    if(!buffer) { return -ENOMEM; }
+    uint64_t* pages = new uint64_t[AHCIController::max_prdt_entries];
+    for(size_t i = 0; i < AHCIController::max_prdt_entries; i++) {
+        pages[i] = VM::GetPhysical((uint64_t)buffer + (i * 4096));
+        if(!controller->addressing_64 && (pages[i] >> 32)) {
+            VM::FreePages(buffer, AHCIController::max_prdt_entries);
+            delete[] pages;
+            return -EIO;
+        }
+    }
+    bounce[slot] = buffer;
+    bounce_pages[slot] = pages;
+    return 0;
+}
+
+void AHCIPort::issue(int slot, uint8_t command, uint64_t lba, uint16_t sector_count, uint64_t* pages, size_t bytes, bool write) {
+    uint32_t bit = 1U << slot;
+    AHCICommandHeader* header = &command_list[slot];
+    AHCICommandTable* table = &command_tables[slot];
+    bool queued = command == AHCIController::ATA_CMD_READ_FPDMA_QUEUED || command == AHCIController::ATA_CMD_WRITE_FPDMA_QUEUED;
+
+    // Build the PRDT, one entry per page
+    size_t prd_count = (bytes + 4095) / 4096;
+    for(size_t i = 0; i < prd_count; i++) {
+        size_t prd_bytes = ((bytes - (i * 4096)) < 4096) ? (bytes - (i * 4096)) : 4096;
+        table->prdt[i].dba = pages[i] & 0xFFFFFFFF;
+        table->prdt[i].dbau = pages[i] >> 32;
+        table->prdt[i].reserved = 0;
+        table->prdt[i].dbc = (prd_bytes - 1) | ((i == (prd_count - 1)) ? (1U << 31) : 0);
+    }
+    // Build the H2D register FIS
+    uint8_t* fis = table->cfis;
+    memset(fis, 0, 64);
+    fis[0] = 0x27; // H2D register FIS
+    fis[1] = 0x80; // This is a command
+    fis[2] = command;
+    fis[4] = lba & 0xFF;
+    fis[5] = (lba >> 8) & 0xFF;
+    fis[6] = (lba >> 16) & 0xFF;
+    fis[7] = (command == AHCIController::ATA_CMD_IDENTIFY) ? 0 : 0x40; // LBA mode
+    fis[8] = (lba >> 24) & 0xFF;
+    fis[9] = (lba >> 32) & 0xFF;
+    fis[10] = (lba >> 40) & 0xFF;
+    if(queued) {
+        // NCQ commands carry the sector count in the features register, and the tag in the count register
+        fis[3] = sector_count & 0xFF;
+        fis[11] = (sector_count >> 8) & 0xFF;
+        fis[12] = slot << 3;
+    } else {
+        fis[12] = sector_count & 0xFF;
+        fis[13] = (sector_count >> 8) & 0xFF;
+    }
+    // The FIS is 5 dwords long
+    header->flags = 5 | (write ? (1 << 6) : 0);
+    header->prdtl = prd_count;
+    header->prdbc = 0;
+
+    // Issue it
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
+    if(queued) { controller->PortRegister(port, AHCIController::PORT_SACT) = bit; }
+    controller->PortRegister(port, AHCIController::PORT_CI) = bit;
+    slots_issued |= bit;
+    release(&mutex);
+    irqrestore(flags);
+}
+
+int AHCIPort::execute(int slot, uint8_t command, uint64_t lba, uint16_t sector_count, uint64_t* pages, size_t bytes, bool write) {
+    uint32_t bit = 1U << slot;
+    issue(slot, command, lba, sector_count, pages, bytes, write);
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
+    while(slots_issued & bit) {
+        if(controller->hasIRQ()) {
+            // The IRQ handler checks for completions and wakes us up
+            slot_waiters.wait(&mutex);
+            continue;
+        }
+        // Without interrupts, startTransfer does everything synchronously, so there is nothing in flight for us to end
+        checkCompletion();
+        release(&mutex);
+        irqrestore(flags);
+        asm volatile("pause");
+        flags = save_irqdisable();
+        acquire(&mutex);
+    }
+    // Collect the result
+    bool failed = slots_failed & bit;
+    slots_failed &= ~bit;
+    release(&mutex);
+    irqrestore(flags);
+    return failed ? -EIO : 0;
+}
+
+int AHCIPort::transfer(void* buf, size_t _len, size_t offset, bool write) {
+    if(offset >= len) { return 0; }
+    if((offset + _len) > len) { _len = len - offset; }
+    if(!_len) { return 0; }
+    uint8_t read_command = ncq ? AHCIController::ATA_CMD_READ_FPDMA_QUEUED : AHCIController::ATA_CMD_READ_DMA_EXT;
+    uint8_t write_command = ncq ? AHCIController::ATA_CMD_WRITE_FPDMA_QUEUED : AHCIController::ATA_CMD_WRITE_DMA_EXT;
+
+    // Every request goes through the bounce buffer of its slot, so that requests from different tasks can be queued at the same time
+    const size_t max_bytes = AHCIController::max_prdt_entries * 4096;
+    int slot = allocateSlot();
+    int err = allocateBounce(slot);
+    if(err < 0) {
+        KLog::the().printf("AHCI: port %i could not get a bounce buffer\n\r", port);
+        freeSlot(slot);
+        return err;
+    }
+    uint8_t* buffer = bounce[slot];
+    uint64_t* pages = bounce_pages[slot];
+
+    uint8_t* curr_buf = (uint8_t*)buf;
+    uint64_t curr = offset;
+    uint64_t end = offset + _len;
+    while(end > curr) {
+        uint64_t sector = curr / 512;
+        uint64_t first_sector_offset = curr % 512;
+        uint64_t chunk = end - curr;
+        if(chunk > (max_bytes - first_sector_offset)) { chunk = max_bytes - first_sector_offset; }
+        uint64_t sector_count = (first_sector_offset + chunk + 511) / 512;
+        if(write) {
+            // Partially written sectors have to be read in first
+            if(first_sector_offset || ((first_sector_offset + chunk) % 512)) {
+                err = execute(slot, read_command, sector, sector_count, pages, sector_count * 512, false);
+                if(err < 0) { break; }
+            }
+            memcopy(curr_buf, buffer + first_sector_offset, chunk);
+            err = execute(slot, write_command, sector, sector_count, pages, sector_count * 512, true);
+            if(err < 0) { break; }
+        } else {
+            err = execute(slot, read_command, sector, sector_count, pages, sector_count * 512, false);
+            if(err < 0) { break; }
+            memcopy(buffer + first_sector_offset, curr_buf, chunk);
+        }
+        curr += chunk;
+        curr_buf += chunk;
+    }
+    freeSlot(slot);
+    if(err < 0) { return (curr == offset) ? err : (int)(curr - offset); }
+    return _len;
+}
+
+void AHCIPort::startTransfer(BlockRequest* request, void* buf, size_t _len, size_t offset, bool write) {
+    // Only whole sectors that fit in one command can be done in one go. Everything else, and everything on a controller
+    // without interrupts to finish it, is done synchronously.
+    const size_t max_bytes = AHCIController::max_prdt_entries * 4096;
+    if(!controller->hasIRQ() || !_len || (offset % 512) || (_len % 512) || _len > max_bytes || (offset + _len) > len) {
+        queue->endTransfer(request, transfer(buf, _len, offset, write));
+        return;
+    }
+    int slot = allocateSlot();
+    int err = allocateBounce(slot);
+    if(err < 0) {
+        KLog::the().printf("AHCI: port %i could not get a bounce buffer\n\r", port);
+        freeSlot(slot);
+        queue->endTransfer(request, err);
+        return;
+    }
+    if(write) { memcopy(buf, bounce[slot], _len); }
+    transfers[slot] = { request, (uint8_t*)buf, _len, write };
+    uint8_t command;
+    if(ncq) { command = write ? AHCIController::ATA_CMD_WRITE_FPDMA_QUEUED : AHCIController::ATA_CMD_READ_FPDMA_QUEUED; }
+    else { command = write ? AHCIController::ATA_CMD_WRITE_DMA_EXT : AHCIController::ATA_CMD_READ_DMA_EXT; }
+    issue(slot, command, offset / 512, _len / 512, bounce_pages[slot], _len, write);
+}
+
+void AHCIInterrupt(Interrupts::ISRRegisters* regs) {
+    for(size_t i = 0; i < ahci_controllers.size(); i++) {
+        ahci_controllers.at(i)->IRQ();
+    }
+    (void)regs;
+}
+
+}
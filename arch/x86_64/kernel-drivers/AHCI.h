@@ -0,0 +1,197 @@
+#ifndef AHCI_H
+#define AHCI_H
+#include <kernel-drivers/PCI.h>
+#include <kernel-drivers/BlockDevices.h>
+#include <CPP/mutex.h>
+#include <interrupts.h>
+#include <softirq.h>
+#include <processes/sync.h>
+
+namespace Kernel {
+
+class AHCIController;
+struct AHCICommandHeader;
+struct AHCICommandTable;
+
+// A SATA disk attached to a AHCI port.
+struct AHCIPort : public BlockDevice {
+    int transfer(void* buf, size_t len, size_t offset, bool write) override;
+    // Transfers that fit in a single command are issued and left to the IRQ to finish, so every slot can have one in flight
+    void startTransfer(BlockRequest* request, void* buf, size_t len, size_t offset, bool write) override;
+    size_t queueDepth() override { return slot_count; }
+    // Build a command in slot and issue it. pages holds the physical pages of the data buffer.
+    void issue(int slot, uint8_t command, uint64_t lba, uint16_t sector_count, uint64_t* pages, size_t bytes, bool write);
+    // Issue a command and sleep until it completed
+    int execute(int slot, uint8_t command, uint64_t lba, uint16_t sector_count, uint64_t* pages, size_t bytes, bool write);
+    // Take a free slot, sleeping until one is if all are busy, and give it back again
+    int allocateSlot();
+    void freeSlot(int slot);
+    // Make sure slot has its bounce buffer. Returns 0, -ENOMEM, or -EIO if the HBA cant reach the buffer.
+    int allocateBounce(int slot);
+
+    AHCIController* controller;
+    int port;
+
+    // Command list, FIS receive area and command tables.
+    // Each slot has its own command table, so up to 32 commands can be in flight at once.
+    AHCICommandHeader* command_list;
+    uint64_t command_list_phys;
+    uint64_t fis_phys;
+    AHCICommandTable* command_tables;
+    uint64_t command_tables_phys;
+
+    bool ncq = false;
+    int slot_count;
+
+    // Bounce buffer of each slot, and the physical address of each of its pages. Only the owner of the slot uses it.
+    // They are allocated the first time the slot does a transfer and then kept, so transfers dont allocate and map a buffer each.
+    uint8_t* bounce[32] = { };
+    uint64_t* bounce_pages[32] = { };
+
+    // Transfer started by startTransfer in each slot, finished once its command completes. Only the owner of the slot
+    // and whoever finishes it use it.
+    struct asyncTransfer {
+        BlockRequest* request;
+        uint8_t* buf;
+        size_t len;
+        bool write;
+    };
+    asyncTransfer transfers[32] = { };
+
+    // Slot bookkeeping, protected by mutex (with interrupts disabled, as the IRQ handler takes it too)
+    uint32_t slots_used = 0; // Slots owned by a request
+    uint32_t slots_issued = 0; // Slots handed to the HBA that have not completed yet
+    uint32_t slots_failed = 0; // Completed with an error
+    // Woken up whenever a command completes or a slot is freed
+    WaitQueue slot_waiters;
+    mutex_t mutex = 0;
+
+    // Check which issued commands have completed. mutex must be held.
+    // Returns the slots of completed transfers from startTransfer, which have to be given to endTransfers without the mutex.
+    uint32_t checkCompletion();
+    void endTransfers(uint32_t completed);
+};
+
+class AHCIController : public PCIDevice {
+public:
+    AHCIController(uint8_t _bus, uint8_t _slot, uint8_t _function) : PCIDevice(_bus, _slot, _function) { }
+    bool Initialize() override;
+
+    // Called from the legacy PCI IRQ, or from the tasklet after a MSI
+    void IRQ();
+    inline bool hasIRQ() { return irq >= 0 || hasMSI(); }
+
+    inline volatile uint32_t& HBARegister(uint32_t reg) { return *(volatile uint32_t*)(abar + reg); }
+    inline volatile uint32_t& PortRegister(int port, uint32_t reg) { return *(volatile uint32_t*)(abar + 0x100 + (port * 0x80) + reg); }
+
+    enum HBARegisters {
+        HBA_CAP = 0x00,
+        HBA_GHC = 0x04,
+        HBA_IS = 0x08,
+        HBA_PI = 0x0C,
+        HBA_VS = 0x10,
+        HBA_CAP2 = 0x24,
+        HBA_BOHC = 0x28
+    };
+
+    enum PortRegisters {
+        PORT_CLB = 0x00,
+        PORT_CLBU = 0x04,
+        PORT_FB = 0x08,
+        PORT_FBU = 0x0C,
+        PORT_IS = 0x10,
+        PORT_IE = 0x14,
+        PORT_CMD = 0x18,
+        PORT_TFD = 0x20,
+        PORT_SIG = 0x24,
+        PORT_SSTS = 0x28,
+        PORT_SCTL = 0x2C,
+        PORT_SERR = 0x30,
+        PORT_SACT = 0x34,
+        PORT_CI = 0x38
+    };
+
+    enum PortCommandBits {
+        PORT_CMD_ST = (1 << 0),
+        PORT_CMD_SUD = (1 << 1),
+        PORT_CMD_POD = (1 << 2),
+        PORT_CMD_FRE = (1 << 4),
+        PORT_CMD_FR = (1 << 14),
+        PORT_CMD_CR = (1 << 15)
+    };
+
+    enum PortInterruptBits {
+        PORT_IS_DHRS = (1 << 0), // D2H register FIS
+        PORT_IS_PSS = (1 << 1), // PIO setup FIS
+        PORT_IS_DSS = (1 << 2), // DMA setup FIS
+        PORT_IS_SDBS = (1 << 3), // Set device bits FIS, used by NCQ completions
+        PORT_IS_TFES = (1 << 30) // Task file error
+    };
+
+    enum ATACommands {
+        ATA_CMD_READ_DMA_EXT = 0x25,
+        ATA_CMD_WRITE_DMA_EXT = 0x35,
+        ATA_CMD_READ_FPDMA_QUEUED = 0x60,
+        ATA_CMD_WRITE_FPDMA_QUEUED = 0x61,
+        ATA_CMD_IDENTIFY = 0xEC
+    };
+
+    // Max amount of PRDT entries per command table. With page sized entries, this limits
+    // a single command to 128KiB.
+    static const size_t max_prdt_entries = 32;
+
+    bool addressing_64 = false;
+
+private:
+    friend struct AHCIPort;
+
+    // MSIs are edge triggered, so the status can be checked and cleared after the IRQ
+    void HandleInterrupt(size_t index) override { SoftIRQ::the().Schedule(&irq_tasklet); (void)index; }
+    static void IRQTasklet(void* data);
+    Tasklet irq_tasklet{IRQTasklet, this};
+
+    bool InitPort(int port);
+    // Stop and start the command engine of a port
+    void StopPort(int port);
+    void StartPort(int port);
+    bool Identify(AHCIPort* port);
+
+    uint8_t* abar = NULL;
+    int slot_count;
+    bool supports_ncq;
+    int irq = -1;
+
+    AHCIPort* ports[32] = { };
+};
+
+// A command header in the command list
+struct AHCICommandHeader {
+    uint16_t flags; // CFL in bits 0-4, A 5, W 6, P 7, R 8, B 9, C 10, PMP 12-15
+    uint16_t prdtl; // Amount of PRDT entries
+    volatile uint32_t prdbc; // Bytes transferred
+    uint32_t ctba; // Command table base address
+    uint32_t ctbau;
+    uint32_t reserved[4];
+} __attribute__((packed));
+
+struct AHCIPRDTEntry {
+    uint32_t dba; // Data base address
+    uint32_t dbau;
+    uint32_t reserved;
+    uint32_t dbc; // Byte count - 1 in bits 0-21, interrupt on completion in bit 31
+} __attribute__((packed));
+
+// Command tables have to be 128 byte aligned; we give every slot 1KiB
+struct AHCICommandTable {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    AHCIPRDTEntry prdt[AHCIController::max_prdt_entries];
+    uint8_t padding[1024 - 128 - (AHCIController::max_prdt_entries * sizeof(AHCIPRDTEntry))];
+} __attribute__((packed));
+
+void AHCIInterrupt(Interrupts::ISRRegisters* regs);
+
+}
+
+#endif
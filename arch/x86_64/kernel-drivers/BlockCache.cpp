@@ -0,0 +1,370 @@
+#include <kernel-drivers/BlockCache.h>
+#include <mem/PM/physalloc.h>
+#include <mem/VM/virtmem.h>
+#include <hardware/instructions.h>
+#include <debug/klog.h>
+#include <timer.h>
+#include <mem.h>
+
+namespace Kernel {
+
+void BlockCache::init() {
+    // Let the cache use up to a quarter of RAM, and start giving memory back
+    // once less than a sixteenth of it is free
+    max_pages = PM::PageCount() / 4;
+    low_watermark = PM::PageCount() / 16;
+    max_dirty_pages = max_pages / 2;
+    pages.reserve(max_pages);
+    initialized = true;
+}
+
+uint64_t BlockCache::hash(BlockDevice* device, uint64_t page) {
+    uint64_t h = ((uint64_t)device >> 4) ^ (page * 0x9E3779B97F4A7C15);
+    return h ^ (h >> 32);
+}
+
+inline uint8_t* BlockCache::pageData(cachePage* entry) {
+    return (uint8_t*)(entry->phys + VM::GetVirtualOffset());
+}
+
+inline void BlockCache::markDirty(cachePage* entry) {
+    if(entry->dirty) { return; }
+    entry->dirty = true;
+    entry->dirty_since = Hardware::Timer::GetCurrentTimestamp();
+    dirty_pages++;
+}
+
+BlockCache::cachePage* BlockCache::find(BlockDevice* device, uint64_t page) {
+    cachePage* curr = buckets[hash(device, page) % bucket_count];
+    while(curr) {
+        if(curr->device == device && curr->page == page) { return curr; }
+        curr = curr->hash_next;
+    }
+    return NULL;
+}
+
+void BlockCache::hashInsert(cachePage* entry) {
+    cachePage** bucket = &buckets[hash(entry->device, entry->page) % bucket_count];
+    entry->hash_next = *bucket;
+    *bucket = entry;
+}
+
+void BlockCache::hashRemove(cachePage* entry) {
+    cachePage** link = &buckets[hash(entry->device, entry->page) % bucket_count];
+    while(*link && *link != entry) { link = &(*link)->hash_next; }
+    if(*link) { *link = entry->hash_next; }
+    entry->hash_next = NULL;
+}
+
+size_t BlockCache::evict() {
+    // Go around the clock, giving every referenced page a second chance.
+    // Dirty pages are skipped, so if two rounds did not find a page, there is no clean one.
+    for(size_t checked = 0; checked < (pages.size() * 2); checked++) {
+        if(clock_hand >= pages.size()) { clock_hand = 0; }
+        cachePage* entry = pages.at(clock_hand);
+        if(entry->dirty || entry->writeback) {
+            clock_hand++;
+            continue;
+        }
+        if(entry->referenced) {
+            entry->referenced = false;
+            clock_hand++;
+            continue;
+        }
+        // Invalidated pages are already out of the hash table
+        if(entry->device) {
+            hashRemove(entry);
+            entry->device = NULL;
+            evictions++;
+        }
+        return clock_hand++;
+    }
+    return pages.size();
+}
+
+void BlockCache::shrink() {
+    while(pages.size() && PM::FreePageCount() < low_watermark) {
+        size_t i = evict();
+        if(i == pages.size()) { break; }
+        cachePage* entry = pages.at(i);
+        pages.remove(i);
+        if(clock_hand > i) { clock_hand--; }
+        PM::FreePages(entry->phys);
+        delete entry;
+    }
+}
+
+BlockCache::cachePage* BlockCache::getFreePage() {
+    // Grow the cache if we are allowed to
+    if(pages.size() < max_pages && PM::FreePageCount() > low_watermark) {
+        cachePage* entry = new cachePage;
+        entry->device = NULL;
+        entry->phys = PM::AllocatePages();
+        entry->dirty = false;
+        entry->writeback = false;
+        entry->hash_next = NULL;
+        pages.push_back(entry);
+        return entry;
+    }
+    size_t i = evict();
+    if(i == pages.size()) { return NULL; }
+    return pages.at(i);
+}
+
+BlockCache::cachePage* BlockCache::insert(BlockDevice* device, uint64_t page, uint8_t* data, size_t len) {
+    // Someone else might have read this page in while we did not hold the mutex
+    cachePage* entry = find(device, page);
+    if(entry) { return entry; }
+    entry = getFreePage();
+    if(!entry) { return NULL; }
+    entry->device = device;
+    entry->page = page;
+    entry->referenced = true;
+    memcopy(data, pageData(entry), len);
+    // Pages at the end of the device can be short
+    if(len < page_size) { memset(pageData(entry) + len, 0, page_size - len); }
+    hashInsert(entry);
+    return entry;
+}
+
+int BlockCache::read(BlockDevice* device, void* buf, size_t len, size_t offset) {
+    acquire(&mutex);
+    if(!initialized) { init(); }
+    release(&mutex);
+    // Constrain len
+    if(offset >= device->len) { return 0; }
+    if((offset + len) > device->len) { len = device->len - offset; }
+
+    uint8_t* curr_buf = (uint8_t*)buf;
+    uint64_t curr = offset;
+    uint64_t end = offset + len;
+    uint64_t last_page = (end - 1) / page_size;
+    while(end > curr) {
+        uint64_t page = curr / page_size;
+        uint64_t page_offset = curr % page_size;
+        acquire(&mutex);
+        cachePage* entry = find(device, page);
+        if(entry) {
+            // Hit, copy the data out directly
+            uint64_t chunk = ((page_size - page_offset) < (end - curr)) ? (page_size - page_offset) : (end - curr);
+            hits++;
+            entry->referenced = true;
+            memcopy(pageData(entry) + page_offset, curr_buf, chunk);
+            release(&mutex);
+            curr += chunk;
+            curr_buf += chunk;
+            continue;
+        }
+        // Miss, find out how many pages after this one we are missing as well, and read them all in one go
+        size_t run = 1;
+        while(run < max_readahead_pages && (page + run) <= last_page && !find(device, page + run)) { run++; }
+        misses += run;
+        release(&mutex);
+
+        uint64_t run_offset = page * page_size;
+        uint64_t run_len = run * page_size;
+        if((run_offset + run_len) > device->len) { run_len = device->len - run_offset; }
+        uint8_t* buffer = (uint8_t*)VM::AllocatePages(run);
+        int ret = device->read(buffer, run_len, run_offset);
+        if(ret < 0) {
+            VM::FreePages(buffer, run);
+            return (curr == offset) ? ret : (int)(curr - offset);
+        }
+
+        // Copy out the part that was asked for. A write might have cached a newer page while we read, so copy from
+        // the page insert kept, and only fall back to what we read if it could not be cached.
+        uint64_t run_end = run_offset + run_len;
+        uint64_t chunk = ((run_end < end) ? run_end : end) - curr;
+        acquire(&mutex);
+        for(size_t i = 0; i < run; i++) {
+            uint64_t page_start = run_offset + (i * page_size);
+            uint64_t page_len = ((run_len - (i * page_size)) < page_size) ? (run_len - (i * page_size)) : page_size;
+            cachePage* entry = insert(device, page + i, buffer + (i * page_size), page_len);
+            uint64_t from = (curr > page_start) ? curr : page_start;
+            uint64_t to = ((page_start + page_len) < (curr + chunk)) ? (page_start + page_len) : (curr + chunk);
+            if(from >= to) { continue; }
+            uint8_t* data = entry ? pageData(entry) : (buffer + (i * page_size));
+            memcopy(data + (from - page_start), curr_buf + (from - curr), to - from);
+        }
+        shrink();
+        release(&mutex);
+        VM::FreePages(buffer, run);
+        curr += chunk;
+        curr_buf += chunk;
+    }
+    return len;
+}
+
+int BlockCache::write(BlockDevice* device, void* buf, size_t len, size_t offset) {
+    acquire(&mutex);
+    if(!initialized) { init(); }
+    release(&mutex);
+    // Constrain len
+    if(offset >= device->len) { return 0; }
+    if((offset + len) > device->len) { len = device->len - offset; }
+
+    uint8_t* curr_buf = (uint8_t*)buf;
+    uint64_t curr = offset;
+    uint64_t end = offset + len;
+    while(end > curr) {
+        uint64_t page = curr / page_size;
+        uint64_t page_offset = curr % page_size;
+        uint64_t chunk = ((page_size - page_offset) < (end - curr)) ? (page_size - page_offset) : (end - curr);
+        uint64_t page_len = ((device->len - (page * page_size)) < page_size) ? (device->len - (page * page_size)) : page_size;
+        bool filled = false;
+        acquire(&mutex);
+        cachePage* entry = find(device, page);
+        if(entry) {
+            hits++;
+        } else if(page_offset || chunk < page_len) {
+            // Partially written pages have to be read in first
+            misses++;
+            release(&mutex);
+            uint8_t* buffer = (uint8_t*)VM::AllocatePages(1);
+            int ret = device->read(buffer, page_len, page * page_size);
+            if(ret < 0) {
+                VM::FreePages(buffer, 1);
+                return (curr == offset) ? ret : (int)(curr - offset);
+            }
+            acquire(&mutex);
+            entry = insert(device, page, buffer, page_len);
+            VM::FreePages(buffer, 1);
+        } else {
+            // The whole page gets overwritten, so there is nothing to read in
+            entry = insert(device, page, curr_buf, page_len);
+            filled = entry != NULL;
+        }
+        if(!entry) {
+            // Every page is dirty, write straight to the device. The request can be dispatched from another address space,
+            // so it gets a kernel copy of the data.
+            release(&mutex);
+            uint8_t* buffer = (uint8_t*)VM::AllocatePages(1);
+            memcopy(curr_buf, buffer, chunk);
+            int ret = device->write(buffer, chunk, curr);
+            VM::FreePages(buffer, 1);
+            if(ret < 0) { return (curr == offset) ? ret : (int)(curr - offset); }
+            curr += chunk;
+            curr_buf += chunk;
+            continue;
+        }
+        if(!filled) { memcopy(curr_buf, pageData(entry) + page_offset, chunk); }
+        entry->referenced = true;
+        markDirty(entry);
+        bool throttle = dirty_pages > max_dirty_pages;
+        release(&mutex);
+        curr += chunk;
+        curr_buf += chunk;
+        // Dont let writers fill the whole cache with dirty pages
+        if(throttle) { writeback(device, ~0ULL, NULL); }
+    }
+    return len;
+}
+
+int BlockCache::writeback(BlockDevice* device, uint64_t dirtied_before, Vector<BlockDevice*>* written) {
+    // Collect the pages to write out. They are marked as under writeback, so they dont get evicted meanwhile.
+    Vector<BlockRequest*> requests;
+    Vector<BlockDevice*> targets;
+    acquire(&mutex);
+    for(size_t i = 0; i < pages.size(); i++) {
+        cachePage* entry = pages.at(i);
+        if(!entry->dirty || entry->writeback) { continue; }
+        if(device && entry->device != device) { continue; }
+        if(entry->dirty_since >= dirtied_before) { continue; }
+        uint64_t page_offset = entry->page * page_size;
+        uint64_t page_len = ((entry->device->len - page_offset) < page_size) ? (entry->device->len - page_offset) : page_size;
+        BlockRequest* request = new BlockRequest(BlockRequest::BLOCK_WRITE, pageData(entry), page_len, page_offset);
+        request->private_data = entry;
+        request->batch = true;
+        requests.push_back(request);
+        targets.push_back(entry->device);
+        entry->dirty = false;
+        entry->writeback = true;
+        dirty_pages--;
+        if(written) {
+            bool known = false;
+            for(size_t j = 0; j < written->size(); j++) {
+                if(written->at(j) == entry->device) { known = true; break; }
+            }
+            if(!known) { written->push_back(entry->device); }
+        }
+    }
+    release(&mutex);
+    if(!requests.size()) { return 0; }
+
+    // Queue everything before waiting, so that the request queue can sort the pages and merge adjacent ones
+    for(size_t i = 0; i < requests.size(); i++) { targets.at(i)->submit(requests.at(i)); }
+    for(size_t i = 0; i < requests.size(); i++) { requests.at(i)->wait(); }
+
+    int err = 0;
+    acquire(&mutex);
+    for(size_t i = 0; i < requests.size(); i++) {
+        BlockRequest* request = requests.at(i);
+        cachePage* entry = (cachePage*)request->private_data;
+        entry->writeback = false;
+        if(request->result < (int)request->len) {
+            // Keep the data, the next writeback tries again
+            if(entry->device) { markDirty(entry); }
+            err = -EIO;
+        } else {
+            writebacks++;
+        }
+        delete request;
+    }
+    release(&mutex);
+    return err;
+}
+
+int BlockCache::sync(BlockDevice* device) {
+    int err = writeback(device, ~0ULL, NULL);
+    int flush_err = device->flush();
+    return (err < 0) ? err : flush_err;
+}
+
+void BlockCache::flushExpired() {
+    uint64_t now = Hardware::Timer::GetCurrentTimestamp();
+    if(now < dirty_expire) { return; }
+    Vector<BlockDevice*> written;
+    if(writeback(NULL, now - dirty_expire, &written) < 0) {
+        KLog::the().printf("BlockCache: writeback failed, the pages stay dirty\n\r");
+    }
+    for(size_t i = 0; i < written.size(); i++) { written.at(i)->flush(); }
+}
+
+void BlockCache::StartFlusher() {
+    WorkQueue::system().queueDelayed(&flush_work, flush_interval);
+}
+
+void BlockCache::FlushWork(void* arg) {
+    BlockCache* cache = (BlockCache*)arg;
+    // Work runs with interrupts on, so the drivers can sleep until their transfers are done
+    cache->flushExpired();
+    WorkQueue::system().queueDelayed(&cache->flush_work, flush_interval);
+}
+
+void BlockCache::invalidate(BlockDevice* device, size_t offset, size_t len) {
+    if(!len) { return; }
+    acquire(&mutex);
+    for(uint64_t page = offset / page_size; page <= ((offset + len - 1) / page_size); page++) {
+        cachePage* entry = find(device, page);
+        if(!entry) { continue; }
+        // Leave the page in the clock, it will get reused first. Dirty data is dropped.
+        hashRemove(entry);
+        if(entry->dirty) {
+            entry->dirty = false;
+            dirty_pages--;
+        }
+        entry->device = NULL;
+        entry->referenced = false;
+    }
+    release(&mutex);
+}
+
+void BlockCache::PrintStats() {
+    acquire(&mutex);
+    uint64_t total = hits + misses;
+    KLog::the().printf("BlockCache: %i pages, %i hits, %i misses (hit rate %i percent), %i evictions\n\r", pages.size(), hits, misses, total ? ((hits * 100) / total) : 0, evictions);
+    KLog::the().printf("BlockCache: %i dirty pages, %i pages written back\n\r", dirty_pages, writebacks);
+    release(&mutex);
+}
+
+}
@@ -0,0 +1,116 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <CPP/vector.h>
+#include <CPP/mutex.h>
+#include <kernel-drivers/BlockDevices.h>
+#include <processes/workqueue.h>
+
+namespace Kernel {
+
+// Page sized cache of block device contents, sitting between the file system
+// drivers and the block devices. Pages are keyed by (device, offset / page_size).
+// Eviction uses the CLOCK algorithm. The cache grows while there is free physical
+// memory, and gives pages back to the PM once free memory runs low.
+// Writes are write-back: they only dirty the cached pages, which get written out by
+// sync(), by the flusher once they have been dirty for dirty_expire ms, or once
+// too many pages are dirty. Dirty pages are never evicted; if the cache is full of
+// them, writes go straight to the device.
+class BlockCache {
+public:
+    static BlockCache& the() {
+        static BlockCache instance;
+        return instance;
+    }
+
+    // Read len bytes at offset from device, going through the cache.
+    // Returns the amount of bytes read, or a negative error.
+    int read(BlockDevice* device, void* buf, size_t len, size_t offset);
+    // Write len bytes at offset to device, going through the cache.
+    // Returns the amount of bytes written, or a negative error.
+    int write(BlockDevice* device, void* buf, size_t len, size_t offset);
+    // Write out all dirty pages of device, and flush the write cache of the device.
+    int sync(BlockDevice* device);
+    // Drop all cached pages of device overlapping [offset, offset + len).
+    void invalidate(BlockDevice* device, size_t offset, size_t len);
+
+    // Dump the hit/miss counters to KLog.
+    void PrintStats();
+
+    // Start writing out expired dirty pages every flush_interval ms, from the system work queue
+    void StartFlusher();
+
+    static const size_t page_size = 4096;
+
+private:
+    struct cachePage {
+        BlockDevice* device;
+        uint64_t page; // offset / page_size
+        uint64_t phys; // Physical address of the data
+        bool referenced; // Set on access, cleared by the clock hand
+        bool dirty; // Modified since it was last written out
+        bool writeback; // Currently being written out
+        uint64_t dirty_since; // Timestamp of the first modification since the last writeback
+        cachePage* hash_next;
+    };
+
+    uint64_t hash(BlockDevice* device, uint64_t page);
+    cachePage* find(BlockDevice* device, uint64_t page);
+    void hashInsert(cachePage* entry);
+    void hashRemove(cachePage* entry);
+    // Get a page to store new data in. Either allocates a new one or evicts one.
+    // Returns NULL if the cache cant hold any more pages right now.
+    cachePage* getFreePage();
+    // Evict a clean page using the clock hand, and unlink it from the hash table.
+    // Returns the index of the evicted page in pages, or pages.size() if every page is dirty.
+    size_t evict();
+    // Give pages back to the PM while free memory is low.
+    void shrink();
+    // Copy a freshly read page into the cache. Returns the cached page, or NULL if the cache is full.
+    cachePage* insert(BlockDevice* device, uint64_t page, uint8_t* data, size_t len);
+    inline uint8_t* pageData(cachePage* entry);
+    inline void markDirty(cachePage* entry);
+    // Write out the dirty pages of device (or of all devices if NULL) that were dirtied before dirtied_before.
+    // The devices that had pages written are added to written, if it is not NULL.
+    int writeback(BlockDevice* device, uint64_t dirtied_before, Vector<BlockDevice*>* written);
+    // Write out the pages that have been dirty for longer than dirty_expire, and flush their devices
+    void flushExpired();
+    static void FlushWork(void* arg);
+    WorkItem flush_work{FlushWork, this};
+
+    // Set up the limits, once the PM knows how much memory there is.
+    void init();
+
+    // Max amount of pages read in with a single request on a miss
+    static const size_t max_readahead_pages = 16;
+    // How long a page may stay dirty, and how often the flusher looks for such pages, in ms
+    static const uint64_t dirty_expire = 5000;
+    static const uint64_t flush_interval = 5000;
+    static const size_t bucket_count = 1024;
+
+    cachePage* buckets[bucket_count] = { };
+    Vector<cachePage*> pages;
+    size_t clock_hand = 0;
+
+    bool initialized = false;
+    // Upper bound on the cache size
+    uint64_t max_pages = 0;
+    // Once the PM has less free pages than this, the cache starts shrinking
+    uint64_t low_watermark = 0;
+    // Once more pages than this are dirty, writers have to write them out first
+    uint64_t max_dirty_pages = 0;
+    uint64_t dirty_pages = 0;
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t writebacks = 0;
+
+    mutex_t mutex = 0;
+};
+
+}
+
+#endif
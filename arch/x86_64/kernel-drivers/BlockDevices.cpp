@@ -5,6 +5,7 @@ namespace Kernel {
 
 int BlockManager::RegisterBlockDevice(BlockDevice* device) {
     device->block_device_id = next_id++;
+    device->queue = new BlockQueue(device);
     BlockDeviceContainer* container = new BlockDeviceContainer;
     container->main = device;
     devices.push_back(container);
@@ -63,14 +64,39 @@ void BlockManager::ParsePartitions() {
     }
 }
 
-int PartitionBlockDevice::read(void* buf, size_t len, size_t _offset) {
-    // TODO: constrain partition size
-    return main->read(buf, len, offset + _offset);
+int BlockDevice::read(void* buf, size_t len, size_t offset) {
+    BlockRequest request(BlockRequest::BLOCK_READ, buf, len, offset);
+    submit(&request);
+    return request.wait();
 }
 
-int PartitionBlockDevice::write(void* buf, size_t len, size_t _offset) {
-    // TODO: constrain partition size
-    return main->write(buf, len, offset + _offset);
+int BlockDevice::write(void* buf, size_t len, size_t offset) {
+    BlockRequest request(BlockRequest::BLOCK_WRITE, buf, len, offset);
+    submit(&request);
+    return request.wait();
+}
+
+void BlockDevice::submit(BlockRequest* request) {
+    if(!queue) {
+        // Not registered, there is nothing to dispatch the request
+        request->result = -ENODEV;
+        request->done = true;
+        if(request->callback) { request->callback(request); }
+        return;
+    }
+    queue->submit(request);
+}
+
+void BlockDevice::startTransfer(BlockRequest* request, void* buf, size_t len, size_t offset, bool write) {
+    queue->endTransfer(request, transfer(buf, len, offset, write));
+}
+
+void PartitionBlockDevice::submit(BlockRequest* request) {
+    // Constrain the request to the partition
+    if(request->offset >= len) { request->len = 0; }
+    else if((request->offset + request->len) > len) { request->len = len - request->offset; }
+    request->offset += offset;
+    main->submit(request);
 }
 
 
@@ -3,22 +3,42 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <CPP/vector.h>
+#include <kernel-drivers/BlockQueue.h>
 #include <errno.h>
 
 namespace Kernel {
 
 struct BlockDevice {
-    virtual int read(void* buf, size_t len, size_t offset) { return -ENOSYS; (void)buf; (void)len; (void)offset; }
-    virtual int write(void* buf, size_t len, size_t offset) { return -ENOSYS; (void)buf; (void)len; (void)offset; }
+    // Synchronous reads and writes, going through the request queue
+    int read(void* buf, size_t len, size_t offset);
+    int write(void* buf, size_t len, size_t offset);
+    // Queue a request on the device. It is dispatched right away if the device has room for it, unless it is a batch.
+    virtual void submit(BlockRequest* request);
+    // Do the actual transfer, and return once it is done. This is implemented by the drivers, and only called by the
+    // request queue.
+    virtual int transfer(void* buf, size_t len, size_t offset, bool write) { return -ENOSYS; (void)buf; (void)len; (void)offset; (void)write; }
+    // Start the transfer of request and return without waiting for it. The driver calls queue->endTransfer(request, result)
+    // once it is done, usually from its IRQ handler or tasklet. Can sleep until the device has room for it.
+    // Drivers that only implement transfer() get it called here, and the request ends before this returns.
+    virtual void startTransfer(BlockRequest* request, void* buf, size_t len, size_t offset, bool write);
+    // How many transfers the request queue hands to the driver at once
+    virtual size_t queueDepth() { return 1; }
+    // Make completed writes durable, for devices with a volatile write cache.
+    // Writes that are still queued are not waited for.
+    virtual int flush() { return 0; }
     virtual int ioctl(uint64_t command, void* arg) { return -ENOSYS; (void)command; (void)arg; }
+    virtual ~BlockDevice() = default;
     int block_device_id;
 
     uint64_t len;
+    // Created when the device is registered
+    BlockQueue* queue = NULL;
 };
 
+// Partitions have no queue of their own, their requests go to the queue of the main device.
 struct PartitionBlockDevice : public BlockDevice {
-    int read(void* buf, size_t len, size_t _offset) override;
-    int write(void* buf, size_t len, size_t _offset) override;
+    void submit(BlockRequest* request) override;
+    int flush() override { return main->flush(); }
 
     BlockDevice* main;
     size_t offset;
@@ -0,0 +1,270 @@
+#include <kernel-drivers/BlockQueue.h>
+#include <kernel-drivers/BlockDevices.h>
+#include <mem/VM/virtmem.h>
+#include <hardware/instructions.h>
+#include <timer.h>
+#include <mem.h>
+
+namespace Kernel {
+
+int BlockRequest::wait() {
+    if(queue) { return queue->wait(this); }
+    return result;
+}
+
+void BlockQueue::submit(BlockRequest* request) {
+    request->queue = this;
+    request->done = false;
+    request->next = NULL;
+    request->merged_next = NULL;
+    request->merged_len = request->len;
+    request->merge_buffer = NULL;
+    request->deadline = Hardware::Timer::GetCurrentTimestamp() + ((request->op == BlockRequest::BLOCK_WRITE) ? write_expire : read_expire);
+    if(!request->len) {
+        complete(request, 0);
+        return;
+    }
+
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
+    // The elevator and the device reorder requests, which is only fine as long as they dont touch the same data.
+    // If they do, let the earlier ones finish first.
+    while(conflicts(request)) {
+        release(&mutex);
+        irqrestore(flags);
+        run();
+        flags = save_irqdisable();
+        acquire(&mutex);
+        if(conflicts(request)) { waiters.wait(&mutex); }
+    }
+    if(!merge(request)) {
+        BlockRequest** link = &head;
+        while(*link && (*link)->offset <= request->offset) { link = &(*link)->next; }
+        request->next = *link;
+        *link = request;
+    }
+    release(&mutex);
+    irqrestore(flags);
+    if(!request->batch) { run(); }
+}
+
+bool BlockQueue::conflicts(BlockRequest* request) {
+    for(BlockRequest* curr = head; curr; curr = curr->next) {
+        if(curr->op != BlockRequest::BLOCK_WRITE && request->op != BlockRequest::BLOCK_WRITE) { continue; }
+        if(request->offset < (curr->offset + curr->merged_len) && curr->offset < (request->offset + request->len)) { return true; }
+    }
+    for(BlockRequest* curr = in_flight; curr; curr = curr->next) {
+        if(curr->op != BlockRequest::BLOCK_WRITE && request->op != BlockRequest::BLOCK_WRITE) { continue; }
+        if(request->offset < (curr->offset + curr->merged_len) && curr->offset < (request->offset + request->len)) { return true; }
+    }
+    return false;
+}
+
+bool BlockQueue::merge(BlockRequest* request) {
+    for(BlockRequest** link = &head; *link; link = &(*link)->next) {
+        BlockRequest* curr = *link;
+        if(curr->op != request->op) { continue; }
+        if((curr->merged_len + request->len) > max_merge_len) { continue; }
+        if((curr->offset + curr->merged_len) == request->offset) {
+            // Back merge, request goes at the end of the chain
+            BlockRequest* tail = curr;
+            while(tail->merged_next) { tail = tail->merged_next; }
+            tail->merged_next = request;
+            curr->merged_len += request->len;
+            return true;
+        }
+        if((request->offset + request->len) == curr->offset) {
+            // Front merge, request takes the place of curr in the queue, and keeps its deadline
+            request->merged_next = curr;
+            request->merged_len = request->len + curr->merged_len;
+            request->deadline = curr->deadline;
+            request->next = curr->next;
+            curr->next = NULL;
+            *link = request;
+            return true;
+        }
+    }
+    return false;
+}
+
+BlockRequest* BlockQueue::pickNext() {
+    if(!head) { return NULL; }
+    // Requests past their deadline go first, the oldest one first
+    BlockRequest** oldest = &head;
+    for(BlockRequest** link = &head; *link; link = &(*link)->next) {
+        if((*link)->deadline < (*oldest)->deadline) { oldest = link; }
+    }
+    BlockRequest** pick = &head;
+    if((*oldest)->deadline <= Hardware::Timer::GetCurrentTimestamp()) {
+        pick = oldest;
+    } else {
+        // C-LOOK: the first request after the elevator position, or wrap around to the lowest offset
+        for(BlockRequest** link = &head; *link; link = &(*link)->next) {
+            if((*link)->offset >= last_end) {
+                pick = link;
+                break;
+            }
+        }
+    }
+    BlockRequest* request = *pick;
+    *pick = request->next;
+    request->next = NULL;
+    last_end = request->offset + request->merged_len;
+    return request;
+}
+
+void BlockQueue::run() {
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
+    while(in_flight_count < device->queueDepth()) {
+        BlockRequest* request = pickNext();
+        if(!request) { break; }
+        request->next = in_flight;
+        in_flight = request;
+        in_flight_count++;
+        release(&mutex);
+        irqrestore(flags);
+        dispatch(request);
+        flags = save_irqdisable();
+        acquire(&mutex);
+    }
+    // Merge buffers are given back where they cant be freed, so the pool is trimmed here
+    void* excess = NULL;
+    while(merge_pool_count > merge_pool_size) {
+        void* buffer = merge_pool;
+        merge_pool = *(void**)buffer;
+        *(void**)buffer = excess;
+        excess = buffer;
+        merge_pool_count--;
+    }
+    release(&mutex);
+    irqrestore(flags);
+    while(excess) {
+        void* next = *(void**)excess;
+        VM::FreePages(excess, max_merge_len / 4096);
+        excess = next;
+    }
+}
+
+int BlockQueue::wait(BlockRequest* request) {
+    for(;;) {
+        run();
+        unsigned long flags = save_irqdisable();
+        acquire(&mutex);
+        // Every completion wakes us up, and might have made room for what we wait on
+        bool done = request->done;
+        if(!done) { waiters.wait(&mutex); }
+        release(&mutex);
+        irqrestore(flags);
+        if(done) { return request->result; }
+    }
+}
+
+void BlockQueue::dispatch(BlockRequest* request) {
+    bool write = request->op == BlockRequest::BLOCK_WRITE;
+    if(!request->merged_next) {
+        device->startTransfer(request, request->buf, request->len, request->offset, write);
+        return;
+    }
+
+    // Merged requests go through a buffer covering all of them
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
+    uint8_t* buffer = (uint8_t*)merge_pool;
+    if(buffer) {
+        merge_pool = *(void**)buffer;
+        merge_pool_count--;
+    }
+    release(&mutex);
+    irqrestore(flags);
+    if(!buffer) { buffer = (uint8_t*)VM::AllocatePages(max_merge_len / 4096); }
+    request->merge_buffer = buffer;
+    if(write) {
+        for(BlockRequest* curr = request; curr; curr = curr->merged_next) {
+            memcopy(curr->buf, buffer + (curr->offset - request->offset), curr->len);
+        }
+    }
+    device->startTransfer(request, buffer, request->merged_len, request->offset, write);
+}
+
+void BlockQueue::endTransfer(BlockRequest* request, int ret) {
+    bool write = request->op == BlockRequest::BLOCK_WRITE;
+    uint8_t* buffer = (uint8_t*)request->merge_buffer;
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
+    for(BlockRequest** link = &in_flight; *link; link = &(*link)->next) {
+        if(*link == request) {
+            *link = request->next;
+            break;
+        }
+    }
+    request->next = NULL;
+    in_flight_count--;
+    bool pending = head != NULL;
+    release(&mutex);
+    irqrestore(flags);
+
+    if(!buffer) {
+        complete(request, ret);
+    } else {
+        // Completed requests can go away, so everything needed later is saved up front
+        size_t base = request->offset;
+        BlockRequest* curr = request;
+        while(curr) {
+            BlockRequest* next = curr->merged_next;
+            int result = ret;
+            if(ret >= 0) {
+                // Short transfers only complete the requests they reached
+                size_t start = curr->offset - base;
+                if((size_t)ret <= start) { result = 0; }
+                else { result = (((size_t)ret - start) < curr->len) ? (ret - start) : curr->len; }
+                if(!write && result > 0) { memcopy(buffer + start, curr->buf, result); }
+            }
+            complete(curr, result);
+            curr = next;
+        }
+        flags = save_irqdisable();
+        acquire(&mutex);
+        *(void**)buffer = merge_pool;
+        merge_pool = buffer;
+        merge_pool_count++;
+        release(&mutex);
+        irqrestore(flags);
+    }
+    // The device has room again. Waiters dispatch too once they are woken up, but requests with a callback might have none.
+    if(pending) { WorkQueue::system().queue(&completion_work); }
+}
+
+void BlockQueue::complete(BlockRequest* request, int result) {
+    request->result = result;
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
+    if(request->callback) {
+        request->next = completed;
+        completed = request;
+        WorkQueue::system().queue(&completion_work);
+    }
+    // Once done is set and the lock dropped, a waiter can return and the request can go away
+    request->done = true;
+    waiters.wakeAll();
+    release(&mutex);
+    irqrestore(flags);
+}
+
+void BlockQueue::CompletionWork(void* arg) {
+    BlockQueue* queue = (BlockQueue*)arg;
+    unsigned long flags = save_irqdisable();
+    acquire(&queue->mutex);
+    BlockRequest* request = queue->completed;
+    queue->completed = NULL;
+    release(&queue->mutex);
+    irqrestore(flags);
+    while(request) {
+        BlockRequest* next = request->next;
+        request->callback(request);
+        request = next;
+    }
+    queue->run();
+}
+
+}
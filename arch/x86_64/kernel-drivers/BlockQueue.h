@@ -0,0 +1,117 @@
+#ifndef BLOCKQUEUE_H
+#define BLOCKQUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <CPP/mutex.h>
+#include <processes/sync.h>
+#include <processes/workqueue.h>
+
+namespace Kernel {
+
+struct BlockDevice;
+class BlockQueue;
+
+// A single read or write of a block device. Requests are dispatched and completed from any context, so buf has to be in
+// the kernel half.
+// Requests with a callback belong to the callback once they complete, and may be freed by it.
+// Nobody may wait on those.
+struct BlockRequest {
+    enum Operation {
+        BLOCK_READ,
+        BLOCK_WRITE
+    };
+
+    BlockRequest() { }
+    BlockRequest(int _op, void* _buf, size_t _len, size_t _offset) : op(_op), buf(_buf), len(_len), offset(_offset) { }
+
+    int op = BLOCK_READ;
+    void* buf = NULL;
+    size_t len = 0;
+    size_t offset = 0;
+
+    // Called from the system work queue once the request completed, so it can sleep
+    void (*callback)(BlockRequest* request) = NULL;
+    void* private_data = NULL;
+    // Only queue the request, so that the ones submitted after it can still get merged with it.
+    // It is dispatched once someone waits on it or calls BlockQueue::run().
+    bool batch = false;
+
+    // Amount of bytes transferred or a negative error, valid once done is set
+    int result = 0;
+    volatile bool done = false;
+
+    // Sleep until the request completed, dispatching queued requests first. Returns result.
+    int wait();
+
+    // Queue bookkeeping
+    BlockQueue* queue = NULL;
+    uint64_t deadline = 0;
+    BlockRequest* next = NULL; // Next request in the queue, sorted by offset
+    BlockRequest* merged_next = NULL; // Next request merged into this one, in offset order
+    size_t merged_len = 0; // Length of this request and all requests merged into it
+    void* merge_buffer = NULL; // Buffer the device transfers merged requests through
+};
+
+// Per device request queue.
+// Requests are kept sorted by offset; adjacent requests of the same type are merged into a
+// single device transfer, and dispatched using a C-LOOK elevator. Requests that have been
+// waiting for longer than their deadline are dispatched first, so writes can not starve reads
+// and the far end of the disk can not starve.
+// Requests are handed to the driver as soon as it has room for them, by whoever submits them, waits on them or
+// completes another one. Up to the queue depth of the device are in flight at once, and drivers finish them from their
+// IRQ handler or tasklet. Requests that still wait for room get merged and sorted.
+// The queue lock is taken from IRQ handlers, so only with interrupts disabled.
+class BlockQueue {
+public:
+    BlockQueue(BlockDevice* _device) : device(_device) { }
+
+    void submit(BlockRequest* request);
+    // Dispatch queued requests until the queue is empty or the device has no more room
+    void run();
+    int wait(BlockRequest* request);
+    // Called by the driver once a transfer it was handed by startTransfer is done, from any context
+    void endTransfer(BlockRequest* request, int result);
+
+    // Largest merged transfer
+    static const size_t max_merge_len = 128 * 1024;
+    // Deadlines, in timer ticks (ms)
+    static const uint64_t read_expire = 500;
+    static const uint64_t write_expire = 5000;
+
+private:
+    // Check if request overlaps a queued request, and one of them writes. mutex must be held.
+    bool conflicts(BlockRequest* request);
+    // Try merging request into a queued request. mutex must be held.
+    bool merge(BlockRequest* request);
+    // Take the next request to dispatch out of the queue. mutex must be held.
+    BlockRequest* pickNext();
+    void dispatch(BlockRequest* request);
+    void complete(BlockRequest* request, int result);
+    // Runs the callbacks of completed requests, and dispatches what waited for room
+    static void CompletionWork(void* arg);
+
+    BlockDevice* device;
+    BlockRequest* head = NULL;
+    // Requests the device is working on, so new ones can be checked for conflicts with them too
+    BlockRequest* in_flight = NULL;
+    size_t in_flight_count = 0;
+    // Where the last dispatched request ended, the elevator position
+    size_t last_end = 0;
+    // Completed requests with a callback, linked by next
+    BlockRequest* completed = NULL;
+    WorkItem completion_work{CompletionWork, this};
+    // Merge buffers of finished transfers, kept for the next ones. Each is max_merge_len long, and its first bytes
+    // link to the next one. The ones beyond merge_pool_size are freed by the next dispatch.
+    void* merge_pool = NULL;
+    size_t merge_pool_count = 0;
+    static const size_t merge_pool_size = 4;
+    // Wakes up waiters whenever a request completes
+    WaitQueue waiters;
+
+    mutex_t mutex = 0;
+};
+
+}
+
+#endif
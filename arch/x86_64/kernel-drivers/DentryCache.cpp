@@ -0,0 +1,127 @@
+#include <kernel-drivers/DentryCache.h>
+#include <debug/klog.h>
+#include <mem.h>
+
+namespace Kernel {
+
+uint64_t DentryCache::hash(VFS::fs_node* parent, const char* name, size_t len) {
+    // FNV-1a over the name, seeded with the parent pointer
+    uint64_t h = 0xcbf29ce484222325 ^ (uint64_t)parent;
+    for(size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+DentryCache::dentry* DentryCache::find(VFS::fs_node* parent, const char* name, size_t len, uint64_t hash) {
+    dentry* curr = buckets[hash % bucket_count];
+    while(curr) {
+        if(curr->hash == hash && curr->parent == parent && curr->len == len) {
+            bool equal = true;
+            for(size_t i = 0; i < len; i++) {
+                if(curr->name[i] != name[i]) { equal = false; break; }
+            }
+            if(equal) { return curr; }
+        }
+        curr = curr->hash_next;
+    }
+    return NULL;
+}
+
+void DentryCache::lruUnlink(dentry* entry) {
+    if(entry->lru_prev) { entry->lru_prev->lru_next = entry->lru_next; } else { lru_head = entry->lru_next; }
+    if(entry->lru_next) { entry->lru_next->lru_prev = entry->lru_prev; } else { lru_tail = entry->lru_prev; }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+void DentryCache::lruPushFront(dentry* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if(lru_head) { lru_head->lru_prev = entry; }
+    lru_head = entry;
+    if(!lru_tail) { lru_tail = entry; }
+}
+
+void DentryCache::remove(dentry* entry) {
+    // Unlink from the hash chain
+    dentry** link = &buckets[entry->hash % bucket_count];
+    while(*link && *link != entry) { link = &(*link)->hash_next; }
+    if(*link) { *link = entry->hash_next; }
+    lruUnlink(entry);
+    delete[] entry->name;
+    delete entry;
+    entry_count--;
+}
+
+bool DentryCache::lookup(VFS::fs_node* parent, const char* name, size_t len, VFS::fs_node** node) {
+    acquire(&mutex);
+    dentry* entry = find(parent, name, len, hash(parent, name, len));
+    if(!entry) {
+        misses++;
+        release(&mutex);
+        return false;
+    }
+    hits++;
+    // Move it to the front of the LRU list
+    lruUnlink(entry);
+    lruPushFront(entry);
+    *node = entry->node;
+    release(&mutex);
+    return true;
+}
+
+void DentryCache::insert(VFS::fs_node* parent, const char* name, size_t len, VFS::fs_node* node) {
+    acquire(&mutex);
+    uint64_t h = hash(parent, name, len);
+    dentry* entry = find(parent, name, len, h);
+    if(entry) {
+        // Already cached, just update it
+        entry->node = node;
+        lruUnlink(entry);
+        lruPushFront(entry);
+        release(&mutex);
+        return;
+    }
+    // Make space if we have to
+    if(entry_count >= max_entries && lru_tail) { remove(lru_tail); }
+    entry = new dentry;
+    entry->parent = parent;
+    entry->name = new char[len];
+    memcopy((void*)name, entry->name, len);
+    entry->len = len;
+    entry->hash = h;
+    entry->node = node;
+    entry->hash_next = buckets[h % bucket_count];
+    buckets[h % bucket_count] = entry;
+    lruPushFront(entry);
+    entry_count++;
+    release(&mutex);
+}
+
+void DentryCache::invalidate(VFS::fs_node* parent, const char* name, size_t len) {
+    acquire(&mutex);
+    dentry* entry = find(parent, name, len, hash(parent, name, len));
+    if(entry) { remove(entry); }
+    release(&mutex);
+}
+
+void DentryCache::invalidate(VFS::fs_node* parent) {
+    acquire(&mutex);
+    dentry* curr = lru_head;
+    while(curr) {
+        dentry* next = curr->lru_next;
+        if(curr->parent == parent) { remove(curr); }
+        curr = next;
+    }
+    release(&mutex);
+}
+
+void DentryCache::PrintStats() {
+    acquire(&mutex);
+    KLog::the().printf("DentryCache: %i entries, %i hits, %i misses\n\r", entry_count, hits, misses);
+    release(&mutex);
+}
+
+}
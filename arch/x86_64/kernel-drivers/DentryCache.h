@@ -0,0 +1,72 @@
+#ifndef DENTRYCACHE_H
+#define DENTRYCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <CPP/mutex.h>
+#include <kernel-drivers/VFS.h>
+
+namespace Kernel {
+
+// Cache of path component lookups, sitting in front of VFSDriver::finddir.
+// Entries are keyed by (parent node, name). Lookups that failed are cached as
+// negative entries (node == NULL). Once the cache is full, the least recently
+// used entry is evicted.
+class DentryCache {
+public:
+    static DentryCache& the() {
+        static DentryCache instance;
+        return instance;
+    }
+
+    // Look up name (len chars, not null terminated) in parent.
+    // Returns false if there is no cached entry. If there is one, node is set,
+    // which will be NULL for a negative entry.
+    bool lookup(VFS::fs_node* parent, const char* name, size_t len, VFS::fs_node** node);
+    // Add the result of a finddir call to the cache.
+    void insert(VFS::fs_node* parent, const char* name, size_t len, VFS::fs_node* node);
+    // Drop the entry for name in parent, if it exists.
+    void invalidate(VFS::fs_node* parent, const char* name, size_t len);
+    // Drop all entries with parent as their parent.
+    // This has to be done if something gets mounted over parent.
+    void invalidate(VFS::fs_node* parent);
+
+    // Dump the hit/miss counters to KLog.
+    void PrintStats();
+
+private:
+    struct dentry {
+        VFS::fs_node* parent;
+        char* name;
+        size_t len;
+        uint64_t hash;
+        VFS::fs_node* node; // NULL for negative entries
+
+        dentry* hash_next;
+        dentry* lru_prev; // Towards the most recently used entry
+        dentry* lru_next; // Towards the least recently used entry
+    };
+
+    uint64_t hash(VFS::fs_node* parent, const char* name, size_t len);
+    dentry* find(VFS::fs_node* parent, const char* name, size_t len, uint64_t hash);
+    void remove(dentry* entry);
+    void lruUnlink(dentry* entry);
+    void lruPushFront(dentry* entry);
+
+    static const size_t bucket_count = 256;
+    static const size_t max_entries = 1024;
+
+    dentry* buckets[bucket_count] = { };
+    dentry* lru_head = NULL;
+    dentry* lru_tail = NULL;
+    size_t entry_count = 0;
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+    mutex_t mutex = 0;
+};
+
+}
+
+#endif
@@ -1,5 +1,7 @@
 #include <kernel-drivers/IDE.h>
 #include <processes/scheduler.h>
+#include <mem/PM/physalloc.h>
+#include <mem/VM/virtmem.h>
 #include <debug/klog.h>
 #include <panic.h>
 #include <errno.h>
@@ -7,7 +9,8 @@
 
 namespace Kernel {
 
-IDEDevice* device_holding_irq = NULL;
+// Channels in compatibility mode, which own IRQ 14 and 15
+IDEChannel* compat_channels[2] = { NULL, NULL };
 
 bool IDEDevice::Initialize() {
     KLog::the().printf("IDE: initializing IDE controller at %i:%i.%i\n\r", bus, slot, function);
@@ -21,6 +24,12 @@ bool IDEDevice::Initialize() {
     devices[2].driver = this;
     devices[3].id = 3;
     devices[3].driver = this;
+    channels[0].io_base = primary_bus_io_base;
+    channels[0].control_base = primary_bus_control_base;
+    channels[0].secondary = false;
+    channels[1].io_base = secondary_bus_io_base;
+    channels[1].control_base = secondary_bus_control_base;
+    channels[1].secondary = true;
 
     uint8_t prog_if = PCI::the().deviceProgIF(bus, slot, function);
     bool success = false;
@@ -35,11 +44,45 @@ bool IDEDevice::Initialize() {
         success = InitPIO();
     }
 
-
-    
+    if(success && !InitDMA()) {
+        KLog::the().printf("IDE: bus master DMA unavailable, using PIO\n\r");
+    }
     return success;
 }
 
+bool IDEDevice::InitDMA() {
+    // The bus master registers are in BAR4, which has to be IO space
+    if(!bars[4].io || !bars[4].address) { return false; }
+    uint16_t bus_master_base = barAddress(4);
+    // Allocate a PRDT and bounce buffer for each channel. PRDs only have 32 bit addresses.
+    for(size_t i = 0; i < 2; i++) {
+        IDEChannel* channel = &channels[i];
+        channel->prdt_phys = PM::AllocatePages();
+        channel->dma_buffer_phys = PM::AllocatePages(dma_buffer_pages);
+        if((channel->prdt_phys >> 32) || ((channel->dma_buffer_phys + (dma_buffer_pages * 4096)) >> 32)) {
+            for(size_t j = 0; j <= i; j++) {
+                PM::FreePages(channels[j].prdt_phys);
+                PM::FreePages(channels[j].dma_buffer_phys, dma_buffer_pages);
+            }
+            return false;
+        }
+        channel->prdt = (IDEChannel::PRD*)(channel->prdt_phys + VM::GetVirtualOffset());
+        channel->dma_buffer = (uint8_t*)(channel->dma_buffer_phys + VM::GetVirtualOffset());
+        channel->bus_master_base = bus_master_base + (i * 8);
+    }
+    // Enable bus mastering
+    uint16_t command = PCI::the().configRead(bus, slot, function, 0x4);
+    PCI::the().configWrite(bus, slot, function, 0x4, command | 0x4);
+    // Make sure both channels are stopped, and clear their status
+    outb(bus_master_base + BM_COMMAND, 0);
+    outb(bus_master_base + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+    outb(bus_master_base + 8 + BM_COMMAND, 0);
+    outb(bus_master_base + 8 + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+    dma_enabled = true;
+    KLog::the().printf("IDE: bus master DMA enabled, registers at %x\n\r", bus_master_base);
+    return true;
+}
+
 bool IDEDevice::InitPIO() {
     // Write 0 to the ProgIF bit
     // This will force PCI/IDE mode controllers to IDE-Compat mode,
@@ -49,52 +92,48 @@ bool IDEDevice::InitPIO() {
 
     // We now check each drive by polling each drive
     // 1. Channel master
-    DriveSelect(false, false);
-    if(Detect(&(devices[0]))) {
+    channels[0].DriveSelect(false);
+    if(Detect(&channels[0], &(devices[0]))) {
         KLog::the().printf("IDE: Drive 0 is attached\n\r");
         BlockManager::the().RegisterBlockDevice(&(devices[0]));
     }
     // 1. Channel slave
-    DriveSelect(true, false);
-    if(Detect(&(devices[1]))) {
+    channels[0].DriveSelect(true);
+    if(Detect(&channels[0], &(devices[1]))) {
         KLog::the().printf("IDE: Drive 1 is attached\n\r");
         BlockManager::the().RegisterBlockDevice(&(devices[1]));
     }
     // 2. Channel master
-    DriveSelect(false, true);
-    if(Detect(&(devices[2]))) {
+    channels[1].DriveSelect(false);
+    if(Detect(&channels[1], &(devices[2]))) {
         KLog::the().printf("IDE: Drive 2 is attached\n\r");
         BlockManager::the().RegisterBlockDevice(&(devices[2]));
     }
     // 2. Channel slave
-    DriveSelect(true, true);
-    if(Detect(&(devices[3]))) {
+    channels[1].DriveSelect(true);
+    if(Detect(&channels[1], &(devices[3]))) {
         KLog::the().printf("IDE: Drive 3 is attached\n\r");
         BlockManager::the().RegisterBlockDevice(&(devices[3]));
     }
-    // Steal the IRQs
+    // Steal the IRQs, each channel gets its own
+    compat_channels[0] = &channels[0];
+    compat_channels[1] = &channels[1];
     Interrupts::the().RegisterIRQHandler(14, IDECompatPriInterrupt);
     Interrupts::the().RegisterIRQHandler(15, IDECompatSecInterrupt);
-    device_holding_irq = this;
 
     return true;
 }
 
-bool IDEDevice::Detect(IDEBlockDevice* device) {
-    WriteLBA(0, 0);
-    SendCommand(ATA_CMD_IDENTIFY);
-    if(ReadStatus() == 0) { return false; }
+bool IDEDevice::Detect(IDEChannel* channel, IDEBlockDevice* device) {
+    channel->WriteLBA(0, 0);
+    channel->SendCommand(ATA_CMD_IDENTIFY);
+    if(channel->ReadStatus() == 0) { return false; }
     // We need to poll until the busy bit clears
-    while(ReadStatus() & 0x80);
+    while(channel->ReadStatus() & 0x80);
     // Check the LBAmid and LBAhigh ports
     bool non_zero = false;
-    if(is_secondary) {
-        if(inb(secondary_bus_io_base + 4)) non_zero = true;
-        if(inb(secondary_bus_io_base + 5)) non_zero = true;
-    } else {
-        if(inb(primary_bus_io_base + 4)) non_zero = true;
-        if(inb(primary_bus_io_base + 5)) non_zero = true;
-    }
+    if(inb(channel->io_base + 4)) non_zero = true;
+    if(inb(channel->io_base + 5)) non_zero = true;
     if(non_zero) {
         KLog::the().printf("IDE: Device is ATAPI, treating as not attached\n\r");
         return false;
@@ -103,18 +142,14 @@ bool IDEDevice::Detect(IDEBlockDevice* device) {
     // Providing that the drive did not error, read the ident info
     while(true) {
         // TODO: timeout
-        uint8_t status = ReadStatus();
+        uint8_t status = channel->ReadStatus();
         if(status & ATA_SR_ERR) { KLog::the().printf("IDE: Device errored during IDENT\n\r"); return false; }
         if(status & ATA_SR_DRQ) { break; }
     }
 
     // Time to read 256 uint16_ts
     uint16_t ident_info[256];
-    if(is_secondary) {
-        for(size_t i = 0; i < 256; i++) { ident_info[i] = ReadDataShortFromSec(); }
-    } else {
-        for(size_t i = 0; i < 256; i++) { ident_info[i] = ReadDataShortFromPri(); }
-    }
+    for(size_t i = 0; i < 256; i++) { ident_info[i] = channel->ReadDataShort(); }
 
     // We only support LBA48 lol
     if(!(ident_info[83] & (1 << 10))) { KLog::the().printf("IDE: Device does not support LBA48\n\r"); }
@@ -129,91 +164,326 @@ bool IDEDevice::Detect(IDEBlockDevice* device) {
     KLog::the().printf("IDE: Device byte count: %x\n\r", lba_sector_count * 512);
     device->len = lba_sector_count * 512;
     device->exists = true;
+    // Check if the drive can do DMA
+    device->supports_dma = ident_info[49] & (1 << 8);
     return true;
 }
 
 int IDEDevice::read(int id, void* buf, size_t len, size_t offset) {
+    return Transfer(id, buf, len, offset, false);
+}
+
+int IDEDevice::write(int id, void* buf, size_t len, size_t offset) {
+    return Transfer(id, buf, len, offset, true);
+}
+
+int IDEDevice::Transfer(int id, void* buf, size_t len, size_t offset, bool write) {
     if(!devices[id].exists) { return -ENODEV; }
-    if(len >= devices[id].len) { return 0; }
-    ASSERT(len, "IDEDevice: read with 0 length");
+    if(offset >= devices[id].len) { return 0; }
     // Constrain len
-    if((len + offset) >= devices[id].len) {
+    if((len + offset) > devices[id].len) {
         len = devices[id].len - offset;
     }
-    acquire(&mutex);
-    switch(id) {
-        case 0: DriveSelect(false, false); break;
-        case 1: DriveSelect(true, false); break;
-        case 2: DriveSelect(false, true); break;
-        case 3: DriveSelect(true, true); break;
-    }
+    if(!len) { return 0; }
+    IDEChannel* channel = ChannelOf(id);
+    channel->mutex.lock();
+    channel->DriveSelect(id % 2);
     // Read the status register to waste time
-    ReadStatus();
-    // Calculate sector(s)
-    uint64_t sector = offset / 512;
-    uint64_t last_sector = (offset + len - 1) / 512;
-    uint64_t sector_count = (last_sector - sector) + 1;
-    // Get the sectors
-    // First we need to calculate the offset in the first sector
-    uint64_t first_sector_offset = offset % 512;
-    int64_t len_to_go = (int64_t)len;
-    // Allocate memory for the sectors
-    // TODO: maybe allocate this using VM::?
-    uint16_t* buffer;
-    if((sector_count * 512) > 4096) {
-        buffer = (uint16_t*)VM::AllocatePages(((sector_count * 512) / 4096) + (((sector_count * 512) & 4095) ? 1 : 0));
-    } else {
-        buffer = new uint16_t[sector_count * 256];
-    }
-    uint16_t* curr = buffer;
-    // Send to command
-    waiting_on_irq = true;
-    WriteLBA(sector, sector_count);
-    SendCommand(ATA_CMD_READ_PIO_EXT);
-    // Check if we are already ready lol
-    //if(!(ReadStatus() & ATA_SR_DRQ)) {
-    //    while(waiting_on_irq);
-    //}
-    while(len_to_go > 0) {
-        while(!(ReadStatus() & ATA_SR_DRQ));
-        // The data is ready, time to roll
-        if(is_secondary) {
-            for(size_t i = 0; i < 256; i++) { *(curr++) = ReadDataShortFromSec(); }
+    channel->ReadStatus();
+    int ret = -EIO;
+    if(dma_enabled && devices[id].supports_dma) {
+        // Sector aligned transfers use the buffer directly, everything else goes through the bounce buffer
+        ret = -EFAULT;
+        if(!(offset % 512) && !(len % 512) && !((uint64_t)buf & 1)) { ret = TransferDMADirect(channel, buf, len, offset, write); }
+        if(ret == -EFAULT) { ret = TransferDMA(channel, buf, len, offset, write); }
+        if(ret < 0) { KLog::the().printf("IDE: DMA %s failed, retrying with PIO\n\r", write ? "write" : "read"); }
+    }
+    if(ret < 0) { ret = write ? WritePIO(channel, buf, len, offset) : ReadPIO(channel, buf, len, offset); }
+    channel->mutex.unlock();
+    return ret;
+}
+
+int IDEDevice::flush(int id) {
+    if(!devices[id].exists) { return -ENODEV; }
+    IDEChannel* channel = ChannelOf(id);
+    channel->mutex.lock();
+    channel->DriveSelect(id % 2);
+    channel->ReadStatus();
+    channel->SendCommand(ATA_CMD_CACHE_FLUSH_EXT);
+    int ret = WaitForCompletion(channel);
+    channel->mutex.unlock();
+    if(ret < 0) { KLog::the().printf("IDE: cache flush of drive %i failed\n\r", id); }
+    return ret;
+}
+
+int IDEDevice::WaitForCompletion(IDEChannel* channel) {
+    // Reading the status register also acknowledges the IRQ on the drive
+    uint8_t status;
+    while((status = channel->ReadStatus()) & ATA_SR_BSY);
+    if(status & (ATA_SR_ERR | ATA_SR_DF)) { return -EIO; }
+    return 0;
+}
+
+int IDEDevice::RunDMA(IDEChannel* channel, uint64_t sector, uint16_t sector_count, bool write) {
+    uint16_t bm = channel->bus_master_base;
+    // The direction bit is from the view of the bus master, it is clear for writes to the drive
+    uint8_t direction = write ? 0 : BM_CMD_READ;
+    // Set up the bus master
+    outb(bm + BM_COMMAND, 0);
+    outl(bm + BM_PRDT, (uint32_t)channel->prdt_phys);
+    outb(bm + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+    outb(bm + BM_COMMAND, direction);
+    // Send the command, and start the transfer
+    channel->waiting_on_irq = true;
+    channel->WriteLBA(sector, sector_count);
+    channel->SendCommand(write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+    outb(bm + BM_COMMAND, direction | BM_CMD_START);
+    uint8_t bm_status = WaitForDMA(channel);
+    outb(bm + BM_COMMAND, 0);
+    // Reading the status register also acknowledges the IRQ on the drive
+    uint8_t status = channel->ReadStatus();
+    outb(bm + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+    if((bm_status & BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF))) { return -EIO; }
+    return 0;
+}
+
+int IDEDevice::TransferDMA(IDEChannel* channel, void* buf, size_t len, size_t offset, bool write) {
+    IDEChannel::PRD* prdt = channel->prdt;
+    uint8_t* curr_buf = (uint8_t*)buf;
+    uint64_t curr = offset;
+    uint64_t end = offset + len;
+    while(end > curr) {
+        uint64_t sector = curr / 512;
+        uint64_t first_sector_offset = curr % 512;
+        uint64_t chunk = end - curr;
+        if(chunk > ((dma_buffer_pages * 4096) - first_sector_offset)) { chunk = (dma_buffer_pages * 4096) - first_sector_offset; }
+        uint64_t sector_count = (first_sector_offset + chunk + 511) / 512;
+        // Build the PRDT, one entry per page of the bounce buffer
+        uint64_t bytes = sector_count * 512;
+        size_t prd_count = (bytes + 4095) / 4096;
+        for(size_t i = 0; i < prd_count; i++) {
+            prdt[i].phys = (uint32_t)(channel->dma_buffer_phys + (i * 4096));
+            prdt[i].len = ((bytes - (i * 4096)) < 4096) ? (bytes - (i * 4096)) : 4096;
+            prdt[i].flags = (i == (prd_count - 1)) ? IDE_PRD_END_OF_TABLE : 0;
+        }
+        if(write) {
+            // Partially written sectors have to be read in first
+            if(first_sector_offset || ((first_sector_offset + chunk) % 512)) {
+                if(RunDMA(channel, sector, sector_count, false) < 0) { return -EIO; }
+            }
+            memcopy(curr_buf, channel->dma_buffer + first_sector_offset, chunk);
+            if(RunDMA(channel, sector, sector_count, true) < 0) { return -EIO; }
         } else {
-            for(size_t i = 0; i < 256; i++) { *(curr++) = ReadDataShortFromPri(); }
+            if(RunDMA(channel, sector, sector_count, false) < 0) { return -EIO; }
+            memcopy(channel->dma_buffer + first_sector_offset, curr_buf, chunk);
+        }
+        curr += chunk;
+        curr_buf += chunk;
+    }
+    return len;
+}
+
+int IDEDevice::TransferDMADirect(IDEChannel* channel, void* buf, size_t len, size_t offset, bool write) {
+    IDEChannel::PRD* prdt = channel->prdt;
+    // Kernel threads run on the page table of whatever ran before them, so only the kernel half, which every page table
+    // shares, translates the same everywhere. Buffers below it go through the bounce buffer.
+    if((uint64_t)buf < 0xffff800000000000ULL) { return -EFAULT; }
+    // PRDs only have 32 bit addresses, so check the whole buffer first
+    for(uint64_t virt = (uint64_t)buf & ~4095ULL; virt < ((uint64_t)buf + len); virt += 4096) {
+        uint64_t phys = VM::GetPhysical(virt);
+        if(!phys || ((phys + 4096) >> 32)) { return -EFAULT; }
+    }
+
+    uint8_t* curr_buf = (uint8_t*)buf;
+    uint64_t sector = offset / 512;
+    uint64_t remaining = len;
+    while(remaining) {
+        // Build the PRDT straight from the buffer pages, merging physically contiguous pages.
+        // A PRD can not cross a 64KiB boundary, and a command can not transfer more than 65535 sectors.
+        size_t prd_count = 0;
+        uint64_t bytes = 0;
+        uint32_t prd_bytes[max_prd_count];
+        uint64_t max_bytes = (remaining < (65535 * 512)) ? remaining : (65535 * 512);
+        while(bytes < max_bytes) {
+            uint64_t virt = (uint64_t)curr_buf + bytes;
+            uint64_t phys = VM::GetPhysical(virt & ~4095ULL) + (virt & 4095);
+            uint64_t seg = 4096 - (virt & 4095);
+            if(seg > (max_bytes - bytes)) { seg = max_bytes - bytes; }
+            if(prd_count && (prdt[prd_count - 1].phys + prd_bytes[prd_count - 1]) == phys
+                && (prdt[prd_count - 1].phys & ~0xFFFFULL) == ((phys + seg - 1) & ~0xFFFFULL)) {
+                prd_bytes[prd_count - 1] += seg;
+            } else {
+                if(prd_count == max_prd_count) { break; }
+                prdt[prd_count].phys = (uint32_t)phys;
+                prd_bytes[prd_count] = seg;
+                prd_count++;
+            }
+            bytes += seg;
+        }
+        // If we ran out of PRDs, the transfer has to end on a sector boundary
+        uint64_t excess = bytes % 512;
+        bytes -= excess;
+        while(excess) {
+            uint64_t trim = (prd_bytes[prd_count - 1] < excess) ? prd_bytes[prd_count - 1] : excess;
+            prd_bytes[prd_count - 1] -= trim;
+            excess -= trim;
+            if(!prd_bytes[prd_count - 1]) { prd_count--; }
+        }
+        for(size_t i = 0; i < prd_count; i++) {
+            prdt[i].len = prd_bytes[i] & 0xFFFF; // 64KiB is encoded as 0
+            prdt[i].flags = (i == (prd_count - 1)) ? IDE_PRD_END_OF_TABLE : 0;
         }
-        len_to_go -= 512;
+        if(RunDMA(channel, sector, bytes / 512, write) < 0) { return -EIO; }
+        sector += bytes / 512;
+        curr_buf += bytes;
+        remaining -= bytes;
     }
-    ASSERT(!(ReadStatus() & ATA_SR_DRQ), "IDE: Drive DRQ asserted after read done");
-    // Memcopy the data we want
-    memcopy(((uint8_t*)(buffer)) + first_sector_offset, buf, len);
-    if((sector_count * 512) > 4096) {
-        VM::FreePages(buffer, ((sector_count * 512) / 4096) + (((sector_count * 512) & 4095) ? 1 : 0));
+    return len;
+}
+
+uint8_t IDEDevice::WaitForDMA(IDEChannel* channel) {
+    uint16_t bm = channel->bus_master_base;
+    Processes::Thread* thread = Processes::Scheduler::the().CurrentThread();
+    if(interrupts_enabled() && thread) {
+        // Let other tasks run until the IRQ handler tells us the transfer is done.
+        // Interrupts are off while we check, so the IRQ cant slip in before we sleep.
+        unsigned long flags = save_irqdisable();
+        channel->irq_waiter = thread;
+        while(channel->waiting_on_irq) { Processes::Scheduler::the().SleepCurrent(); }
+        channel->irq_waiter = NULL;
+        irqrestore(flags);
+    } else if(interrupts_enabled()) {
+        // Before scheduling starts there is nothing else to run, so halt until the IRQ.
+        // The sti only takes effect after the hlt, so the IRQ cant slip in between.
+        for(;;) {
+            asm volatile("cli");
+            if(!channel->waiting_on_irq) { break; }
+            asm volatile("sti; hlt");
+        }
+        asm volatile("sti");
     } else {
-        delete buffer;
+        // Early in boot, before interrupts are enabled, the IRQ never arrives; poll the bus master instead
+        while(!(inb(bm + BM_STATUS) & BM_SR_IRQ)) { asm volatile("pause"); }
+    }
+    return inb(bm + BM_STATUS);
+}
+
+int IDEDevice::ReadPIOSectors(IDEChannel* channel, uint16_t* buf, uint64_t sector, uint64_t sector_count) {
+    while(sector_count) {
+        // Larger reads are split into several commands
+        uint16_t count = (sector_count > 65535) ? 65535 : sector_count;
+        channel->WriteLBA(sector, count);
+        channel->SendCommand(ATA_CMD_READ_PIO_EXT);
+        for(size_t i = 0; i < count; i++) {
+            // Wait for the drive to have the next sector ready
+            uint8_t status;
+            while((status = channel->ReadStatus()) & ATA_SR_BSY);
+            if(status & (ATA_SR_ERR | ATA_SR_DF)) { return -EIO; }
+            while(!((status = channel->ReadStatus()) & ATA_SR_DRQ));
+            for(size_t j = 0; j < 256; j++) { *(buf++) = channel->ReadDataShort(); }
+        }
+        sector += count;
+        sector_count -= count;
     }
-    release(&mutex);
+    return 0;
+}
+
+int IDEDevice::ReadPIO(IDEChannel* channel, void* buf, size_t len, size_t offset) {
+    // Whole sectors are read straight into buf, only partial sectors at the start and end go through a sector buffer
+    uint16_t sector_buffer[256];
+    uint8_t* curr_buf = (uint8_t*)buf;
+    uint64_t curr = offset;
+    uint64_t end = offset + len;
+    if(curr % 512) {
+        uint64_t first_sector_offset = curr % 512;
+        uint64_t chunk = 512 - first_sector_offset;
+        if(chunk > (end - curr)) { chunk = end - curr; }
+        if(ReadPIOSectors(channel, sector_buffer, curr / 512, 1) < 0) { return -EIO; }
+        memcopy((uint8_t*)sector_buffer + first_sector_offset, curr_buf, chunk);
+        curr += chunk;
+        curr_buf += chunk;
+    }
+    uint64_t whole_sectors = (end - curr) / 512;
+    if(whole_sectors) {
+        if(ReadPIOSectors(channel, (uint16_t*)curr_buf, curr / 512, whole_sectors) < 0) { return (curr == offset) ? -EIO : (int)(curr - offset); }
+        curr += whole_sectors * 512;
+        curr_buf += whole_sectors * 512;
+    }
+    if(end > curr) {
+        if(ReadPIOSectors(channel, sector_buffer, curr / 512, 1) < 0) { return (curr == offset) ? -EIO : (int)(curr - offset); }
+        memcopy(sector_buffer, curr_buf, end - curr);
+    }
+    ASSERT(!(channel->ReadStatus() & ATA_SR_DRQ), "IDE: Drive DRQ asserted after read done");
     return len;
 }
 
-int IDEDevice::write(int id, void* buf, size_t len, size_t offset) {
-    return -ENOSYS;
-    (void)id;
-    (void)buf;
-    (void)len;
-    (void)offset;
+int IDEDevice::WritePIOSectors(IDEChannel* channel, uint16_t* buf, uint64_t sector, uint64_t sector_count) {
+    while(sector_count) {
+        // Larger writes are split into several commands
+        uint16_t count = (sector_count > 65535) ? 65535 : sector_count;
+        channel->WriteLBA(sector, count);
+        channel->SendCommand(ATA_CMD_WRITE_PIO_EXT);
+        for(size_t i = 0; i < count; i++) {
+            // Wait for the drive to take the next sector
+            uint8_t status;
+            while((status = channel->ReadStatus()) & ATA_SR_BSY);
+            if(status & (ATA_SR_ERR | ATA_SR_DF)) { return -EIO; }
+            while(!((status = channel->ReadStatus()) & ATA_SR_DRQ));
+            for(size_t j = 0; j < 256; j++) { channel->WriteDataShort(*(buf++)); }
+        }
+        // The command is only done once the drive has taken care of the last sector
+        if(WaitForCompletion(channel) < 0) { return -EIO; }
+        sector += count;
+        sector_count -= count;
+    }
+    return 0;
+}
+
+int IDEDevice::WritePIO(IDEChannel* channel, void* buf, size_t len, size_t offset) {
+    // Whole sectors are written straight from buf, partial sectors at the start and end are read in and patched first
+    uint16_t sector_buffer[256];
+    uint8_t* curr_buf = (uint8_t*)buf;
+    uint64_t curr = offset;
+    uint64_t end = offset + len;
+    if(curr % 512) {
+        uint64_t first_sector_offset = curr % 512;
+        uint64_t chunk = 512 - first_sector_offset;
+        if(chunk > (end - curr)) { chunk = end - curr; }
+        if(ReadPIOSectors(channel, sector_buffer, curr / 512, 1) < 0) { return -EIO; }
+        memcopy(curr_buf, (uint8_t*)sector_buffer + first_sector_offset, chunk);
+        if(WritePIOSectors(channel, sector_buffer, curr / 512, 1) < 0) { return -EIO; }
+        curr += chunk;
+        curr_buf += chunk;
+    }
+    uint64_t whole_sectors = (end - curr) / 512;
+    if(whole_sectors) {
+        if(WritePIOSectors(channel, (uint16_t*)curr_buf, curr / 512, whole_sectors) < 0) { return (curr == offset) ? -EIO : (int)(curr - offset); }
+        curr += whole_sectors * 512;
+        curr_buf += whole_sectors * 512;
+    }
+    if(end > curr) {
+        if(ReadPIOSectors(channel, sector_buffer, curr / 512, 1) < 0) { return (curr == offset) ? -EIO : (int)(curr - offset); }
+        memcopy(curr_buf, sector_buffer, end - curr);
+        if(WritePIOSectors(channel, sector_buffer, curr / 512, 1) < 0) { return (curr == offset) ? -EIO : (int)(curr - offset); }
+    }
+    return len;
+}
+
+void IDEChannel::IRQ() {
+    waiting_on_irq = false;
+    if(irq_waiter) { Processes::Scheduler::the().WakeUp(irq_waiter); }
 }
 
 void IDECompatPriInterrupt(Interrupts::ISRRegisters* regs) {
-    if(device_holding_irq) {
-        device_holding_irq->IRQ();
+    if(compat_channels[0]) {
+        compat_channels[0]->IRQ();
     }
     (void)regs;
 }
 
 void IDECompatSecInterrupt(Interrupts::ISRRegisters* regs) {
-    if(device_holding_irq) {
-        device_holding_irq->IRQ();
+    if(compat_channels[1]) {
+        compat_channels[1]->IRQ();
     }
     (void)regs;
 }
@@ -3,88 +3,67 @@
 #include <hardware/instructions.h>
 #include <kernel-drivers/PCI.h>
 #include <kernel-drivers/BlockDevices.h>
-#include <CPP/mutex.h>
+#include <processes/sync.h>
 #include <interrupts.h>
 
 namespace Kernel {
 
 class IDEBlockDevice;
 
-class IDEDevice : public PCIDevice {
-public:
-    IDEDevice(uint8_t _bus, uint8_t _slot, uint8_t _function) : PCIDevice(_bus, _slot, _function) { }
-    bool Initialize() override;
-    bool hasKernelTask() override { return false; }
-
-    bool InitPIO();
-
-    int read(int id, void* buf, size_t len, size_t offset);
-    int write(int id, void* buf, size_t len, size_t offset);
-
-    void IRQ() { waiting_on_irq = false;}
-private:
-    
-    bool waiting_on_irq = false;
-
-    bool Detect(IDEBlockDevice* device);
-
-    inline void SendCommand(uint8_t cmd) {
-        if(is_secondary) {
-            outb(secondary_bus_io_base + 7, cmd);
-        } else {
-            outb(primary_bus_io_base + 7, cmd);
-        }
-    }
+// One of the two channels of a IDE controller.
+// The channels are independent, so each has its own lock, IRQ and DMA buffers, and
+// the drives on different channels can transfer at the same time.
+struct IDEChannel {
+    uint16_t io_base;
+    uint16_t control_base;
+    // Bus master registers of this channel, 0 if there is no DMA
+    uint16_t bus_master_base = 0;
+    bool secondary;
+
+    // Physical Region Descriptor
+    struct PRD {
+        uint32_t phys;
+        uint16_t len; // 0 means 64KiB
+        uint16_t flags;
+        #define IDE_PRD_END_OF_TABLE 0x8000
+    } __attribute__((packed));
+
+    PRD* prdt = NULL;
+    uint64_t prdt_phys = 0;
+    // Physically contiguous bounce buffer DMA transfers go through
+    uint8_t* dma_buffer = NULL;
+    uint64_t dma_buffer_phys = 0;
+
+    volatile bool waiting_on_irq = false;
+    // Thread sleeping until the IRQ comes in
+    Processes::Thread* volatile irq_waiter = NULL;
+    // Serializes everything on the channel, as only one drive can be selected at a time.
+    // Held for whole transfers, so the other tasks sleep instead of spinning on it.
+    Mutex mutex;
+
+    void IRQ();
+
+    inline void SendCommand(uint8_t cmd) { outb(io_base + 7, cmd); }
 
     inline void WriteLBA(uint64_t lba, uint16_t sec_count) {
-        if(is_secondary) {
-            outb(secondary_bus_io_base + 2, (sec_count >> 8) & 0xFF); // Sec high
-            outb(secondary_bus_io_base + 3, (lba >> 24) & 0xFF); // LBA4
-            outb(secondary_bus_io_base + 4, (lba >> 32) & 0xFF); // LBA5
-            outb(secondary_bus_io_base + 5, (lba >> 40) & 0xFF); // LBA6
-            outb(secondary_bus_io_base + 2, sec_count & 0xFF); // Sec low
-            outb(secondary_bus_io_base + 3, (lba >> 0) & 0xFF); // LBA1
-            outb(secondary_bus_io_base + 4, (lba >> 8) & 0xFF); // LBA2
-            outb(secondary_bus_io_base + 5, (lba >> 16) & 0xFF); // LBA3
-        } else {
-            outb(primary_bus_io_base + 2, (sec_count >> 8) & 0xFF); // Sec high
-            outb(primary_bus_io_base + 3, (lba >> 24) & 0xFF); // LBA4
-            outb(primary_bus_io_base + 4, (lba >> 32) & 0xFF); // LBA5
-            outb(primary_bus_io_base + 5, (lba >> 40) & 0xFF); // LBA6
-            outb(primary_bus_io_base + 2, sec_count & 0xFF); // Sec low
-            outb(primary_bus_io_base + 3, (lba >> 0) & 0xFF); // LBA1
-            outb(primary_bus_io_base + 4, (lba >> 8) & 0xFF); // LBA2
-            outb(primary_bus_io_base + 5, (lba >> 16) & 0xFF); // LBA3
-        }
-    }
-
-    inline uint8_t ReadStatus() {
-        if(is_secondary) {
-            return inb(secondary_bus_io_base + 7);
-        } else {
-            return inb(primary_bus_io_base + 7);
-        }
-    }
-
-    inline uint8_t ReadError() {
-        if(is_secondary) {
-            return inb(secondary_bus_io_base + 1);
-        } else {
-            return inb(primary_bus_io_base + 1);
-        }
+        outb(io_base + 2, (sec_count >> 8) & 0xFF); // Sec high
+        outb(io_base + 3, (lba >> 24) & 0xFF); // LBA4
+        outb(io_base + 4, (lba >> 32) & 0xFF); // LBA5
+        outb(io_base + 5, (lba >> 40) & 0xFF); // LBA6
+        outb(io_base + 2, sec_count & 0xFF); // Sec low
+        outb(io_base + 3, (lba >> 0) & 0xFF); // LBA1
+        outb(io_base + 4, (lba >> 8) & 0xFF); // LBA2
+        outb(io_base + 5, (lba >> 16) & 0xFF); // LBA3
     }
 
-    inline uint16_t ReadDataShortFromPri() { return inw(primary_bus_io_base); }
-    inline uint16_t ReadDataShortFromSec() { return inw(secondary_bus_io_base); }
+    inline uint8_t ReadStatus() { return inb(io_base + 7); }
+    inline uint8_t ReadError() { return inb(io_base + 1); }
+    inline uint16_t ReadDataShort() { return inw(io_base); }
+    inline void WriteDataShort(uint16_t data) { outw(io_base, data); }
 
-    inline void DriveSelect(bool slave, bool _is_secondary) {
-        is_secondary = _is_secondary;
+    inline void DriveSelect(bool slave) {
         int make_sure_slave_is_a_one = slave ? 1 : 0;
-        if(is_secondary) {
-            outb(secondary_bus_io_base + 6, 0xE0 | (make_sure_slave_is_a_one << 4));
-        } else {
-            outb(primary_bus_io_base + 6, 0xE0 | (make_sure_slave_is_a_one << 4));
-        }
+        outb(io_base + 6, 0xE0 | (make_sure_slave_is_a_one << 4));
     }
 
     inline bool PollUntilReady() {
@@ -92,9 +71,66 @@ private:
         while(ReadStatus() & 0x80);
         return true;
     }
+};
+
+class IDEDevice : public PCIDevice {
+public:
+    IDEDevice(uint8_t _bus, uint8_t _slot, uint8_t _function) : PCIDevice(_bus, _slot, _function) { }
+    bool Initialize() override;
+
+    bool InitPIO();
+    // Set up bus master DMA. If this fails, the PIO paths are used.
+    bool InitDMA();
+
+    int read(int id, void* buf, size_t len, size_t offset);
+    int write(int id, void* buf, size_t len, size_t offset);
+    // Write back the write cache of the drive
+    int flush(int id);
+
+private:
+    int Transfer(int id, void* buf, size_t len, size_t offset, bool write);
+    // Transfer implementations, the channel mutex must be held and the drive must be selected
+    int ReadPIO(IDEChannel* channel, void* buf, size_t len, size_t offset);
+    // Read whole sectors into buf, splitting into several commands if needed
+    int ReadPIOSectors(IDEChannel* channel, uint16_t* buf, uint64_t sector, uint64_t sector_count);
+    // Partially written sectors at the start and end are read in first
+    int WritePIO(IDEChannel* channel, void* buf, size_t len, size_t offset);
+    int WritePIOSectors(IDEChannel* channel, uint16_t* buf, uint64_t sector, uint64_t sector_count);
+    // Transfer through the DMA bounce buffer
+    int TransferDMA(IDEChannel* channel, void* buf, size_t len, size_t offset, bool write);
+    // Transfer sector aligned data directly from/to buf, which has to be in the kernel half.
+    // Returns -EFAULT if buf is not, or cant be reached by the bus master.
+    int TransferDMADirect(IDEChannel* channel, void* buf, size_t len, size_t offset, bool write);
+    // Run a DMA transfer with the PRDT that has been set up
+    int RunDMA(IDEChannel* channel, uint64_t sector, uint16_t sector_count, bool write);
+    // Wait for the drive to finish a command that has no data phase
+    int WaitForCompletion(IDEChannel* channel);
+    // Wait for a DMA transfer to finish. Returns the bus master status.
+    uint8_t WaitForDMA(IDEChannel* channel);
+
+    // Bus master IDE registers, relative to the channel base
+    enum BusMasterRegisters {
+        BM_COMMAND = 0x0,
+        BM_STATUS = 0x2,
+        BM_PRDT = 0x4
+    };
+    enum BusMasterBits {
+        BM_CMD_START = 0x1,
+        BM_CMD_READ = 0x8, // Direction is device to memory
+        BM_SR_ACTIVE = 0x1,
+        BM_SR_ERR = 0x2,
+        BM_SR_IRQ = 0x4
+    };
+
+    bool dma_enabled = false;
+    static const size_t dma_buffer_pages = 16;
+    // The PRDT is a single page
+    static const size_t max_prd_count = 4096 / sizeof(IDEChannel::PRD);
+
+    bool Detect(IDEChannel* channel, IDEBlockDevice* device);
 
-    bool is_secondary = false;
-    mutex_t mutex;
+    // Drives 0 and 1 are on the primary channel, 2 and 3 on the secondary one
+    inline IDEChannel* ChannelOf(int id) { return &channels[id / 2]; }
 
     enum StatusPortBitmask {
         ATA_SR_ERR = 0x1, // Error
@@ -140,6 +176,7 @@ private:
     const uint16_t secondary_bus_io_base = 0x170;
     const uint16_t secondary_bus_control_base = 0x376;
 
+    IDEChannel channels[2];
     IDEBlockDevice* devices;
 };
 
@@ -148,8 +185,9 @@ struct IDEBlockDevice : public BlockDevice {
     IDEDevice* driver;
     int id;
     bool exists = false;
-    int read(void* buf, size_t len, size_t offset) override { return driver->read(id, buf, len, offset); }
-    int write(void* buf, size_t len, size_t offset) override { return driver->write(id, buf, len, offset); }
+    bool supports_dma = false;
+    int transfer(void* buf, size_t len, size_t offset, bool write) override { return write ? driver->write(id, buf, len, offset) : driver->read(id, buf, len, offset); }
+    int flush() override { return driver->flush(id); }
 };
 
 void IDECompatPriInterrupt(Interrupts::ISRRegisters* regs);
@@ -0,0 +1,464 @@
+#include <kernel-drivers/NVMe.h>
+#include <mem/PM/physalloc.h>
+#include <mem/VM/virtmem.h>
+#include <hardware/instructions.h>
+#include <debug/klog.h>
+#include <errno.h>
+#include <mem.h>
+
+namespace Kernel {
+
+Vector<NVMeController*> nvme_controllers;
+
+bool NVMeController::Initialize() {
+    KLog::the().printf("NVMe: initializing NVMe controller at %i:%i.%i\n\r", bus, slot, function);
+    // The registers are in BAR0, which has to be memory space, and is usually 64 bit
+    if(bars[0].io || !bars[0].size) {
+        KLog::the().printf("NVMe: BAR0 is not a memory BAR\n\r");
+        return false;
+    }
+    registers = (uint8_t*)VM::MapIOSpace(barAddress(0), 0x1000);
+    // Enable memory space access and bus mastering
+    uint16_t command = PCI::the().configRead(bus, slot, function, 0x4);
+    PCI::the().configWrite(bus, slot, function, 0x4, command | 0x6);
+
+    uint64_t cap = Register64(NVME_CAP);
+    if(((cap >> 48) & 0xF) != 0) {
+        KLog::the().printf("NVMe: controller does not support 4KiB pages\n\r");
+        return false;
+    }
+    if(!((cap >> 37) & 0x1)) {
+        KLog::the().printf("NVMe: controller does not support the NVM command set\n\r");
+        return false;
+    }
+    if((cap & 0xFFFF) + 1 < NVMeQueue::depth) {
+        KLog::the().printf("NVMe: controller queues are too small\n\r");
+        return false;
+    }
+    doorbell_stride = 4 << ((cap >> 32) & 0xF);
+    // Admin queue pair and one I/O queue pair
+    doorbells = (uint8_t*)VM::MapIOSpace(barAddress(0) + 0x1000, 4 * doorbell_stride);
+    KLog::the().printf("NVMe: version %x, doorbell stride %i\n\r", Register32(NVME_VS), doorbell_stride);
+
+    // Reset the controller
+    Register32(NVME_CC) = Register32(NVME_CC) & ~1U;
+    while(Register32(NVME_CSTS) & 0x1) { asm volatile("pause"); }
+    // Set up the admin queue
+    admin_queue = CreateQueue(0);
+    Register32(NVME_AQA) = ((NVMeQueue::depth - 1) << 16) | (NVMeQueue::depth - 1);
+    Register64(NVME_ASQ) = admin_queue->sq_phys;
+    Register64(NVME_ACQ) = admin_queue->cq_phys;
+    // Enable it, with 64 byte submission entries, 16 byte completion entries and 4KiB pages
+    Register32(NVME_CC) = 0x1 | (6 << 16) | (4 << 20);
+    while(!(Register32(NVME_CSTS) & 0x1)) {
+        if(Register32(NVME_CSTS) & 0x2) {
+            KLog::the().printf("NVMe: controller fatal status while enabling\n\r");
+            return false;
+        }
+        asm volatile("pause");
+    }
+
+    uint64_t page = PM::AllocatePages();
+    if(Identify(1, 0, page) != 0) {
+        KLog::the().printf("NVMe: identify controller failed\n\r");
+        PM::FreePages(page);
+        return false;
+    }
+    uint8_t* ident = (uint8_t*)(page + VM::GetVirtualOffset());
+    // MDTS is in units of the minimum page size, which we know is 4KiB
+    uint8_t mdts = ident[77];
+    if(mdts && (((uint64_t)4096 << mdts) < max_transfer)) { max_transfer = (uint64_t)4096 << mdts; }
+    // Get a vector for each queue if we can, so the IRQ does not need to check both
+    int vectors = EnableMSI(2);
+    if(!CreateIOQueues((vectors > 1) ? 1 : 0)) {
+        KLog::the().printf("NVMe: failed to create the I/O queues\n\r");
+        PM::FreePages(page);
+        return false;
+    }
+    ProbeNamespaces(*(uint32_t*)(ident + 516));
+    PM::FreePages(page);
+
+    if(vectors > 0) {
+        KLog::the().printf("NVMe: using %s with %i vectors\n\r", hasMSIX() ? "MSI-X" : "MSI", vectors);
+        return true;
+    }
+    // Otherwise use the legacy interrupt line. If there is none, we poll.
+    uint8_t line = PCI::the().configRead(bus, slot, function, 0x3C) & 0xFF;
+    if(line < 16) {
+        nvme_controllers.push_back(this);
+        Interrupts::the().RegisterIRQHandler(line, NVMeInterrupt);
+        irq = line;
+        KLog::the().printf("NVMe: using IRQ %i\n\r", irq);
+    }
+    return true;
+}
+
+NVMeQueue* NVMeController::CreateQueue(uint16_t id) {
+    NVMeQueue* queue = new NVMeQueue;
+    queue->id = id;
+    queue->sq_phys = PM::AllocatePages();
+    queue->cq_phys = PM::AllocatePages();
+    queue->sq = (volatile NVMeCommand*)(queue->sq_phys + VM::GetVirtualOffset());
+    queue->cq = (volatile NVMeCompletion*)(queue->cq_phys + VM::GetVirtualOffset());
+    memset((void*)queue->sq, 0, 4096);
+    memset((void*)queue->cq, 0, 4096);
+    // The admin queue only does commands with a single page
+    if(id) {
+        for(size_t i = 0; i < NVMeQueue::depth; i++) { queue->prp_lists[i] = PM::AllocatePages(); }
+    }
+    queue->sq_doorbell = (volatile uint32_t*)(doorbells + ((2 * id) * doorbell_stride));
+    queue->cq_doorbell = (volatile uint32_t*)(doorbells + (((2 * id) + 1) * doorbell_stride));
+    return queue;
+}
+
+bool NVMeController::CreateIOQueues(uint16_t vector) {
+    io_queue = CreateQueue(1);
+    NVMeCommand cmd;
+    // Completion queue first, physically contiguous with interrupts enabled
+    memset(&cmd, 0, sizeof(NVMeCommand));
+    cmd.cdw0 = NVME_ADMIN_CREATE_CQ;
+    cmd.prp1 = io_queue->cq_phys;
+    cmd.cdw10 = ((NVMeQueue::depth - 1) << 16) | io_queue->id;
+    cmd.cdw11 = ((uint32_t)vector << 16) | 0x1 | 0x2;
+    if(admin_queue->submit(&cmd, false) != 0) { return false; }
+    // And the submission queue, completing into it
+    memset(&cmd, 0, sizeof(NVMeCommand));
+    cmd.cdw0 = NVME_ADMIN_CREATE_SQ;
+    cmd.prp1 = io_queue->sq_phys;
+    cmd.cdw10 = ((NVMeQueue::depth - 1) << 16) | io_queue->id;
+    cmd.cdw11 = (io_queue->id << 16) | 0x1;
+    if(admin_queue->submit(&cmd, false) != 0) { return false; }
+    return true;
+}
+
+int NVMeController::Identify(uint32_t cns, uint32_t nsid, uint64_t page) {
+    NVMeCommand cmd;
+    memset(&cmd, 0, sizeof(NVMeCommand));
+    cmd.cdw0 = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.prp1 = page;
+    cmd.cdw10 = cns;
+    return admin_queue->submit(&cmd, hasIRQ());
+}
+
+void NVMeController::ProbeNamespaces(uint32_t count) {
+    // Get the list of active namespaces
+    uint64_t list_page = PM::AllocatePages();
+    if(Identify(2, 0, list_page) != 0) {
+        KLog::the().printf("NVMe: could not get the active namespace list\n\r");
+        PM::FreePages(list_page);
+        return;
+    }
+    uint32_t* list = (uint32_t*)(list_page + VM::GetVirtualOffset());
+    uint64_t page = PM::AllocatePages();
+    uint8_t* ident = (uint8_t*)(page + VM::GetVirtualOffset());
+    for(size_t i = 0; i < 1024 && list[i] && list[i] <= count; i++) {
+        if(Identify(0, list[i], page) != 0) { continue; }
+        uint64_t size = *(uint64_t*)ident;
+        if(!size) { continue; }
+        // The current LBA format tells us the block size
+        uint8_t format = ident[26] & 0xF;
+        uint32_t lba_format = *(uint32_t*)(ident + 128 + (format * 4));
+        NVMeNamespace* ns = new NVMeNamespace;
+        ns->controller = this;
+        ns->nsid = list[i];
+        ns->block_size = 1ULL << ((lba_format >> 16) & 0xFF);
+        ns->len = size * ns->block_size;
+        KLog::the().printf("NVMe: namespace %i: %x blocks of %i bytes\n\r", ns->nsid, size, ns->block_size);
+        BlockManager::the().RegisterBlockDevice(ns);
+    }
+    PM::FreePages(page);
+    PM::FreePages(list_page);
+}
+
+void NVMeController::HandleInterrupt(size_t index) {
+    // MSIs are edge triggered, so there is nothing to acknowledge, and reaping can wait until after the IRQ
+    bool shared = msiVector(1) < 0;
+    if(admin_queue && (shared || index == 0)) { SoftIRQ::the().Schedule(&admin_queue->completion_tasklet); }
+    if(io_queue && (shared || index == 1)) { SoftIRQ::the().Schedule(&io_queue->completion_tasklet); }
+}
+
+void NVMeQueue::CompletionTasklet(void* data) {
+    NVMeQueue* queue = (NVMeQueue*)data;
+    unsigned long flags = save_irqdisable();
+    acquire(&queue->mutex);
+    uint32_t completed = queue->checkCompletion();
+    release(&queue->mutex);
+    irqrestore(flags);
+    queue->endCommands(completed);
+}
+
+void NVMeController::IRQ() {
+    if(admin_queue) {
+        acquire(&admin_queue->mutex);
+        uint32_t completed = admin_queue->checkCompletion();
+        release(&admin_queue->mutex);
+        admin_queue->endCommands(completed);
+    }
+    if(io_queue) {
+        acquire(&io_queue->mutex);
+        uint32_t completed = io_queue->checkCompletion();
+        release(&io_queue->mutex);
+        io_queue->endCommands(completed);
+    }
+}
+
+uint32_t NVMeQueue::checkCompletion() {
+    bool reaped = false;
+    uint32_t async = 0;
+    while((cq[cq_head].status & 0x1) == phase) {
+        uint16_t cid = cq[cq_head].cid;
+        if(cid < depth) {
+            status[cid] = cq[cq_head].status >> 1;
+            cids_done |= (1U << cid);
+            if(commands[cid].request) { async |= (1U << cid); }
+        }
+        cq_head++;
+        if(cq_head == depth) {
+            // The phase flips every time we wrap around
+            cq_head = 0;
+            phase ^= 1;
+        }
+        reaped = true;
+    }
+    if(reaped) {
+        *cq_doorbell = cq_head;
+        waiters.wakeAll();
+    }
+    return async;
+}
+
+void NVMeQueue::endCommands(uint32_t completed) {
+    for(int cid = 0; completed; cid++) {
+        uint32_t bit = 1U << cid;
+        if(!(completed & bit)) { continue; }
+        completed &= ~bit;
+        asyncCommand command = commands[cid];
+        commands[cid].request = NULL;
+        unsigned long flags = save_irqdisable();
+        acquire(&mutex);
+        uint16_t ret = status[cid];
+        cids_done &= ~bit;
+        release(&mutex);
+        irqrestore(flags);
+        if(ret) { KLog::the().printf("NVMe: namespace %i command failed with status %x\n\r", command.ns->nsid, ret); }
+        else if(command.buf) { memcopy(bounce[cid], command.buf, command.len); }
+        freeCid(cid);
+        command.ns->queue->endTransfer(command.request, ret ? -EIO : (int)command.len);
+    }
+}
+
+int NVMeQueue::allocateCid(bool can_sleep) {
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
+    for(;;) {
+        for(int cid = 0; cid < (depth - 1); cid++) {
+            if(cids_used & (1U << cid)) { continue; }
+            cids_used |= (1U << cid);
+            release(&mutex);
+            irqrestore(flags);
+            return cid;
+        }
+        // All ids are busy, wait until a command finishes
+        if(can_sleep) {
+            waiters.wait(&mutex);
+        } else {
+            checkCompletion();
+            release(&mutex);
+            irqrestore(flags);
+            asm volatile("pause");
+            flags = save_irqdisable();
+            acquire(&mutex);
+        }
+    }
+}
+
+void NVMeQueue::freeCid(int cid) {
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
+    cids_used &= ~(1U << cid);
+    waiters.wakeAll();
+    release(&mutex);
+    irqrestore(flags);
+}
+
+void NVMeQueue::issue(int cid, NVMeCommand* cmd) {
+    cmd->cdw0 = (cmd->cdw0 & 0xFFFF) | ((uint32_t)cid << 16);
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
+    memcopy(cmd, (void*)&sq[sq_tail], sizeof(NVMeCommand));
+    sq_tail = (sq_tail + 1) % depth;
+    *sq_doorbell = sq_tail;
+    release(&mutex);
+    irqrestore(flags);
+}
+
+int NVMeQueue::execute(int cid, NVMeCommand* cmd, bool can_sleep) {
+    uint32_t bit = 1U << cid;
+    issue(cid, cmd);
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
+    while(!(cids_done & bit)) {
+        if(can_sleep) {
+            // The completion tasklet or IRQ handler reaps the queue and wakes us up
+            waiters.wait(&mutex);
+            continue;
+        }
+        // Without interrupts, startTransfer does everything synchronously, so there is nothing in flight for us to end
+        checkCompletion();
+        release(&mutex);
+        irqrestore(flags);
+        asm volatile("pause");
+        flags = save_irqdisable();
+        acquire(&mutex);
+    }
+    uint16_t ret = status[cid];
+    cids_done &= ~bit;
+    release(&mutex);
+    irqrestore(flags);
+    return ret;
+}
+
+int NVMeQueue::submit(NVMeCommand* cmd, bool can_sleep) {
+    int cid = allocateCid(can_sleep);
+    int ret = execute(cid, cmd, can_sleep);
+    freeCid(cid);
+    return ret;
+}
+
+void NVMeNamespace::buildCommand(NVMeCommand* cmd, int cid, uint8_t opcode, uint64_t lba, uint32_t count, uint64_t* pages, size_t page_count) {
+    memset(cmd, 0, sizeof(NVMeCommand));
+    cmd->cdw0 = opcode;
+    cmd->nsid = nsid;
+    cmd->prp1 = pages[0];
+    // A second page goes directly into PRP2, anything more needs a PRP list
+    if(page_count == 2) {
+        cmd->prp2 = pages[1];
+    } else if(page_count > 2) {
+        uint64_t prp_list = controller->io_queue->prp_lists[cid];
+        uint64_t* prp_entries = (uint64_t*)(prp_list + VM::GetVirtualOffset());
+        for(size_t i = 1; i < page_count; i++) { prp_entries[i - 1] = pages[i]; }
+        cmd->prp2 = prp_list;
+    }
+    cmd->cdw10 = lba & 0xFFFFFFFF;
+    cmd->cdw11 = lba >> 32;
+    cmd->cdw12 = (count - 1) & 0xFFFF;
+}
+
+int NVMeNamespace::command(int cid, uint8_t opcode, uint64_t lba, uint32_t count, uint64_t* pages, size_t page_count) {
+    NVMeCommand cmd;
+    buildCommand(&cmd, cid, opcode, lba, count, pages, page_count);
+    uint16_t status = controller->io_queue->execute(cid, &cmd, controller->hasIRQ());
+    if(status) {
+        KLog::the().printf("NVMe: namespace %i command %x failed with status %x\n\r", nsid, opcode, status);
+        return -EIO;
+    }
+    return 0;
+}
+
+int NVMeNamespace::allocateBounce(int cid) {
+    NVMeQueue* io_queue = controller->io_queue;
+    if(io_queue->bounce[cid]) { return 0; }
+    size_t max_pages = controller->max_transfer / 4096;
+    uint8_t* buffer = (uint8_t*)VM::AllocatePages(max_pages);
+    if(!buffer) { return -ENOMEM; }
+    uint64_t* pages = new uint64_t[max_pages];
+    for(size_t i = 0; i < max_pages; i++) { pages[i] = VM::GetPhysical((uint64_t)buffer + (i * 4096)); }
+    io_queue->bounce[cid] = buffer;
+    io_queue->bounce_pages[cid] = pages;
+    return 0;
+}
+
+int NVMeNamespace::transfer(void* buf, size_t _len, size_t offset, bool write) {
+    if(offset >= len) { return 0; }
+    if((offset + _len) > len) { _len = len - offset; }
+    if(!_len) { return 0; }
+
+    // Every request goes through the bounce buffer and PRP list of its command id, so that requests from different tasks
+    // can be queued at the same time
+    const size_t max_bytes = controller->max_transfer;
+    bool can_sleep = controller->hasIRQ();
+    int cid = controller->io_queue->allocateCid(can_sleep);
+    int err = allocateBounce(cid);
+    if(err < 0) {
+        KLog::the().printf("NVMe: namespace %i could not get a bounce buffer\n\r", nsid);
+        controller->io_queue->freeCid(cid);
+        return err;
+    }
+    uint8_t* bounce = controller->io_queue->bounce[cid];
+    uint64_t* pages = controller->io_queue->bounce_pages[cid];
+
+    uint8_t* curr_buf = (uint8_t*)buf;
+    uint64_t curr = offset;
+    uint64_t end = offset + _len;
+    while(end > curr) {
+        uint64_t lba = curr / block_size;
+        uint64_t first_block_offset = curr % block_size;
+        uint64_t chunk = end - curr;
+        if(chunk > (max_bytes - first_block_offset)) { chunk = max_bytes - first_block_offset; }
+        uint64_t block_count = (first_block_offset + chunk + block_size - 1) / block_size;
+        size_t page_count = ((block_count * block_size) + 4095) / 4096;
+        if(write) {
+            // Partially written blocks have to be read in first
+            if(first_block_offset || ((first_block_offset + chunk) % block_size)) {
+                err = command(cid, NVMeController::NVME_IO_READ, lba, block_count, pages, page_count);
+                if(err < 0) { break; }
+            }
+            memcopy(curr_buf, bounce + first_block_offset, chunk);
+            err = command(cid, NVMeController::NVME_IO_WRITE, lba, block_count, pages, page_count);
+            if(err < 0) { break; }
+        } else {
+            err = command(cid, NVMeController::NVME_IO_READ, lba, block_count, pages, page_count);
+            if(err < 0) { break; }
+            memcopy(bounce + first_block_offset, curr_buf, chunk);
+        }
+        curr += chunk;
+        curr_buf += chunk;
+    }
+    controller->io_queue->freeCid(cid);
+    if(err < 0) { return (curr == offset) ? err : (int)(curr - offset); }
+    return _len;
+}
+
+void NVMeNamespace::startTransfer(BlockRequest* request, void* buf, size_t _len, size_t offset, bool write) {
+    // Only whole blocks that fit in one command can be done in one go. Everything else, and everything on a controller
+    // without interrupts to finish it, is done synchronously.
+    if(!controller->hasIRQ() || !_len || (offset % block_size) || (_len % block_size) || _len > controller->max_transfer || (offset + _len) > len) {
+        queue->endTransfer(request, transfer(buf, _len, offset, write));
+        return;
+    }
+    NVMeQueue* io_queue = controller->io_queue;
+    int cid = io_queue->allocateCid(true);
+    size_t page_count = (_len + 4095) / 4096;
+    uint64_t direct_pages[128 * 1024 / 4096];
+    uint64_t* pages = direct_pages;
+    uint8_t* copy_back = NULL;
+    // Page aligned buffers in the kernel half, which every page table shares, can be given to the controller as they are
+    if(!((uint64_t)buf % 4096) && (uint64_t)buf >= 0xffff800000000000ULL) {
+        for(size_t i = 0; i < page_count; i++) { direct_pages[i] = VM::GetPhysical((uint64_t)buf + (i * 4096)); }
+    } else {
+        int err = allocateBounce(cid);
+        if(err < 0) {
+            KLog::the().printf("NVMe: namespace %i could not get a bounce buffer\n\r", nsid);
+            io_queue->freeCid(cid);
+            queue->endTransfer(request, err);
+            return;
+        }
+        if(write) { memcopy(buf, io_queue->bounce[cid], _len); }
+        else { copy_back = (uint8_t*)buf; }
+        pages = io_queue->bounce_pages[cid];
+    }
+    NVMeCommand cmd;
+    buildCommand(&cmd, cid, write ? NVMeController::NVME_IO_WRITE : NVMeController::NVME_IO_READ, offset / block_size, _len / block_size, pages, page_count);
+    io_queue->commands[cid] = { request, this, copy_back, _len };
+    io_queue->issue(cid, &cmd);
+}
+
+void NVMeInterrupt(Interrupts::ISRRegisters* regs) {
+    for(size_t i = 0; i < nvme_controllers.size(); i++) {
+        nvme_controllers.at(i)->IRQ();
+    }
+    (void)regs;
+}
+
+}
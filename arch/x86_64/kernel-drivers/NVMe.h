@@ -0,0 +1,184 @@
+#ifndef NVME_H
+#define NVME_H
+#include <kernel-drivers/PCI.h>
+#include <kernel-drivers/BlockDevices.h>
+#include <CPP/mutex.h>
+#include <interrupts.h>
+#include <softirq.h>
+#include <processes/sync.h>
+
+namespace Kernel {
+
+class NVMeController;
+struct NVMeNamespace;
+
+struct NVMeCommand {
+    uint32_t cdw0; // Opcode in bits 0-7, command id in bits 16-31
+    uint32_t nsid;
+    uint32_t cdw2;
+    uint32_t cdw3;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__((packed));
+
+struct NVMeCompletion {
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status; // Phase tag in bit 0
+} __attribute__((packed));
+
+// A submission/completion queue pair.
+struct NVMeQueue {
+    uint16_t id;
+    static const uint16_t depth = 32;
+
+    volatile NVMeCommand* sq;
+    uint64_t sq_phys;
+    volatile NVMeCompletion* cq;
+    uint64_t cq_phys;
+    uint16_t sq_tail = 0;
+    uint16_t cq_head = 0;
+    uint8_t phase = 1;
+    volatile uint32_t* sq_doorbell;
+    volatile uint32_t* cq_doorbell;
+
+    // Command ids in use, and the ones that completed. A command id is also the index in status.
+    // At most depth - 1 commands can be outstanding, so the submission queue can never overflow.
+    uint32_t cids_used = 0;
+    uint32_t cids_done = 0;
+    uint16_t status[depth];
+    // Woken up whenever a command completes or a command id is freed
+    WaitQueue waiters;
+
+    // Protected with interrupts disabled, as the IRQ handler takes it too
+    mutex_t mutex = 0;
+
+    // Per command id resources, only used by the owner of the id. The PRP list page is allocated with the queue, the
+    // bounce buffer (max_transfer long) the first time the id needs one.
+    uint64_t prp_lists[depth] = { };
+    uint8_t* bounce[depth] = { };
+    uint64_t* bounce_pages[depth] = { };
+
+    // Transfer started by NVMeNamespace::startTransfer under each command id, finished once the command completes
+    struct asyncCommand {
+        BlockRequest* request;
+        NVMeNamespace* ns;
+        uint8_t* buf; // Where the data of a read goes, if it went through the bounce buffer
+        size_t len;
+    };
+    asyncCommand commands[depth] = { };
+
+    // Take a free command id, waiting until there is one, and give it back again
+    int allocateCid(bool can_sleep);
+    void freeCid(int cid);
+    // Put cmd into the submission queue under cid
+    void issue(int cid, NVMeCommand* cmd);
+    // Issue cmd under cid and wait for it. Returns the NVMe status (0 on success).
+    int execute(int cid, NVMeCommand* cmd, bool can_sleep);
+    // Submit cmd under a free command id and wait for it
+    int submit(NVMeCommand* cmd, bool can_sleep);
+    // Reap the completion queue. mutex must be held.
+    // Returns the command ids of completed transfers from startTransfer, which have to be given to endCommands without the mutex.
+    uint32_t checkCompletion();
+    void endCommands(uint32_t completed);
+
+    // Reaps the completion queue after a MSI
+    Tasklet completion_tasklet{CompletionTasklet, this};
+    static void CompletionTasklet(void* data);
+};
+
+// A namespace on a NVMe controller.
+struct NVMeNamespace : public BlockDevice {
+    int transfer(void* buf, size_t len, size_t offset, bool write) override;
+    // Transfers of whole blocks that fit in a single command are issued and left to the completion tasklet to finish.
+    // Page aligned buffers are transferred to directly, without a copy.
+    void startTransfer(BlockRequest* request, void* buf, size_t len, size_t offset, bool write) override;
+    // The namespaces share the command ids of the I/O queue, so startTransfer can still have to wait for one
+    size_t queueDepth() override { return NVMeQueue::depth - 1; }
+    // Build a read/write of count blocks under cid, with the data in pages. Anything past the second page goes into
+    // the PRP list of cid.
+    void buildCommand(NVMeCommand* cmd, int cid, uint8_t opcode, uint64_t lba, uint32_t count, uint64_t* pages, size_t page_count);
+    // Issue a single read/write and wait for it
+    int command(int cid, uint8_t opcode, uint64_t lba, uint32_t count, uint64_t* pages, size_t page_count);
+    // Make sure cid has its bounce buffer. Returns 0 or -ENOMEM.
+    int allocateBounce(int cid);
+
+    NVMeController* controller;
+    uint32_t nsid;
+    uint64_t block_size;
+};
+
+class NVMeController : public PCIDevice {
+public:
+    NVMeController(uint8_t _bus, uint8_t _slot, uint8_t _function) : PCIDevice(_bus, _slot, _function) { }
+    bool Initialize() override;
+
+    void IRQ();
+    inline bool hasIRQ() { return irq >= 0 || hasMSI(); }
+
+    enum Registers {
+        NVME_CAP = 0x00,
+        NVME_VS = 0x08,
+        NVME_INTMS = 0x0C,
+        NVME_INTMC = 0x10,
+        NVME_CC = 0x14,
+        NVME_CSTS = 0x1C,
+        NVME_AQA = 0x24,
+        NVME_ASQ = 0x28,
+        NVME_ACQ = 0x30
+    };
+
+    enum AdminOpcodes {
+        NVME_ADMIN_CREATE_SQ = 0x01,
+        NVME_ADMIN_CREATE_CQ = 0x05,
+        NVME_ADMIN_IDENTIFY = 0x06
+    };
+
+    enum IOOpcodes {
+        NVME_IO_WRITE = 0x01,
+        NVME_IO_READ = 0x02
+    };
+
+    // Largest transfer we do with a single command
+    uint64_t max_transfer = 128 * 1024;
+
+    // There is only one CPU, so there is one I/O queue pair.
+    // Once there are more, this becomes a array indexed by the CPU.
+    NVMeQueue* io_queue = NULL;
+
+private:
+    // With two vectors, the admin queue uses the first one and the I/O queue the second one
+    void HandleInterrupt(size_t index) override;
+
+    inline volatile uint32_t& Register32(uint32_t reg) { return *(volatile uint32_t*)(registers + reg); }
+    inline volatile uint64_t& Register64(uint32_t reg) { return *(volatile uint64_t*)(registers + reg); }
+
+    NVMeQueue* CreateQueue(uint16_t id);
+    // Create the I/O queue pair, with the completion queue interrupting on the MSI(-X) vector with the index vector
+    bool CreateIOQueues(uint16_t vector);
+    int Identify(uint32_t cns, uint32_t nsid, uint64_t page);
+    void ProbeNamespaces(uint32_t count);
+
+    uint8_t* registers = NULL;
+    uint8_t* doorbells = NULL;
+    uint64_t doorbell_stride;
+    int irq = -1;
+
+    NVMeQueue* admin_queue = NULL;
+};
+
+void NVMeInterrupt(Interrupts::ISRRegisters* regs);
+
+}
+
+#endif
@@ -1,81 +1,335 @@
 #include <mem.h>
 #include <kernel-drivers/PCI.h>
 #include <kernel-drivers/IDE.h>
+#include <kernel-drivers/AHCI.h>
+#include <kernel-drivers/NVMe.h>
+#include <kernel-drivers/VirtioBlk.h>
 #include <hardware/instructions.h>
+#include <hardware/acpi.h>
+#include <mem/VM/virtmem.h>
+#include <hardware/lapic.h>
+#include <errno.h>
 #include <debug/klog.h>
 
 namespace Kernel {
-    uint16_t PCI::configReadImpl(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
-        uint32_t address;
-        uint32_t lbus  = (uint32_t)bus;
-        uint32_t lslot = (uint32_t)slot;
-        uint32_t lfunc = (uint32_t)func;
-        uint16_t tmp = 0;
+    template<typename T> static PCIDevice* CreateDriver(uint8_t bus, uint8_t slot, uint8_t function) { return new T(bus, slot, function); }
 
+    // Built in drivers. The first match wins, so more specific entries go first.
+    static const PCIDriverMatch builtin_drivers[] = {
+        { PCI_ANY, PCI_ANY, 0x1, 0x1, PCI_ANY, "IDE", CreateDriver<IDEDevice> },
+        { PCI_ANY, PCI_ANY, 0x1, 0x6, 0x1, "AHCI", CreateDriver<AHCIController> },
+        { PCI_ANY, PCI_ANY, 0x1, 0x8, 0x2, "NVMe", CreateDriver<NVMeController> },
+        // Transitional and modern virtio-blk; we only use the modern interface of either
+        { 0x1AF4, 0x1001, PCI_ANY, PCI_ANY, PCI_ANY, "virtio-blk", CreateDriver<VirtioBlkDevice> },
+        { 0x1AF4, 0x1042, PCI_ANY, PCI_ANY, PCI_ANY, "virtio-blk", CreateDriver<VirtioBlkDevice> },
+    };
+
+    struct MCFGEntry {
+        uint64_t base;
+        uint16_t segment;
+        uint8_t start_bus;
+        uint8_t end_bus;
+        uint32_t reserved;
+    } __attribute__((packed));
+
+    void PCI::initECAM() {
+        ACPI::SDTHeader* mcfg = ACPI::FindTable("MCFG");
+        if(!mcfg) { return; }
+        // The entries start after 8 reserved bytes
+        size_t entry_count = (mcfg->length - sizeof(ACPI::SDTHeader) - 8) / sizeof(MCFGEntry);
+        MCFGEntry* entries = (MCFGEntry*)((uint8_t*)mcfg + sizeof(ACPI::SDTHeader) + 8);
+        for(size_t i = 0; i < entry_count; i++) {
+            if(entries[i].segment != 0) { continue; }
+            ecam_base = entries[i].base;
+            ecam_start_bus = entries[i].start_bus;
+            ecam_end_bus = entries[i].end_bus;
+            KLog::the().printf("PCI: ECAM at %x for buses %i-%i\n\r", ecam_base, ecam_start_bus, ecam_end_bus);
+            return;
+        }
+    }
+
+    volatile uint8_t* PCI::ecamFunction(uint8_t bus, uint8_t slot, uint8_t func) {
+        if(!ecam_base || bus < ecam_start_bus || bus > ecam_end_bus) { return NULL; }
+        if(!ecam_buses[bus]) {
+            // Only buses that are actually used get mapped, each bus has 1MiB of config space
+            acquire(&mutex);
+            if(!ecam_buses[bus]) { ecam_buses[bus] = (volatile uint8_t*)VM::MapIOSpace(ecam_base + ((uint64_t)(bus - ecam_start_bus) << 20), 1 << 20); }
+            release(&mutex);
+        }
+        return ecam_buses[bus] + ((uint64_t)slot << 15) + ((uint64_t)func << 12);
+    }
+
+    uint32_t PCI::configRead32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+        volatile uint8_t* ecam = ecamFunction(bus, slot, func);
+        if(ecam) { return *(volatile uint32_t*)(ecam + (offset & 0xFC)); }
         // Create configuration address as per Figure 1
-        address = (uint32_t)((lbus << 16) | (lslot << 11) |
-                    (lfunc << 8) | (offset & 0xFC) | ((uint32_t)0x80000000));
+        uint32_t address = (uint32_t)(((uint32_t)bus << 16) | ((uint32_t)slot << 11) |
+                    ((uint32_t)func << 8) | (offset & 0xFC) | ((uint32_t)0x80000000));
+        acquire(&mutex);
+        outl(0xCF8, address);
+        uint32_t ret = inl(0xCFC);
+        release(&mutex);
+        return ret;
+    }
 
-        // Write out the address
+    void PCI::configWrite32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t data) {
+        volatile uint8_t* ecam = ecamFunction(bus, slot, func);
+        if(ecam) {
+            *(volatile uint32_t*)(ecam + (offset & 0xFC)) = data;
+            return;
+        }
+        uint32_t address = (uint32_t)(((uint32_t)bus << 16) | ((uint32_t)slot << 11) |
+                    ((uint32_t)func << 8) | (offset & 0xFC) | ((uint32_t)0x80000000));
+        acquire(&mutex);
         outl(0xCF8, address);
-        // Read in the data
-        // (offset & 2) * 8) = 0 will choose the first word of the 32-bit register
-        tmp = (uint16_t)((inl(0xCFC) >> ((offset & 2) * 8)) & 0xFFFF);
-        return tmp;
+        outl(0xCFC, data);
+        release(&mutex);
     }
 
     void PCI::configWrite(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t data) {
+        volatile uint8_t* ecam = ecamFunction(bus, slot, func);
+        if(ecam) {
+            *(volatile uint16_t*)(ecam + (offset & 0xFE)) = data;
+            return;
+        }
+        uint32_t address = (uint32_t)(((uint32_t)bus << 16) | ((uint32_t)slot << 11) |
+                    ((uint32_t)func << 8) | (offset & 0xFC) | ((uint32_t)0x80000000));
         acquire(&mutex);
-        // Since PCI reads dwords, we need to know the current stuff at the other pci config location
-        uint16_t other = configReadImpl(bus, slot, func, offset ^ 1);
-        // Calculate uint32_t
-        uint32_t val = (offset & 1) ? other : (other << 16);
-        val |= (offset & 1) ? (data << 16) : data;
+        // The IO ports only do whole dwords, so we need to know the current stuff in the other word of the dword
+        outl(0xCF8, address);
+        uint32_t val = inl(0xCFC);
+        val &= (offset & 2) ? 0x0000FFFF : 0xFFFF0000;
+        val |= (offset & 2) ? ((uint32_t)data << 16) : data;
         outl(0xCFC, val);
         release(&mutex);
     }
 
+    uint8_t PCI::findCapability(uint8_t bus, uint8_t slot, uint8_t func, uint8_t cap_id, uint8_t after) {
+        // Check the status register to see if there even is a capability list
+        if(!(configRead(bus, slot, func, 0x6) & (1 << 4))) { return 0; }
+        uint8_t curr = after ? configRead8(bus, slot, func, after + 1) : configRead8(bus, slot, func, 0x34);
+        // Limit the walk, in case the list loops
+        for(size_t i = 0; i < 48 && curr; i++) {
+            curr &= ~0x3;
+            if(configRead8(bus, slot, func, curr) == cap_id) { return curr; }
+            curr = configRead8(bus, slot, func, curr + 1);
+        }
+        return 0;
+    }
+
+    void PCI::decodeBars(uint8_t bus, uint8_t slot, uint8_t function, PCIBar* bars) {
+        uint8_t header_type = deviceHeader(bus, slot, function) & 0x7F;
+        size_t bar_count = (header_type == 0x0) ? 6 : ((header_type == 0x1) ? 2 : 0);
+        memset(bars, 0, 6 * sizeof(PCIBar));
+        if(!bar_count) { return; }
+        // Stop the function from decoding while the BARs hold the sizing pattern
+        uint16_t command = configRead(bus, slot, function, 0x4);
+        configWrite(bus, slot, function, 0x4, command & ~0x3);
+        for(size_t i = 0; i < bar_count; i++) {
+            uint8_t offset = 0x10 + (i * 4);
+            uint32_t raw = configRead32(bus, slot, function, offset);
+            configWrite32(bus, slot, function, offset, 0xFFFFFFFF);
+            uint32_t mask = configRead32(bus, slot, function, offset);
+            configWrite32(bus, slot, function, offset, raw);
+            PCIBar* bar = &bars[i];
+            if(raw & 0x1) {
+                bar->io = true;
+                bar->address = raw & ~0x3;
+                uint32_t size_mask = mask & ~0x3;
+                bar->size = size_mask ? ((~size_mask + 1) & 0xFFFF) : 0;
+                continue;
+            }
+            bar->prefetchable = raw & 0x8;
+            bar->address = raw & ~0xF;
+            uint64_t size_mask = mask & ~0xF;
+            if(((raw >> 1) & 0x3) == 0x2 && (i + 1) < bar_count) {
+                // 64 bit BAR, the next one holds the upper half
+                uint8_t high_offset = offset + 4;
+                uint32_t high_raw = configRead32(bus, slot, function, high_offset);
+                configWrite32(bus, slot, function, high_offset, 0xFFFFFFFF);
+                uint32_t high_mask = configRead32(bus, slot, function, high_offset);
+                configWrite32(bus, slot, function, high_offset, high_raw);
+                bar->is_64bit = true;
+                bar->address |= (uint64_t)high_raw << 32;
+                size_mask |= (uint64_t)high_mask << 32;
+                bar->size = size_mask ? (~size_mask + 1) : 0;
+                i++;
+            } else {
+                bar->size = size_mask ? ((~size_mask + 1) & 0xFFFFFFFF) : 0;
+            }
+        }
+        configWrite(bus, slot, function, 0x4, command);
+    }
+
+    bool PCIDevice::AllocateMSIVectors(size_t count) {
+        for(size_t i = 0; i < count; i++) {
+            int vector = Interrupts::the().AllocateVector(MSIInterrupt, this);
+            if(vector < 0) {
+                for(size_t j = 0; j < i; j++) { Interrupts::the().FreeVector(msi_vectors[j]); }
+                return false;
+            }
+            msi_vectors[i] = vector;
+        }
+        return true;
+    }
+
+    int PCIDevice::EnableMSI(size_t count) {
+        if(msi_count) { return msi_count; }
+        if(!LAPIC::Present()) { return -ENODEV; }
+        if(count > max_msi_vectors) { count = max_msi_vectors; }
+        if(!count) { return 0; }
+
+        uint8_t cap = PCI::the().findCapability(bus, slot, function, PCI::PCI_CAP_MSIX);
+        if(cap) {
+            uint16_t control = PCI::the().configRead(bus, slot, function, cap + 2);
+            size_t table_size = (control & 0x7FF) + 1;
+            uint32_t table = PCI::the().configRead32(bus, slot, function, cap + 4);
+            uint8_t bir = table & 0x7;
+            if(bir <= 5 && !bars[bir].io && bars[bir].address) {
+                if(count > table_size) { count = table_size; }
+                if(!AllocateMSIVectors(count)) { return -ENOSPC; }
+                // Mask the whole function while the table is set up
+                PCI::the().configWrite(bus, slot, function, cap + 2, control | MSIX_CONTROL_ENABLE | MSIX_CONTROL_MASK);
+                msix_table = (volatile uint32_t*)VM::MapIOSpace(barAddress(bir) + (table & ~0x7), table_size * 16);
+                for(size_t i = 0; i < table_size; i++) {
+                    volatile uint32_t* entry = msix_table + (i * 4);
+                    if(i >= count) {
+                        entry[3] = 1; // Masked
+                        continue;
+                    }
+                    entry[0] = LAPIC::MSIAddress() & 0xFFFFFFFF;
+                    entry[1] = LAPIC::MSIAddress() >> 32;
+                    entry[2] = LAPIC::MSIData(msi_vectors[i]);
+                    entry[3] = 0;
+                }
+                msix = true;
+                msi_capability = cap;
+                msi_count = count;
+                // Turn off the legacy interrupt, and unmask the function
+                PCI::the().configWrite(bus, slot, function, 0x4, PCI::the().configRead(bus, slot, function, 0x4) | (1 << 10));
+                PCI::the().configWrite(bus, slot, function, cap + 2, (control | MSIX_CONTROL_ENABLE) & ~MSIX_CONTROL_MASK);
+                return count;
+            }
+        }
+
+        cap = PCI::the().findCapability(bus, slot, function, PCI::PCI_CAP_MSI);
+        if(!cap) { return -ENODEV; }
+        // Multiple messages need a aligned block of vectors, so we stick to one
+        if(!AllocateMSIVectors(1)) { return -ENOSPC; }
+        uint16_t control = PCI::the().configRead(bus, slot, function, cap + 2);
+        PCI::the().configWrite32(bus, slot, function, cap + 4, LAPIC::MSIAddress() & 0xFFFFFFFF);
+        if(control & MSI_CONTROL_64BIT) {
+            PCI::the().configWrite32(bus, slot, function, cap + 8, LAPIC::MSIAddress() >> 32);
+            PCI::the().configWrite(bus, slot, function, cap + 12, LAPIC::MSIData(msi_vectors[0]));
+        } else {
+            PCI::the().configWrite(bus, slot, function, cap + 8, LAPIC::MSIData(msi_vectors[0]));
+        }
+        msix = false;
+        msi_capability = cap;
+        msi_count = 1;
+        PCI::the().configWrite(bus, slot, function, 0x4, PCI::the().configRead(bus, slot, function, 0x4) | (1 << 10));
+        // A single message, and enable
+        PCI::the().configWrite(bus, slot, function, cap + 2, (control & ~MSI_CONTROL_MME) | MSI_CONTROL_ENABLE);
+        return 1;
+    }
+
+    void PCIDevice::DisableMSI() {
+        if(!msi_count) { return; }
+        uint16_t control = PCI::the().configRead(bus, slot, function, msi_capability + 2);
+        if(msix) { PCI::the().configWrite(bus, slot, function, msi_capability + 2, control & ~MSIX_CONTROL_ENABLE); }
+        else { PCI::the().configWrite(bus, slot, function, msi_capability + 2, control & ~MSI_CONTROL_ENABLE); }
+        PCI::the().configWrite(bus, slot, function, 0x4, PCI::the().configRead(bus, slot, function, 0x4) & ~(1 << 10));
+        for(size_t i = 0; i < msi_count; i++) { Interrupts::the().FreeVector(msi_vectors[i]); }
+        msi_count = 0;
+    }
+
+    void PCIDevice::MSIInterrupt(Interrupts::ISRRegisters* regs, void* context) {
+        PCIDevice* device = (PCIDevice*)context;
+        for(size_t i = 0; i < device->msi_count; i++) {
+            if(device->msi_vectors[i] == (int)regs->int_num) {
+                device->HandleInterrupt(i);
+                return;
+            }
+        }
+    }
+
     bool PCI::probe() {
         KLog::the().printf("--- BEGIN PCI PROBE ---\n\r");
-        for(uint16_t bus = 0; bus < 256; bus++) { // Bus is actually 8 bits, but since we count from 0 -> 255 and i cant be bothered to make a non-forever looping version of that this will work
-            for(uint8_t device = 0; device < 32; device++) {
-                probeDevice((uint8_t)bus, device);
+        initECAM();
+        // Start from the host bridges, and follow the bridges from there so only present buses are visited.
+        // If the host bridge is a multi function device, each function is the host bridge of the bus with that number.
+        if(deviceHeader(0, 0, 0) & 0x80) {
+            for(uint8_t function = 0; function < 8; function++) {
+                if(deviceVendor(0, 0, function) != 0xFFFF) { probeBus(function); }
             }
+        } else {
+            probeBus(0);
         }
         KLog::the().printf("--- END PCI PROBE ---\n\r");
         return true;
     }
 
+    void PCI::probeBus(uint8_t bus) {
+        if(visited_buses[bus]) { return; }
+        visited_buses[bus] = true;
+        for(uint8_t slot = 0; slot < 32; slot++) { probeDevice(bus, slot); }
+    }
+
     void PCI::probeDevice(uint8_t bus, uint8_t slot) {
         // Check whether this device actually exists
         if(deviceVendor(bus, slot, 0) == 0xFFFF) { return; }
         probeDeviceFunction(bus, slot, 0); // Function 0 always exists
-        if(deviceHeader(bus, slot, 0)) {
+        if(deviceHeader(bus, slot, 0) & 0x80) {
             // Multi function device, probe individual functions
             for(size_t i = 1; i < 8; i++) { probeDeviceFunction(bus, slot, i); }
         }
     }
-    
+
+    const PCIDriverMatch* PCI::findDriver(uint16_t vendor, uint16_t device, uint8_t class_code, uint8_t subclass, uint8_t prog_if) {
+        size_t builtin_count = sizeof(builtin_drivers) / sizeof(builtin_drivers[0]);
+        for(size_t i = 0; i < builtin_count + extra_drivers.size(); i++) {
+            const PCIDriverMatch* match = (i < builtin_count) ? &builtin_drivers[i] : extra_drivers.at(i - builtin_count);
+            if(match->vendor != PCI_ANY && match->vendor != vendor) { continue; }
+            if(match->device != PCI_ANY && match->device != device) { continue; }
+            if(match->class_code != PCI_ANY && match->class_code != class_code) { continue; }
+            if(match->subclass != PCI_ANY && match->subclass != subclass) { continue; }
+            if(match->prog_if != PCI_ANY && match->prog_if != prog_if) { continue; }
+            return match;
+        }
+        return NULL;
+    }
+
     void PCI::probeDeviceFunction(uint8_t bus, uint8_t slot, uint8_t function) {
-        if(deviceVendor(bus, slot, function) == 0xFFFF) { return; } // Doesnt exist
-        uint8_t device_class = deviceClass(bus, slot, function);
-        uint8_t device_subclass = deviceClass(bus, slot, function);
+        uint32_t id = configRead32(bus, slot, function, 0x0);
+        uint16_t vendor = id & 0xFFFF;
+        uint16_t device = id >> 16;
+        if(vendor == 0xFFFF) { return; } // Doesnt exist
+        // Class, subclass, prog IF and revision are all in one dword
+        uint32_t class_reg = configRead32(bus, slot, function, 0x8);
+        uint8_t device_class = class_reg >> 24;
+        uint8_t device_subclass = (class_reg >> 16) & 0xFF;
+        uint8_t prog_if = (class_reg >> 8) & 0xFF;
         KLog::the().printf("%i:%i.%i: Class %i (%x), %s; subclass %i (%x), %s\n\r", (unsigned int)bus, (unsigned int)slot, (unsigned int)function, device_class, device_class, classToString(device_class), device_subclass, device_subclass, subclassToString(device_class, device_subclass));
-        KLog::the().printf("\tDevice Vendor: %x, Device ID: %x\n\r", deviceVendor(bus, slot, function), deviceID(bus, slot, function));
-
-        // TODO: actually have a good way to load PCI drivers
-        PCIDevice* driver = NULL;
-        if(device_class == 0x1 && device_subclass == 0x1) {
-            KLog::the().printf("\tHas device driver: IDE\n\r");
-            driver = new IDEDevice(bus, slot, function);
-            if(!driver->Initialize()) {
-                KLog::the().printf("\tIDE driver failed to initialize\n\r");
-                delete driver;
-                driver = NULL;
-            }
+        KLog::the().printf("\tDevice Vendor: %x, Device ID: %x\n\r", vendor, device);
+
+        // Follow PCI to PCI bridges to the buses behind them
+        if((deviceHeader(bus, slot, function) & 0x7F) == 0x1) {
+            uint8_t secondary_bus = configRead8(bus, slot, function, 0x19);
+            KLog::the().printf("\tBridge to bus %i\n\r", secondary_bus);
+            if(secondary_bus) { probeBus(secondary_bus); }
+            return;
         }
 
-        if(driver != NULL) { device_drivers.push_back(driver); }
+        const PCIDriverMatch* match = findDriver(vendor, device, device_class, device_subclass, prog_if);
+        if(!match) { return; }
+        KLog::the().printf("\tHas device driver: %s\n\r", match->name);
+        PCIDevice* driver = match->create(bus, slot, function);
+        if(!driver->Initialize()) {
+            KLog::the().printf("\t%s driver failed to initialize\n\r", match->name);
+            delete driver;
+            return;
+        }
+        device_drivers.push_back(driver);
     }
 
     const char* PCI::classToString(uint8_t c) {
@@ -5,11 +5,33 @@
 #include <stdint.h>
 #include <CPP/mutex.h>
 #include <CPP/vector.h>
+#include <interrupts.h>
 
 namespace Kernel {
 
 class PCIDevice;
 
+// Matches a driver to devices. Fields set to PCI_ANY match everything.
+struct PCIDriverMatch {
+    #define PCI_ANY 0xFFFF
+    uint16_t vendor;
+    uint16_t device;
+    uint16_t class_code;
+    uint16_t subclass;
+    uint16_t prog_if;
+    const char* name;
+    PCIDevice* (*create)(uint8_t bus, uint8_t slot, uint8_t function);
+};
+
+// A decoded base address register
+struct PCIBar {
+    uint64_t address;
+    uint64_t size; // 0 if the BAR is not implemented, or is the upper half of a 64 bit BAR
+    bool io;
+    bool prefetchable;
+    bool is_64bit;
+};
+
 class PCI {
 public:
     static PCI& the() {
@@ -18,68 +40,125 @@ public:
     }
 
     bool probe();
+    // Add a driver to the ones the probe matches devices against. Has to be done before probe(), and match has to stay around.
+    void RegisterDriver(const PCIDriverMatch* match) { extra_drivers.push_back(match); }
 
     const char* classToString(uint8_t c);
     const char* subclassToString(uint8_t c, uint8_t s);
 
-    uint16_t configRead(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) { acquire(&mutex); uint16_t ret = configReadImpl(bus, slot, func, offset); release(&mutex); return ret; }
+    // Config space access goes through ECAM if the MCFG table covers the bus, otherwise through the IO ports
+    uint32_t configRead32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+    void configWrite32(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t data);
+    inline uint16_t configRead(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) { return (configRead32(bus, slot, func, offset & 0xFC) >> ((offset & 2) * 8)) & 0xFFFF; }
     void configWrite(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint16_t data);
-    
+    inline uint8_t configRead8(uint8_t bus, uint8_t slot, uint8_t function, uint8_t offset) { return (configRead32(bus, slot, function, offset & 0xFC) >> ((offset & 3) * 8)) & 0xFF; }
+
     inline uint16_t deviceVendor(uint8_t bus, uint8_t slot, uint8_t function) { return configRead(bus, slot, function, 0); }
     inline uint16_t deviceID(uint8_t bus, uint8_t slot, uint8_t function) { return configRead(bus, slot, function, 0x2); }
-    inline uint16_t deviceHeader(uint8_t bus, uint8_t slot, uint8_t function) { return configRead(bus, slot, function, 0xE); }
-    inline uint8_t deviceClass(uint8_t bus, uint8_t slot, uint8_t function) { return ((configRead(bus, slot, function, 0xA) >> 8) & 0xFF); }
-    inline uint8_t deviceSubClass(uint8_t bus, uint8_t slot, uint8_t function) { return (configRead(bus, slot, function, 0xA) & 0xFF); }
-    inline uint8_t deviceProgIF(uint8_t bus, uint8_t slot, uint8_t function) { return (configRead(bus, slot, function, 0x8) >> 8) & 0xFF; }
+    inline uint8_t deviceHeader(uint8_t bus, uint8_t slot, uint8_t function) { return configRead8(bus, slot, function, 0xE); }
+    inline uint8_t deviceClass(uint8_t bus, uint8_t slot, uint8_t function) { return configRead8(bus, slot, function, 0xB); }
+    inline uint8_t deviceSubClass(uint8_t bus, uint8_t slot, uint8_t function) { return configRead8(bus, slot, function, 0xA); }
+    inline uint8_t deviceProgIF(uint8_t bus, uint8_t slot, uint8_t function) { return configRead8(bus, slot, function, 0x9); }
+
+    enum CapabilityIDs {
+        PCI_CAP_MSI = 0x05,
+        PCI_CAP_VENDOR = 0x09,
+        PCI_CAP_MSIX = 0x11
+    };
+
+    // Find the next capability with the id cap_id, starting after the capability at offset after (or at the start of the list if 0).
+    // Returns the config space offset of the capability, or 0 if there is none.
+    uint8_t findCapability(uint8_t bus, uint8_t slot, uint8_t function, uint8_t cap_id, uint8_t after = 0);
+
+    // Decode the BARs of a function, including their sizes. bars has to have room for 6.
+    void decodeBars(uint8_t bus, uint8_t slot, uint8_t function, PCIBar* bars);
 
     inline void deviceWriteProgIF(uint8_t bus, uint8_t slot, uint8_t function, uint8_t val) {
         uint16_t tmp = (configRead(bus, slot, function, 0x8) & 0x00FF) | (val << 8);
         configWrite(bus, slot, function, 0x8, tmp);
     }
 private:
+    // Protects the IO port config mechanism, which takes two accesses, and the ECAM mappings
     mutex_t mutex;
 
-    uint16_t configReadImpl(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+    // Find the ECAM area of bus in the MCFG table
+    void initECAM();
+    // Get the ECAM config space of a function, mapping its bus on first use. Returns NULL if the bus has no ECAM.
+    volatile uint8_t* ecamFunction(uint8_t bus, uint8_t slot, uint8_t func);
+
+    void probeBus(uint8_t bus);
     void probeDevice(uint8_t bus, uint8_t slot);
     void probeDeviceFunction(uint8_t bus, uint8_t slot, uint8_t function);
+    // Find the driver for a function, NULL if there is none
+    const PCIDriverMatch* findDriver(uint16_t vendor, uint16_t device, uint8_t class_code, uint8_t subclass, uint8_t prog_if);
+
+    // Segment group 0 of the MCFG table, the only one we use
+    uint64_t ecam_base = 0;
+    uint8_t ecam_start_bus = 0;
+    uint8_t ecam_end_bus = 0;
+    volatile uint8_t* ecam_buses[256] = { };
 
+    bool visited_buses[256] = { };
+
+    Vector<const PCIDriverMatch*> extra_drivers;
     Vector<PCIDevice*> device_drivers;
 };
 
 class PCIDevice {
 public:
     PCIDevice(uint8_t _bus, uint8_t _slot, uint8_t _function) : bus(_bus), slot(_slot), function(_function) {
-        header_type = PCI::the().deviceHeader(bus, slot, function);
-        if(header_type == 0x0 || header_type == 0x1) {
-            // BAR0,1 exists
-            bar0 = (PCI::the().configRead(bus, slot, function, 0x12) << 16) | PCI::the().configRead(bus, slot, function, 0x10);
-            bar1 = (PCI::the().configRead(bus, slot, function, 0x16) << 16) | PCI::the().configRead(bus, slot, function, 0x14);
-        }
-        if(header_type == 0x0) {
-            // BAR2-5 exists
-            bar2 = (PCI::the().configRead(bus, slot, function, 0x1A) << 16) | PCI::the().configRead(bus, slot, function, 0x18);
-            bar3 = (PCI::the().configRead(bus, slot, function, 0x1E) << 16) | PCI::the().configRead(bus, slot, function, 0x1C);
-            bar4 = (PCI::the().configRead(bus, slot, function, 0x22) << 16) | PCI::the().configRead(bus, slot, function, 0x20);
-            bar5 = (PCI::the().configRead(bus, slot, function, 0x26) << 16) | PCI::the().configRead(bus, slot, function, 0x24);
-        }
+        header_type = PCI::the().deviceHeader(bus, slot, function) & 0x7F;
+        PCI::the().decodeBars(bus, slot, function, bars);
     }
     virtual ~PCIDevice() { }
 
     virtual bool Initialize() { return false; }
-    virtual void KernelTask(void* arg) { for(;;); (void)arg; }
-    virtual bool hasKernelTask() { return false; }
+
+    // Most vectors a single device gets
+    static const size_t max_msi_vectors = 8;
 protected:
+    // Set up to count dedicated interrupt vectors, through MSI-X if the device has it, otherwise through MSI (with a single vector).
+    // This also turns off the legacy interrupt. Returns the amount of vectors set up, -ENODEV if the device can only do legacy interrupts.
+    int EnableMSI(size_t count);
+    void DisableMSI();
+    // Called for interrupts on the index-th MSI vector
+    virtual void HandleInterrupt(size_t index) { (void)index; }
+    inline bool hasMSI() { return msi_count > 0; }
+    inline bool hasMSIX() { return msi_count > 0 && msix; }
+    inline int msiVector(size_t index) { return (index < msi_count) ? msi_vectors[index] : -1; }
+
+    // Get the address a BAR points to. 64 bit memory BARs are combined with the next BAR.
+    uint64_t barAddress(int index) {
+        if(index < 0 || index > 5) { return 0; }
+        return bars[index].address;
+    }
+
     uint8_t bus;
     uint8_t slot;
     uint8_t function;
 
     uint8_t header_type = 0;
-    uint32_t bar0 = 0;
-    uint32_t bar1 = 0;
-    uint32_t bar2 = 0;
-    uint32_t bar3 = 0;
-    uint32_t bar4 = 0;
-    uint32_t bar5 = 0;
+    PCIBar bars[6] = { };
+
+private:
+    enum MSIControlBits {
+        MSI_CONTROL_ENABLE = 0x1,
+        MSI_CONTROL_MME = 0x70, // Multiple message enable
+        MSI_CONTROL_64BIT = 0x80,
+        MSIX_CONTROL_MASK = 0x4000,
+        MSIX_CONTROL_ENABLE = 0x8000
+    };
+
+    static void MSIInterrupt(Interrupts::ISRRegisters* regs, void* context);
+    // Allocate the vectors and point them at this device. Returns false if there are not enough free ones.
+    bool AllocateMSIVectors(size_t count);
+
+    size_t msi_count = 0;
+    int msi_vectors[max_msi_vectors];
+    bool msix = false;
+    // Config space offset of the capability in use
+    uint8_t msi_capability = 0;
+    volatile uint32_t* msix_table = NULL;
 };
 
 }
@@ -23,7 +23,11 @@ void PS2::Interrupt(int irq) {
     if(irq == 1) {
         // First channel
         uint8_t data = inb(data_port);
-        KLog::the().printf("PS2: got data from first channel: %i\n\r", data);
+        size_t next = (log_write + 1) % log_size;
+        if(next != log_read) {
+            log_ring[log_write] = data;
+            log_write = next;
+        }
         DecodeAndBuffer(data);
     } else if(irq == 12) {
         // Second channel
@@ -33,6 +37,19 @@ void PS2::Interrupt(int irq) {
     }
 }
 
+void PS2::LogScancodes() {
+    while(log_read != log_write) {
+        KLog::the().printf("PS2: got data from first channel: %i\n\r", log_ring[log_read]);
+        log_read = (log_read + 1) % log_size;
+    }
+    // The IRQ handler bumps this, so read and reset it in one go
+    unsigned long flags = save_irqdisable();
+    size_t dropped = dropped_chars;
+    dropped_chars = 0;
+    irqrestore(flags);
+    if(dropped) { KLog::the().printf("PS2: dropped %i chars\n\r", dropped); }
+}
+
 void PS2::Init() {
     // Send the disable commands
     // We legit dont actually care about any return values or interrupts from these so it
@@ -113,7 +130,7 @@ void PS2::Init() {
     if(first_channel_works) { PS2::DetectChannel1(); }
 
     // Register interrupts
-    Interrupts::the().RegisterIRQHandler(1, PS2InterruptWrapper);
+    Interrupts::the().RegisterThreadedIRQHandler(1, PS2InterruptWrapper, PS2InterruptThread, NULL);
     Interrupts::the().RegisterIRQHandler(12, PS2InterruptWrapper);
 
     // TOOD: detect second channel
@@ -256,7 +273,7 @@ void PS2::DecodeAndBuffer(uint8_t scancode) {
     uint8_t byte_to_buffer = translation_table_normal[(uint8_t)(scancode & ~(1 << 8))];
     // Check if we actually have the space lol
     if(write_pos == ((read_pos - 1 + buffer_size) % buffer_size)) {
-        KLog::the().printf("PS2: dropping char %c\n\r", byte_to_buffer);
+        dropped_chars = dropped_chars + 1;
         return;
     }
     buffer[write_pos] = byte_to_buffer;
@@ -267,4 +284,9 @@ void PS2InterruptWrapper(Interrupts::ISRRegisters* regs) {
     PS2::the().Interrupt(regs->int_num);
 }
 
+void PS2InterruptThread(void* data) {
+    PS2::the().LogScancodes();
+    (void)data;
+}
+
 }
\ No newline at end of file
@@ -12,7 +12,10 @@ namespace Kernel {
 class PS2 {
 public:
     char getKey();
+    // Hard IRQ handler, reads and decodes the scancode
     void Interrupt(int irq);
+    // Runs in the IRQ thread, and logs what the IRQ got
+    void LogScancodes();
     void Init();
     static PS2& the() {
         static PS2 instance;
@@ -101,6 +104,14 @@ private:
 
     mutex_t mutex;
 
+    // Scancodes the IRQ got, for the IRQ thread to log. Logging renders to the framebuffer, which is much too slow for the IRQ.
+    static const size_t log_size = 32;
+    volatile uint8_t log_ring[log_size];
+    volatile size_t log_read = 0;
+    volatile size_t log_write = 0;
+    // Chars that did not fit in the buffer since the last log
+    volatile size_t dropped_chars = 0;
+
     // TODO: shift + control + alt shit
     uint8_t translation_table_normal[128] = {
         0, 0x1B, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', 0x8, 0x9,
@@ -113,6 +124,7 @@ private:
 };
 
 void PS2InterruptWrapper(Interrupts::ISRRegisters* regs);
+void PS2InterruptThread(void* data);
 
 }
 
@@ -0,0 +1,41 @@
+#include <kernel-drivers/RamBlockDevice.h>
+#include <mem/PM/physalloc.h>
+#include <mem/VM/virtmem.h>
+#include <debug/klog.h>
+#include <mem.h>
+
+namespace Kernel {
+
+RamBlockDevice::RamBlockDevice(size_t size) : BlockDevice() {
+    size_t wanted_pages = (size + 4095) / 4096;
+    pages = new uint64_t[wanted_pages];
+    page_count = 0;
+    // AllocatePages panics when memory runs out, so stop early and leave some for the rest of the kernel
+    while(page_count < wanted_pages && PM::FreePageCount() > 256) {
+        uint64_t phys = PM::AllocatePages();
+        memset((void*)(phys + VM::GetVirtualOffset()), 0, 4096);
+        pages[page_count++] = phys;
+    }
+    len = page_count * 4096;
+    KLog::the().printf("RamBlockDevice: created RAM disk of %i KiB\n\r", len / 1024);
+}
+
+int RamBlockDevice::transfer(void* buf, size_t _len, size_t offset, bool write) {
+    if(offset >= len) { return 0; }
+    if((offset + _len) > len) { _len = len - offset; }
+    uint8_t* curr_buf = (uint8_t*)buf;
+    uint64_t curr = offset;
+    uint64_t end = offset + _len;
+    while(end > curr) {
+        uint64_t page_offset = curr % 4096;
+        uint64_t chunk = ((4096 - page_offset) < (end - curr)) ? (4096 - page_offset) : (end - curr);
+        uint8_t* data = (uint8_t*)(pages[curr / 4096] + VM::GetVirtualOffset()) + page_offset;
+        if(write) { memcopy(curr_buf, data, chunk); }
+        else { memcopy(data, curr_buf, chunk); }
+        curr += chunk;
+        curr_buf += chunk;
+    }
+    return _len;
+}
+
+}
@@ -0,0 +1,25 @@
+#ifndef RAMBLOCKDEVICE_H
+#define RAMBLOCKDEVICE_H
+#include <kernel-drivers/BlockDevices.h>
+
+// Size in bytes of the RAM disk registered at boot, 0 for none
+#define RAM_BLOCK_DEVICE_SIZE 0
+
+namespace Kernel {
+
+// Block device backed by physical memory, so that the block layer and everything above it
+// can be measured without device latency. The contents are lost on reboot.
+struct RamBlockDevice : public BlockDevice {
+    // Allocates size bytes, rounded up to pages. If less than 1 MiB of memory would be left, the device is shorter.
+    RamBlockDevice(size_t size);
+    int transfer(void* buf, size_t len, size_t offset, bool write) override;
+
+private:
+    // Physical address of every page. They dont have to be contiguous.
+    uint64_t* pages;
+    size_t page_count;
+};
+
+}
+
+#endif
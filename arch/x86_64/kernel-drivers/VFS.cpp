@@ -1,5 +1,8 @@
 #include <kernel-drivers/VFS.h>
+#include <kernel-drivers/DentryCache.h>
+#include <kernel-drivers/BlockCache.h>
 #include <mem/VM/virtmem.h>
+#include <mem/PM/physalloc.h>
 #include <debug/klog.h>
 #include <CPP/string.h>
 #include <errno.h>
@@ -28,253 +31,334 @@ bool VFS::attemptMountRoot(VFSDriver* driver) {
     return true;
 }
 
-VFS::fs_node* VFS::iterateFromDescriptor(const char* working, fs_node* node, int64_t* err) {
-    fs_node* curr = node;
-    // We need to iterate over the working path first
-    if(working[0] != '/') { *err = -EINVAL; return NULL; }
-    char* curr_folder_name = NULL;
-    char* curr_working_index = (char*)(working + 1);
-    while(*curr_working_index) {
+VFS::fs_node* VFS::lookup(fs_node* dir, const char* name, size_t len) {
+    fs_node* node;
+    if(DentryCache::the().lookup(dir, name, len, &node)) { return node; }
+    // Not cached, ask the driver. It wants a null terminated name
+    char name_buf[257];
+    memcopy((void*)name, name_buf, len);
+    name_buf[len] = 0;
+    node = dir->finddir(name_buf);
+    if(node || (dir->driver && dir->driver->allowNegativeDentries())) {
+        DentryCache::the().insert(dir, name, len, node);
+    }
+    return node;
+}
+
+VFS::fs_node* VFS::walkPath(fs_node* start, const char* path, int64_t* err) {
+    fs_node* curr = start;
+    const char* curr_index = path;
+    while(*curr_index) {
+        if(*curr_index == '/') { curr_index++; continue; }
+        if(!curr->isDir()) { *err = -ENOTDIR; return NULL; }
         // Get the size of this file name
-        size_t char_len = getLenUntilEndOfPathPart(curr_working_index);
-        if(char_len > 256) { *err = -ENAMETOOLONG; return NULL;  }
-        curr_folder_name = new char[char_len + 1];
-        memset(curr_folder_name, 0, char_len + 1);
-        memcopy(curr_working_index, curr_folder_name, char_len);
-        fs_node* next = curr->finddir(curr_folder_name);
-        delete curr_folder_name;
-        if(!next) { *err = -EINVAL; }
-        if(!next->isDir()) { *err = -ENOTDIR; return NULL;  }
+        size_t char_len = getLenUntilEndOfPathPart(curr_index);
+        if(char_len > 256) { *err = -ENAMETOOLONG; return NULL; }
+        fs_node* next = lookup(curr, curr_index, char_len);
+        if(!next) { *err = -EINVAL; return NULL; }
         curr = next;
-        curr_working_index += char_len;
+        curr_index += char_len;
+        // A trailing slash only makes sense after a directory
+        if(*curr_index == '/' && !curr->isDir()) { *err = -ENOTDIR; return NULL; }
     }
     return curr;
 }
 
-int VFS::attemptMountOnFolder(const char* working, const char* folder, VFSDriver* driver) {
-    acquire(&mutex);
+VFS::fs_node* VFS::resolvePath(const char* working, const char* path, int64_t* err) {
     fs_node* curr = root_node;
     // Check if we have a relative path
-    if(folder[0] != '/') {
-        int64_t err = 0;
-        iterateFromDescriptor(working, curr, &err);
-        if(err) { release(&mutex); return err; }
-    }
-    // Iterate over the file relative path
-    char* curr_folder_name = NULL;
-    char* curr_file_index = (char*)folder;
-    if(*curr_file_index == '/') { curr_file_index++; }
-    while(*curr_file_index) {
-        if(!curr->isDir()) { release(&mutex); return -ENOTDIR; }
-        // Get the size of this file name
-        size_t char_len = getLenUntilEndOfPathPart(curr_file_index);
-        if(char_len > 256) { release(&mutex); return -ENAMETOOLONG; }
-        curr_folder_name = new char[char_len + 1];
-        memset(curr_folder_name, 0, char_len + 1);
-        memcopy(curr_file_index, curr_folder_name, char_len);
-        fs_node* next = root_node->finddir(curr_folder_name);
-        delete curr_folder_name;
-        if(!next) { release(&mutex); return -EINVAL; }
-        curr = next;
-        curr_file_index += char_len;
+    if(path[0] != '/') {
+        // We need to iterate over the working path first
+        if(working[0] != '/') { *err = -EINVAL; return NULL; }
+        curr = walkPath(curr, working, err);
+        if(!curr) { return NULL; }
+        if(!curr->isDir()) { *err = -ENOTDIR; return NULL; }
     }
-    if(!curr->isDir()) { release(&mutex); return false; }
+    return walkPath(curr, path, err);
+}
+
+int VFS::attemptMountOnFolder(const char* working, const char* folder, VFSDriver* driver) {
+    tree_lock.writeLock();
+    int64_t err = 0;
+    fs_node* curr = resolvePath(working, folder, &err);
+    if(!curr) { tree_lock.writeUnlock(); return err; }
+    if(!curr->isDir()) { tree_lock.writeUnlock(); return false; }
     fs_node* mount = driver->mount();
     if(mount) {
         // We can mount this driver, overwrite the curr node
         memcopy(mount, curr, sizeof(fs_node));
+        // Anything we cached below this node belongs to the old driver
+        DentryCache::the().invalidate(curr);
         if(*folder == '/') { folder++; }
         if(working[1]) {
             KLog::the().printf("VFS: mounted %s on %s/%s\n\r", driver->driverName(), working, folder);
         } else {
             KLog::the().printf("VFS: mounted %s on /%s\n\r", driver->driverName(), folder);    
         }
-        release(&mutex);
+        tree_lock.writeUnlock();
         return true;
     }
-    release(&mutex);
+    tree_lock.writeUnlock();
     return false;
 }
 
-int64_t VFS::open(const char* working, const char* file, int64_t pid) {
-    acquire(&mutex);
-    fs_node* curr = root_node;
-    // Check if we have a relative path
-    if(file[0] != '/') {
-        // We need to iterate over the working path first
-        if(working[0] != '/') { release(&mutex); return -EINVAL; }
-        char* curr_folder_name = NULL;
-        char* curr_working_index = (char*)(working + 1);
-        while(*curr_working_index) {
-            // Get the size of this file name
-            size_t char_len = getLenUntilEndOfPathPart(curr_working_index);
-            if(char_len > 256) { release(&mutex); return -ENAMETOOLONG; }
-            curr_folder_name = new char[char_len + 1];
-            memset(curr_folder_name, 0, char_len + 1);
-            memcopy(curr_working_index, curr_folder_name, char_len);
-            fs_node* next = curr->finddir(curr_folder_name);
-            delete curr_folder_name;
-            if(!next) { release(&mutex); return -EINVAL; }
-            if(!next->isDir()) { release(&mutex); return -ENOTDIR; }
-            curr = next;
-            curr_working_index += char_len;
-            if(*curr_working_index == '/') {
-                if(!curr->isDir()) { release(&mutex); return -ENOTDIR; }
-                curr_working_index++;
-            }
+VFS::fs_node* VFS::createFile(const char* working, const char* path, int64_t* err) {
+    // Split the path into the directory and the name of the new file
+    size_t len = strlen(path);
+    if(path[len - 1] == '/') { *err = -EISDIR; return NULL; }
+    size_t name_start = len;
+    while(name_start && path[name_start - 1] != '/') { name_start--; }
+    const char* name = path + name_start;
+    size_t name_len = len - name_start;
+    if(name_len > 256) { *err = -ENAMETOOLONG; return NULL; }
+    char* dir_path = new char[name_start + 1];
+    memcopy((void*)path, dir_path, name_start);
+    dir_path[name_start] = 0;
+    fs_node* dir = resolvePath(working, dir_path, err);
+    delete[] dir_path;
+    if(!dir) { return NULL; }
+    if(!dir->isDir()) { *err = -ENOTDIR; return NULL; }
+    fs_node* node = dir->create(name, err);
+    if(node) {
+        // The failed lookup before this might have left a negative entry
+        DentryCache::the().invalidate(dir, name, name_len);
+        DentryCache::the().insert(dir, name, name_len, node);
+    }
+    return node;
+}
+
+int64_t VFS::open(const char* working, const char* file, int64_t pid, int flags) {
+    if(file[0] == 0 || (file[0] == '/' && file[1] == 0)) { return -EISDIR; }
+    // Lookups only read the tree, so they can run at the same time. Creating a file changes it, which is done alone,
+    // after looking again in case someone else created it in between.
+    bool writing = false;
+    tree_lock.readLock();
+    int64_t err = 0;
+    fs_node* curr = resolvePath(working, file, &err);
+    if(!curr && err == -EINVAL && (flags & VFS_O_CREAT)) {
+        tree_lock.readUnlock();
+        tree_lock.writeLock();
+        writing = true;
+        err = 0;
+        curr = resolvePath(working, file, &err);
+        if(!curr && err == -EINVAL) {
+            err = 0;
+            curr = createFile(working, file, &err);
         }
     }
-    // Iterate over the file relative path
-    char* curr_folder_name = NULL;
-    char* curr_file_index = (char*)file;
-    if(*curr_file_index == '/') { curr_file_index++; }
-    if(*curr_file_index == 0) { release(&mutex); return -EISDIR; }
-    while(*curr_file_index) {
-        if(!curr->isDir()) { release(&mutex); return -ENOTDIR; }
-        // Get the size of this file name
-        size_t char_len = getLenUntilEndOfPathPart(curr_file_index);
-        if(char_len > 256) { release(&mutex); return -ENAMETOOLONG; }
-        curr_folder_name = new char[char_len + 1];
-        memset(curr_folder_name, 0, char_len + 1);
-        memcopy(curr_file_index, curr_folder_name, char_len);
-        fs_node* next = curr->finddir(curr_folder_name);
-        delete curr_folder_name;
-        if(!next) { release(&mutex); return -EINVAL; }
-        curr = next;
-        curr_file_index += char_len;
-        if(*curr_file_index == '/') {
-            if(!curr->isDir()) { release(&mutex); return -ENOTDIR; }
-            curr_file_index++;
+    int64_t ret = err;
+    if(curr && curr->isDir()) {
+        ret = -EISDIR;
+    } else if(curr) {
+        // Open the node and create a new file descriptor for it
+        int open_err = curr->open(true, true);
+        if(open_err < 0 && open_err != -ENOSYS) {
+            ret = open_err;
+        } else {
+            openFile* open_file = new openFile;
+            open_file->node = curr;
+            open_file->ref_count = 1;
+            open_file->ra_buffer = NULL;
+            open_file->ra_start = 0;
+            open_file->ra_len = 0;
+            open_file->ra_window = 0;
+            open_file->ra_next_offset = 0;
+            open_file->ra_generation = curr->generation;
+            acquire(&fd_lock);
+            ret = allocateDescriptor(open_file, pid);
+            release(&fd_lock);
         }
     }
-    if(curr->isDir()) { release(&mutex); return -EISDIR; }
-    // Create a new file descriptor for this file
-    int64_t file_desc = 0;
-    for(int64_t i = 0; i < (int64_t)opened_files.size(); i++) {
-        if(opened_files.at(i)->id == file_desc) { file_desc++; i = -1; }
+    if(writing) { tree_lock.writeUnlock(); }
+    else { tree_lock.readUnlock(); }
+    return ret;
+}
+
+int64_t VFS::allocateDescriptor(openFile* file, int64_t pid) {
+    // Reuse a closed id if we have one, otherwise take the next fresh one
+    int64_t file_desc;
+    if(free_descriptors.size()) {
+        file_desc = free_descriptors.at(free_descriptors.size() - 1);
+        free_descriptors.remove(free_descriptors.size() - 1);
+    } else {
+        file_desc = next_descriptor++;
+    }
+    // Grow the table if the id does not fit
+    if((size_t)file_desc >= opened_files_capacity) {
+        size_t new_capacity = opened_files_capacity ? (opened_files_capacity * 2) : 32;
+        fileDescriptor** new_table = new fileDescriptor*[new_capacity];
+        memset(new_table, 0, new_capacity * sizeof(fileDescriptor*));
+        if(opened_files) {
+            memcopy(opened_files, new_table, opened_files_capacity * sizeof(fileDescriptor*));
+            delete[] opened_files;
+        }
+        opened_files = new_table;
+        opened_files_capacity = new_capacity;
     }
-    // file_desc is now the lowest unused file descriptor, time to create a new fileDescriptor
     fileDescriptor* fd = new fileDescriptor;
-    fd->id = file_desc;
     fd->pid = pid;
-    fd->node = curr;
-    opened_files.push_back(fd);
-    release(&mutex);
+    fd->file = file;
+    opened_files[file_desc] = fd;
     return file_desc;
 }
 
+VFS::openFile* VFS::getFile(int64_t file, int64_t pid) {
+    acquire(&fd_lock);
+    if(file < 0 || (size_t)file >= opened_files_capacity || !opened_files[file]) { release(&fd_lock); return NULL; }
+    // If we are not the kernel (pid -1) then we also check the pid
+    if(pid != -1 && opened_files[file]->pid != pid) {
+    //    return NULL;
+    }
+    openFile* open_file = opened_files[file]->file;
+    open_file->ref_count++;
+    release(&fd_lock);
+    return open_file;
+}
+
+void VFS::putFile(openFile* file) {
+    acquire(&fd_lock);
+    bool last = --file->ref_count == 0;
+    release(&fd_lock);
+    // Noone else can reach it anymore, so the rest can be done without the lock
+    if(last) {
+        file->node->close();
+        if(file->ra_buffer) { VM::FreePages(file->ra_buffer, ra_max_window / 4096); }
+        delete file;
+    }
+}
+
 int VFS::close(int64_t file, int64_t pid) {
-    acquire(&mutex);
-    // Find the fd
-    for(size_t i = 0; i < opened_files.size(); i++) {
-        if(opened_files.at(i)->id == file) {
-            // If we are not the kernel (pid -1) then we also check the pid
-            if(pid != -1 && opened_files.at(i)->pid != pid) {
-            //    return -EBADF;
-            }
-            delete opened_files.at(i);
-            opened_files.remove(i);
-            release(&mutex);
-            return 0;
-        }
+    acquire(&fd_lock);
+    if(file < 0 || (size_t)file >= opened_files_capacity || !opened_files[file]) { release(&fd_lock); return -EBADF; }
+    // If we are not the kernel (pid -1) then we also check the pid
+    if(pid != -1 && opened_files[file]->pid != pid) {
+    //    return -EBADF;
     }
-    release(&mutex);
-    return -EBADF;
+    openFile* open_file = opened_files[file]->file;
+    delete opened_files[file];
+    opened_files[file] = NULL;
+    free_descriptors.push_back(file);
+    release(&fd_lock);
+    putFile(open_file);
+    return 0;
 }
 
 int VFS::pread(int64_t file, void* buf, size_t nbyte, size_t offset, int64_t pid) {
-    // Find the fd
-    fs_node* node = NULL;
-    for(size_t i = 0; i < opened_files.size(); i++) {
-        if(opened_files.at(i)->id == file) {
-            // If we are not the kernel (pid -1) then we also check the pid
-            if(pid != -1 && opened_files.at(i)->pid != pid) {
-            //    return -EBADF;
-            }
-            node = opened_files.at(i)->node;
-            break;
-        }
+    openFile* open_file = getFile(file, pid);
+    if(!open_file) { return -EBADF; }
+    int ret;
+    if(open_file->node->flags == FS_NODE_FILE) {
+        ret = readahead(open_file, buf, nbyte, offset);
+    } else {
+        ret = open_file->node->read(buf, nbyte, offset);
     }
-    if(!node) { return -EBADF; }
-    int ret = node->read(buf, nbyte, offset);
+    putFile(open_file);
     return ret;
 }
 
-int VFS::pwrite(int64_t file, void* buf, size_t nbyte, size_t offset, int64_t pid) {
-    // Find the fd
-    fs_node* node = NULL;
-    for(size_t i = 0; i < opened_files.size(); i++) {
-        if(opened_files.at(i)->id == file) {
-            // If we are not the kernel (pid -1) then we also check the pid
-            if(pid != -1 && opened_files.at(i)->pid != pid) {
-            //    return -EBADF;
+int VFS::readahead(openFile* file, void* buf, size_t nbyte, size_t offset) {
+    file->ra_mutex.lock();
+    // Drop the buffer if the file was written to since it was filled
+    if(file->ra_generation != file->node->generation) {
+        file->ra_len = 0;
+        file->ra_generation = file->node->generation;
+    }
+    // Grow the window while the reads are sequential, and drop it once they are not
+    bool sequential = offset == file->ra_next_offset;
+    if(!sequential) {
+        file->ra_window = 0;
+    } else if(file->ra_window < ra_max_window) {
+        file->ra_window = file->ra_window ? (file->ra_window * 2) : ra_min_window;
+    }
+    size_t done = 0;
+    uint8_t* curr_buf = (uint8_t*)buf;
+    // Serve what we can from the buffer
+    if(offset >= file->ra_start && offset < (file->ra_start + file->ra_len)) {
+        size_t available = (file->ra_start + file->ra_len) - offset;
+        done = (nbyte < available) ? nbyte : available;
+        memcopy(file->ra_buffer + (offset - file->ra_start), curr_buf, done);
+    }
+    if(done < nbyte) {
+        size_t remaining = nbyte - done;
+        int ret;
+        // Dont read past the end of the file, the drivers complain about reads they have to cut short
+        size_t file_size = file->node->size();
+        size_t available = ((offset + done) < file_size) ? (file_size - (offset + done)) : 0;
+        if(remaining > available) { remaining = available; }
+        size_t window = (file->ra_window < available) ? file->ra_window : available;
+        bool fill = sequential && remaining < window;
+        if(fill && !file->ra_buffer) { file->ra_buffer = (uint8_t*)VM::AllocatePages(ra_max_window / 4096); }
+        if(!remaining) {
+            // At the end of the file
+            ret = 0;
+        } else if(fill && file->ra_buffer) {
+            // Fill the buffer with the next window, and copy out what was asked for
+            file->ra_len = 0;
+            ret = file->node->read(file->ra_buffer, window, offset + done);
+            if(ret > 0) {
+                file->ra_start = offset + done;
+                file->ra_len = ret;
+                if((size_t)ret < remaining) { remaining = ret; }
+                memcopy(file->ra_buffer, curr_buf + done, remaining);
+                ret = remaining;
             }
-            node = opened_files.at(i)->node;
-            break;
+        } else {
+            // Large or random reads go straight to the driver, and so does everything if the buffer could not be allocated
+            ret = file->node->read(curr_buf + done, remaining, offset + done);
         }
+        if(ret < 0 && done == 0) {
+            file->ra_mutex.unlock();
+            return ret;
+        }
+        if(ret > 0) { done += ret; }
     }
-    if(!node) { return -EBADF; }
-    int ret = node->write(buf, nbyte, offset);
+    file->ra_next_offset = offset + done;
+    file->ra_mutex.unlock();
+    return done;
+}
+
+int VFS::pwrite(int64_t file, void* buf, size_t nbyte, size_t offset, int64_t pid) {
+    openFile* open_file = getFile(file, pid);
+    if(!open_file) { return -EBADF; }
+    int ret = open_file->node->write(buf, nbyte, offset);
+    // Readahead buffers of the file, including the ones of other open files, might now be stale
+    if(ret > 0) { open_file->node->generation++; }
+    putFile(open_file);
+    return ret;
+}
+
+int VFS::fsync(int64_t file, int64_t pid) {
+    openFile* open_file = getFile(file, pid);
+    if(!open_file) { return -EBADF; }
+    int ret = open_file->node->fsync();
+    putFile(open_file);
     return ret;
 }
 
 size_t VFS::size(int64_t file, int64_t pid) {
-    // Find the fd
-    fs_node* node = NULL;
-    for(size_t i = 0; i < opened_files.size(); i++) {
-        if(opened_files.at(i)->id == file) {
-            // If we are not the kernel (pid -1) then we also check the pid
-            if(pid != -1 && opened_files.at(i)->pid != pid) {
-                // return -EBADF;
-            }
-            node = opened_files.at(i)->node;
-            break;
-        }
-    }
-    if(!node) { return -EBADF; }
-    return node->size();
+    openFile* open_file = getFile(file, pid);
+    if(!open_file) { return -EBADF; }
+    size_t ret = open_file->node->size();
+    putFile(open_file);
+    return ret;
 }
 
 bool VFS::isatty(int64_t file, int64_t pid) {
-    // Find the fd
-    fs_node* node = NULL;
-    for(size_t i = 0; i < opened_files.size(); i++) {
-        if(opened_files.at(i)->id == file) {
-            // If we are not the kernel (pid -1) then we also check the pid
-            if(pid != -1 && opened_files.at(i)->pid != pid) {
-                // return -EBADF;
-            }
-            node = opened_files.at(i)->node;
-            break;
-        }
-    }
-    if(!node) { return -EBADF; }
-    return node->flags == FS_NODE_CHARDEVICE;
+    openFile* open_file = getFile(file, pid);
+    if(!open_file) { return -EBADF; }
+    bool ret = open_file->node->flags == FS_NODE_CHARDEVICE;
+    putFile(open_file);
+    return ret;
 }
 
 int64_t VFS::copy_descriptor(int64_t file, int64_t new_pid) {
-    acquire(&mutex);
-    // Find the fd
-    fs_node* node = NULL;
-    for(size_t i = 0; i < opened_files.size(); i++) {
-        if(opened_files.at(i)->id == file) {
-            node = opened_files.at(i)->node;
-            break;
-        }
-    }
-    if(!node) { release(&mutex); return -EBADF; }
-    // Create a new file descriptor for this file
-    int64_t file_desc = 0;
-    for(int64_t i = 0; i < (int64_t)opened_files.size(); i++) {
-        if(opened_files.at(i)->id == file_desc) { file_desc++; i = -1; }
-    }
-    // file_desc is now the lowest unused file descriptor, time to create a new fileDescriptor
-    fileDescriptor* fd = new fileDescriptor;
-    fd->id = file_desc;
-    fd->pid = new_pid;
-    fd->node = node;
-    opened_files.push_back(fd);
-    release(&mutex);
+    acquire(&fd_lock);
+    if(file < 0 || (size_t)file >= opened_files_capacity || !opened_files[file]) { release(&fd_lock); return -EBADF; }
+    // The new descriptor shares the open file with the old one
+    openFile* open_file = opened_files[file]->file;
+    open_file->ref_count++;
+    int64_t file_desc = allocateDescriptor(open_file, new_pid);
+    release(&fd_lock);
     return file_desc;
 }
 
@@ -345,6 +429,26 @@ VFS::fs_node* VFS::fs_node::finddir(const char* name) {
     if(!driver) { return NULL; }
     return driver->finddir(this, name);
 }
+VFS::fs_node* VFS::fs_node::create(const char* name, int64_t* err) {
+    if(flags == FS_NODE_CHARDEVICE || flags == FS_NODE_BLOCKDEVICE) {
+        *err = -ENOTDIR;
+        return NULL;
+    }
+    if(!driver) { *err = -EINVAL; return NULL; }
+    return driver->create(this, name, err);
+}
+int VFS::fs_node::fsync() {
+    if(flags == FS_NODE_CHARDEVICE) {
+        return -EINVAL;
+    } else if(flags == FS_NODE_BLOCKDEVICE) {
+        // Writes to block device nodes dont go through the block cache, so only the device has to flush
+        BlockDevice* block_dev = BlockManager::the().GetBlockDevice(block_char_dev_id, block_dev_part_id);
+        if(!block_dev) { return -ENOTBLK; }
+        return block_dev->flush();
+    }
+    if(!driver) { return -EINVAL; }
+    return driver->fsync(this);
+}
 
 ///
 /// EchFS stuff
@@ -354,77 +458,301 @@ int EchFSDriver::read(VFS::fs_node* node, void* buf, size_t size, size_t offset)
     // We cant read a directory lol
     if(node->flags == FS_NODE_DIR || node->flags == (FS_NODE_DIR & FS_NODE_MOUNT)) { return -EINVAL; }
     // Find the echfs_file entry we have for this
-    echfs_file* file = NULL;
-    echfs_file_ll* curr_ll = cached_file_entries;
-    while(curr_ll) {
-        if(curr_ll->file->node == node) { file = curr_ll->file; break; }
-        curr_ll = curr_ll->next;
-    }
+    // For files, the inode is the dir entry
+    if(node->inode >= main_dir_entry_len()) { return -EINVAL; }
+    echfs_file* file = entry_files[node->inode];
     if(!file) { return -EINVAL; }
     // Constrain size
-    if((offset + size) > main_directory_table[file->dir_entry].file_size) {
-        uint64_t new_size = main_directory_table[file->dir_entry].file_size - offset;
+    uint64_t file_size = main_directory_table[file->dir_entry].file_size;
+    if(offset >= file_size) { return 0; }
+    if((offset + size) > file_size) {
+        uint64_t new_size = file_size - offset;
         KLog::the().printf("EchFSDriver: read of size %i constrained to %i\n\r", size, new_size);
         size = new_size;
     }
+    if(size == 0) { return 0; }
 
+    // Building the extents is done alone, after checking again in case someone else built them in between
+    extent_lock.readLock();
+    if(!file->extents_built) {
+        extent_lock.readUnlock();
+        extent_lock.writeLock();
+        int err = file->extents_built ? 0 : buildExtents(file);
+        extent_lock.writeUnlock();
+        if(err < 0) { return err; }
+        extent_lock.readLock();
+    }
+
+    // Read each physically contiguous run with a single request
+    uint64_t curr = offset;
     uint64_t end = offset + size;
-    // Check if we have the blocks we need buffered
-    if(file->known_blocks.size() < (end / block_size) + 1) {
-        // Special case if we have no blocks buffered
-        if(file->known_blocks.size() == 0) {
-            uint64_t file_dir_entry = file->dir_entry;
-            file->known_blocks.push_back(main_directory_table[file_dir_entry].starting_block);
+    uint8_t* curr_buf = (uint8_t*)buf;
+    int ret = size;
+    while(end > curr) {
+        uint64_t logical_block = curr / block_size;
+        echfs_extent* extent = findExtent(file, logical_block);
+        if(!extent) {
+            KLog::the().printf("EchFSDriver: file read points to blocks after the end of the chain\n\r");
+            ret = curr - offset;
+            break;
         }
-        // Traverse the blocks we need to get to the blocks we need
-        for(size_t curr_block = file->known_blocks.size(); curr_block < (((end - 1) / block_size) + 1); curr_block++) {
-            // Get the previous block
-            uint64_t prev_block_id = file->known_blocks.at(curr_block - 1);
-            // Read the next block
-            uint64_t curr_block_id = allocation_table[prev_block_id];
-            if(curr_block_id == 0) {
-                KLog::the().printf("EchFSDriver: file seems to have blocks pointing to free area\n\r");
-                return -ENOENT;
-            } else if(curr_block_id == 0xFFFFFFFFFFFFFFF0) {
-                KLog::the().printf("EchFSDriver: file seems to have blocks pointing to reserved area\n\r");
-                return -ENOENT;
-            } else if(curr_block_id == 0xFFFFFFFFFFFFFFFF) {
-                KLog::the().printf("EchFSDriver: file read points to blocks after the end of the chain\n\r");
-                // Shorten size
-                size = ((curr_block - 1) * block_size) - offset;
-                break;
-            }
-            // Debug loop for if curr_block_id == 0
-            if(curr_block_id == 0) { 
-                KLog::the().printf("debug check: curr_block_id == 0"); for(;;);
-            }
-            file->known_blocks.push_back(curr_block_id);
+        // Read until the end of the extent, or until we have everything we need
+        uint64_t extent_end = (extent->logical_block + extent->len) * block_size;
+        uint64_t len = ((extent_end < end) ? extent_end : end) - curr;
+        uint64_t physical_offset = ((extent->physical_block + (logical_block - extent->logical_block)) * block_size) + (curr % block_size);
+        int err = BlockCache::the().read(block, curr_buf, len, physical_offset);
+        if(err < 0) {
+            ret = (curr == offset) ? err : (int)(curr - offset);
+            break;
+        }
+        curr += len;
+        curr_buf += len;
+    }
+    extent_lock.readUnlock();
+    return ret;
+}
+
+int EchFSDriver::buildExtents(echfs_file* file) {
+    uint64_t starting_block = main_directory_table[file->dir_entry].starting_block;
+    // Only walk as many blocks as the file size needs, so that a looping chain cant hang us
+    uint64_t needed_blocks = (main_directory_table[file->dir_entry].file_size + block_size - 1) / block_size;
+    // Walk the chain once to validate it and count the runs, and a second time to fill them in
+    size_t run_count = 0;
+    uint64_t walked = 0;
+    for(uint64_t block_id = starting_block, prev = 0; walked < needed_blocks && block_id != 0xFFFFFFFFFFFFFFFF; prev = block_id, block_id = allocation_table[block_id], walked++) {
+        if(block_id == 0xFFFFFFFFFFFFFFF0) {
+            KLog::the().printf("EchFSDriver: file seems to have blocks pointing to reserved area\n\r");
+            return -ENOENT;
+        } else if(block_id == 0 || block_id >= block_count) {
+            KLog::the().printf("EchFSDriver: file seems to have blocks pointing to free area\n\r");
+            return -ENOENT;
+        }
+        if(run_count == 0 || block_id != prev + 1) { run_count++; }
+    }
+    echfs_extent* extents = run_count ? new echfs_extent[run_count] : NULL;
+    size_t curr_run = 0;
+    uint64_t logical_block = 0;
+    for(uint64_t block_id = starting_block; logical_block < walked; block_id = allocation_table[block_id]) {
+        echfs_extent* run = curr_run ? &extents[curr_run - 1] : NULL;
+        // Extend the current run if this block follows it, otherwise start a new one
+        if(run && (run->physical_block + run->len) == block_id) {
+            run->len++;
+        } else {
+            run = &extents[curr_run++];
+            run->logical_block = logical_block;
+            run->physical_block = block_id;
+            run->len = 1;
+        }
+        logical_block++;
+    }
+    file->extents = extents;
+    file->extent_count = run_count;
+    file->extent_capacity = run_count;
+    file->extents_built = true;
+    return 0;
+}
+
+EchFSDriver::echfs_extent* EchFSDriver::findExtent(echfs_file* file, uint64_t block) {
+    size_t low = 0;
+    size_t high = file->extent_count;
+    while(low < high) {
+        size_t mid = low + ((high - low) / 2);
+        echfs_extent* extent = &file->extents[mid];
+        if(block < extent->logical_block) { high = mid; }
+        else if(block >= (extent->logical_block + extent->len)) { low = mid + 1; }
+        else { return extent; }
+    }
+    return NULL;
+}
+void EchFSDriver::appendExtent(echfs_file* file, uint64_t physical_block) {
+    echfs_extent* last = file->extent_count ? &file->extents[file->extent_count - 1] : NULL;
+    if(last && (last->physical_block + last->len) == physical_block) {
+        last->len++;
+        return;
+    }
+    if(file->extent_count == file->extent_capacity) {
+        size_t new_capacity = file->extent_capacity ? (file->extent_capacity * 2) : 4;
+        echfs_extent* new_extents = new echfs_extent[new_capacity];
+        if(file->extents) {
+            memcopy(file->extents, new_extents, file->extent_count * sizeof(echfs_extent));
+            delete[] file->extents;
         }
+        file->extents = new_extents;
+        file->extent_capacity = new_capacity;
     }
-    // We load the buffer each logical block at a time
+    echfs_extent* extent = &file->extents[file->extent_count++];
+    extent->logical_block = last ? (last->logical_block + last->len) : 0;
+    extent->physical_block = physical_block;
+    extent->len = 1;
+}
+
+int EchFSDriver::allocateBlocks(echfs_file* file, uint64_t count) {
+    echfs_extent* last_extent = file->extent_count ? &file->extents[file->extent_count - 1] : NULL;
+    uint64_t last = last_extent ? (last_extent->physical_block + last_extent->len - 1) : echfs_block_end;
+    // Find all the blocks before changing anything, so there is nothing to undo if there are not enough.
+    // Start looking right after the end of the file, to keep it contiguous.
+    uint64_t* new_blocks = new uint64_t[count];
+    uint64_t found = 0;
+    uint64_t start = last_extent ? (last + 1) : allocation_hint;
+    for(uint64_t i = 0; i < block_count && found < count; i++) {
+        uint64_t blk = (start + i) % block_count;
+        if(allocation_table[blk] == 0) { new_blocks[found++] = blk; }
+    }
+    if(found < count) {
+        delete[] new_blocks;
+        return -ENOSPC;
+    }
+    // Link the new blocks into the chain
+    uint64_t first_changed = new_blocks[0];
+    uint64_t last_changed = new_blocks[0];
+    for(uint64_t i = 0; i < count; i++) {
+        allocation_table[new_blocks[i]] = ((i + 1) < count) ? new_blocks[i + 1] : echfs_block_end;
+        appendExtent(file, new_blocks[i]);
+        if(new_blocks[i] < first_changed) { first_changed = new_blocks[i]; }
+        if(new_blocks[i] > last_changed) { last_changed = new_blocks[i]; }
+    }
+    if(last_extent) {
+        allocation_table[last] = new_blocks[0];
+        if(last < first_changed) { first_changed = last; }
+        if(last > last_changed) { last_changed = last; }
+    } else {
+        main_directory_table[file->dir_entry].starting_block = new_blocks[0];
+    }
+    allocation_hint = new_blocks[count - 1] + 1;
+    delete[] new_blocks;
+    return writeAllocationTable(first_changed, last_changed);
+}
+
+int EchFSDriver::writeData(echfs_file* file, void* buf, size_t size, size_t offset) {
+    // Write each physically contiguous run with a single request
     uint64_t curr = offset;
-    uint64_t first_block_offset = (offset % block_size);
-    // The amount of data we still have to read
-    uint64_t remaining_len = size;
+    uint64_t end = offset + size;
     uint8_t* curr_buf = (uint8_t*)buf;
     while(end > curr) {
-        // Calculate needed block
-        uint64_t block_id = file->known_blocks.at(curr / block_size);
-        // Calculate the amount of data we need from this block
-        uint64_t block_len = ((block_size - first_block_offset) <= remaining_len) ? (block_size - first_block_offset) : remaining_len;
-        // Read this data into the buffer
-        block->read(curr_buf, block_len, (block_id * block_size) + first_block_offset);
-        remaining_len -= block_len;
-        curr += block_len;
-        curr_buf += block_len;
-        first_block_offset = 0;
+        uint64_t logical_block = curr / block_size;
+        echfs_extent* extent = findExtent(file, logical_block);
+        if(!extent) { return (curr == offset) ? -EIO : (int)(curr - offset); }
+        uint64_t extent_end = (extent->logical_block + extent->len) * block_size;
+        uint64_t len = ((extent_end < end) ? extent_end : end) - curr;
+        uint64_t physical_offset = ((extent->physical_block + (logical_block - extent->logical_block)) * block_size) + (curr % block_size);
+        int ret = BlockCache::the().write(block, curr_buf, len, physical_offset);
+        if(ret < 0) { return (curr == offset) ? ret : (int)(curr - offset); }
+        curr += len;
+        curr_buf += len;
     }
     return size;
 }
+
+int EchFSDriver::writeDirEntry(uint64_t entry) {
+    uint64_t offset = blockOffset(16 + allocation_table_block_size) + (entry * sizeof(echfs_dir_entry));
+    int ret = BlockCache::the().write(block, &main_directory_table[entry], sizeof(echfs_dir_entry), offset);
+    return (ret < 0) ? ret : 0;
+}
+
+int EchFSDriver::writeAllocationTable(uint64_t first_block, uint64_t last_block) {
+    uint64_t offset = blockOffset(16) + (first_block * sizeof(uint64_t));
+    int ret = BlockCache::the().write(block, &allocation_table[first_block], (last_block - first_block + 1) * sizeof(uint64_t), offset);
+    return (ret < 0) ? ret : 0;
+}
+
 int EchFSDriver::write(VFS::fs_node* node, void* buf, size_t size, size_t offset) {
     if(!mounted) { return -EINVAL; }
-    (void)node; (void)buf; (void)size; (void)offset;
-    return -ENOSYS;
+    if(node->isDir()) { return -EISDIR; }
+    if(node->inode >= main_dir_entry_len()) { return -EINVAL; }
+    echfs_file* file = entry_files[node->inode];
+    if(!file) { return -EINVAL; }
+    if(size == 0) { return 0; }
+
+    mutex.lock();
+    // Readers walk the extents without the mutex, so changing them also needs the extent lock.
+    // Holding the mutex is enough to only read them.
+    extent_lock.writeLock();
+    int err = file->extents_built ? 0 : buildExtents(file);
+    echfs_dir_entry* entry = &main_directory_table[file->dir_entry];
+    uint64_t file_size = entry->file_size;
+    // Grow the allocation chain if the write goes past the blocks of the file
+    if(err >= 0) {
+        echfs_extent* last_extent = file->extent_count ? &file->extents[file->extent_count - 1] : NULL;
+        uint64_t allocated_blocks = last_extent ? (last_extent->logical_block + last_extent->len) : 0;
+        uint64_t needed_blocks = (offset + size + block_size - 1) / block_size;
+        if(needed_blocks > allocated_blocks) { err = allocateBlocks(file, needed_blocks - allocated_blocks); }
+    }
+    extent_lock.writeUnlock();
+    if(err < 0) {
+        mutex.unlock();
+        return err;
+    }
+    // Writing past the end leaves a hole, which has to read back as zeros
+    if(offset > file_size) {
+        uint8_t* zeroes = new uint8_t[block_size];
+        memset(zeroes, 0, block_size);
+        for(uint64_t curr = file_size; curr < offset;) {
+            uint64_t len = ((offset - curr) < block_size) ? (offset - curr) : block_size;
+            err = writeData(file, zeroes, len, curr);
+            if(err < 0) {
+                delete[] zeroes;
+                mutex.unlock();
+                return err;
+            }
+            curr += len;
+        }
+        delete[] zeroes;
+    }
+    int ret = writeData(file, buf, size, offset);
+    if(ret > 0 && (offset + ret) > file_size) {
+        entry->file_size = offset + ret;
+        node->length = entry->file_size;
+        err = writeDirEntry(file->dir_entry);
+        if(err < 0) { ret = err; }
+    }
+    mutex.unlock();
+    return ret;
+}
+
+VFS::fs_node* EchFSDriver::create(VFS::fs_node* dir, const char* name, int64_t* err) {
+    if(!mounted) { *err = -EINVAL; return NULL; }
+    if(!dir->isDir()) { *err = -ENOTDIR; return NULL; }
+    // Max file name len on echfs is 200
+    size_t name_len = strlen(name);
+    if(!name_len) { *err = -EINVAL; return NULL; }
+    if(name_len >= 200) { *err = -ENAMETOOLONG; return NULL; }
+    mutex.lock();
+    if(indexFind(dir->inode, name) != echfs_index_end) { mutex.unlock(); *err = -EEXIST; return NULL; }
+    // Reuse a deleted entry, or take the end of the main directory
+    uint64_t entry_count = main_dir_entry_len();
+    uint64_t slot = echfs_index_end;
+    for(uint64_t i = 0; i < entry_count; i++) {
+        uint64_t dir_id = main_directory_table[i].dir_id;
+        if(dir_id == echfs_dir_id_deleted || dir_id == echfs_dir_id_end) {
+            slot = i;
+            break;
+        }
+    }
+    if(slot == echfs_index_end) { mutex.unlock(); *err = -ENOSPC; return NULL; }
+    // If we took the end, the entry after it has to end the main directory now
+    if(main_directory_table[slot].dir_id == echfs_dir_id_end && (slot + 1) < entry_count && main_directory_table[slot + 1].dir_id != echfs_dir_id_end) {
+        memset(&main_directory_table[slot + 1], 0, sizeof(echfs_dir_entry));
+        writeDirEntry(slot + 1);
+    }
+    echfs_dir_entry* entry = &main_directory_table[slot];
+    memset(entry, 0, sizeof(echfs_dir_entry));
+    entry->dir_id = dir->inode;
+    entry->type = 0;
+    memcopy((void*)name, entry->name, name_len + 1);
+    entry->permissions = 0644;
+    entry->starting_block = echfs_block_end;
+    entry->file_size = 0;
+    indexInsert(slot);
+    if(writeDirEntry(slot) < 0) { KLog::the().printf("EchFSDriver: could not write dir entry of %s\n\r", name); }
+    VFS::fs_node* node = fileForEntry(slot)->node;
+    mutex.unlock();
+    return node;
+}
+
+int EchFSDriver::fsync(VFS::fs_node* node) {
+    if(!mounted || !node) { return -EINVAL; }
+    // Data and table updates all sit in the block cache, so writing out the whole partition covers them
+    return BlockCache::the().sync(block);
 }
 // TODO: does the driver even need to know of the opens and closes?
 // It might if it would flush buffers and things, but we dont do that yet
@@ -438,18 +766,7 @@ int EchFSDriver::close(VFS::fs_node* node) {
     if(!mounted || !node) { return -EINVAL; }
     if(node->open_count > 0) { node->open_count--; }
     else { KLog::the().printf("EchFSDriver: close called with no open FDs"); }
-    // If no one has this file open, we can discard the known blocks vector
-    if(node->open_count == 0) {
-        // Find the echfs_file entry we have for this
-        echfs_file* file = NULL;
-        echfs_file_ll* curr_ll = cached_file_entries;
-        while(curr_ll) {
-            if(curr_ll->file->node == node) { file = curr_ll->file; break; }
-            curr_ll = curr_ll->next;
-        }
-        if(!file) { return 0; } // If we cant find it, then just return
-        file->known_blocks.clear_and_free();
-    }
+    // The extents of the file are kept, so that the next open does not have to walk the chain again
     return 0;
 }
 size_t EchFSDriver::size(VFS::fs_node* node) {
@@ -460,18 +777,13 @@ size_t EchFSDriver::size(VFS::fs_node* node) {
 VFS::dirent* EchFSDriver::readdir(VFS::fs_node* node, size_t num) {
     if(!mounted) { return NULL; }
     if(node->flags != FS_NODE_DIR && node->flags != (FS_NODE_DIR | FS_NODE_MOUNT)) { return NULL; }
-    uint64_t entry_count = main_dir_entry_len();
-    uint64_t curr_num = 0;
-    for(size_t i = 0; i < entry_count; i++) {
-        echfs_dir_entry* entry = &main_directory_table[i];
-        if(entry->dir_id != node->inode) { continue; }
-        if(curr_num < num) { curr_num++; continue; }
-        // We have gotten the entry num we want
-        VFS::dirent* ret = new VFS::dirent;
-        memcopy(entry->name, ret->name, 201);
-        ret->inode = i;
-    }
-    return NULL;
+    echfs_dir_children* dir = indexChildren(node->inode, false);
+    if(!dir || num >= dir->children.size()) { return NULL; }
+    uint64_t i = dir->children.at(num);
+    VFS::dirent* ret = new VFS::dirent;
+    memcopy(main_directory_table[i].name, ret->name, 201);
+    ret->inode = i;
+    return ret;
 }
 VFS::fs_node* EchFSDriver::finddir(VFS::fs_node* node, const char* name) {
     if(!mounted) { return NULL; }
@@ -479,46 +791,109 @@ VFS::fs_node* EchFSDriver::finddir(VFS::fs_node* node, const char* name) {
     if(strlen(name) >= 200) { return NULL; }
     // node must be a dir or a mount
     if(node->flags != FS_NODE_DIR && node->flags != (FS_NODE_DIR | FS_NODE_MOUNT)) { return NULL; }
+    uint64_t i = indexFind(node->inode, name);
+    if(i == echfs_index_end) { return NULL; }
+    return fileForEntry(i)->node;
+}
+
+EchFSDriver::echfs_file* EchFSDriver::fileForEntry(uint64_t i) {
+    // Check if we have this file cached
+    if(entry_files[i]) { return entry_files[i]; }
+    // We do not have a cached entry for this, create a echfs_file and a fs_node for this
+    echfs_dir_entry* entry = &main_directory_table[i];
+    echfs_file* file_entry = new echfs_file;
+    VFS::fs_node* new_node = new VFS::fs_node;
+    new_node->driver = this;
+    new_node->flags = entry->type ? FS_NODE_DIR : FS_NODE_FILE;
+    new_node->inode = entry->type ? entry->starting_block : i;
+    new_node->length = entry->type ? 0 : entry->file_size;
+    new_node->uid = entry->owner;
+    new_node->gid = entry->group;
+    new_node->mask = entry->permissions;
+    new_node->open_count = 0;
+
+    file_entry->node = new_node;
+    file_entry->dir_entry = i;
+    file_entry->dir_id = entry->type ? entry->starting_block : 0;
+    file_entry->opened = false;
+    file_entry->extents = NULL;
+    file_entry->extent_count = 0;
+    file_entry->extent_capacity = 0;
+    file_entry->extents_built = false;
+
+    entry_files[i] = file_entry;
+    return file_entry;
+}
+
+uint64_t EchFSDriver::indexHash(uint64_t dir_id, const char* name) {
+    // FNV-1a over the name, seeded with the directory id
+    uint64_t h = 0xcbf29ce484222325 ^ dir_id;
+    while(*name) {
+        h ^= (uint8_t)*name++;
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+EchFSDriver::echfs_dir_children* EchFSDriver::indexChildren(uint64_t dir_id, bool create) {
+    echfs_dir_children** bucket = &dir_children[dir_id % index_bucket_count];
+    echfs_dir_children* curr = *bucket;
+    while(curr) {
+        if(curr->dir_id == dir_id) { return curr; }
+        curr = curr->next;
+    }
+    if(!create) { return NULL; }
+    curr = new echfs_dir_children;
+    curr->dir_id = dir_id;
+    curr->next = *bucket;
+    *bucket = curr;
+    return curr;
+}
+
+void EchFSDriver::indexInsert(uint64_t entry) {
+    echfs_dir_entry* dir_entry = &main_directory_table[entry];
+    uint64_t bucket = indexHash(dir_entry->dir_id, dir_entry->name) & (index_bucket_count - 1);
+    index_next[entry] = index_heads[bucket];
+    index_heads[bucket] = entry;
+    indexChildren(dir_entry->dir_id, true)->children.push_back(entry);
+}
+
+uint64_t EchFSDriver::indexFind(uint64_t dir_id, const char* name) {
+    uint64_t curr = index_heads[indexHash(dir_id, name) & (index_bucket_count - 1)];
+    while(curr != echfs_index_end) {
+        echfs_dir_entry* entry = &main_directory_table[curr];
+        if(entry->dir_id == dir_id && strcmp(entry->name, name) == 0) { return curr; }
+        curr = index_next[curr];
+    }
+    return echfs_index_end;
+}
+
+void EchFSDriver::buildIndex() {
     uint64_t entry_count = main_dir_entry_len();
+    // Use a power of two bucket count, with about one bucket per entry
+    index_bucket_count = 64;
+    while(index_bucket_count < entry_count) { index_bucket_count *= 2; }
+    index_heads = new uint64_t[index_bucket_count];
+    for(size_t i = 0; i < index_bucket_count; i++) { index_heads[i] = echfs_index_end; }
+    dir_children = new echfs_dir_children*[index_bucket_count];
+    memset(dir_children, 0, index_bucket_count * sizeof(echfs_dir_children*));
+    index_next = new uint64_t[entry_count];
+    entry_files = new echfs_file*[entry_count];
+    memset(entry_files, 0, entry_count * sizeof(echfs_file*));
+    uint64_t indexed = 0;
     for(size_t i = 0; i < entry_count; i++) {
-        echfs_dir_entry* entry = &main_directory_table[i];
-        if(entry->dir_id != node->inode) { continue; }
-        if(strcmp(entry->name, name) == 0) {
-            // Check if we have this file cached
-            echfs_file_ll* curr = cached_file_entries;
-            while(curr) {
-                echfs_file* cache = curr->file;
-                if(cache->dir_entry == i) {
-                    return cache->node;
-                }
-                curr = curr->next;
-            }
-            // We do not have a cached entry for this, create a echfs_file and a fs_node for this
-            echfs_file* file_entry = new echfs_file;
-            VFS::fs_node* new_node = new VFS::fs_node;
-            new_node->driver = this;
-            new_node->flags = entry->type ? FS_NODE_DIR : FS_NODE_FILE;
-            new_node->inode = entry->type ? entry->starting_block : i;
-            new_node->length = entry->type ? 0 : entry->file_size;
-            new_node->uid = entry->owner;
-            new_node->gid = entry->group;
-            new_node->mask = entry->permissions;
-            new_node->open_count = 0;
-            
-            file_entry->node = new_node;
-            file_entry->dir_entry = i;
-            file_entry->dir_id = entry->type ? entry->starting_block : 0;
-            file_entry->opened = false;
-            
-            echfs_file_ll* ll_entry = new echfs_file_ll;
-            ll_entry->file = file_entry;
-            ll_entry->next = cached_file_entries;
-            cached_file_entries = ll_entry;
-
-            return new_node;
+        index_next[i] = echfs_index_end;
+        uint64_t dir_id = main_directory_table[i].dir_id;
+        // The main directory ends at the first entry with a dir_id of 0
+        if(dir_id == echfs_dir_id_end) {
+            for(size_t x = i + 1; x < entry_count; x++) { index_next[x] = echfs_index_end; }
+            break;
         }
+        if(dir_id == echfs_dir_id_deleted) { continue; }
+        indexInsert(i);
+        indexed++;
     }
-    return NULL;
+    KLog::the().printf("EchFSDriver: indexed %i dir entries\n\r", indexed);
 }
 
 VFS::fs_node* EchFSDriver::mount() {
@@ -570,6 +945,8 @@ VFS::fs_node* EchFSDriver::mount() {
     block->read(main_directory_table, (main_directory_block_size * block_size), (16 + allocation_table_block_size) * block_size);
     // Dump the allocation table stats to KLog
     dumpBlockStates();
+    // Build the directory index
+    buildIndex();
     // Create and read root node
     root_node = new VFS::fs_node;
     root_node->name = NULL;
@@ -642,7 +1019,6 @@ VFS::dirent* DevFSDriver::readdir(VFS::fs_node* node, size_t num) {
 }
 
 VFS::fs_node* DevFSDriver::finddir(VFS::fs_node* node, const char* name) {
-    acquire(&mutex);
     // we dont have subdirs
     if(node->inode != 0xFFFFFFFFFFFFFFFF || !(node->isDir())) { return NULL; }
     // in any case, name must be at least 3 chars
@@ -658,6 +1034,7 @@ VFS::fs_node* DevFSDriver::finddir(VFS::fs_node* node, const char* name) {
         tty_id--;
         // Check if a tty for this even exists
         if(!CharDeviceManager::the().get(tty_id)) { return NULL; }
+        acquire(&mutex);
         // Attempt to get the tty for this
         for(size_t i = 0; i < tty_nodes.size(); i++) {
             if(tty_nodes.at(i)->tty_id == tty_id) { 
@@ -679,7 +1056,6 @@ VFS::fs_node* DevFSDriver::finddir(VFS::fs_node* node, const char* name) {
         release(&mutex);
         return container->node;
     }
-    release(&mutex);
     return NULL;
 }
 
@@ -693,5 +1069,188 @@ VFS::fs_node* DevFSDriver::mount() {
     root_node->gid = 0;
     return root_node;
 }
+///
+/// TmpFS stuff
+///
+TmpFSDriver::tmpfs_node* TmpFSDriver::getNode(VFS::fs_node* node) {
+    if(!node || node->inode >= nodes.size()) { return NULL; }
+    return nodes.at(node->inode);
+}
+
+void TmpFSDriver::reservePages(tmpfs_node* file, size_t page_count) {
+    if(page_count <= file->page_capacity) { return; }
+    size_t new_capacity = file->page_capacity ? file->page_capacity : 4;
+    while(new_capacity < page_count) { new_capacity *= 2; }
+    uint64_t* new_pages = new uint64_t[new_capacity];
+    memset(new_pages, 0, new_capacity * sizeof(uint64_t));
+    if(file->pages) {
+        memcopy(file->pages, new_pages, file->page_capacity * sizeof(uint64_t));
+        delete[] file->pages;
+    }
+    file->pages = new_pages;
+    file->page_capacity = new_capacity;
+}
+
+int TmpFSDriver::read(VFS::fs_node* node, void* buf, size_t size, size_t offset) {
+    if(!mounted) { return -EINVAL; }
+    if(node->isDir()) { return -EISDIR; }
+    lock.readLock();
+    tmpfs_node* file = getNode(node);
+    if(!file) { lock.readUnlock(); return -EINVAL; }
+    if(offset >= file->size) { lock.readUnlock(); return 0; }
+    if((offset + size) > file->size) { size = file->size - offset; }
+    uint8_t* curr_buf = (uint8_t*)buf;
+    uint64_t curr = offset;
+    uint64_t end = offset + size;
+    while(end > curr) {
+        uint64_t page_offset = curr % 4096;
+        uint64_t chunk = ((4096 - page_offset) < (end - curr)) ? (4096 - page_offset) : (end - curr);
+        uint64_t phys = file->pages[curr / 4096];
+        // Pages that were never written are holes
+        if(phys) { memcopy((void*)(phys + VM::GetVirtualOffset() + page_offset), curr_buf, chunk); }
+        else { memset(curr_buf, 0, chunk); }
+        curr += chunk;
+        curr_buf += chunk;
+    }
+    lock.readUnlock();
+    return size;
+}
+
+int TmpFSDriver::write(VFS::fs_node* node, void* buf, size_t size, size_t offset) {
+    if(!mounted) { return -EINVAL; }
+    if(node->isDir()) { return -EISDIR; }
+    if(!size) { return 0; }
+    lock.writeLock();
+    tmpfs_node* file = getNode(node);
+    if(!file) { lock.writeUnlock(); return -EINVAL; }
+    reservePages(file, (offset + size + 4095) / 4096);
+    uint8_t* curr_buf = (uint8_t*)buf;
+    uint64_t curr = offset;
+    uint64_t end = offset + size;
+    while(end > curr) {
+        uint64_t page_offset = curr % 4096;
+        uint64_t chunk = ((4096 - page_offset) < (end - curr)) ? (4096 - page_offset) : (end - curr);
+        uint64_t* phys = &file->pages[curr / 4096];
+        if(!*phys) {
+            *phys = PM::AllocatePages();
+            if(!*phys) { break; }
+            memset((void*)(*phys + VM::GetVirtualOffset()), 0, 4096);
+        }
+        memcopy(curr_buf, (void*)(*phys + VM::GetVirtualOffset() + page_offset), chunk);
+        curr += chunk;
+        curr_buf += chunk;
+    }
+    if(curr > file->size) {
+        file->size = curr;
+        node->length = curr;
+    }
+    lock.writeUnlock();
+    return (curr == offset) ? -ENOSPC : (int)(curr - offset);
+}
+
+int TmpFSDriver::open(VFS::fs_node* node, bool read, bool write) {
+    if(!mounted || !node) { return -EINVAL; }
+    node->open_count++;
+    return 0;
+    (void)read; (void)write;
+}
+
+int TmpFSDriver::close(VFS::fs_node* node) {
+    if(!mounted || !node) { return -EINVAL; }
+    if(node->open_count > 0) { node->open_count--; }
+    return 0;
+}
+
+size_t TmpFSDriver::size(VFS::fs_node* node) {
+    if(!mounted || !node) { return -EINVAL; }
+    if(node->isDir()) { return -EISDIR; }
+    lock.readLock();
+    tmpfs_node* file = getNode(node);
+    size_t ret = file ? file->size : -EINVAL;
+    lock.readUnlock();
+    return ret;
+}
+
+VFS::dirent* TmpFSDriver::readdir(VFS::fs_node* node, size_t num) {
+    if(!mounted || !node->isDir()) { return NULL; }
+    lock.readLock();
+    tmpfs_node* dir = getNode(node);
+    if(!dir || num >= dir->children.size()) { lock.readUnlock(); return NULL; }
+    tmpfs_node* child = nodes.at(dir->children.at(num));
+    VFS::dirent* ret = new VFS::dirent;
+    memcopy(child->name, ret->name, strlen(child->name) + 1);
+    ret->inode = dir->children.at(num);
+    lock.readUnlock();
+    return ret;
+}
+
+VFS::fs_node* TmpFSDriver::finddir(VFS::fs_node* node, const char* name) {
+    if(!mounted || !node->isDir()) { return NULL; }
+    lock.readLock();
+    tmpfs_node* dir = getNode(node);
+    if(!dir) { lock.readUnlock(); return NULL; }
+    for(size_t i = 0; i < dir->children.size(); i++) {
+        tmpfs_node* child = nodes.at(dir->children.at(i));
+        if(strcmp(child->name, name) == 0) {
+            lock.readUnlock();
+            return child->node;
+        }
+    }
+    lock.readUnlock();
+    return NULL;
+}
+
+VFS::fs_node* TmpFSDriver::create(VFS::fs_node* dir, const char* name, int64_t* err) {
+    if(!mounted) { *err = -EINVAL; return NULL; }
+    if(!dir->isDir()) { *err = -ENOTDIR; return NULL; }
+    size_t name_len = strlen(name);
+    if(!name_len) { *err = -EINVAL; return NULL; }
+    if(name_len > 255) { *err = -ENAMETOOLONG; return NULL; }
+    if(finddir(dir, name)) { *err = -EEXIST; return NULL; }
+    lock.writeLock();
+    tmpfs_node* parent = getNode(dir);
+    if(!parent) { lock.writeUnlock(); *err = -EINVAL; return NULL; }
+    tmpfs_node* file = new tmpfs_node;
+    file->name = new char[name_len + 1];
+    memcopy((void*)name, file->name, name_len + 1);
+    file->pages = NULL;
+    file->page_capacity = 0;
+    file->size = 0;
+    file->node = new VFS::fs_node;
+    file->node->name = file->name;
+    file->node->driver = this;
+    file->node->flags = FS_NODE_FILE;
+    file->node->inode = nodes.size();
+    file->node->length = 0;
+    file->node->uid = 0;
+    file->node->gid = 0;
+    file->node->mask = 0644;
+    file->node->open_count = 0;
+    parent->children.push_back(nodes.size());
+    nodes.push_back(file);
+    lock.writeUnlock();
+    return file->node;
+}
+
+VFS::fs_node* TmpFSDriver::mount() {
+    if(mounted) { return root_node; }
+    tmpfs_node* root = new tmpfs_node;
+    root->name = NULL;
+    root->pages = NULL;
+    root->page_capacity = 0;
+    root->size = 0;
+    root_node = new VFS::fs_node;
+    root_node->name = NULL;
+    root_node->driver = this;
+    root_node->flags = FS_NODE_DIR | FS_NODE_MOUNT;
+    root_node->inode = 0;
+    root_node->uid = 0;
+    root_node->gid = 0;
+    root_node->open_count = 0;
+    root->node = root_node;
+    nodes.push_back(root);
+    mounted = true;
+    return root_node;
+}
 
 }
\ No newline at end of file
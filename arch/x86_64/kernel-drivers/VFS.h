@@ -5,10 +5,14 @@
 #include <stddef.h>
 #include <CPP/vector.h>
 #include <CPP/mutex.h>
+#include <processes/sync.h>
 #include <kernel-drivers/BlockDevices.h>
 #include <kernel-drivers/CharDevices.h>
 #include <errno.h>
 
+// Time writing a file through the VFS at boot, and log the throughput
+#define VFS_WRITE_BENCHMARK 0
+
 namespace Kernel {
 
 class VFSDriver;
@@ -27,10 +31,14 @@ public:
 
     bool attemptMountRoot(VFSDriver* driver);
     int attemptMountOnFolder(const char* working, const char* folder, VFSDriver* driver);
-    int64_t open(const char* working, const char* file, int64_t pid);
+    // Open flags, these match the mlibc ABI
+    #define VFS_O_CREAT 0x10
+    int64_t open(const char* working, const char* file, int64_t pid, int flags = 0);
     int close(int64_t file, int64_t pid);
     int pread(int64_t file, void* buf, size_t nbyte, size_t offset, int64_t pid);
     int pwrite(int64_t file, void* buf, size_t nbyte, size_t offset, int64_t pid);
+    // Write everything buffered for the file to the device
+    int fsync(int64_t file, int64_t pid);
     size_t size(int64_t file, int64_t pid);
     bool isatty(int64_t file, int64_t pid);
     int64_t copy_descriptor(int64_t file, int64_t new_pid);
@@ -56,6 +64,7 @@ public:
         int block_dev_part_id; // If a block device, this is the part
         
         size_t open_count; // Amount of times this file has been opened
+        uint64_t generation = 0; // Bumped on every write, so that readahead buffers can tell they are stale
 
         // TODO: make these inline
         // Thanks C++ compiler
@@ -66,6 +75,8 @@ public:
         size_t size();
         VFS::dirent* readdir(size_t num);
         VFS::fs_node* finddir(const char* name);
+        VFS::fs_node* create(const char* name, int64_t* err);
+        int fsync();
 
         bool isDir() {
             return (flags == FS_NODE_DIR) || (flags == (FS_NODE_DIR | FS_NODE_MOUNT));
@@ -73,20 +84,67 @@ public:
     };
 private:
 
-    fs_node* iterateFromDescriptor(const char* working, fs_node* node, int64_t* err);
+    // Look up a single path component (len chars, not null terminated) in dir.
+    // Goes through the dentry cache before asking the driver.
+    fs_node* lookup(fs_node* dir, const char* name, size_t len);
+    // Walk path relative to start.
+    fs_node* walkPath(fs_node* start, const char* path, int64_t* err);
+    // Resolve path, relative to working if it is not absolute.
+    fs_node* resolvePath(const char* working, const char* path, int64_t* err);
+    // Create a regular file at path, relative to working if it is not absolute.
+    fs_node* createFile(const char* working, const char* path, int64_t* err);
+
+    // A opened file. Descriptors created by copy_descriptor share the same
+    // openFile, it is destroyed once the last descriptor referencing it is closed.
+    struct openFile {
+        fs_node* node;
+        size_t ref_count;
+
+        // Readahead state. Small sequential reads of regular files are served
+        // from ra_buffer, which gets refilled with a window that grows as long
+        // as the access pattern stays sequential.
+        Mutex ra_mutex; // Held across the reads that refill the buffer
+        uint8_t* ra_buffer; // Allocated on the first readahead
+        size_t ra_start; // File offset of the data in ra_buffer
+        size_t ra_len; // Amount of valid data in ra_buffer
+        size_t ra_window; // Current readahead size, 0 if the last read was not sequential
+        size_t ra_next_offset; // Where the next read starts if the access is sequential
+        uint64_t ra_generation; // Generation of the node when ra_buffer was filled
+    };
+
+    // Read through the readahead buffer of file
+    int readahead(openFile* file, void* buf, size_t nbyte, size_t offset);
+    static const size_t ra_min_window = 16 * 1024;
+    static const size_t ra_max_window = 128 * 1024;
 
     struct fileDescriptor {
-        int64_t id;
         int64_t pid;
-        fs_node* node;
+        openFile* file;
     };
 
-    Vector<fileDescriptor*> opened_files;
+    // Get the open file behind a descriptor, and take a reference to it.
+    // The reference has to be given back with putFile().
+    openFile* getFile(int64_t file, int64_t pid);
+    void putFile(openFile* file);
+    // Create a new descriptor for file. fd_lock must be held.
+    int64_t allocateDescriptor(openFile* file, int64_t pid);
+
+    // Global open file table, indexed by descriptor id
+    fileDescriptor** opened_files = NULL;
+    size_t opened_files_capacity = 0;
+    // Descriptor ids that have been closed and can be handed out again
+    Vector<int64_t> free_descriptors;
+    // Lowest id that has never been handed out
+    int64_t next_descriptor = 0;
 
     // Root file node.
     fs_node* root_node = NULL;
 
-    mutex_t mutex;
+    // Protects the tree of nodes. Lookups only read it and share it, mounting and creating files write it.
+    // Drivers can do I/O while it is held, so it sleeps.
+    RWLock tree_lock;
+    // Protects the descriptor table and the reference counts of open files
+    mutex_t fd_lock = 0;
 };
 
 
@@ -99,7 +157,10 @@ public:
     virtual size_t size(VFS::fs_node* node)  { return -ENOSYS; (void)node; }
     virtual VFS::dirent* readdir(VFS::fs_node* node, size_t num) { return NULL; (void)node; (void)num; }
     virtual VFS::fs_node* finddir(VFS::fs_node* node, const char* name) { return NULL; (void)node; (void)name; }
-    
+    // Create a regular file called name in the directory dir
+    virtual VFS::fs_node* create(VFS::fs_node* dir, const char* name, int64_t* err) { *err = -ENOSYS; return NULL; (void)dir; (void)name; }
+    // Write the buffered data of node to the device. Drivers without a backing device have nothing to do.
+    virtual int fsync(VFS::fs_node* node) { return 0; (void)node; }
 
     virtual VFS::fs_node* mount() { return NULL; };
 
@@ -107,6 +168,11 @@ public:
 
     virtual const char* driverName() { return "NULL"; }
 
+    // Whether failed finddir calls may be cached by the dentry cache.
+    // Drivers whose directory contents can appear without going through the VFS
+    // should return false.
+    virtual bool allowNegativeDentries() { return true; }
+
     BlockDevice* block;
 protected:
     VFS::fs_node* root_node;
@@ -124,6 +190,8 @@ public:
     size_t size(VFS::fs_node* node) override;
     VFS::dirent* readdir(VFS::fs_node* node, size_t num) override;
     VFS::fs_node* finddir(VFS::fs_node* node, const char* name) override;
+    VFS::fs_node* create(VFS::fs_node* dir, const char* name, int64_t* err) override;
+    int fsync(VFS::fs_node* node) override;
 
     VFS::fs_node* mount() override;
 
@@ -149,24 +217,79 @@ private:
         uint64_t file_size; 
     } __attribute__((packed));
 
+    // A run of physically contiguous blocks in a file
+    struct echfs_extent {
+        uint64_t logical_block; // First block of the run, counted from the start of the file
+        uint64_t physical_block; // Block on the device the run starts at
+        uint64_t len; // Length of the run in blocks
+    };
+
     struct echfs_file {
         VFS::fs_node* node;
         uint64_t dir_entry;
-        Vector<uint64_t> known_blocks;  // If this is a directy, this is the list of known
-                                        // Inodes in this directory
+        // The allocation chain of the file, as extents sorted by logical_block.
+        // Built on the first read, and kept around for as long as the echfs_file lives.
+        echfs_extent* extents;
+        size_t extent_count;
+        size_t extent_capacity;
+        bool extents_built;
         uint64_t dir_id; // If this is a directory, this is the id of that dir
         bool opened;
     };
 
-    struct echfs_file_ll {
-        echfs_file* file;
-        echfs_file_ll* next;
+    // Walk the allocation chain of file and build its extent list
+    int buildExtents(echfs_file* file);
+    // Find the extent containing logical block, or NULL if it is past the end of the chain
+    echfs_extent* findExtent(echfs_file* file, uint64_t block);
+    // Add a block to the end of the extent list of file
+    void appendExtent(echfs_file* file, uint64_t physical_block);
+    // Append count free blocks to the allocation chain of file. The extents must be built.
+    int allocateBlocks(echfs_file* file, uint64_t count);
+    // Write to the blocks of file, which have to be allocated already
+    int writeData(echfs_file* file, void* buf, size_t size, size_t offset);
+
+    // Write the in memory copies of the on disk tables back, through the block cache
+    int writeDirEntry(uint64_t entry);
+    int writeAllocationTable(uint64_t first_block, uint64_t last_block);
+
+    // Children of a single directory, for readdir
+    struct echfs_dir_children {
+        uint64_t dir_id;
+        Vector<uint64_t> children; // Dir entry indices
+        echfs_dir_children* next;
     };
 
     inline uint64_t main_dir_entry_len() {
         return (main_directory_block_size * block_size) / sizeof(echfs_dir_entry);
     }
 
+    // Special dir_id values
+    static const uint64_t echfs_dir_id_end = 0; // End of the main directory
+    static const uint64_t echfs_dir_id_deleted = 0xFFFFFFFFFFFFFFFE;
+    static const uint64_t echfs_index_end = 0xFFFFFFFFFFFFFFFF;
+    // Allocation table value of the last block of a chain, and starting block of empty files
+    static const uint64_t echfs_block_end = 0xFFFFFFFFFFFFFFFF;
+
+    // In memory index of the main directory table, built at mount time.
+    // Has to be kept up to date whenever a dir entry gets added; entries are never removed.
+    void buildIndex();
+    void indexInsert(uint64_t entry);
+    // Returns echfs_index_end if there is no such entry
+    uint64_t indexFind(uint64_t dir_id, const char* name);
+    echfs_dir_children* indexChildren(uint64_t dir_id, bool create);
+    uint64_t indexHash(uint64_t dir_id, const char* name);
+    // Get the echfs_file of a dir entry, creating it if needed
+    echfs_file* fileForEntry(uint64_t entry);
+
+    // Hash chains over the dir entries, keyed by (dir_id, name)
+    uint64_t* index_heads = NULL;
+    uint64_t* index_next = NULL;
+    uint64_t index_bucket_count = 0;
+    // Per directory child lists, hashed by dir_id
+    echfs_dir_children** dir_children = NULL;
+    // The echfs_file we handed out for each dir entry, or NULL
+    echfs_file** entry_files = NULL;
+
     uint64_t block_count = 0;
     uint64_t block_size;
     uint64_t allocation_table_block_size;
@@ -177,7 +300,13 @@ private:
     bool is_allocation_table_on_heap;
     bool is_main_directory_table_on_heap;
 
-    echfs_file_ll* cached_file_entries = NULL;
+    // Where the search for free blocks starts, if the file has no blocks to follow
+    uint64_t allocation_hint = 0;
+    // Serializes changes to the tables. Held across the writes to the disk.
+    Mutex mutex;
+    // Guards the extent lists of the files. Reads hold it shared across their I/O, building or growing a list takes it
+    // exclusively. Taken after mutex.
+    RWLock extent_lock;
 };
 
 class DevFSDriver : public VFSDriver {
@@ -192,6 +321,8 @@ public:
     VFS::fs_node* mount() override;
 
     const char* driverName() override { return "DevFS"; }
+    // ttys show up whenever a char device gets registered
+    bool allowNegativeDentries() override { return false; }
 private:
     struct ttyContainer {
         int tty_id;
@@ -204,6 +335,42 @@ private:
     uint64_t tty_bitmask = (1ULL << 32);
 };
 
+// File system keeping everything in memory. Contents are lost on reboot.
+class TmpFSDriver : public VFSDriver {
+public:
+    int read(VFS::fs_node* node, void* buf, size_t size, size_t offset) override;
+    int write(VFS::fs_node* node, void* buf, size_t size, size_t offset) override;
+    int open(VFS::fs_node* node, bool read, bool write) override;
+    int close(VFS::fs_node* node) override;
+    size_t size(VFS::fs_node* node) override;
+    VFS::dirent* readdir(VFS::fs_node* node, size_t num) override;
+    VFS::fs_node* finddir(VFS::fs_node* node, const char* name) override;
+    VFS::fs_node* create(VFS::fs_node* dir, const char* name, int64_t* err) override;
+
+    VFS::fs_node* mount() override;
+
+    const char* driverName() override { return "TmpFS"; }
+private:
+    struct tmpfs_node {
+        VFS::fs_node* node;
+        char* name;
+        Vector<uint64_t> children; // Node ids, if this is a directory
+        // Physical address of every page of the file, 0 for pages that have never been written
+        uint64_t* pages;
+        size_t page_capacity;
+        size_t size;
+    };
+
+    // Node ids are the inode numbers, and index nodes. The root is node 0.
+    tmpfs_node* getNode(VFS::fs_node* node);
+    // Grow the page array of file to hold at least page_count pages
+    void reservePages(tmpfs_node* file, size_t page_count);
+
+    Vector<tmpfs_node*> nodes;
+    // Reads and lookups share it, writes and creating files hold it alone
+    RWLock lock;
+};
+
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,342 @@
+#include <kernel-drivers/Virtio.h>
+#include <mem/PM/physalloc.h>
+#include <mem/VM/virtmem.h>
+#include <debug/klog.h>
+#include <mem.h>
+
+namespace Kernel {
+
+Virtqueue::Virtqueue(uint16_t _index, uint16_t _size, bool _indirect, bool _event_idx, bool _interrupts) {
+    index = _index;
+    size = _size;
+    use_indirect = _indirect;
+    use_event_idx = _event_idx;
+    use_interrupts = _interrupts;
+    if(use_indirect) {
+        // Every request id gets its own preallocated indirect table
+        size_t pages = ((size * max_buffers * 16) + 4095) / 4096;
+        indirect_phys = PM::AllocatePages(pages);
+        indirect = (uint8_t*)(indirect_phys + VM::GetVirtualOffset());
+        memset(indirect, 0, pages * 4096);
+    }
+}
+
+// Split virtqueue
+
+SplitVirtqueue::SplitVirtqueue(uint16_t _index, uint16_t _size, bool indirect, bool event_idx, bool interrupts) : Virtqueue(_index, _size, indirect, event_idx, interrupts) {
+    // The descriptor table and available ring share the first page, the used ring gets the second one
+    uint64_t phys = PM::AllocatePages(2);
+    uint8_t* virt = (uint8_t*)(phys + VM::GetVirtualOffset());
+    memset(virt, 0, 2 * 4096);
+    desc_phys = phys;
+    driver_phys = phys + (size * sizeof(Descriptor));
+    device_phys = phys + 4096;
+    desc = (volatile Descriptor*)virt;
+    avail = (volatile uint16_t*)(virt + (size * sizeof(Descriptor)));
+    used = (volatile uint16_t*)(virt + 4096);
+    used_ring = (volatile UsedElement*)(virt + 4096 + 4);
+
+    // All descriptors start out on the free list
+    for(uint16_t i = 0; i < size - 1; i++) { desc[i].next = i + 1; }
+    num_free = size;
+    if(!use_interrupts) {
+        avail[0] = 1; // VIRTQ_AVAIL_F_NO_INTERRUPT
+        if(use_event_idx) { avail[2 + size] = last_used_idx - 1; }
+    }
+}
+
+int SplitVirtqueue::add(VirtqBuffer* buffers, size_t count) {
+    if(!count || count > max_buffers) { return -1; }
+    size_t needed = use_indirect ? 1 : count;
+    if(num_free < needed) { return -1; }
+
+    // The request id is the index of the head descriptor
+    uint16_t head = free_head;
+    if(use_indirect) {
+        Descriptor* table = (Descriptor*)indirectTable(head);
+        for(size_t i = 0; i < count; i++) {
+            table[i].addr = buffers[i].phys;
+            table[i].len = buffers[i].len;
+            table[i].flags = (buffers[i].device_writable ? VIRTQ_DESC_F_WRITE : 0) | ((i + 1) < count ? VIRTQ_DESC_F_NEXT : 0);
+            table[i].next = i + 1;
+        }
+        desc[head].addr = indirectPhys(head);
+        desc[head].len = count * sizeof(Descriptor);
+        desc[head].flags = VIRTQ_DESC_F_INDIRECT;
+        free_head = desc[head].next;
+    } else {
+        // The chain follows the free list, so the next fields are already correct
+        uint16_t curr = head;
+        for(size_t i = 0; i < count; i++) {
+            desc[curr].addr = buffers[i].phys;
+            desc[curr].len = buffers[i].len;
+            desc[curr].flags = (buffers[i].device_writable ? VIRTQ_DESC_F_WRITE : 0) | ((i + 1) < count ? VIRTQ_DESC_F_NEXT : 0);
+            curr = desc[curr].next;
+        }
+        free_head = curr;
+    }
+    num_free -= needed;
+
+    avail[2 + (avail_idx % size)] = head;
+    // The device must see the ring entry before the index update
+    asm volatile("" ::: "memory");
+    avail_idx++;
+    avail[1] = avail_idx;
+    num_added++;
+    return head;
+}
+
+bool SplitVirtqueue::kickPrepare() {
+    // The index update has to be visible before we look at what the device wants
+    asm volatile("mfence" ::: "memory");
+    uint16_t new_idx = avail_idx;
+    uint16_t old_idx = new_idx - num_added;
+    num_added = 0;
+    if(use_event_idx) { return needEvent(used[2 + (size * 4)], new_idx, old_idx); }
+    return !(used[0] & 1); // VIRTQ_USED_F_NO_NOTIFY
+}
+
+int SplitVirtqueue::getUsed(uint32_t* len) {
+    if(last_used_idx == used[1]) { return -1; }
+    asm volatile("" ::: "memory");
+    uint16_t slot = last_used_idx % size;
+    uint16_t id = used_ring[slot].id;
+    if(len) { *len = used_ring[slot].len; }
+    last_used_idx++;
+
+    // Put the chain back on the free list
+    uint16_t curr = id;
+    uint16_t count = 1;
+    while(desc[curr].flags & VIRTQ_DESC_F_NEXT) {
+        curr = desc[curr].next;
+        count++;
+    }
+    desc[curr].next = free_head;
+    free_head = id;
+    num_free += count;
+
+    // Ask for a interrupt on the next completion, or push the event far away if we poll
+    if(use_event_idx) { avail[2 + size] = use_interrupts ? last_used_idx : (uint16_t)(last_used_idx - 1); }
+    return id;
+}
+
+// Packed virtqueue
+
+PackedVirtqueue::PackedVirtqueue(uint16_t _index, uint16_t _size, bool indirect, bool event_idx, bool interrupts) : Virtqueue(_index, _size, indirect, event_idx, interrupts) {
+    // Descriptor ring, followed by the driver and device event suppression structures
+    uint64_t phys = PM::AllocatePages();
+    uint8_t* virt = (uint8_t*)(phys + VM::GetVirtualOffset());
+    memset(virt, 0, 4096);
+    desc_phys = phys;
+    driver_phys = phys + (size * sizeof(Descriptor));
+    device_phys = driver_phys + sizeof(EventSuppression);
+    desc = (volatile Descriptor*)virt;
+    driver_event = (volatile EventSuppression*)(virt + (size * sizeof(Descriptor)));
+    device_event = driver_event + 1;
+
+    num_free = size;
+    free_ids = new uint16_t[size];
+    chain_length = new uint16_t[size];
+    free_id_count = size;
+    for(uint16_t i = 0; i < size; i++) { free_ids[i] = size - i - 1; }
+
+    driver_event->off_wrap = 1 << 15;
+    if(!use_interrupts) { driver_event->flags = VIRTQ_EVENT_FLAGS_DISABLE; }
+    else { driver_event->flags = use_event_idx ? VIRTQ_EVENT_FLAGS_DESC : VIRTQ_EVENT_FLAGS_ENABLE; }
+}
+
+int PackedVirtqueue::add(VirtqBuffer* buffers, size_t count) {
+    if(!count || count > max_buffers) { return -1; }
+    size_t needed = use_indirect ? 1 : count;
+    if(num_free < needed || !free_id_count) { return -1; }
+
+    uint16_t id = free_ids[--free_id_count];
+    uint16_t head = next_avail_idx;
+    uint16_t head_flags = 0;
+    for(size_t i = 0; i < needed; i++) {
+        uint16_t flags;
+        if(use_indirect) {
+            Descriptor* table = (Descriptor*)indirectTable(id);
+            for(size_t j = 0; j < count; j++) {
+                table[j].addr = buffers[j].phys;
+                table[j].len = buffers[j].len;
+                table[j].id = 0;
+                table[j].flags = buffers[j].device_writable ? VIRTQ_DESC_F_WRITE : 0;
+            }
+            desc[next_avail_idx].addr = indirectPhys(id);
+            desc[next_avail_idx].len = count * sizeof(Descriptor);
+            flags = VIRTQ_DESC_F_INDIRECT;
+        } else {
+            desc[next_avail_idx].addr = buffers[i].phys;
+            desc[next_avail_idx].len = buffers[i].len;
+            flags = (buffers[i].device_writable ? VIRTQ_DESC_F_WRITE : 0) | ((i + 1) < count ? VIRTQ_DESC_F_NEXT : 0);
+        }
+        desc[next_avail_idx].id = id;
+        // The avail and used bits have to match the wrap counter to make the descriptor available
+        flags |= avail_wrap_counter ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED;
+        // The head is made available last, so the device never sees a half written chain
+        if(i == 0) { head_flags = flags; }
+        else { desc[next_avail_idx].flags = flags; }
+        next_avail_idx++;
+        if(next_avail_idx == size) {
+            next_avail_idx = 0;
+            avail_wrap_counter = !avail_wrap_counter;
+        }
+    }
+    asm volatile("" ::: "memory");
+    desc[head].flags = head_flags;
+
+    chain_length[id] = needed;
+    num_free -= needed;
+    num_added += needed;
+    return id;
+}
+
+bool PackedVirtqueue::kickPrepare() {
+    asm volatile("mfence" ::: "memory");
+    uint16_t new_idx = next_avail_idx;
+    uint16_t old_idx = new_idx - num_added;
+    num_added = 0;
+    uint16_t flags = device_event->flags;
+    if(flags == VIRTQ_EVENT_FLAGS_DISABLE) { return false; }
+    if(flags != VIRTQ_EVENT_FLAGS_DESC || !use_event_idx) { return true; }
+    uint16_t off_wrap = device_event->off_wrap;
+    uint16_t event = off_wrap & 0x7FFF;
+    // An event from the previous lap is relative to the start of that lap
+    if((bool)(off_wrap >> 15) != avail_wrap_counter) { event -= size; }
+    return needEvent(event, new_idx, old_idx);
+}
+
+int PackedVirtqueue::getUsed(uint32_t* len) {
+    uint16_t flags = desc[next_used_idx].flags;
+    bool avail_bit = flags & VIRTQ_DESC_F_AVAIL;
+    bool used_bit = flags & VIRTQ_DESC_F_USED;
+    if(avail_bit != used_bit || used_bit != used_wrap_counter) { return -1; }
+    asm volatile("" ::: "memory");
+    uint16_t id = desc[next_used_idx].id;
+    if(len) { *len = desc[next_used_idx].len; }
+    if(id >= size) { return -1; }
+
+    // The device writes a single used descriptor per chain, skip the rest of it
+    next_used_idx += chain_length[id];
+    if(next_used_idx >= size) {
+        next_used_idx -= size;
+        used_wrap_counter = !used_wrap_counter;
+    }
+    num_free += chain_length[id];
+    free_ids[free_id_count++] = id;
+
+    if(use_interrupts && use_event_idx) { driver_event->off_wrap = next_used_idx | (used_wrap_counter << 15); }
+    return id;
+}
+
+// virtio-pci transport
+
+volatile uint8_t* VirtioPCIDevice::MapCapability(uint8_t cap) {
+    uint8_t bar = PCI::the().configRead8(bus, slot, function, cap + 4);
+    if(bar > 5) { return NULL; }
+    // We only support memory BARs
+    if(bars[bar].io) { return NULL; }
+    uint32_t offset = PCI::the().configRead32(bus, slot, function, cap + 8);
+    uint32_t length = PCI::the().configRead32(bus, slot, function, cap + 12);
+    if(!length) { return NULL; }
+    return (volatile uint8_t*)VM::MapIOSpace(barAddress(bar) + offset, length);
+}
+
+bool VirtioPCIDevice::InitTransport() {
+    // Walk the vendor specific capabilities; the first one of each type is the one to use
+    uint8_t cap = 0;
+    while((cap = PCI::the().findCapability(bus, slot, function, PCI::PCI_CAP_VENDOR, cap))) {
+        uint8_t type = PCI::the().configRead8(bus, slot, function, cap + 3);
+        switch(type) {
+            case VIRTIO_PCI_CAP_COMMON_CFG: if(!common) { common = MapCapability(cap); } break;
+            case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                if(!notify) {
+                    notify = MapCapability(cap);
+                    notify_off_multiplier = PCI::the().configRead32(bus, slot, function, cap + 16);
+                }
+                break;
+            case VIRTIO_PCI_CAP_ISR_CFG: if(!isr) { isr = MapCapability(cap); } break;
+            case VIRTIO_PCI_CAP_DEVICE_CFG: if(!device_config) { device_config = MapCapability(cap); } break;
+            default: break;
+        }
+    }
+    if(!common || !notify || !isr) {
+        KLog::the().printf("Virtio: device is missing required capabilities\n\r");
+        return false;
+    }
+    // Enable memory space access and bus mastering
+    uint16_t command = PCI::the().configRead(bus, slot, function, 0x4);
+    PCI::the().configWrite(bus, slot, function, 0x4, command | 0x6);
+
+    Reset();
+    AddStatus(VIRTIO_STATUS_ACKNOWLEDGE);
+    AddStatus(VIRTIO_STATUS_DRIVER);
+    return true;
+}
+
+void VirtioPCIDevice::Reset() {
+    Common8(COMMON_DEVICE_STATUS) = 0;
+    // The reset is done once the status reads back as 0
+    while(Common8(COMMON_DEVICE_STATUS) != 0) { asm volatile("pause"); }
+}
+
+void VirtioPCIDevice::AddStatus(uint8_t status) {
+    Common8(COMMON_DEVICE_STATUS) = Common8(COMMON_DEVICE_STATUS) | status;
+}
+
+uint64_t VirtioPCIDevice::DeviceFeatures() {
+    Common32(COMMON_DEVICE_FEATURE_SELECT) = 0;
+    uint64_t ret = Common32(COMMON_DEVICE_FEATURE);
+    Common32(COMMON_DEVICE_FEATURE_SELECT) = 1;
+    ret |= (uint64_t)Common32(COMMON_DEVICE_FEATURE) << 32;
+    return ret;
+}
+
+bool VirtioPCIDevice::NegotiateFeatures(uint64_t _features) {
+    features = _features;
+    Common32(COMMON_DRIVER_FEATURE_SELECT) = 0;
+    Common32(COMMON_DRIVER_FEATURE) = features & 0xFFFFFFFF;
+    Common32(COMMON_DRIVER_FEATURE_SELECT) = 1;
+    Common32(COMMON_DRIVER_FEATURE) = features >> 32;
+    AddStatus(VIRTIO_STATUS_FEATURES_OK);
+    // The device clears FEATURES_OK if it does not like the subset we picked
+    if(!(Common8(COMMON_DEVICE_STATUS) & VIRTIO_STATUS_FEATURES_OK)) {
+        AddStatus(VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    return true;
+}
+
+Virtqueue* VirtioPCIDevice::SetupQueue(uint16_t index, uint16_t max_size, bool interrupts, uint16_t msix_vector) {
+    if(index >= Common16(COMMON_NUM_QUEUES)) { return NULL; }
+    Common16(COMMON_QUEUE_SELECT) = index;
+    uint16_t size = Common16(COMMON_QUEUE_SIZE);
+    if(!size) { return NULL; }
+    // The rings are laid out for at most 128 entries
+    if(max_size > 128) { max_size = 128; }
+    if(size > max_size) { size = max_size; }
+    Common16(COMMON_QUEUE_MSIX_VECTOR) = msix_vector;
+    // The device reads back VIRTIO_MSI_NO_VECTOR if it could not allocate the vector
+    if(Common16(COMMON_QUEUE_MSIX_VECTOR) != msix_vector) { return NULL; }
+
+    bool indirect = hasFeature(features, VIRTIO_F_RING_INDIRECT_DESC);
+    bool event_idx = hasFeature(features, VIRTIO_F_RING_EVENT_IDX);
+    Virtqueue* queue;
+    if(hasFeature(features, VIRTIO_F_RING_PACKED)) { queue = new PackedVirtqueue(index, size, indirect, event_idx, interrupts); }
+    else { queue = new SplitVirtqueue(index, size, indirect, event_idx, interrupts); }
+
+    Common16(COMMON_QUEUE_SIZE) = size;
+    Common64(COMMON_QUEUE_DESC, queue->desc_phys);
+    Common64(COMMON_QUEUE_DRIVER, queue->driver_phys);
+    Common64(COMMON_QUEUE_DEVICE, queue->device_phys);
+    queue->notify_address = (volatile uint16_t*)(notify + (Common16(COMMON_QUEUE_NOTIFY_OFF) * notify_off_multiplier));
+    Common16(COMMON_QUEUE_ENABLE) = 1;
+    return queue;
+}
+
+void VirtioPCIDevice::Notify(Virtqueue* queue) {
+    *queue->notify_address = queue->index;
+}
+
+}
@@ -0,0 +1,229 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+#include <stddef.h>
+#include <stdint.h>
+#include <kernel-drivers/PCI.h>
+
+namespace Kernel {
+
+// A buffer handed to the device, as part of a request.
+struct VirtqBuffer {
+    uint64_t phys;
+    uint32_t len;
+    bool device_writable;
+};
+
+// Base class for the split and packed virtqueue layouts.
+// None of the functions lock; the owner of the queue has to.
+class Virtqueue {
+public:
+    virtual ~Virtqueue() = default;
+    // Add a request made up of count buffers. Returns the request id, or -1 if the queue is full.
+    virtual int add(VirtqBuffer* buffers, size_t count) = 0;
+    // Check whether the device has to be notified about the requests added since the last call.
+    virtual bool kickPrepare() = 0;
+    // Get a completed request. Returns the request id, or -1 if there is none.
+    virtual int getUsed(uint32_t* len) = 0;
+
+    // Max amount of buffers in a single request
+    static const size_t max_buffers = 32;
+
+    uint16_t index;
+    uint16_t size;
+    // Physical addresses of the descriptor, driver and device areas, for the transport
+    uint64_t desc_phys;
+    uint64_t driver_phys;
+    uint64_t device_phys;
+    volatile uint16_t* notify_address = NULL;
+
+protected:
+    Virtqueue(uint16_t _index, uint16_t _size, bool _indirect, bool _event_idx, bool _interrupts);
+    // Get the indirect table of a request id
+    inline uint64_t indirectPhys(uint16_t id) { return indirect_phys + (id * max_buffers * 16); }
+    inline void* indirectTable(uint16_t id) { return indirect + (id * max_buffers * 16); }
+
+    bool use_indirect;
+    bool use_event_idx;
+    bool use_interrupts;
+    // Indirect descriptor tables, one per request id
+    uint64_t indirect_phys = 0;
+    uint8_t* indirect = NULL;
+    // Ring entries added since the last kickPrepare()
+    uint16_t num_added = 0;
+
+    enum DescriptorFlags {
+        VIRTQ_DESC_F_NEXT = 1,
+        VIRTQ_DESC_F_WRITE = 2,
+        VIRTQ_DESC_F_INDIRECT = 4,
+        VIRTQ_DESC_F_AVAIL = (1 << 7),
+        VIRTQ_DESC_F_USED = (1 << 15)
+    };
+
+    // True if the event index has been passed going from old_idx to new_idx
+    static inline bool needEvent(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx) {
+        return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+    }
+};
+
+class SplitVirtqueue : public Virtqueue {
+public:
+    SplitVirtqueue(uint16_t _index, uint16_t _size, bool _indirect, bool _event_idx, bool _interrupts);
+    int add(VirtqBuffer* buffers, size_t count) override;
+    bool kickPrepare() override;
+    int getUsed(uint32_t* len) override;
+
+private:
+    struct Descriptor {
+        uint64_t addr;
+        uint32_t len;
+        uint16_t flags;
+        uint16_t next;
+    } __attribute__((packed));
+
+    struct UsedElement {
+        uint32_t id;
+        uint32_t len;
+    } __attribute__((packed));
+
+    volatile Descriptor* desc;
+    // Available ring: flags, idx, ring[size], used_event
+    volatile uint16_t* avail;
+    // Used ring: flags, idx, then the elements, then avail_event
+    volatile uint16_t* used;
+    volatile UsedElement* used_ring;
+
+    uint16_t free_head = 0;
+    uint16_t num_free;
+    uint16_t avail_idx = 0;
+    uint16_t last_used_idx = 0;
+};
+
+class PackedVirtqueue : public Virtqueue {
+public:
+    PackedVirtqueue(uint16_t _index, uint16_t _size, bool _indirect, bool _event_idx, bool _interrupts);
+    int add(VirtqBuffer* buffers, size_t count) override;
+    bool kickPrepare() override;
+    int getUsed(uint32_t* len) override;
+
+private:
+    struct Descriptor {
+        uint64_t addr;
+        uint32_t len;
+        uint16_t id;
+        uint16_t flags;
+    } __attribute__((packed));
+
+    struct EventSuppression {
+        uint16_t off_wrap;
+        uint16_t flags;
+        #define VIRTQ_EVENT_FLAGS_ENABLE 0
+        #define VIRTQ_EVENT_FLAGS_DISABLE 1
+        #define VIRTQ_EVENT_FLAGS_DESC 2
+    } __attribute__((packed));
+
+    volatile Descriptor* desc;
+    volatile EventSuppression* driver_event;
+    volatile EventSuppression* device_event;
+
+    uint16_t next_avail_idx = 0;
+    bool avail_wrap_counter = true;
+    uint16_t next_used_idx = 0;
+    bool used_wrap_counter = true;
+    uint16_t num_free;
+
+    // Free buffer ids, and the amount of ring descriptors each id in flight uses
+    uint16_t* free_ids;
+    uint16_t free_id_count;
+    uint16_t* chain_length;
+};
+
+// Transport for modern (virtio 1.0+) virtio-pci devices.
+class VirtioPCIDevice : public PCIDevice {
+public:
+    VirtioPCIDevice(uint8_t _bus, uint8_t _slot, uint8_t _function) : PCIDevice(_bus, _slot, _function) { }
+
+    enum FeatureBits {
+        VIRTIO_F_RING_INDIRECT_DESC = 28,
+        VIRTIO_F_RING_EVENT_IDX = 29,
+        VIRTIO_F_VERSION_1 = 32,
+        VIRTIO_F_RING_PACKED = 34
+    };
+
+    enum DeviceStatus {
+        VIRTIO_STATUS_ACKNOWLEDGE = 1,
+        VIRTIO_STATUS_DRIVER = 2,
+        VIRTIO_STATUS_DRIVER_OK = 4,
+        VIRTIO_STATUS_FEATURES_OK = 8,
+        VIRTIO_STATUS_FAILED = 128
+    };
+
+    static const uint16_t VIRTIO_MSI_NO_VECTOR = 0xFFFF;
+
+protected:
+    // Find the virtio capabilities, map them, and reset the device.
+    bool InitTransport();
+    uint64_t DeviceFeatures();
+    // Tell the device which features we use. Returns false if it does not accept them.
+    bool NegotiateFeatures(uint64_t features);
+    // Set up a virtqueue, with at most max_size entries. msix_vector is the index of the MSI-X vector it interrupts on,
+    // VIRTIO_MSI_NO_VECTOR when using the legacy interrupt.
+    Virtqueue* SetupQueue(uint16_t index, uint16_t max_size, bool interrupts, uint16_t msix_vector = VIRTIO_MSI_NO_VECTOR);
+    void Notify(Virtqueue* queue);
+    void Reset();
+    void AddStatus(uint8_t status);
+    // Reading the ISR status acknowledges the legacy interrupt
+    uint8_t ReadISR() { return *isr; }
+
+    static inline bool hasFeature(uint64_t features, int bit) { return features & (1ULL << bit); }
+
+    volatile uint8_t* device_config = NULL;
+    uint64_t features = 0;
+
+private:
+    // Map the area a virtio capability describes
+    volatile uint8_t* MapCapability(uint8_t cap);
+
+    enum CapabilityTypes {
+        VIRTIO_PCI_CAP_COMMON_CFG = 1,
+        VIRTIO_PCI_CAP_NOTIFY_CFG = 2,
+        VIRTIO_PCI_CAP_ISR_CFG = 3,
+        VIRTIO_PCI_CAP_DEVICE_CFG = 4
+    };
+
+    // Common configuration layout
+    enum CommonConfig {
+        COMMON_DEVICE_FEATURE_SELECT = 0,
+        COMMON_DEVICE_FEATURE = 4,
+        COMMON_DRIVER_FEATURE_SELECT = 8,
+        COMMON_DRIVER_FEATURE = 12,
+        COMMON_MSIX_CONFIG = 16,
+        COMMON_NUM_QUEUES = 18,
+        COMMON_DEVICE_STATUS = 20,
+        COMMON_CONFIG_GENERATION = 21,
+        COMMON_QUEUE_SELECT = 22,
+        COMMON_QUEUE_SIZE = 24,
+        COMMON_QUEUE_MSIX_VECTOR = 26,
+        COMMON_QUEUE_ENABLE = 28,
+        COMMON_QUEUE_NOTIFY_OFF = 30,
+        COMMON_QUEUE_DESC = 32,
+        COMMON_QUEUE_DRIVER = 40,
+        COMMON_QUEUE_DEVICE = 48
+    };
+
+    inline volatile uint8_t& Common8(uint32_t reg) { return *(volatile uint8_t*)(common + reg); }
+    inline volatile uint16_t& Common16(uint32_t reg) { return *(volatile uint16_t*)(common + reg); }
+    inline volatile uint32_t& Common32(uint32_t reg) { return *(volatile uint32_t*)(common + reg); }
+    inline void Common64(uint32_t reg, uint64_t val) {
+        Common32(reg) = val & 0xFFFFFFFF;
+        Common32(reg + 4) = val >> 32;
+    }
+
+    volatile uint8_t* common = NULL;
+    volatile uint8_t* notify = NULL;
+    uint32_t notify_off_multiplier = 0;
+    volatile uint8_t* isr = NULL;
+};
+
+}
+
+#endif
@@ -0,0 +1,223 @@
+#include <kernel-drivers/VirtioBlk.h>
+#include <mem/VM/virtmem.h>
+#include <hardware/instructions.h>
+#include <debug/klog.h>
+#include <errno.h>
+#include <mem.h>
+
+namespace Kernel {
+
+Vector<VirtioBlkDevice*> virtio_blk_devices;
+
+int VirtioBlkDisk::transfer(void* buf, size_t len, size_t offset, bool write) {
+    if(write && device->read_only) { return -EROFS; }
+    return device->transfer(buf, len, offset, write);
+}
+
+bool VirtioBlkDevice::Initialize() {
+    KLog::the().printf("Virtio: initializing virtio-blk device at %i:%i.%i\n\r", bus, slot, function);
+    if(!InitTransport()) { return false; }
+
+    uint64_t device_features = DeviceFeatures();
+    if(!hasFeature(device_features, VIRTIO_F_VERSION_1)) {
+        KLog::the().printf("Virtio: device does not support virtio 1.0\n\r");
+        AddStatus(VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    uint64_t wanted = (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_F_RING_INDIRECT_DESC) | (1ULL << VIRTIO_F_RING_EVENT_IDX)
+                    | (1ULL << VIRTIO_F_RING_PACKED) | (1ULL << VIRTIO_BLK_F_SEG_MAX) | (1ULL << VIRTIO_BLK_F_RO);
+    if(!NegotiateFeatures(device_features & wanted)) {
+        KLog::the().printf("Virtio: device did not accept the features\n\r");
+        return false;
+    }
+    if(!device_config) {
+        KLog::the().printf("Virtio: device has no device configuration\n\r");
+        AddStatus(VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    read_only = hasFeature(features, VIRTIO_BLK_F_RO);
+
+    // Every request needs a buffer for the header and one for the status. With indirect descriptors,
+    // the table limits the amount of data buffers, otherwise the queue does, which is checked once it is set up.
+    max_pages = Virtqueue::max_buffers - 2;
+    if(hasFeature(features, VIRTIO_BLK_F_SEG_MAX)) {
+        uint32_t seg_max = *(volatile uint32_t*)(device_config + 12);
+        if(seg_max && seg_max < max_pages) { max_pages = seg_max; }
+    }
+
+    // Prefer a MSI-X vector, otherwise use the legacy interrupt line. If there is neither, we poll.
+    // Virtio devices only interrupt through MSI-X or the legacy line, so plain MSI is no use.
+    if(EnableMSI(1) > 0) {
+        if(hasMSIX()) { queue = SetupQueue(0, max_queue_size, true, 0); }
+        if(!queue) { DisableMSI(); }
+    }
+    uint8_t line = PCI::the().configRead(bus, slot, function, 0x3C) & 0xFF;
+    if(!queue) { queue = SetupQueue(0, max_queue_size, line < 16); }
+    if(!queue) {
+        KLog::the().printf("Virtio: could not set up the request queue\n\r");
+        AddStatus(VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    // A request that needs more descriptors than the queue has could never be added
+    if(!hasFeature(features, VIRTIO_F_RING_INDIRECT_DESC) && max_pages > (size_t)(queue->size - 2)) { max_pages = queue->size - 2; }
+    if(!hasMSI() && line < 16) {
+        virtio_blk_devices.push_back(this);
+        Interrupts::the().RegisterIRQHandler(line, VirtioBlkInterrupt);
+        irq = line;
+    }
+    AddStatus(VIRTIO_STATUS_DRIVER_OK);
+
+    disk = new VirtioBlkDisk;
+    disk->device = this;
+    disk->len = *(volatile uint64_t*)device_config * 512;
+    KLog::the().printf("Virtio: %x sectors, %s virtqueue of %i entries%s%s, ", disk->len / 512, hasFeature(features, VIRTIO_F_RING_PACKED) ? "packed" : "split", queue->size,
+                        hasFeature(features, VIRTIO_F_RING_INDIRECT_DESC) ? ", indirect" : "", hasFeature(features, VIRTIO_F_RING_EVENT_IDX) ? ", event idx" : "");
+    if(hasMSI()) { KLog::the().printf("MSI-X vector %i\n\r", msiVector(0)); }
+    else if(hasIRQ()) { KLog::the().printf("IRQ %i\n\r", irq); }
+    else { KLog::the().printf("polling\n\r"); }
+    BlockManager::the().RegisterBlockDevice(disk);
+    return true;
+}
+
+void VirtioBlkDevice::IRQ() {
+    // Reading the ISR status deasserts the interrupt
+    if(!(ReadISR() & 0x1)) { return; }
+    acquire(&mutex);
+    CheckCompletion();
+    release(&mutex);
+}
+
+void VirtioBlkDevice::HandleInterrupt(size_t index) {
+    // MSI-X interrupts are not shared and need no acknowledging, so all the work can be done after the IRQ
+    SoftIRQ::the().Schedule(&completion_tasklet);
+    (void)index;
+}
+
+void VirtioBlkDevice::CompletionTasklet(void* data) {
+    VirtioBlkDevice* device = (VirtioBlkDevice*)data;
+    unsigned long flags = save_irqdisable();
+    acquire(&device->mutex);
+    device->CheckCompletion();
+    release(&device->mutex);
+    irqrestore(flags);
+}
+
+void VirtioBlkDevice::CheckCompletion() {
+    int id;
+    bool reaped = false;
+    while((id = queue->getUsed(NULL)) >= 0) {
+        if(id < max_queue_size && completions[id]) {
+            *completions[id] = true;
+            completions[id] = NULL;
+        }
+        reaped = true;
+    }
+    if(reaped) { waiters.wakeAll(); }
+}
+
+int VirtioBlkDevice::Request(uint64_t header_phys, volatile uint8_t* status, uint64_t* pages, size_t page_count, size_t bytes, bool write) {
+    VirtqBuffer buffers[Virtqueue::max_buffers];
+    buffers[0] = { header_phys, sizeof(RequestHeader), false };
+    for(size_t i = 0; i < page_count; i++) {
+        size_t len = bytes - (i * 4096);
+        buffers[i + 1] = { pages[i], (uint32_t)(len > 4096 ? 4096 : len), !write };
+    }
+    buffers[page_count + 1] = { header_phys + sizeof(RequestHeader), 1, true };
+    *status = 0xFF;
+
+    // The flag lives on our stack, so the id can be reused as soon as the request completes
+    volatile bool done = false;
+    bool added = false;
+    unsigned long flags = save_irqdisable();
+    acquire(&mutex);
+    for(;;) {
+        if(!added) {
+            int id = queue->add(buffers, page_count + 2);
+            if(id >= 0) {
+                added = true;
+                completions[id] = &done;
+                if(queue->kickPrepare()) { Notify(queue); }
+            }
+        }
+        if(done) { break; }
+        // Wait until our request completed, or the queue has room for it
+        if(hasIRQ()) {
+            // The completion tasklet or IRQ handler reaps the queue and wakes us up
+            waiters.wait(&mutex);
+            continue;
+        }
+        CheckCompletion();
+        if(done) { break; }
+        release(&mutex);
+        irqrestore(flags);
+        asm volatile("pause");
+        flags = save_irqdisable();
+        acquire(&mutex);
+    }
+    release(&mutex);
+    irqrestore(flags);
+    return *status;
+}
+
+int VirtioBlkDevice::transfer(void* buf, size_t _len, size_t offset, bool write) {
+    uint64_t len = disk->len;
+    if(offset >= len) { return 0; }
+    if((offset + _len) > len) { _len = len - offset; }
+    if(!_len) { return 0; }
+
+    // Every request gets its own bounce buffer, so that requests from different tasks can be queued at the same time.
+    // The page after the data holds the request header and status.
+    const size_t max_bytes = max_pages * 4096;
+    uint8_t* bounce = (uint8_t*)VM::AllocatePages(max_pages + 1);
+    uint64_t pages[Virtqueue::max_buffers];
+    for(size_t i = 0; i < max_pages; i++) { pages[i] = VM::GetPhysical((uint64_t)bounce + (i * 4096)); }
+    RequestHeader* header = (RequestHeader*)(bounce + max_bytes);
+    uint64_t header_phys = VM::GetPhysical((uint64_t)header);
+    volatile uint8_t* status = (volatile uint8_t*)header + sizeof(RequestHeader);
+    header->reserved = 0;
+
+    int err = 0;
+    uint8_t* curr_buf = (uint8_t*)buf;
+    uint64_t curr = offset;
+    uint64_t end = offset + _len;
+    while(end > curr) {
+        uint64_t sector = curr / 512;
+        uint64_t first_sector_offset = curr % 512;
+        uint64_t chunk = end - curr;
+        if(chunk > (max_bytes - first_sector_offset)) { chunk = max_bytes - first_sector_offset; }
+        uint64_t bytes = ((first_sector_offset + chunk + 511) / 512) * 512;
+        size_t page_count = (bytes + 4095) / 4096;
+        header->sector = sector;
+        if(write) {
+            // Partially written sectors have to be read in first
+            if(first_sector_offset || ((first_sector_offset + chunk) % 512)) {
+                header->type = VIRTIO_BLK_T_IN;
+                if(Request(header_phys, status, pages, page_count, bytes, false) != VIRTIO_BLK_S_OK) { err = -EIO; break; }
+            }
+            memcopy(curr_buf, bounce + first_sector_offset, chunk);
+            header->type = VIRTIO_BLK_T_OUT;
+            if(Request(header_phys, status, pages, page_count, bytes, true) != VIRTIO_BLK_S_OK) { err = -EIO; break; }
+        } else {
+            header->type = VIRTIO_BLK_T_IN;
+            if(Request(header_phys, status, pages, page_count, bytes, false) != VIRTIO_BLK_S_OK) { err = -EIO; break; }
+            memcopy(bounce + first_sector_offset, curr_buf, chunk);
+        }
+        curr += chunk;
+        curr_buf += chunk;
+    }
+    VM::FreePages(bounce, max_pages + 1);
+    if(err < 0) {
+        KLog::the().printf("Virtio: request at sector %x failed\n\r", curr / 512);
+        return (curr == offset) ? err : (int)(curr - offset);
+    }
+    return _len;
+}
+
+void VirtioBlkInterrupt(Interrupts::ISRRegisters* regs) {
+    for(size_t i = 0; i < virtio_blk_devices.size(); i++) {
+        virtio_blk_devices.at(i)->IRQ();
+    }
+    (void)regs;
+}
+
+}
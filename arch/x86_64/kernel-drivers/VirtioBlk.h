@@ -0,0 +1,87 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+#include <kernel-drivers/Virtio.h>
+#include <kernel-drivers/BlockDevices.h>
+#include <CPP/mutex.h>
+#include <interrupts.h>
+#include <softirq.h>
+#include <processes/sync.h>
+
+namespace Kernel {
+
+class VirtioBlkDevice;
+
+// The disk of a virtio-blk device.
+struct VirtioBlkDisk : public BlockDevice {
+    int transfer(void* buf, size_t len, size_t offset, bool write) override;
+
+    VirtioBlkDevice* device;
+};
+
+class VirtioBlkDevice : public VirtioPCIDevice {
+public:
+    VirtioBlkDevice(uint8_t _bus, uint8_t _slot, uint8_t _function) : VirtioPCIDevice(_bus, _slot, _function) { }
+    bool Initialize() override;
+
+    void IRQ();
+    inline bool hasIRQ() { return irq >= 0 || hasMSI(); }
+
+    int transfer(void* buf, size_t len, size_t offset, bool write);
+
+    enum BlkFeatureBits {
+        VIRTIO_BLK_F_SEG_MAX = 2,
+        VIRTIO_BLK_F_RO = 5
+    };
+
+    enum RequestTypes {
+        VIRTIO_BLK_T_IN = 0,
+        VIRTIO_BLK_T_OUT = 1
+    };
+
+    enum RequestStatus {
+        VIRTIO_BLK_S_OK = 0,
+        VIRTIO_BLK_S_IOERR = 1,
+        VIRTIO_BLK_S_UNSUPP = 2
+    };
+
+    // Max amount of entries in the request queue
+    static const uint16_t max_queue_size = 64;
+
+    bool read_only = false;
+
+private:
+    void HandleInterrupt(size_t index) override;
+    static void CompletionTasklet(void* data);
+    Tasklet completion_tasklet{CompletionTasklet, this};
+
+    struct RequestHeader {
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t sector;
+    } __attribute__((packed));
+
+    // Issue a single request and sleep until it completed. header_phys points to a RequestHeader, followed by the status byte.
+    // Returns the virtio-blk status.
+    int Request(uint64_t header_phys, volatile uint8_t* status, uint64_t* pages, size_t page_count, size_t bytes, bool write);
+    // Reap the used ring. mutex must be held.
+    void CheckCompletion();
+
+    Virtqueue* queue = NULL;
+    // Completion flag of the request waiting on each id. Protected by mutex (with interrupts disabled, as the IRQ handler takes it too)
+    volatile bool* completions[max_queue_size] = { };
+    // Woken up whenever requests complete, which also makes room in the queue
+    WaitQueue waiters;
+    mutex_t mutex = 0;
+
+    // Max amount of data pages in a single request
+    size_t max_pages;
+    int irq = -1;
+
+    VirtioBlkDisk* disk = NULL;
+};
+
+void VirtioBlkInterrupt(Interrupts::ISRRegisters* regs);
+
+}
+
+#endif
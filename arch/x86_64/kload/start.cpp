@@ -9,6 +9,8 @@
 #include <kmain.h>
 #include <interrupts.h>
 #include <debug/serial.h>
+#include <hardware/acpi.h>
+#include <hardware/lapic.h>
 
 
 
@@ -83,6 +85,10 @@ extern "C" void _start(struct stivale2_struct *stivale2_struct) {
     // Init KLog
     Kernel::KLog::the().registerCallback(Kernel::Debug::SerialPrintWrap, NULL);
 
+    // Find the ACPI tables
+    stivale2_struct_tag_rsdp* rsdp_tag = (stivale2_struct_tag_rsdp*)stivale2_get_tag(stivale2_struct, STIVALE2_STRUCT_TAG_RSDP_ID);
+    Kernel::ACPI::Init(rsdp_tag ? rsdp_tag->rsdp : 0);
+
 
     // We are in a much safer place now; dereferencing null pointers will for example now crash, before it would have been identity mapped to physical memory.
 
@@ -96,6 +102,8 @@ extern "C" void _start(struct stivale2_struct *stivale2_struct) {
 
     // Initalize Interrupts
     Kernel::Interrupts::the().InitInterrupts();
+    // Enable the local APIC, which MSIs are delivered through
+    Kernel::LAPIC::Init();
 
     // Basic init has occured, we can call the main now
     Kernel::KernelMain(fb_tag);
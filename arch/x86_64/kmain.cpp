@@ -7,15 +7,51 @@
 #include <mem/VM/virtmem.h>
 #include <mem/PM/physalloc.h>
 #include <processes/scheduler.h>
+#include <processes/workqueue.h>
+#include <processes/futex.h>
 #include <kernel-drivers/PCI.h>
 #include <kernel-drivers/IDE.h>
 #include <kernel-drivers/BlockDevices.h>
+#include <kernel-drivers/BlockCache.h>
+#include <kernel-drivers/DentryCache.h>
+#include <kernel-drivers/RamBlockDevice.h>
 #include <kernel-drivers/CharDevices.h>
 #include <kernel-drivers/VFS.h>
 #include <kernel-drivers/PS2.h>
 #include <kernel-drivers/Stivale2GraphicsTerminal.h>
 
 namespace Kernel {
+#if VFS_WRITE_BENCHMARK
+    void WriteBenchmark(const char* dir) {
+        const size_t chunk_size = 64 * 1024;
+        const size_t total_size = 8 * 1024 * 1024;
+        int64_t fd = VFS::the().open(dir, "write-benchmark", -1, VFS_O_CREAT);
+        if(fd < 0) {
+            KLog::the().printf("WriteBenchmark: could not create the file in %s, error %i\n\r", dir, fd);
+            return;
+        }
+        uint8_t* buffer = (uint8_t*)VM::AllocatePages(chunk_size / 4096);
+        for(size_t i = 0; i < chunk_size; i++) { buffer[i] = i & 0xFF; }
+        uint64_t start = Hardware::Timer::GetCurrentTimestamp();
+        size_t written = 0;
+        while(written < total_size) {
+            int ret = VFS::the().pwrite(fd, buffer, chunk_size, written, -1);
+            if(ret <= 0) { break; }
+            written += ret;
+        }
+        uint64_t buffered = Hardware::Timer::GetCurrentTimestamp();
+        int sync_ret = VFS::the().fsync(fd, -1);
+        uint64_t end = Hardware::Timer::GetCurrentTimestamp();
+        VFS::the().close(fd, -1);
+        VM::FreePages(buffer, chunk_size / 4096);
+        uint64_t total_ms = (end > start) ? (end - start) : 1;
+        KLog::the().printf("WriteBenchmark: %s: wrote %i KiB, %i ms buffered, %i ms with fsync (%i KiB/s), fsync returned %i\n\r",
+                            dir, written / 1024, buffered - start, end - start, ((written / 1024) * 1000) / total_ms, sync_ret);
+        BlockCache::the().PrintStats();
+        DentryCache::the().PrintStats();
+    }
+#endif
+
     void kInit2(void* arg) {
         KLog::the().printf("kInit2: started init\n\r");
         // We mount the first partition we find
@@ -49,6 +85,8 @@ namespace Kernel {
         // Try to mount devfs
         DevFSDriver* devfs = new DevFSDriver;
         VFS::the().attemptMountOnFolder("/", "dev", devfs);
+        TmpFSDriver* tmpfs = new TmpFSDriver;
+        VFS::the().attemptMountOnFolder("/", "tmp", tmpfs);
 
         // See if we can launch /init
         int64_t init_fd = VFS::the().open("/", "init", -1);
@@ -58,9 +96,16 @@ namespace Kernel {
         uint8_t* init_elf = new uint8_t[init_size];
         VFS::the().pread(init_fd, init_elf, init_size, 0, -1);
         VFS::the().close(init_fd, -1);
+#if VFS_WRITE_BENCHMARK
+        // tmpfs has no device behind it, so comparing the two shows how much of the time is spent below the VFS
+        WriteBenchmark("/");
+        WriteBenchmark("/tmp");
+#endif
+        // Start writing back dirty pages in the background, now that the root filesystem is mounted
+        BlockCache::the().StartFlusher();
         PM::PrintMemUsage();
         Processes::Scheduler::the().CreateProcess(init_elf, init_size, "init", "/", true);
-        Processes::Scheduler::the().KillCurrentProcess();
+        Processes::Scheduler::the().ExitCurrentThread();
         for(;;);
         (void)arg;
     }
@@ -86,9 +131,16 @@ namespace Kernel {
 
         // Initialize scheduler
         Processes::Scheduler::the().Init();
+        // Start the kernel threads doing background work
+        WorkQueue::system().Init(2);
+        Futex::the().Init();
+        PM::InitZeroPool();
 
         // Probe PCI devices
         PCI::the().probe();
+#if RAM_BLOCK_DEVICE_SIZE
+        BlockManager::the().RegisterBlockDevice(new RamBlockDevice(RAM_BLOCK_DEVICE_SIZE));
+#endif
 
         // Read partition tables
         BlockManager::the().ParsePartitions();
@@ -107,7 +107,7 @@ namespace PM {
                 if(current_block >= count) {
                     // Ladies and gentlemen, we got em
                     // Set these bits as used
-                    *bitmap_entry |= ((1 << current_block) - 1) << current_block_pos;
+                    *bitmap_entry |= ((1ULL << current_block) - 1) << current_block_pos;
                     // Calculate offset
                     uint64_t addr = curr->base + (((offset * 64) + current_block_pos) * 4096);
                     // Check if the hint is now full
@@ -162,6 +162,7 @@ namespace PM {
     }
 
     void FreePages(uint64_t object, int count) {
+        acquire(&mutex);
         descriptors* curr = pages;
         while(curr) {
             uint64_t* bitmap = (uint64_t*)(curr + 1);
@@ -169,8 +170,9 @@ namespace PM {
             if(object >= curr->base && object <= (curr->base + curr->size)) {
                 // Got it, set the bits to 0
                 size_t page_offset = (object - curr->base) / 4096;
+                // The bitmap is allocated in 64 page chunks by CheckAndAllocate
                 for(int i = 0; i < count; i++) {
-                    BIT_CLEAR(bitmap, page_offset + 1);
+                    bitmap[(page_offset + i) / 64] &= ~(1ULL << ((page_offset + i) % 64));
                 }
                 free_pages += count;
                 used_pages -= count;
@@ -179,6 +181,7 @@ namespace PM {
             }
             curr = curr->next;
         }
+        release(&mutex);
         KLog::the().printf("PM: couldnt deallocate page %x, count %i, ignoring\n\r", object, count);
     }
 
@@ -187,6 +190,7 @@ namespace PM {
     }
 
     uint64_t PageCount() { return free_pages + used_pages; }
+    uint64_t FreePageCount() { return free_pages; }
 }
 
 }
\ No newline at end of file
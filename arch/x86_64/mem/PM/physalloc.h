@@ -21,6 +21,14 @@ namespace Kernel {
         void PrintMemUsage();
         // Return the amount of pages of RAM.
         uint64_t PageCount();
+        // Return the amount of pages that are currently free.
+        uint64_t FreePageCount();
+
+        // Allocate a single zeroed page. These come from a pool a background work item keeps zeroed,
+        // so the caller doesnt have to wait for the zeroing.
+        uint64_t AllocateZeroedPage();
+        // Start filling the zeroed page pool. Needs the system work queue.
+        void InitZeroPool();
     }
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,60 @@
+#include <mem.h>
+#include <mem/PM/physalloc.h>
+#include <mem/VM/virtmem.h>
+#include <processes/workqueue.h>
+#include <hardware/instructions.h>
+
+namespace Kernel {
+
+namespace PM {
+    static const size_t zero_pool_size = 64;
+    // Refill once it drops below this
+    static const size_t zero_pool_low = 16;
+
+    // Physical addresses of zeroed pages. Protected by disabling interrupts, as page faults allocate from it too.
+    // The allocator itself has its own lock, so it is never called with them disabled here.
+    static uint64_t zero_pool[zero_pool_size];
+    static size_t zero_pool_count = 0;
+    static bool zero_pool_started = false;
+
+    static void RefillZeroPool(void* arg);
+    static WorkItem refill_work(RefillZeroPool, NULL);
+
+    static void RefillZeroPool(void* arg) {
+        (void)arg;
+        for(;;) {
+            // Unlocked peek, the count is checked again before the page goes in
+            if(zero_pool_count >= zero_pool_size) { return; }
+            uint64_t phys = AllocatePages();
+            memset((void*)(phys + VM::GetVirtualOffset()), 0, 4096);
+            unsigned long flags = save_irqdisable();
+            if(zero_pool_count < zero_pool_size) {
+                zero_pool[zero_pool_count++] = phys;
+                phys = 0;
+            }
+            irqrestore(flags);
+            // Someone else filled it up in the meantime
+            if(phys) { FreePages(phys); }
+        }
+    }
+
+    uint64_t AllocateZeroedPage() {
+        unsigned long flags = save_irqdisable();
+        uint64_t phys = 0;
+        if(zero_pool_count) { phys = zero_pool[--zero_pool_count]; }
+        if(zero_pool_started && zero_pool_count < zero_pool_low) { WorkQueue::system().queue(&refill_work); }
+        irqrestore(flags);
+        if(phys) { return phys; }
+        // The pool ran dry, zero one ourselves
+        phys = AllocatePages();
+        memset((void*)(phys + VM::GetVirtualOffset()), 0, 4096);
+        return phys;
+    }
+
+    void InitZeroPool() {
+        zero_pool_started = true;
+        WorkQueue::system().queue(&refill_work);
+    }
+}
+
+}
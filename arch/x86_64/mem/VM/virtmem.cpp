@@ -3,6 +3,7 @@
 #include <mem/PM/physalloc.h>
 #include <panic.h>
 #include <debug/klog.h>
+#include <hardware/instructions.h>
 
 namespace Kernel {
 
@@ -23,8 +24,102 @@ namespace VM {
         asm volatile("invlpg (%0)" : : "b"(address) : "memory");
     }
 
+    // Everything from here up is kernel memory, which every page table shares
+    const uint64_t kernel_half = 0xffff800000000000;
+
+    // Kernel mappings are global, so they survive page table switches
+    bool global_pages = false;
+    const uint64_t page_global = 1 << 8;
+
+    bool pcid_enabled = false;
+    bool invpcid_supported = false;
+    // Page tables that currently own a PCID. The one in slot i uses PCID i + 1, PCID 0 is only used while booting.
+    static const size_t pcid_slots = 8;
+    uint64_t pcid_owner[pcid_slots] = { };
+    size_t pcid_next = 0;
+
+    static void DetectPagingFeatures() {
+        uint32_t eax, ebx, ecx, edx;
+        cpuid(1, &eax, &ebx, &ecx, &edx);
+        global_pages = edx & (1 << 13);
+        // Without global pages, changes to kernel mappings would have to be flushed from every PCID, so only use PCIDs with them
+        pcid_enabled = global_pages && (ecx & (1 << 17));
+        cpuid(0, &eax, &ebx, &ecx, &edx);
+        if(eax >= 7) {
+            cpuid(7, &eax, &ebx, &ecx, &edx);
+            invpcid_supported = pcid_enabled && (ebx & (1 << 10));
+        }
+    }
+
+    static void EnablePagingFeatures() {
+        uint64_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        if(global_pages) { cr4 |= 1 << 7; }
+        // CR3 must use PCID 0 when this is turned on
+        if(pcid_enabled) { cr4 |= 1 << 17; }
+        asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    }
+
+    static int FindPCIDSlot(uint64_t table) {
+        for(size_t i = 0; i < pcid_slots; i++) {
+            if(pcid_owner[i] == table) { return i; }
+        }
+        return -1;
+    }
+
+    // Drop the TLB entry of virt in the address space of table, which may not be loaded
+    static void InvalidateMapping(uint64_t table, uint64_t virt) {
+        // invlpg drops global entries no matter which PCID they were loaded with, so that covers the kernel half everywhere
+        if(virt >= kernel_half || table == CurrentPageTable()) {
+            InvalidatePage(virt);
+            return;
+        }
+        // Without PCIDs, loading the table flushes the TLB anyway
+        if(!pcid_enabled) { return; }
+        unsigned long flags = save_irqdisable();
+        int slot = FindPCIDSlot(table);
+        if(slot >= 0) {
+            if(invpcid_supported) {
+                struct { uint64_t pcid; uint64_t address; } descriptor = { (uint64_t)slot + 1, virt };
+                // Type 0 invalidates a single address of a single PCID
+                asm volatile("invpcid %0, %1" : : "m"(descriptor), "r"((uint64_t)0) : "memory");
+            } else {
+                // Give up the PCID, so the table gets a flushed one when it is loaded again
+                pcid_owner[slot] = 0;
+            }
+        }
+        irqrestore(flags);
+    }
+
+    void LoadPageTable(uint64_t table) {
+        table &= ~0xFFFULL;
+        unsigned long flags = save_irqdisable();
+        if(CurrentPageTable() == table) {
+            irqrestore(flags);
+            return;
+        }
+        if(!pcid_enabled) {
+            asm volatile("mov %0, %%cr3" : : "r"(table) : "memory");
+            irqrestore(flags);
+            return;
+        }
+        int slot = FindPCIDSlot(table);
+        if(slot >= 0) {
+            // The TLB entries left under this PCID are still valid, keep them
+            asm volatile("mov %0, %%cr3" : : "r"(table | (slot + 1) | (1ULL << 63)) : "memory");
+        } else {
+            // Take the next PCID, without the no flush bit to throw out what its previous owner left behind
+            slot = pcid_next;
+            pcid_next = (pcid_next + 1) % pcid_slots;
+            pcid_owner[slot] = table;
+            asm volatile("mov %0, %%cr3" : : "r"(table | (slot + 1)) : "memory");
+        }
+        irqrestore(flags);
+    }
+
     void Init(stivale2_struct_tag_memmap* memmap, uint64_t hhdm_offset) {
         virtual_offset = hhdm_offset;
+        DetectPagingFeatures();
         // Create the new kernel page table
         page_table = (uint64_t*)PM::AllocatePages();
         // Preallocate all lvl4 entries from 256-511
@@ -44,8 +139,12 @@ namespace VM {
                 }
             }
         }
-        // Change to this page table
-        SwitchPageTables((uint64_t)page_table);
+        // Change to this page table. LoadPageTable would already hand out a PCID, but CR4.PCIDE can only be turned on
+        // while CR3 uses PCID 0, so load it directly.
+        asm volatile("mov %0, %%cr3" : : "r"((uint64_t)page_table) : "memory");
+        EnablePagingFeatures();
+        // KLog isnt up yet
+        Debug::SerialPrintf("VM: global pages %s, PCID %s, INVPCID %s\n\r", global_pages ? "on" : "off", pcid_enabled ? "on" : "off", invpcid_supported ? "on" : "off");
     }
 
 
@@ -53,7 +152,8 @@ namespace VM {
     uint64_t CurrentPageTable() {
         uint64_t ret;
         asm volatile("mov %%cr3, %0" : "=r"(ret));
-        return ret;
+        // The low bits hold the PCID
+        return ret & ~0xFFFULL;
     }
 
     // Get the physical address of a mapping. Returns NULL if failed.
@@ -102,28 +202,30 @@ namespace VM {
         // Check if the level 3 table exists
         uint64_t* lvl4_table = (uint64_t*)(CurrentPageTable() + virtual_offset);
         if(~(lvl4_table[lvl4]) & 1) {
-            lvl4_table[lvl4] = (uint64_t)PM::AllocatePages() | 0b111;
+            lvl4_table[lvl4] = PM::AllocateZeroedPage() | 0b111;
             InvalidatePage(lvl4_table[lvl4] + virtual_offset);
-            memset((void*)((lvl4_table[lvl4] & 0xffffffffff000) + virtual_offset), 0x00, 4096);
         }
         uint64_t* lvl3_table = (uint64_t*)((lvl4_table[lvl4] & 0xffffffffff000) + virtual_offset);
         // Check if the level 2 table exists
         if(~(lvl3_table[lvl3]) & 1) {
-            lvl3_table[lvl3] = (uint64_t)PM::AllocatePages() | 0b111;
+            lvl3_table[lvl3] = PM::AllocateZeroedPage() | 0b111;
             InvalidatePage(lvl3_table[lvl3] + virtual_offset);
-            memset((void*)((lvl3_table[lvl3] & 0xffffffffff000) + virtual_offset), 0x00, 4096);
         }
         uint64_t* lvl2_table = (uint64_t*)((lvl3_table[lvl3] & 0xffffffffff000) + virtual_offset);
         // Check if the level 1 table exists
         if(~(lvl2_table[lvl2]) & 1) {
-            lvl2_table[lvl2] = (uint64_t)PM::AllocatePages() | 0b111;
+            lvl2_table[lvl2] = PM::AllocateZeroedPage() | 0b111;
             InvalidatePage(lvl2_table[lvl2] + virtual_offset);
-            memset((void*)((lvl2_table[lvl2] & 0xffffffffff000) + virtual_offset), 0x00, 4096);
         }
         uint64_t* lvl1_table = (uint64_t*)((lvl2_table[lvl2] & 0xffffffffff000) + virtual_offset);
-        if(!(options & 1)) { lvl1_table[lvl1] = 0; return; } // If the present bit is not set, then just set to null
+        if(!(options & 1)) { // If the present bit is not set, then just set to null
+            lvl1_table[lvl1] = 0;
+            InvalidatePage((virt & 0xFFFFFFFFFF000));
+            return;
+        }
         // Set the entry
         ASSERT((phys & 0x8000000000000000) == 0, "Physical address would set NX bit!");
+        if(global_pages && virt >= kernel_half) { options |= page_global; }
         lvl1_table[lvl1] = (phys & 0xFFFFFFFFFF000) | options;
         InvalidatePage((virt & 0xFFFFFFFFFF000));
         //release(&mutex);
@@ -145,30 +247,34 @@ namespace VM {
             lvl4_table = (uint64_t*)((uint64_t)(table) + virtual_offset);
         }
         if(~(lvl4_table[lvl4]) & 1) {
-            lvl4_table[lvl4] = (uint64_t)PM::AllocatePages() | 0b111;
+            lvl4_table[lvl4] = PM::AllocateZeroedPage() | 0b111;
             InvalidatePage(lvl4_table[lvl4] + virtual_offset);
-            memset((void*)((lvl4_table[lvl4] & 0xffffffffff000) + virtual_offset), 0x00, 4096);
         }
         uint64_t* lvl3_table = (uint64_t*)((lvl4_table[lvl4] & 0xffffffffff000) + virtual_offset);
         // Check if the level 2 table exists
         if(~(lvl3_table[lvl3]) & 1) {
-            lvl3_table[lvl3] = (uint64_t)PM::AllocatePages() | 0b111;
+            lvl3_table[lvl3] = PM::AllocateZeroedPage() | 0b111;
             InvalidatePage(lvl3_table[lvl3] + virtual_offset);
-            memset((void*)((lvl3_table[lvl3] & 0xffffffffff000) + virtual_offset), 0x00, 4096);
         }
         uint64_t* lvl2_table = (uint64_t*)((lvl3_table[lvl3] & 0xffffffffff000) + virtual_offset);
         // Check if the level 1 table exists
         if(~(lvl2_table[lvl2]) & 1) {
-            lvl2_table[lvl2] = (uint64_t)PM::AllocatePages() | 0b111;
+            lvl2_table[lvl2] = PM::AllocateZeroedPage() | 0b111;
             InvalidatePage(lvl2_table[lvl2] + virtual_offset);
-            memset((void*)((lvl2_table[lvl2] & 0xffffffffff000) + virtual_offset), 0x00, 4096);
         }
         uint64_t* lvl1_table = (uint64_t*)((lvl2_table[lvl2] & 0xffffffffff000) + virtual_offset);
-        if(!(options & 1)) { lvl1_table[lvl1] = 0; return; } // If the present bit is not set, then just set to null
+        // The table might not be the loaded one
+        uint64_t table_phys = (uint64_t)lvl4_table - virtual_offset;
+        if(!(options & 1)) { // If the present bit is not set, then just set to null
+            lvl1_table[lvl1] = 0;
+            InvalidateMapping(table_phys, (virt & 0xFFFFFFFFFF000));
+            return;
+        }
         // Set the entry
         ASSERT((phys & 0x8000000000000000) == 0, "Physical address would set NX bit!");
+        if(global_pages && virt >= kernel_half) { options |= page_global; }
         lvl1_table[lvl1] = (phys & 0xFFFFFFFFFF000) | options;
-        InvalidatePage((virt & 0xFFFFFFFFFF000));
+        InvalidateMapping(table_phys, (virt & 0xFFFFFFFFFF000));
         //release(&mutex);
     }
 
@@ -230,6 +336,28 @@ namespace VM {
         return NULL;
     }
 
+    // MMIO mappings live in their own window above the kernel pages
+    const uint64_t io_space_begin = 0xffffff0000000000;
+    const uint64_t io_space_end = 0xffffff8000000000;
+    uint64_t io_space_next = io_space_begin;
+
+    void* MapIOSpace(uint64_t phys, size_t size) {
+        acquire(&mutex);
+        uint64_t page_offset = phys & 4095;
+        uint64_t page_count = round_to_page_up(size + page_offset) / 4096;
+        if((io_space_next + (page_count * 4096)) > io_space_end) {
+            Debug::Panic("VM: out of IO space");
+        }
+        uint64_t virt = io_space_next;
+        io_space_next += page_count * 4096;
+        for(size_t i = 0; i < page_count; i++) {
+            // Present, writable, write through and cache disable
+            MapPage((phys & ~4095ULL) + (i * 4096), virt + (i * 4096), 0b11011);
+        }
+        release(&mutex);
+        return (void*)(virt + page_offset);
+    }
+
     #if defined(VM_FREE) && VM_FREE
     void FreePages(void* adr, size_t pages) {
         #if defined(VM_LOG_FREE) && VM_LOG_FREE
@@ -17,10 +17,10 @@ constexpr uint64_t round_to_page_up(uint64_t addr) {
 #if defined(VM_DEBUG_PAGETABLES) && VM_DEBUG_PAGETABLES
 #define SwitchPageTables(table) \
     Kernel::Debug::SerialPrintf("switch page tables from %s: %x\n\r", __builtin_FUNCTION(), (uint64_t)table); \
-    asm volatile("mov %0, %%cr3" : : "r"((uint64_t)table));
+    ::Kernel::VM::LoadPageTable((uint64_t)table);
 #else
 #define SwitchPageTables(table) \
-    asm volatile("mov %0, %%cr3" : : "r"((uint64_t)table));
+    ::Kernel::VM::LoadPageTable((uint64_t)table);
 
 #endif
 
@@ -44,8 +44,11 @@ namespace Kernel {
 
         
 
-        // Gets the value of CR3
+        // Gets the physical address of the loaded page table
         uint64_t CurrentPageTable();
+        // Load a page table. Does nothing if it already is loaded.
+        // With PCIDs, the TLB entries of recently used page tables are kept across switches.
+        void LoadPageTable(uint64_t table);
 
         // Allocate a virtual memory page. Allocated into Kernel memory.
         void* AllocatePages(size_t count = 1);
@@ -53,6 +56,10 @@ namespace Kernel {
         // Frees x pages.
         void FreePages(void* adr, size_t pages);
 
+        // Map a physical MMIO area into kernel space, uncached.
+        // Returns the virtual address of phys. These mappings are never freed.
+        void* MapIOSpace(uint64_t phys, size_t size);
+
         // Maps addresses.
         void MapPage(unsigned long phys, unsigned long virt, unsigned long options = 0b11);
         void MapPage(unsigned long phys, unsigned long virt, unsigned long options, uint64_t* table);
@@ -0,0 +1,129 @@
+#include <processes/futex.h>
+#include <processes/scheduler.h>
+#include <hardware/instructions.h>
+#include <timer.h>
+#include <errno.h>
+
+namespace Kernel {
+    void Futex::Init() {
+        Hardware::Timer::AttachCallback(TimerCallback, this);
+    }
+
+    Futex::Bucket* Futex::BucketOf(Processes::Process* proc, uint64_t addr) {
+        // Fibonacci hashing, the top bits of the product are the best mixed
+        uint64_t key = (addr >> 2) ^ ((uint64_t)proc >> 4);
+        return &buckets[(key * 0x9E3779B97F4A7C15ULL) >> 58];
+    }
+
+    int Futex::wait(Processes::Process* proc, uint64_t addr, uint32_t expected, uint64_t timeout) {
+        if(addr & 0x3) { return -EINVAL; }
+        Processes::Thread* thread = Processes::Scheduler::the().CurrentThread();
+        Bucket* bucket = BucketOf(proc, addr);
+        FutexWaiter waiter = { proc, addr, thread, 0, false, false, NULL };
+
+        unsigned long flags = save_irqdisable();
+        acquire(&bucket->mutex);
+        // The value is checked under the bucket mutex, so a wake after the value changed cant slip in before we are queued
+        uint32_t value;
+        if(!proc->attemptCopyFromUser(addr, sizeof(uint32_t), &value)) {
+            release(&bucket->mutex);
+            irqrestore(flags);
+            return -EFAULT;
+        }
+        if(value != expected) {
+            release(&bucket->mutex);
+            irqrestore(flags);
+            return -EAGAIN;
+        }
+        // A kill that came before we are queued would not find us to wake up
+        if(thread->should_exit) {
+            release(&bucket->mutex);
+            irqrestore(flags);
+            return -EINTR;
+        }
+        // Wake ups go in order, so the new waiter goes at the end
+        FutexWaiter** link = &bucket->head;
+        while(*link) { link = &(*link)->next; }
+        *link = &waiter;
+        thread->futex_waiter = &waiter;
+        if(timeout) {
+            waiter.deadline = Hardware::Timer::GetCurrentTimestamp() + timeout;
+            if(waiter.deadline < next_deadline) { next_deadline = waiter.deadline; }
+        }
+        release(&bucket->mutex);
+
+        while(!waiter.woken) { Processes::Scheduler::the().SleepCurrent(); }
+        irqrestore(flags);
+        if(thread->should_exit) { return -EINTR; }
+        return waiter.timed_out ? -ETIMEDOUT : 0;
+    }
+
+    int Futex::wake(Processes::Process* proc, uint64_t addr, uint64_t count) {
+        if(addr & 0x3) { return -EINVAL; }
+        Bucket* bucket = BucketOf(proc, addr);
+        int woken = 0;
+        unsigned long flags = save_irqdisable();
+        acquire(&bucket->mutex);
+        FutexWaiter* waiter = bucket->head;
+        while(waiter && (uint64_t)woken < count) {
+            FutexWaiter* next = waiter->next;
+            if(waiter->proc == proc && waiter->addr == addr) {
+                Remove(bucket, waiter);
+                woken++;
+            }
+            waiter = next;
+        }
+        release(&bucket->mutex);
+        irqrestore(flags);
+        return woken;
+    }
+
+    void Futex::cancel(Processes::Thread* thread) {
+        unsigned long flags = save_irqdisable();
+        FutexWaiter* waiter = thread->futex_waiter;
+        if(waiter) {
+            Bucket* bucket = BucketOf(waiter->proc, waiter->addr);
+            acquire(&bucket->mutex);
+            Remove(bucket, waiter);
+            release(&bucket->mutex);
+        }
+        irqrestore(flags);
+    }
+
+    void Futex::Remove(Bucket* bucket, FutexWaiter* waiter) {
+        for(FutexWaiter** link = &bucket->head; *link; link = &(*link)->next) {
+            if(*link != waiter) { continue; }
+            *link = waiter->next;
+            break;
+        }
+        waiter->thread->futex_waiter = NULL;
+        // Once woken is set, the waiter can return and its stack can be reused
+        Processes::Thread* thread = waiter->thread;
+        waiter->woken = true;
+        Processes::Scheduler::the().WakeUp(thread);
+    }
+
+    void Futex::TimerCallback(void* arg) {
+        Futex* futex = (Futex*)arg;
+        uint64_t now = Hardware::Timer::GetCurrentTimestamp();
+        if(now < futex->next_deadline) { return; }
+        // We are in the timer IRQ, so interrupts are already off
+        futex->next_deadline = ~0ULL;
+        for(size_t i = 0; i < bucket_count; i++) {
+            Bucket* bucket = &futex->buckets[i];
+            acquire(&bucket->mutex);
+            FutexWaiter* waiter = bucket->head;
+            while(waiter) {
+                FutexWaiter* next = waiter->next;
+                if(waiter->deadline && waiter->deadline <= now) {
+                    waiter->timed_out = true;
+                    futex->Remove(bucket, waiter);
+                } else if(waiter->deadline && waiter->deadline < futex->next_deadline) {
+                    futex->next_deadline = waiter->deadline;
+                }
+                waiter = next;
+            }
+            release(&bucket->mutex);
+        }
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <CPP/mutex.h>
+#include <processes/process.h>
+
+namespace Kernel {
+    // A thread sleeping on a futex. It lives on the stack of the waiting thread.
+    struct FutexWaiter {
+        Processes::Process* proc;
+        uint64_t addr;
+        Processes::Thread* thread;
+        // When the wait times out, 0 if it never does
+        uint64_t deadline;
+        volatile bool woken;
+        bool timed_out;
+        FutexWaiter* next;
+    };
+
+    // Userspace locks. A futex is an aligned 32 bit word in the memory of a process, and its threads can sleep on its
+    // address until another thread of the process wakes them. The kernel only gets involved when there is contention.
+    // Waiters are kept in a hash table keyed by process and address, so unrelated futexes rarely share a bucket.
+    // Futexes are private to a process, there is no shared memory yet.
+    class Futex {
+    public:
+        void Init();
+
+        // Sleep on addr if it still holds expected. timeout is in ms, 0 waits forever.
+        // Returns 0 once woken, -EAGAIN if the value did not match, -ETIMEDOUT, -EINVAL, -EFAULT, or -EINTR if the
+        // process is going away.
+        int wait(Processes::Process* proc, uint64_t addr, uint32_t expected, uint64_t timeout);
+        // Wake up to count threads sleeping on addr, the ones that waited the longest first. Returns how many were woken.
+        int wake(Processes::Process* proc, uint64_t addr, uint64_t count);
+        // End the wait of a thread early, because its process is going away
+        void cancel(Processes::Thread* thread);
+
+        static Futex& the() {
+            static Futex instance;
+            return instance;
+        }
+
+    private:
+        struct Bucket {
+            FutexWaiter* head = NULL;
+            // Taken with interrupts disabled, the timer wakes up waiters that time out
+            mutex_t mutex = 0;
+        };
+
+        Bucket* BucketOf(Processes::Process* proc, uint64_t addr);
+        // Unlink waiter and wake its thread. The bucket mutex must be held.
+        void Remove(Bucket* bucket, FutexWaiter* waiter);
+        // Wakes up waiters whose timeout ran out
+        static void TimerCallback(void* arg);
+
+        static const size_t bucket_count = 64;
+        Bucket buckets[bucket_count];
+        // Earliest deadline of all waiters
+        volatile uint64_t next_deadline = ~0ULL;
+    };
+}
+
+#endif
@@ -2,11 +2,67 @@
 #include <processes/process.h>
 #include <mem/VM/virtmem.h>
 #include <debug/serial.h>
+#include <kernel-drivers/VFS.h>
 
 namespace Kernel  {
 
 namespace Processes {
 
+int64_t Process::allocateFd(VFSTranslation* translation) {
+    acquire(&fd_lock);
+    // Reuse the lowest closed fd if we have one, otherwise take the next fresh one
+    int64_t fd;
+    if(free_fds.size()) {
+        fd = free_fds.at(free_fds.size() - 1);
+        free_fds.remove(free_fds.size() - 1);
+    } else {
+        fd = next_fd++;
+    }
+    // Grow the table if the fd does not fit
+    if((size_t)fd >= fd_table_capacity) {
+        size_t new_capacity = fd_table_capacity ? (fd_table_capacity * 2) : 16;
+        VFSTranslation** new_table = new VFSTranslation*[new_capacity];
+        memset(new_table, 0, new_capacity * sizeof(VFSTranslation*));
+        if(fd_table) {
+            memcopy(fd_table, new_table, fd_table_capacity * sizeof(VFSTranslation*));
+            delete[] fd_table;
+        }
+        fd_table = new_table;
+        fd_table_capacity = new_capacity;
+    }
+    translation->process_fd = fd;
+    fd_table[fd] = translation;
+    release(&fd_lock);
+    return fd;
+}
+
+Process::VFSTranslation* Process::takeFd(int64_t local_fd) {
+    acquire(&fd_lock);
+    if(local_fd < 0 || (size_t)local_fd >= fd_table_capacity || !fd_table[local_fd]) {
+        release(&fd_lock);
+        return NULL;
+    }
+    VFSTranslation* translation = fd_table[local_fd];
+    fd_table[local_fd] = NULL;
+    // Keep the free list sorted, there are rarely more than a few holes
+    size_t pos = 0;
+    while(pos < free_fds.size() && free_fds.at(pos) > local_fd) { pos++; }
+    free_fds.insert(pos, local_fd);
+    release(&fd_lock);
+    return translation;
+}
+
+void Process::putFd(VFSTranslation* translation) {
+    acquire(&fd_lock);
+    bool last = --translation->ref_count == 0;
+    release(&fd_lock);
+    // The global fd stays open until the last syscall using it is done, so its id cant be handed out again under it
+    if(last) {
+        VFS::the().close(translation->global_fd, pid);
+        delete translation;
+    }
+}
+
 bool Process::attemptCopyFromUser(uint64_t user_pointer, size_t size, void* destination) {
     // If the top bit is set, then the address can not point to user memory
     if(user_pointer & (1UL << 63)) { return false; }
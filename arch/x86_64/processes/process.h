@@ -4,28 +4,68 @@
 #include <CPP/vector.h>
 #include <mem/VM/virtmem.h>
 #include <mem/PM/physalloc.h>
-#include <hardware/cpu.h>
+#include <CPP/mutex.h>
 
 namespace Kernel {
+    struct FutexWaiter;
+    class WaitQueue;
+
     namespace Processes {
+        // Scheduling classes, in the order they get to run. See Scheduler::PickNext.
+        enum class SchedPolicy {
+            Fair = 0, // Shares the CPU by weight, which nice sets
+            FIFO, // Real time, runs until it blocks or something with a higher priority can run
+            RoundRobin, // Real time, like FIFO, but takes turns with threads of the same priority
+            Idle, // Only runs when nothing else can
+        };
+
         // Actual execution thing
         struct Thread {
             int tid;
-            Hardware::Registers regs;
+            // Stack pointer saved by switch_to while the thread is switched out.
+            // Everything else the thread needs to continue is on its kernel stack.
+            uint64_t kernel_rsp = 0;
             // TCB Base
-            uint64_t tcb_base;
+            uint64_t tcb_base = 0;
             enum class BlockState {
                 Running = 0,
                 WaitingOnMessage,
                 WaitingOnIRQ, // A Driver this thread has called into is waiting on a IRQ
                 ShouldDestroy,
                 ProcessActionBusy, // A critical action is being taken with the process
+                Sleeping, // A kernel task waiting for Scheduler::WakeUp
+                Exited, // A user thread that exited, kept until it is joined
             };
             BlockState blocked;
 
             uint64_t irq; // The IRQ this thread is waiting on if it is waiting.
 
-            // Syscall stack mapping.
+            SchedPolicy policy = SchedPolicy::Fair;
+            int nice = 0; // -20 to 19, for the fair and idle classes
+            int rt_priority = 0; // 1 to 99, for the real time classes. Higher runs first.
+            uint64_t time_slice = 0; // In ms, 0 uses the default of the class
+            // Runtime weighted by nice, in us. The fair class runs the thread that has the least.
+            uint64_t vruntime = 0;
+            // How long it ran since it was picked, in ms
+            uint64_t slice_used = 0;
+            // Preempt count while the thread is switched out
+            int preempt_count = 0;
+
+            int64_t exit_code = 0;
+            // The thread this one waits on to exit, -1 if none
+            int join_tid = -1;
+            // Set while it sleeps on a futex
+            FutexWaiter* futex_waiter = NULL;
+            // Set while it sleeps on a kernel lock
+            WaitQueue* wait_queue = NULL;
+            // Set when its process is killed or execs. The thread exits the next time it returns to user mode, where it
+            // holds nothing, so it is never freed in the middle of a syscall.
+            bool should_exit = false;
+            // Whether it ever ran. One that did not has nothing in the kernel to unwind, and can be freed right away.
+            bool started = false;
+
+            // Kernel stack mapping. Interrupts and syscalls from user mode land on it, and a thread that is switched out
+            // keeps its state on it. For kernel threads, this is their only stack.
             // This is specific to each thread, and is not in process mappings.
             // It will be deallocated when a thread is killed.
             VM::VMObject* syscall_stack_map;
@@ -46,6 +86,8 @@ namespace Kernel {
             char* name;
             uint64_t page_table;
             Vector<Thread*> threads;
+            // The main thread is 0
+            int next_tid = 1;
             // Store the base address of all mappings.
             // TODO: find a way to deallocate memory
             Vector<VM::VMObject*> mappings;
@@ -102,42 +144,39 @@ namespace Kernel {
                 int64_t process_fd = 0;
 
                 size_t pos = 0;
+                // The fd table holds one, and every syscall using it holds another until it is done
+                size_t ref_count = 1;
 
                 VFSTranslation(int64_t _global_fd, int64_t _process_fd) : global_fd(_global_fd), process_fd(_process_fd) { }
                 VFSTranslation() = default;
             };
 
-            // The table to convert process VFS to driver VFS
-            Vector<VFSTranslation*>* fd_translation_table = NULL;
-            int* fd_translation_table_ref_count = NULL;
-            
-            int64_t getLowestVFSInt() {
-                int64_t lowest = 0;
-                restart_loop:
-                for(size_t i = 0; i < fd_translation_table->size(); i++) {
-                    if(fd_translation_table->at(i)->process_fd == lowest) { lowest++; goto restart_loop; }
-                }
-                return lowest;
-            }
+            // The table to convert process VFS to driver VFS, indexed by process fd. Like the table of the VFS it grows as
+            // needed, but closed fds are handed out again lowest first, as unix programs expect.
+            VFSTranslation** fd_table = NULL;
+            size_t fd_table_capacity = 0;
+            // Closed fds below next_fd, sorted so the lowest is at the end
+            Vector<int64_t> free_fds;
+            // Lowest fd that was never handed out
+            int64_t next_fd = 0;
+            mutex_t fd_lock = 0;
+
+            // Put translation at the lowest free fd, and return it
+            int64_t allocateFd(VFSTranslation* translation);
 
+            // Look up local_fd and take a reference to it, which has to be given back with putFd()
             VFSTranslation* getGlobalFd(int64_t local_fd) {
-                for(size_t i = 0; i < fd_translation_table->size(); i++) {
-                    if(fd_translation_table->at(i)->process_fd == local_fd) {
-                        return fd_translation_table->at(i);
-                    }
-                }
-                return NULL;
+                acquire(&fd_lock);
+                VFSTranslation* translation = (local_fd < 0 || (size_t)local_fd >= fd_table_capacity) ? NULL : fd_table[local_fd];
+                if(translation) { translation->ref_count++; }
+                release(&fd_lock);
+                return translation;
             }
+            void putFd(VFSTranslation* translation);
 
-            void deleteFd(VFSTranslation* fd) {
-                for(size_t i = 0; i < fd_translation_table->size(); i++) {
-                    if(fd_translation_table->at(i) == fd) {
-                        delete fd;
-                        fd_translation_table->remove(i);
-                        return;
-                    }
-                }
-            }
+            // Remove local_fd from the table, so it can be handed out again. The reference of the table goes to the caller.
+            // Returns NULL if it was not open.
+            VFSTranslation* takeFd(int64_t local_fd);
 
             bool attempt_destroy = false;
         };
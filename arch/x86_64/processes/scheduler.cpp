@@ -11,14 +11,30 @@
 #include <processes/syscalls/syscall.h>
 #include <errno.h>
 #include <kernel-drivers/VFS.h>
+#include <softirq.h>
+#include <processes/futex.h>
+#include <processes/sync.h>
+
+extern "C" void switch_to(uint64_t* prev_rsp, uint64_t next_rsp);
+extern "C" void interrupt_return();
 
 namespace Kernel {
     namespace Processes {
         void Scheduler::Init() {
-            // TODO
+            // The kernel process is PID 0, and is scheduled first
+            kernel_process = new Processes::Process();
+            kernel_process->page_table = VM::CreateNewPageTable();
+            kernel_process->is_kernel = true;
+            kernel_process->name = new char[7];
+            memcopy((void*)"kernel", kernel_process->name, 7);
+            kernel_process->pid = 0;
+            kernel_process->parent = 0;
+            processes.push_back(kernel_process);
+            idle_thread = CreateKernelThread(IdleTask, NULL, 4);
         }
         int64_t Scheduler::CreateProcessImpl(uint8_t* data, size_t length, char** argv, int argc, char** envp, int envc, const char* working_dir, bool init) {
-            acquire(&mutex);
+            // Loading the interpreter and opening the standard files goes through the VFS, which can sleep.
+            // So the process is built without the lock, and only taken to hand out the pid and publish the thread.
             // Sanity checks
             if(!argv) { return -EINVAL; }
             if(!envp) { return -EINVAL; }
@@ -29,7 +45,6 @@ namespace Kernel {
             ELF* intr_elf = NULL;
             if(!proc_elf->readHeader()) {
                 KLog::the().printf("Failed to load ELF file for process %s\r\n", argv[0]);
-                release(&mutex);
                 return -EINVAL;
             }
             // If this is a dynamic executable, we need to load the dynamic relocator
@@ -45,8 +60,7 @@ namespace Kernel {
                 if(ld_fd < 0) {
                     KLog::the().printf("Error executing ELF file %s: interpreter %s doesnt exist\n\r", argv[0], proc_elf->interpreterPath);
                     delete proc_elf;
-                    release(&mutex);
-                    return -EINVAL;
+                        return -EINVAL;
                 }
                 size_t int_length = VFS::the().size(ld_fd, -1);
                 uint8_t* int_data = new uint8_t[int_length];
@@ -57,8 +71,7 @@ namespace Kernel {
                     KLog::the().printf("Failed to load ELF header for ld\n\r");
                     delete proc_elf;
                     delete intr_elf;
-                    release(&mutex);
-                    return -EINVAL;
+                        return -EINVAL;
                 }
                 is_interpreter = true;
             }
@@ -66,6 +79,8 @@ namespace Kernel {
             // Create process
             Process* new_proc = new Process;
             new_proc->page_table = VM::CreateNewPageTable();
+            // Adding the process reserves its pid. It has no threads yet, so the scheduler passes over it.
+            Lock();
             if(init) {
                 ASSERT(!init_spawned, "CreateProcessImpl called with init after init has been spawned");
                 new_proc->pid = 0;
@@ -73,6 +88,8 @@ namespace Kernel {
             } else {
                 new_proc->pid = GetNextPid();
             }
+            processes.push_back(new_proc);
+            Unlock();
             // Set the parent
             new_proc->parent = 0;
             // Create the string in it, and copy the given name over
@@ -90,6 +107,8 @@ namespace Kernel {
             
             // We want to save the current page table, as we need to switch to it later
             uint64_t curr_page_table = VM::CurrentPageTable();
+            // Switching back to us would load our own page table again, so stay on the CPU until we are done with the new one
+            PreemptDisable();
             // Switch into new page table
             SwitchPageTables(new_proc->page_table);
 
@@ -129,42 +148,37 @@ namespace Kernel {
 
             // The sections have been copied out, we can now switch the page table back
             SwitchPageTables(curr_page_table);
+            PreemptEnable();
 
             // Initialize main thread
             Thread* main_thread = new Thread;
             main_thread->tid = 0;
-            if(is_interpreter) {
-                main_thread->regs.rip = intr_elf->file_entry + 0x40000000;
-            } else {
-                main_thread->regs.rip = proc_elf->file_entry + (proc_elf->file_base ? 0 : 0x4000000);
-            }
-            main_thread->regs.rflags = 0x202;
-            main_thread->regs.cs = 0x18 | 0b11;
-            main_thread->regs.ss = 0x20 | 0b11;
             main_thread->blocked = Thread::BlockState::Running;
-            main_thread->regs.page_table = new_proc->page_table;
-
+            main_thread->vruntime = min_vruntime;
             main_thread->stack_base = stack_base;
             main_thread->stack_size = stack_size;
-            main_thread->regs.rsp = proc_rsp; // -16 for the two pointers on the stack
-            main_thread->regs.rdi = argc;
-            main_thread->regs.rsi = 0;
-            main_thread->regs.rdx = 0;
-            main_thread->regs.rcx = envc;
-            
-            // Create syscall thread stack
+
+            // Create kernel stack
             // TODO: guard pages
             VM::VMObject* syscall_stack = new VM::VMObject(true, false);
             syscall_stack->base = (uint64_t)VM::AllocatePages(4);
             syscall_stack->size = 4 * 4096;
             main_thread->syscall_stack_map = syscall_stack;
 
-            // Initialize process FD table
-            new_proc->fd_translation_table = new Vector<Process::VFSTranslation*>;
-            new_proc->fd_translation_table_ref_count = new int;
-
-            // Attach thread to new process
-            new_proc->threads.push_back(main_thread);
+            // The thread starts by "returning" to the entry point
+            Interrupts::ISRRegisters frame = { };
+            if(is_interpreter) {
+                frame.rip = intr_elf->file_entry + 0x40000000;
+            } else {
+                frame.rip = proc_elf->file_entry + (proc_elf->file_base ? 0 : 0x4000000);
+            }
+            frame.rflags = 0x202;
+            frame.cs = 0x18 | 0b11;
+            frame.ss = 0x20 | 0b11;
+            frame.rsp = proc_rsp; // -16 for the two pointers on the stack
+            frame.rdi = argc;
+            frame.rcx = envc;
+            PrepareStack(main_thread, &frame, syscall_stack->base + syscall_stack->size);
 
             // Init basic files
             // (I/O)
@@ -173,9 +187,11 @@ namespace Kernel {
             SyscallHandler::the().open("/dev/tty1", 3, new_proc);
             SyscallHandler::the().open("/dev/tty1", 3, new_proc);
 
-            // Add process
-            processes.push_back(new_proc);
-            release(&mutex);
+            // Attach thread to new process, which lets it run
+            Lock();
+            new_proc->threads.push_back(main_thread);
+            CheckPreempt(main_thread);
+            Unlock();
             return new_proc->pid;
         }
 
@@ -293,46 +309,74 @@ namespace Kernel {
         }
 
         int Scheduler::CreateKernelTask(void (*start)(void*), void* arg, uint64_t stack_size) {
-            acquire(&mutex);
-            Processes::Process* proc = new Processes::Process;
-            proc->page_table = VM::CreateNewPageTable();
-            proc->is_kernel = true;
-            proc->name = new char[8];
-            proc->pid = GetNextPid();
-            // Set the parent
-            proc->parent = 0;
-            // Copy the name
-            memcopy((void*)"kworker", proc->name, 8);
+            Lock();
+            Thread* thread = CreateKernelThread(start, arg, stack_size);
+            Unlock();
+            return thread->tid;
+        }
+
+        Thread* Scheduler::CreateKernelThread(void (*start)(void*), void* arg, uint64_t stack_size) {
             // Init thread
             Thread* thread = new Processes::Thread;
-            thread->stack_size = stack_size * 1024;
-            thread->stack_base = (uint64_t)VM::AllocatePages(stack_size);
-            thread->tid = 0;
-            thread->regs.page_table = proc->page_table;
-            thread->regs.rflags = 0x202;
-            thread->regs.cs = 0x8;
-            thread->regs.ss = 0x10;
-            thread->regs.rip = (uint64_t)start;
-            thread->regs.rdi = (uint64_t)arg;
-            thread->regs.rsp = thread->stack_base + thread->stack_size;
+            thread->tid = next_kernel_tid++;
             thread->blocked = Thread::BlockState::Running;
-            
-            // Create interrupt stack
-            VM::VMObject* intr_stack = new VM::VMObject(true, false);
-            intr_stack->base = (uint64_t)VM::AllocatePages(4);
-            intr_stack->size = 4 * 4096;
-            thread->syscall_stack_map = intr_stack;
+            thread->vruntime = min_vruntime;
+
+            // Kernel threads run on their kernel stack
+            VM::VMObject* stack = new VM::VMObject(true, false);
+            stack->base = (uint64_t)VM::AllocatePages(stack_size);
+            stack->size = stack_size * 4096;
+            thread->syscall_stack_map = stack;
+            thread->stack_base = stack->base;
+            thread->stack_size = stack->size;
+
+            // start gets called with KernelTaskReturn as return address, on a stack aligned like after a call
+            uint64_t top = stack->base + stack->size;
+            *(uint64_t*)(top - 8) = (uint64_t)KernelTaskReturn;
+            Interrupts::ISRRegisters frame = { };
+            frame.rflags = 0x202;
+            frame.cs = 0x8;
+            frame.ss = 0x10;
+            frame.rip = (uint64_t)start;
+            frame.rdi = (uint64_t)arg;
+            frame.rsp = top - 8;
+            PrepareStack(thread, &frame, top - 16);
+
+            kernel_process->threads.push_back(thread);
+            CheckPreempt(thread);
+            return thread;
+        }
 
-            // Add thread
-            proc->threads.push_back(thread);
-            // Add process
-            processes.push_back(proc);
-            release(&mutex);
-            return proc->pid;
+        void Scheduler::PrepareStack(Thread* thread, Interrupts::ISRRegisters* frame, uint64_t top) {
+            uint64_t frame_base = top - sizeof(Interrupts::ISRRegisters);
+            *(Interrupts::ISRRegisters*)frame_base = *frame;
+            // What switch_to pops: rbp, rbx and r12-r15, then the address it returns to
+            uint64_t* stack = (uint64_t*)frame_base;
+            *--stack = (uint64_t)interrupt_return;
+            for(int i = 0; i < 6; i++) { *--stack = 0; }
+            thread->kernel_rsp = (uint64_t)stack;
+        }
+
+        void Scheduler::KernelTaskReturn() {
+            the().ExitCurrentThread();
+        }
+
+        void Scheduler::IdleTask(void* arg) {
+            for(;;) { asm volatile("sti; hlt"); }
+            (void)arg;
+        }
+
+        void Scheduler::ExitCurrentThread() {
+            // The scheduler frees the thread once it comes across it while running on another stack
+            asm volatile("cli");
+            CurrentThread()->blocked = Thread::BlockState::ShouldDestroy;
+            Schedule();
+            Debug::Panic("Exited thread got scheduled");
+            for(;;);
         }
 
         int64_t Scheduler::ForkCurrent(Interrupts::ISRRegisters* regs) {
-            acquire(&mutex);
+            Lock();
             // Create new process
             Processes::Process* new_proc = new Processes::Process();
             Processes::Process* curr_proc = CurrentProcess();
@@ -362,64 +406,167 @@ namespace Kernel {
                 new_proc->mappings.push_back(new_obj);
             }
 
-            // Copy the file descriptors
-            new_proc->fd_translation_table = new Vector<Process::VFSTranslation*>;
-            for(size_t i = 0; i < curr_proc->fd_translation_table->size(); i++) {
+            // Copy the file descriptors. The child gets the same fds, holes included.
+            acquire(&curr_proc->fd_lock);
+            new_proc->fd_table_capacity = curr_proc->fd_table_capacity;
+            new_proc->fd_table = new Process::VFSTranslation*[new_proc->fd_table_capacity];
+            memset(new_proc->fd_table, 0, new_proc->fd_table_capacity * sizeof(Process::VFSTranslation*));
+            for(size_t i = 0; i < curr_proc->fd_table_capacity; i++) {
+                Process::VFSTranslation* parent_translation = curr_proc->fd_table[i];
+                if(!parent_translation) { continue; }
                 Process::VFSTranslation* translation = new Process::VFSTranslation;
-                translation->process_fd = curr_proc->fd_translation_table->at(i)->process_fd;
-                translation->pos = curr_proc->fd_translation_table->at(i)->pos;
-                translation->global_fd = VFS::the().copy_descriptor(curr_proc->fd_translation_table->at(i)->global_fd, new_proc->pid);
-                new_proc->fd_translation_table->push_back(translation);
+                translation->process_fd = parent_translation->process_fd;
+                translation->pos = parent_translation->pos;
+                translation->global_fd = VFS::the().copy_descriptor(parent_translation->global_fd, new_proc->pid);
+                new_proc->fd_table[i] = translation;
             }
+            for(size_t i = 0; i < curr_proc->free_fds.size(); i++) { new_proc->free_fds.push_back(curr_proc->free_fds.at(i)); }
+            new_proc->next_fd = curr_proc->next_fd;
+            release(&curr_proc->fd_lock);
 
             // Create the new thread
             Thread* main_thread = new Thread();
-            // Very fun code
-            main_thread->regs.rax = 0;
-            main_thread->regs.rbp = regs->rbp;
-            main_thread->regs.rbx = regs->rbx;
-            main_thread->regs.rcx = regs->rcx;
-            main_thread->regs.rdi = regs->rdi;
-            main_thread->regs.rdx = regs->rdx;
-            main_thread->regs.rip = regs->rip;
-            main_thread->regs.rsi = regs->rsi;
-            main_thread->regs.rsp = regs->rsp;
-            main_thread->regs.r8 = regs->r8;
-            main_thread->regs.r9 = regs->r9;
-            main_thread->regs.r10 = regs->r10;
-            main_thread->regs.r11 = regs->r11;
-            main_thread->regs.r12 = regs->r12;
-            main_thread->regs.r13 = regs->r13;
-            main_thread->regs.r14 = regs->r14;
-            main_thread->regs.r15 = regs->r15;
-            main_thread->regs.rflags = regs->rflags;
-            main_thread->regs.cs = regs->cs;
-            main_thread->regs.ss = regs->ss;
-            main_thread->regs.page_table = new_proc->page_table;
-
-            // Create syscall thread stack
+            Thread* curr_t = CurrentThread();
+            main_thread->tcb_base = curr_t->tcb_base;
+            main_thread->stack_base = curr_t->stack_base;
+            main_thread->stack_size = curr_t->stack_size;
+            // The child inherits the scheduling class, and starts with the same vruntime so forking gains nothing
+            main_thread->policy = curr_t->policy;
+            main_thread->nice = curr_t->nice;
+            main_thread->rt_priority = curr_t->rt_priority;
+            main_thread->time_slice = curr_t->time_slice;
+            main_thread->vruntime = curr_t->vruntime;
+
+            // Create kernel stack
             // TODO: guard pages
             VM::VMObject* syscall_stack = new VM::VMObject(true, false);
             syscall_stack->base = (uint64_t)VM::AllocatePages(4);
             syscall_stack->size = 4 * 4096;
             main_thread->syscall_stack_map = syscall_stack;
 
+            // The child returns from the same syscall, with 0 as result
+            Interrupts::ISRRegisters frame = *regs;
+            frame.rax = 0;
+            PrepareStack(main_thread, &frame, syscall_stack->base + syscall_stack->size);
+
             new_proc->threads.push_back(main_thread);
             processes.push_back(new_proc);
-            release(&mutex);
+            CheckPreempt(main_thread);
+            Unlock();
             return new_proc->pid;
         }
 
+        int64_t Scheduler::CreateThread(uint64_t entry, uint64_t stack, uint64_t arg, uint64_t tcb) {
+            if((entry | stack) & (1UL << 63)) { return -EINVAL; }
+            Lock();
+            Process* proc = CurrentProcess();
+            Thread* curr_t = CurrentThread();
+            // The process is going away, or execs
+            if(curr_t->should_exit) {
+                Unlock();
+                return -EINTR;
+            }
+            Thread* thread = new Thread;
+            thread->tid = proc->next_tid++;
+            thread->blocked = Thread::BlockState::Running;
+            thread->tcb_base = tcb;
+            // Userspace owns the stack
+            thread->stack_base = stack;
+            thread->stack_size = 0;
+            // The new thread inherits the scheduling class, and starts level with its creator
+            thread->policy = curr_t->policy;
+            thread->nice = curr_t->nice;
+            thread->rt_priority = curr_t->rt_priority;
+            thread->time_slice = curr_t->time_slice;
+            thread->vruntime = curr_t->vruntime;
+
+            // Create kernel stack
+            // TODO: guard pages
+            VM::VMObject* syscall_stack = new VM::VMObject(true, false);
+            syscall_stack->base = (uint64_t)VM::AllocatePages(4);
+            syscall_stack->size = 4 * 4096;
+            thread->syscall_stack_map = syscall_stack;
+
+            Interrupts::ISRRegisters frame = { };
+            frame.rip = entry;
+            frame.rflags = 0x202;
+            frame.cs = 0x18 | 0b11;
+            frame.ss = 0x20 | 0b11;
+            frame.rsp = stack;
+            frame.rdi = arg;
+            PrepareStack(thread, &frame, syscall_stack->base + syscall_stack->size);
+
+            proc->threads.push_back(thread);
+            CheckPreempt(thread);
+            Unlock();
+            return thread->tid;
+        }
+
+        void Scheduler::ExitThread(int64_t code) {
+            asm volatile("cli");
+            Process* proc = CurrentProcess();
+            Thread* curr_t = CurrentThread();
+            bool last = true;
+            for(size_t i = 0; i < proc->threads.size(); i++) {
+                Thread* thread = proc->threads.at(i);
+                if(thread == curr_t) { continue; }
+                if(!IsParked(thread)) { last = false; }
+                // Wake up whoever is joining us
+                if(thread->join_tid == curr_t->tid) { WakeUp(thread); }
+            }
+            if(last) {
+                KLog::the().printf("Process %i exited with code %i\r\n", proc->pid, code);
+                KillCurrentProcess();
+                ExitCurrent();
+            }
+            curr_t->exit_code = code;
+            curr_t->blocked = Thread::BlockState::Exited;
+            // This never returns, the thread is gone
+            Schedule();
+            Debug::Panic("Exited thread got scheduled");
+            for(;;);
+        }
+
+        int Scheduler::JoinThread(int tid, int64_t* code) {
+            Thread* curr_t = CurrentThread();
+            if(tid == curr_t->tid) { return -EDEADLK; }
+            unsigned long flags = save_irqdisable();
+            Process* proc = CurrentProcess();
+            for(;;) {
+                if(curr_t->should_exit) {
+                    irqrestore(flags);
+                    return -EINTR;
+                }
+                Thread* target = NULL;
+                for(size_t i = 0; i < proc->threads.size(); i++) {
+                    Thread* thread = proc->threads.at(i);
+                    if(thread->tid == tid && thread->blocked != Thread::BlockState::ShouldDestroy) { target = thread; }
+                }
+                if(!target) {
+                    irqrestore(flags);
+                    return -ESRCH;
+                }
+                if(target->blocked == Thread::BlockState::Exited) {
+                    *code = target->exit_code;
+                    // Now it can be freed
+                    target->blocked = Thread::BlockState::ShouldDestroy;
+                    irqrestore(flags);
+                    return 0;
+                }
+                curr_t->join_tid = tid;
+                SleepCurrent();
+                curr_t->join_tid = -1;
+            }
+        }
+
         int Scheduler::Exec(uint8_t* data, size_t length, char** argv, int argc, char** envp, int envc, Interrupts::ISRRegisters* regs) {
             // We forbid all threads other than thread 0 to perform an exec
             if(curr_thread != 0) { return -EFAULT; }
-            acquire(&mutex);
-            // Try to load the elf file from data
+            // Try to load the elf file from data. The interpreter is read through the VFS, so this happens before taking the lock.
             ELF* proc_elf = new ELF(data, length);
             ELF* intr_elf = NULL;
             if(!proc_elf->readHeader()) {
                 KLog::the().printf("Failed to load ELF file for process %s\r\n", argv[0]);
-                release(&mutex);
                 return -EINVAL;
             }
             // If this is a dynamic executable, we need to load the dynamic relocator
@@ -435,8 +582,7 @@ namespace Kernel {
                 if(ld_fd < 0) {
                     KLog::the().printf("Error executing ELF file %s: interpreter %s doesnt exist\n\r", argv[0], proc_elf->interpreterPath);
                     delete proc_elf;
-                    release(&mutex);
-                    return -EINVAL;
+                        return -EINVAL;
                 }
                 size_t int_length = VFS::the().size(ld_fd, -1);
                 uint8_t* int_data = new uint8_t[int_length];
@@ -447,27 +593,38 @@ namespace Kernel {
                     KLog::the().printf("Failed to load ELF header for ld\n\r");
                     delete proc_elf;
                     delete intr_elf;
-                    release(&mutex);
-                    return -EINVAL;
+                        return -EINVAL;
                 }
                 is_interpreter = true;
             }
 
             Process* current_proc = CurrentProcess();
-            // Kill all threads other than thread zero
-            for(size_t i = 1; i < current_proc->threads.size(); i++) {
-                current_proc->threads.at(i)->blocked = Thread::BlockState::ProcessActionBusy;
+            Thread* curr_t = CurrentThread();
+            // Kill all threads other than thread zero. They might be inside the kernel, so have them exit on their way back
+            // to user mode and wait until all of them did. Threads they create meanwhile get marked on the next round.
+            for(;;) {
+                unsigned long flags = save_irqdisable();
+                bool parked = true;
+                for(size_t i = 0; i < current_proc->threads.size(); i++) {
+                    Thread* thread = current_proc->threads.at(i);
+                    if(thread == curr_t) { continue; }
+                    MarkForExit(thread);
+                    if(!IsParked(thread)) { parked = false; }
+                }
+                irqrestore(flags);
+                if(parked) { break; }
+                Yield();
             }
-            
-            // Yeet out all the memory this process is currently using
-            current_proc->deleteAllMemory();
+
             // Delete all threads other than thread zero
+            Lock();
             while(current_proc->threads.size() > 1) {
-                Thread* thread_to_destroy = current_proc->threads.at(1);
-                VM::FreePages((void*)thread_to_destroy->syscall_stack_map->base, thread_to_destroy->syscall_stack_map->size / 4096);
-                delete thread_to_destroy;
+                FreeThread(current_proc->threads.at(1));
                 current_proc->threads.remove(1);
             }
+            Unlock();
+            // Yeet out all the memory this process is currently using
+            current_proc->deleteAllMemory();
 
             // Map the main elf file
             if(is_interpreter) {
@@ -516,147 +673,373 @@ namespace Kernel {
             regs->rsi = 0;
             regs->rdx = 0;
             regs->rcx = envc;
-
-            release(&mutex);
             return 0;
         }
 
-        void Scheduler::SaveContext(Interrupts::ISRRegisters* regs) {
-            if(running_proc_killed || running_thread_killed) { return; } // Dont try to save the context if the running process got killed
-            Process* curr_p = processes.at(curr_proc);
-            Thread* curr_t = curr_p->threads.at(curr_thread);
-
-            // Very fun code
-            curr_t->regs.rax = regs->rax;
-            curr_t->regs.rbp = regs->rbp;
-            curr_t->regs.rbx = regs->rbx;
-            curr_t->regs.rcx = regs->rcx;
-            curr_t->regs.rdi = regs->rdi;
-            curr_t->regs.rdx = regs->rdx;
-            curr_t->regs.rip = regs->rip;
-            curr_t->regs.rsi = regs->rsi;
-            curr_t->regs.rsp = regs->rsp;
-            curr_t->regs.r8 = regs->r8;
-            curr_t->regs.r9 = regs->r9;
-            curr_t->regs.r10 = regs->r10;
-            curr_t->regs.r11 = regs->r11;
-            curr_t->regs.r12 = regs->r12;
-            curr_t->regs.r13 = regs->r13;
-            curr_t->regs.r14 = regs->r14;
-            curr_t->regs.r15 = regs->r15;
-            curr_t->regs.rflags = regs->rflags;
-            curr_t->regs.cs = regs->cs;
-            curr_t->regs.ss = regs->ss;
-            curr_t->regs.page_table = VM::CurrentPageTable();
-        }
-
-        void Scheduler::Schedule(Interrupts::ISRRegisters* regs) {
-            running_proc_killed = false;
-            // Increment tid
-            begin:
-            curr_thread++;
-            begin_no_increment:
-
+        void Scheduler::Schedule() {
+            Thread* prev = current;
+            need_resched = false;
+            Reap(prev);
             // Make sure PID 0 is scheduled first
-            if(!first_schedule_complete) { curr_proc = 0; curr_thread = 0; first_schedule_complete = true; }
-            
-            ASSERT(processes.size(), "No processes");
+            if(!first_schedule_complete) {
+                curr_proc = 0;
+                curr_thread = 0;
+                first_schedule_complete = true;
+            } else {
+                curr_thread++;
+            }
+            Thread* next = PickNext();
+            yielded = NULL;
+            if(!next) {
+                // Nothing can run, idle until a IRQ wakes something up
+                next = idle_thread;
+                current_slice = min_granularity;
+                curr_proc = 0;
+                for(size_t i = 0; i < kernel_process->threads.size(); i++) {
+                    if(kernel_process->threads.at(i) == idle_thread) { curr_thread = i; }
+                }
+            }
+            next->slice_used = 0;
+            SwitchTo(prev, next);
+        }
 
-            // Check if we have overflowed the available processes
-            if(curr_proc >= processes.size()) { curr_proc = 0; curr_thread = 0; }
-            Process* proc = processes.at(curr_proc);
-            
-            // Check if this process should actually still exist
-            if(proc->attempt_destroy) {
-                // Check if we share a stack with any of the threads
-                // Demap all the stacks and delete all threads
-                bool unmapped_everything = true;
-                for(size_t i = 0; i < proc->threads.size(); i++) {
-                    Thread* thread = proc->threads.at(i);
-                    if(!thread->syscall_stack_map->base) { continue; }
-                    // Check if we are currently using this stack (lol)
-                    uint64_t curr_frame = (uint64_t)__builtin_frame_address(0);
-                    if(thread->syscall_stack_map->base <= curr_frame && (thread->syscall_stack_map->base + thread->syscall_stack_map->size) >= curr_frame) {
-                        unmapped_everything = false;
-                    } else {
-                        VM::FreePages((void*)thread->syscall_stack_map->base, thread->syscall_stack_map->size / 4096);
-                        delete thread;
+        void Scheduler::Reap(Thread* prev) {
+            size_t p = 0;
+            while(p < processes.size()) {
+                Process* proc = processes.at(p);
+                // Check if this process should actually still exist
+                if(proc->attempt_destroy) {
+                    if(ReapProcess(proc, prev)) {
+                        delete proc;
+                        processes.remove(p);
+                        continue;
                     }
+                    p++;
+                    continue;
                 }
-                if(unmapped_everything) {
-                    delete proc;
-                    processes.remove(curr_proc);
-                } else {
-                    curr_proc++;
-                    curr_thread = 0;
+                // Check if any threads should be destroyed. If we are running on one, it has to wait until we switched away.
+                size_t t = 0;
+                while(t < proc->threads.size()) {
+                    Thread* thread = proc->threads.at(t);
+                    if(thread->blocked == Thread::BlockState::ShouldDestroy && thread != prev) {
+                        FreeThread(thread);
+                        proc->threads.remove(t);
+                        continue;
+                    }
+                    t++;
                 }
-                goto begin_no_increment;
-            }
-
-            // Check if we have overflowed the available threads
-            if(curr_thread >= proc->threads.size()) { curr_thread = 0; curr_proc++; goto begin_no_increment; }
-            Thread* thread = proc->threads.at(curr_thread);
-
-            // Check if this thread should be destroyed
-            if(thread->blocked == Thread::BlockState::ShouldDestroy) {
-                VM::FreePages((void*)thread->syscall_stack_map->base, thread->syscall_stack_map->size / 4096);
-                delete thread;
-                proc->threads.remove(curr_thread);
-                goto begin;
-            } else if(thread->blocked == Thread::BlockState::WaitingOnMessage && proc->msg_count) {
-                // This thread is blocked waiting for a IPC message, and we got one
-                size_t msg_size = proc->nextMessageSize();
-                if(msg_size > thread->regs.rcx) {
-                    // This message is bigger than the buffer, set error and unblock
-                    thread->regs.rax = -E2BIG;
-                    thread->blocked = Thread::BlockState::Running;
-                } else {
-                    // We can copy this message to the process
-                    if(!proc->attemptCopyToUser(thread->regs.rbx, msg_size, proc->buffer)) {
-                        // Copy failed
-                        thread->regs.rax = -EINVAL;
-                    } else {
-                        // Copy succeded
-                        thread->regs.rax = msg_size;
+                p++;
+            }
+        }
+
+        // Weights of the nice values, from -20 to 19. Every step is about 10% more or less CPU time.
+        static const uint64_t nice_weights[40] = {
+            88761, 71755, 56483, 46273, 36291,
+            29154, 23254, 18705, 14949, 11916,
+            9548, 7620, 6100, 4904, 3906,
+            3121, 2501, 1991, 1586, 1277,
+            1024, 820, 655, 526, 423,
+            335, 272, 215, 172, 137,
+            110, 87, 70, 56, 45,
+            36, 29, 23, 18, 15
+        };
+        static const uint64_t nice_0_weight = 1024;
+        static const uint64_t idle_class_weight = 3;
+
+        uint64_t Scheduler::Weight(Thread* thread) {
+            if(thread->policy == SchedPolicy::Idle) { return idle_class_weight; }
+            return nice_weights[thread->nice + 20];
+        }
+
+        // How a class ranks against the others
+        static int ClassRank(Thread* thread) {
+            switch(thread->policy) {
+                case SchedPolicy::FIFO:
+                case SchedPolicy::RoundRobin: return 2;
+                case SchedPolicy::Fair: return 1;
+                default: return 0;
+            }
+        }
+
+        Thread* Scheduler::PickNext() {
+            ASSERT(processes.size(), "No processes");
+            // Real time threads go first, the highest priority first. Then the fair thread with the least vruntime, and
+            // then the idle class the same way. Every thread is visited once, starting after the last one that ran,
+            // so that threads of equal standing take turns.
+            Thread* best_rt = NULL;
+            Thread* best_fair = NULL;
+            Thread* best_idle = NULL;
+            size_t rt_pos[2], fair_pos[2], idle_pos[2], yielded_pos[2];
+            bool yielded_runnable = false;
+            uint64_t fair_weight = 0;
+            uint64_t idle_weight = 0;
+            // Sleepers only get credit for half a period
+            uint64_t credit = sched_latency * 1000 / 2;
+            uint64_t vruntime_floor = (min_vruntime > credit) ? (min_vruntime - credit) : 0;
+
+            size_t proc_count = processes.size();
+            if(curr_proc >= proc_count) { curr_proc = 0; curr_thread = 0; }
+            size_t start_proc = curr_proc;
+            size_t start_thread = curr_thread;
+            for(size_t i = 0; i <= proc_count; i++) {
+                size_t p = (start_proc + i) % proc_count;
+                Process* proc = processes.at(p);
+                // Killed processes that are still around only have the thread we are switching away from left
+                if(proc->attempt_destroy) { continue; }
+                size_t begin = (i == 0) ? start_thread : 0;
+                size_t end = (i == proc_count) ? start_thread : proc->threads.size();
+                if(end > proc->threads.size()) { end = proc->threads.size(); }
+                for(size_t t = begin; t < end; t++) {
+                    Thread* thread = proc->threads.at(t);
+                    if(thread->blocked == Thread::BlockState::WaitingOnMessage && proc->msg_count) {
+                        // This thread is blocked waiting for a IPC message, and we got one.
+                        // The arguments and the result are in the syscall frame it is waiting in.
+                        Interrupts::ISRRegisters* frame = UserFrame(thread);
+                        size_t msg_size = proc->nextMessageSize();
+                        if(msg_size > frame->rcx) {
+                            // This message is bigger than the buffer, set error and unblock
+                            frame->rax = -E2BIG;
+                            thread->blocked = Thread::BlockState::Running;
+                        } else {
+                            // We can copy this message to the process
+                            if(!proc->attemptCopyToUser(frame->rbx, msg_size, proc->buffer)) {
+                                // Copy failed
+                                frame->rax = -EINVAL;
+                            } else {
+                                // Copy succeded
+                                frame->rax = msg_size;
+                            }
+                            thread->blocked = Thread::BlockState::Running;
+                        }
+                    }
+
+                    // Check if this thread can be scheduled
+                    if(thread->blocked != Thread::BlockState::Running || thread == idle_thread) { continue; }
+                    // The thread that yielded goes behind everything else, see below
+                    if(thread == yielded) {
+                        yielded_runnable = true;
+                        yielded_pos[0] = p; yielded_pos[1] = t;
+                        continue;
+                    }
+                    switch(thread->policy) {
+                        case SchedPolicy::FIFO:
+                        case SchedPolicy::RoundRobin:
+                            if(!best_rt || thread->rt_priority > best_rt->rt_priority) {
+                                best_rt = thread;
+                                rt_pos[0] = p; rt_pos[1] = t;
+                            }
+                            break;
+                        case SchedPolicy::Fair:
+                            if(thread->vruntime < vruntime_floor) { thread->vruntime = vruntime_floor; }
+                            fair_weight += Weight(thread);
+                            if(!best_fair || thread->vruntime < best_fair->vruntime) {
+                                best_fair = thread;
+                                fair_pos[0] = p; fair_pos[1] = t;
+                            }
+                            break;
+                        case SchedPolicy::Idle:
+                            idle_weight += Weight(thread);
+                            if(!best_idle || thread->vruntime < best_idle->vruntime) {
+                                best_idle = thread;
+                                idle_pos[0] = p; idle_pos[1] = t;
+                            }
+                            break;
                     }
-                    thread->blocked = Thread::BlockState::Running;
                 }
             }
 
-            // Check if this thread can be scheduled
-            if(thread->blocked != Thread::BlockState::Running) { goto begin; }
-
-            ASSERT(proc->threads.size() > 0, "Scheduler: process has no threads registered with it!");
-
-            // Set isr registers to the saved registers in thread
-            regs->rax = thread->regs.rax;
-            regs->rbp = thread->regs.rbp;
-            regs->rbx = thread->regs.rbx;
-            regs->rcx = thread->regs.rcx;
-            regs->rdi = thread->regs.rdi;
-            regs->rdx = thread->regs.rdx;
-            regs->rip = thread->regs.rip;
-            regs->rsi = thread->regs.rsi;
-            regs->rsp = thread->regs.rsp;
-            regs->r8 = thread->regs.r8;
-            regs->r9 = thread->regs.r9;
-            regs->r10 = thread->regs.r10;
-            regs->r11 = thread->regs.r11;
-            regs->r12 = thread->regs.r12;
-            regs->r13 = thread->regs.r13;
-            regs->r14 = thread->regs.r14;
-            regs->r15 = thread->regs.r15;
-            regs->rflags = thread->regs.rflags;
-            regs->cs = thread->regs.cs;
-            regs->ss = thread->regs.ss;
-            // Update FS base
-            write_msr(0xC0000100, thread->tcb_base);
-
-            // Update TSS RSP0
-            tss_set_rsp0(thread->syscall_stack_map->base + thread->syscall_stack_map->size);
-            // Change to process page table
-            SwitchPageTables(thread->regs.page_table);
-            timer_curr = 0;
+            // The thread that yielded only wins if nothing else of its standing can run
+            if(yielded_runnable) {
+                Thread* thread = yielded;
+                switch(thread->policy) {
+                    case SchedPolicy::FIFO:
+                    case SchedPolicy::RoundRobin:
+                        if(!best_rt || thread->rt_priority > best_rt->rt_priority) {
+                            best_rt = thread;
+                            rt_pos[0] = yielded_pos[0]; rt_pos[1] = yielded_pos[1];
+                        }
+                        break;
+                    case SchedPolicy::Fair:
+                        fair_weight += Weight(thread);
+                        if(!best_fair) {
+                            best_fair = thread;
+                            fair_pos[0] = yielded_pos[0]; fair_pos[1] = yielded_pos[1];
+                        }
+                        break;
+                    case SchedPolicy::Idle:
+                        idle_weight += Weight(thread);
+                        if(!best_idle) {
+                            best_idle = thread;
+                            idle_pos[0] = yielded_pos[0]; idle_pos[1] = yielded_pos[1];
+                        }
+                        break;
+                }
+            }
+
+            Thread* next;
+            if(best_rt) {
+                next = best_rt;
+                curr_proc = rt_pos[0]; curr_thread = rt_pos[1];
+                if(next->policy == SchedPolicy::FIFO) { current_slice = 0; }
+                else { current_slice = next->time_slice ? next->time_slice : rr_timeslice; }
+                return next;
+            }
+            uint64_t total_weight;
+            if(best_fair) {
+                next = best_fair;
+                curr_proc = fair_pos[0]; curr_thread = fair_pos[1];
+                total_weight = fair_weight;
+                if(next->vruntime > min_vruntime) { min_vruntime = next->vruntime; }
+            } else if(best_idle) {
+                next = best_idle;
+                curr_proc = idle_pos[0]; curr_thread = idle_pos[1];
+                total_weight = idle_weight;
+            } else {
+                return NULL;
+            }
+            // The period is split up by weight
+            if(next->time_slice) {
+                current_slice = next->time_slice;
+            } else {
+                current_slice = (sched_latency * Weight(next)) / total_weight;
+                if(current_slice < min_granularity) { current_slice = min_granularity; }
+            }
+            return next;
+        }
+
+        bool Scheduler::Preempts(Thread* thread, Thread* curr) {
+            if(!curr || curr == idle_thread) { return true; }
+            if(ClassRank(thread) != ClassRank(curr)) { return ClassRank(thread) > ClassRank(curr); }
+            switch(thread->policy) {
+                case SchedPolicy::FIFO:
+                case SchedPolicy::RoundRobin:
+                    return thread->rt_priority > curr->rt_priority;
+                case SchedPolicy::Fair:
+                    // Only if it is well behind, otherwise threads that wake up often would keep interrupting each other
+                    return (thread->vruntime + (min_granularity * 1000)) < curr->vruntime;
+                default:
+                    return false;
+            }
+        }
+
+        void Scheduler::CheckPreempt(Thread* thread) {
+            if(Preempts(thread, current)) { need_resched = true; }
+        }
+
+        int Scheduler::SetScheduling(Thread* thread, SchedPolicy policy, int priority, uint64_t time_slice) {
+            switch(policy) {
+                case SchedPolicy::FIFO:
+                case SchedPolicy::RoundRobin:
+                    if(priority < 1 || priority > 99) { return -EINVAL; }
+                    break;
+                case SchedPolicy::Fair:
+                case SchedPolicy::Idle:
+                    if(priority < -20 || priority > 19) { return -EINVAL; }
+                    break;
+                default: return -EINVAL;
+            }
+            if(time_slice > 1000) { return -EINVAL; }
+            unsigned long flags = save_irqdisable();
+            thread->policy = policy;
+            if(policy == SchedPolicy::FIFO || policy == SchedPolicy::RoundRobin) {
+                thread->rt_priority = priority;
+                thread->nice = 0;
+            } else {
+                thread->nice = priority;
+                thread->rt_priority = 0;
+            }
+            thread->time_slice = time_slice;
+            // The new class might let it run before the current thread, or make the current thread give up the CPU
+            if(thread == current) { need_resched = true; }
+            else if(thread->blocked == Thread::BlockState::Running) { CheckPreempt(thread); }
+            irqrestore(flags);
+            return 0;
+        }
+
+        int Scheduler::SetProcessScheduling(int64_t pid, SchedPolicy policy, int priority, uint64_t time_slice) {
+            // The lock keeps the process and its threads from going away under us
+            Lock();
+            Process* target = pid ? GetProcessByPid(pid) : CurrentProcess();
+            if(!target || target->attempt_destroy) {
+                Unlock();
+                return -ESRCH;
+            }
+            int err = 0;
+            for(size_t i = 0; i < target->threads.size() && err >= 0; i++) {
+                err = SetScheduling(target->threads.at(i), policy, priority, time_slice);
+            }
+            Unlock();
+            return err;
+        }
+
+        int Scheduler::GetProcessScheduling(int64_t pid, SchedPolicy* policy, int* priority, uint64_t* time_slice) {
+            Lock();
+            Process* target = pid ? GetProcessByPid(pid) : CurrentProcess();
+            if(!target || target->attempt_destroy || !target->threads.size()) {
+                Unlock();
+                return -ESRCH;
+            }
+            Thread* thread = target->threads.at(0);
+            *policy = thread->policy;
+            bool realtime = thread->policy == SchedPolicy::FIFO || thread->policy == SchedPolicy::RoundRobin;
+            *priority = realtime ? thread->rt_priority : thread->nice;
+            *time_slice = thread->time_slice;
+            Unlock();
+            return 0;
+        }
+
+        bool Scheduler::ReapProcess(Process* proc, Thread* prev) {
+            // Demap all the stacks and delete all threads, except the one we are running on
+            size_t i = 0;
+            while(i < proc->threads.size()) {
+                Thread* thread = proc->threads.at(i);
+                if(thread == prev) {
+                    i++;
+                    continue;
+                }
+                // The last thread out only marks the process once all the others are parked
+                ASSERT(IsParked(thread), "Reaping a process with a thread still in the kernel");
+                FreeThread(thread);
+                proc->threads.remove(i);
+            }
+            return proc->threads.size() == 0;
+        }
+
+        void Scheduler::FreeThread(Thread* thread) {
+            // Waiters live on the stack that is freed here, and only threads that left the kernel can be freed
+            ASSERT(!thread->futex_waiter && !thread->wait_queue, "Freeing a thread that is still waiting");
+            VM::FreePages((void*)thread->syscall_stack_map->base, thread->syscall_stack_map->size / 4096);
+            delete thread->syscall_stack_map;
+            delete thread;
+        }
+
+        void Scheduler::SwitchTo(Thread* prev, Thread* next) {
+            current = next;
+            next->started = true;
+            if(prev == next) { return; }
+            // The preempt count goes with the thread
+            if(prev) { prev->preempt_count = preempt_count; }
+            preempt_count = next->preempt_count;
+            Process* proc = processes.at(curr_proc);
+
+            // Interrupts from user mode land on the kernel stack of the thread
+            tss_set_rsp0(next->syscall_stack_map->base + next->syscall_stack_map->size);
+            // Kernel threads dont use FS, and only touch the kernel half every page table shares, so they keep running
+            // on whatever was loaded before. That way switching to them and back costs no TLB flush.
+            if(!proc->is_kernel) {
+                SetFSBase(next->tcb_base);
+                // Change to process page table. Threads of the same process share it, so this often is a no-op.
+                SwitchPageTables(proc->page_table);
+            }
+            // This returns once something switches back to prev
+            switch_to(prev ? &prev->kernel_rsp : &boot_rsp, next->kernel_rsp);
+        }
+
+        void Scheduler::SetFSBase(uint64_t base) {
+            // wrmsr is serializing, so skip it if nothing changes
+            if(base == loaded_fs_base) { return; }
+            write_msr(0xC0000100, base);
+            loaded_fs_base = base;
         }
 
         void Scheduler::KillCurrentProcess() {
@@ -665,25 +1048,60 @@ namespace Kernel {
             ASSERT(proc->pid, "Attempted to kill init!");
             // KLog::the().printf("Killing %s\r\n", proc->name);
             uint64_t state = save_irqdisable();
-            // Delete all current memory
-            FreeCurrentProcMem();
-            // Check if we can destroy the translation table
-            if(proc->fd_translation_table) {
+            for(size_t i = 0; i < proc->threads.size(); i++) { MarkForExit(proc->threads.at(i)); }
+            irqrestore(state);
+        }
+
+        void Scheduler::MarkForExit(Thread* thread) {
+            if(IsParked(thread)) { return; }
+            if(!thread->started) {
+                thread->blocked = Thread::BlockState::ShouldDestroy;
+                return;
+            }
+            thread->should_exit = true;
+            // Waits userspace asked for end early. Waits on the kernel or on devices are left to finish.
+            if(thread->futex_waiter) { Futex::the().cancel(thread); }
+            if(thread->join_tid != -1) { WakeUp(thread); }
+        }
+
+        void Scheduler::ExitPoint(Interrupts::ISRRegisters* regs) {
+            if((regs->cs & 0b11) != 0b11 || !current || !current->should_exit) { return; }
+            ExitCurrent();
+        }
+
+        void Scheduler::ExitCurrent() {
+            asm volatile("cli");
+            Process* proc = CurrentProcess();
+            Thread* curr_t = CurrentThread();
+            // Interrupts are off, so exactly one thread finds itself last
+            bool last = true;
+            for(size_t i = 0; i < proc->threads.size(); i++) {
+                Thread* thread = proc->threads.at(i);
+                if(thread != curr_t && !IsParked(thread)) { last = false; }
+            }
+            if(last) {
+                // Closing files can sleep, so this runs like any other kernel code
+                asm volatile("sti");
+                // Delete all current memory
+                FreeCurrentProcMem();
                 // Noone is using this translation table anymore, we can just yeet it
-                for(size_t i = 0; i < proc->fd_translation_table->size(); i++) {
-                    VFS::the().close(proc->fd_translation_table->at(i)->global_fd, -1);
-                    delete proc->fd_translation_table->at(i);
+                for(size_t i = 0; i < proc->fd_table_capacity; i++) {
+                    if(!proc->fd_table[i]) { continue; }
+                    VFS::the().close(proc->fd_table[i]->global_fd, -1);
+                    delete proc->fd_table[i];
                 }
-                delete proc->fd_translation_table;
-                delete proc->fd_translation_table_ref_count;
-            }
-            // TODO: destroy page table
-            // probably has to be done in scheduler
-            delete proc->name;
-            proc->attempt_destroy = true;
-            running_proc_killed = true;
-            // Restart interrupts
-            irqrestore(state);
+                delete[] proc->fd_table;
+                // TODO: destroy page table
+                // probably has to be done in scheduler
+                delete proc->name;
+                asm volatile("cli");
+                proc->attempt_destroy = true;
+            }
+            curr_t->blocked = Thread::BlockState::ShouldDestroy;
+            // This never returns, the thread is gone
+            Schedule();
+            Debug::Panic("Exited thread got scheduled");
+            for(;;);
         }
 
         void Scheduler::FreeCurrentProcMem() {
@@ -714,17 +1132,20 @@ namespace Kernel {
         void Scheduler::WaitOnIRQ(int irq) {
             // The timer subsystem needs IRQ 0, so we simply return lol
             if(irq == 0) { return; }
+            ASSERT(!preempt_count, "WaitOnIRQ called with preemption disabled");
+            unsigned long flags = save_irqdisable();
             // We now check if we need to register a callback for this interrupt
-            if(irq_wait_states[irq]++) { Interrupts::the().RegisterIRQHandler(irq, SchedulerIRQCallbackWrapper); }
+            if(irq_wait_states[irq]++ == 0) { Interrupts::the().RegisterIRQHandler(irq, SchedulerIRQCallbackWrapper); }
             // Set wait state, being carefull to set irq before the block
-            Process* curr = CurrentProcess();
-            Thread* curr_t = curr->threads.at(curr_thread);
+            Thread* curr_t = CurrentThread();
             curr_t->irq = irq;
             curr_t->blocked = Thread::BlockState::WaitingOnIRQ;
-            while(curr_t->blocked == Thread::BlockState::WaitingOnIRQ);
+            // Let other threads run until the IRQ handler unblocks us
+            while(curr_t->blocked == Thread::BlockState::WaitingOnIRQ) { Schedule(); }
             // We have now in fact unblocked, decrement irq_wait_states
             irq_wait_states[irq]--;
             if(irq_wait_states[irq] == 0) { Interrupts::the().DeregisterIRQHandler(irq); }
+            irqrestore(flags);
         }
 
         void Scheduler::IRQHandler(Interrupts::ISRRegisters* regs) {
@@ -735,11 +1156,28 @@ namespace Kernel {
                     Thread* thread = proc->threads.at(y);
                     if(thread->blocked == Thread::BlockState::WaitingOnIRQ && thread->irq == regs->int_num) {
                         thread->blocked = Thread::BlockState::Running;
+                        CheckPreempt(thread);
                     }
                 }
             }
         }
 
+        void Scheduler::SleepCurrent() {
+            // Lock() disables preemption too, so this also catches sleeping with the scheduler lock held
+            ASSERT(!preempt_count, "SleepCurrent called with preemption disabled");
+            Thread* thread = CurrentThread();
+            thread->blocked = Thread::BlockState::Sleeping;
+            // We are skipped until we are woken up
+            while(thread->blocked == Thread::BlockState::Sleeping) { Schedule(); }
+        }
+
+        void Scheduler::WakeUp(Thread* thread) {
+            if(thread->blocked == Thread::BlockState::Sleeping) {
+                thread->blocked = Thread::BlockState::Running;
+                CheckPreempt(thread);
+            }
+        }
+
         void Scheduler::FirstSchedule() {
             // This doesnt actually schedule anything, but prepares internal values for scheduling to begin
             // Scheduling is always done from the timer interrupt
@@ -755,19 +1193,64 @@ namespace Kernel {
             // Bail if the schedule has not yet been inited, or if we were in kernel mode
             if(!first_schedule_init_done) { return; }
             
-            timer_curr++;
-            if(timer_curr >= timer_switch) {
-                if(mutex) { return; } // lol
-                if(first_schedule_complete) {
-                    SaveContext(regs);
+            // Charge the tick to whatever was running. Fair threads age by how much of the CPU they are owed,
+            // so a heavier thread gets more ticks for the same vruntime.
+            // The idle thread only uses its slice to look for threads that were made runnable without a wake up.
+            if(current) { current->slice_used++; }
+            if(current && current != idle_thread) {
+                if(current->policy == SchedPolicy::Fair || current->policy == SchedPolicy::Idle) {
+                    current->vruntime += (1000 * nice_0_weight) / Weight(current);
                 }
-                //KLog::the().printf("Calling scheduler\r\n");
-                Schedule(regs);
             }
+
+            // A slice of 0 never runs out (FIFO). The switch happens on the way out of the IRQ.
+            if(!current || (current_slice && current->slice_used >= current_slice)) { need_resched = true; }
+            (void)regs;
+        }
+
+        void Scheduler::Yield() {
+            if(!first_schedule_init_done || !current) {
+                asm volatile("pause");
+                return;
+            }
+            ASSERT(!preempt_count, "Yield called with preemption disabled");
+            unsigned long flags = save_irqdisable();
+            yielded = current;
+            Schedule();
+            irqrestore(flags);
+        }
+
+        bool Scheduler::InAtomic() {
+            if(!first_schedule_init_done || !current) { return false; }
+            return preempt_count || !interrupts_enabled() || SoftIRQ::the().InSoftIRQ();
+        }
+
+        void Scheduler::PreemptEnable() {
+            asm volatile("" ::: "memory");
+            preempt_count = preempt_count - 1;
+            if(!preempt_count && need_resched && interrupts_enabled()) { PreemptPoint(); }
+        }
+
+        void Scheduler::PreemptPoint() {
+            if(!need_resched || preempt_count || !first_schedule_init_done) { return; }
+            // Tasklets dont belong to the task they interrupted, they should be done before it is switched away from
+            if(SoftIRQ::the().InSoftIRQ()) { return; }
+            unsigned long flags = save_irqdisable();
+            // Check again, the IRQs we just held off might have rescheduled already
+            if(need_resched && !preempt_count) { Schedule(); }
+            irqrestore(flags);
         }
 
         void SchedulerIRQCallbackWrapper(Interrupts::ISRRegisters* regs) {
             Scheduler::the().IRQHandler(regs);
         }
     }
+}
+
+void preempt_disable() {
+    Kernel::Processes::Scheduler::the().PreemptDisable();
+}
+
+void preempt_enable() {
+    Kernel::Processes::Scheduler::the().PreemptEnable();
 }
\ No newline at end of file
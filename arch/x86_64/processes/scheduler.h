@@ -1,7 +1,6 @@
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
 
-#include <hardware/cpu.h>
 #include <processes/process.h>
 #include <CPP/vector.h>
 #include <interrupts.h>
@@ -24,18 +23,20 @@ namespace Kernel {
 
             void TimerCallback(Interrupts::ISRRegisters* regs);
 
-            // Save the context of the current process.
-            void SaveContext(Interrupts::ISRRegisters* regs);
-
-            // Updates regs with the required information to go to the next process, and switches the page table.
-            void Schedule(Interrupts::ISRRegisters* regs);
+            // Switch to the next thread that can run. Has to be called with interrupts disabled.
+            // Returns once the current thread gets picked again, which is never if it is blocked for good or was killed.
+            void Schedule();
 
             // Do the first schedule.
             void FirstSchedule();
 
-            // Kill the current process.
+            // Kill the current process. Its threads might be in the middle of syscalls, holding locks or waited on by
+            // devices, so this only marks them. Each exits on its way back to user mode, and the last one out frees the
+            // memory and files of the process. Safe to call from exception handlers.
             // TODO: add refcounting to the memory mappings
             void KillCurrentProcess();
+            // Exit the current thread if it was marked to. Called on the way back to user mode.
+            void ExitPoint(Interrupts::ISRRegisters* regs);
 
             // Load a ELF file.
             // This is used to create "first pids"; Other exec and forks should result from other versions of this process.
@@ -58,8 +59,23 @@ namespace Kernel {
             // The enviroment is taken from the execing process.
             int Exec(uint8_t* data, size_t length, char** argv, int argc, char** envp, int envc, Interrupts::ISRRegisters* regs);
 
-            // Create a task running in kernel space.
+            // Create a kernel thread. Kernel threads are all part of the kernel process, and share its address space.
+            // stack_size is in pages. Returning from start exits the thread. Returns the tid.
             int CreateKernelTask(void (*start)(void*), void* arg, uint64_t stack_size);
+            // Exit the current kernel thread.
+            [[noreturn]] void ExitCurrentThread();
+
+            // Create a thread in the current process. It starts at entry with arg in rdi, on the user stack at stack, and with tcb
+            // as its FS base. Returns the tid or a negative errno.
+            int64_t CreateThread(uint64_t entry, uint64_t stack, uint64_t arg, uint64_t tcb);
+            // Exit the current user thread. It stays around until it is joined. If it was the last thread, the process exits.
+            [[noreturn]] void ExitThread(int64_t code);
+            // Wait until a thread of the current process exited and get its exit code. Every thread can only be joined once.
+            // Returns 0, -ESRCH, -EDEADLK or -EINTR.
+            int JoinThread(int tid, int64_t* code);
+
+            // Set the FS base, which userspace uses for thread local storage
+            void SetFSBase(uint64_t base);
 
             // Wait on a IRQ
             void WaitOnIRQ(int irq);
@@ -67,6 +83,52 @@ namespace Kernel {
             // IRQ Handler, for waiting tasks
             void IRQHandler(Interrupts::ISRRegisters* regs);
 
+            // Block the current kernel task until WakeUp is called on it. Has to be called with interrupts disabled, so a wake up
+            // from a IRQ cant get lost between checking for work and going to sleep. Returns with interrupts disabled again.
+            // Sleeping, yielding and waiting on IRQs panic while preemption is disabled or the scheduler lock is held.
+            void SleepCurrent();
+            // Make a sleeping thread runnable again. Safe to call from IRQ handlers.
+            void WakeUp(Thread* thread);
+
+            // Give up the CPU to the other runnable threads. The current thread stays runnable, and runs again once nothing
+            // of its class (or of the same priority, for real time threads) is left waiting. Call from loops that wait on
+            // something another thread does. Before scheduling starts, this only pauses.
+            void Yield();
+
+            // While the preempt count is not 0, the current thread is only switched away from if it blocks. The count
+            // belongs to the thread, so blocking with it raised does not leak it to others. Nests.
+            inline void PreemptDisable() {
+                preempt_count = preempt_count + 1;
+                asm volatile("" ::: "memory");
+            }
+            // A reschedule that came due while preemption was disabled happens here, unless interrupts are disabled too.
+            // Then it waits for the next preemption point, which IRQ handlers always reach on their way out.
+            void PreemptEnable();
+            // Switch away if a reschedule is due and nothing forbids it. Called on the way out of IRQs and syscalls.
+            void PreemptPoint();
+            // Make the current thread switch away at the next preemption point
+            inline void SetNeedResched() { need_resched = true; }
+            // Whether the current code cant sleep: interrupts or preemption are disabled, which includes holding the scheduler
+            // lock, or it is a tasklet. Before scheduling starts nothing sleeps, so this is false then.
+            bool InAtomic();
+
+            // Set the scheduling class of a thread. priority is the nice value for the fair and idle classes, and the
+            // real time priority for FIFO and round robin. time_slice is in ms, 0 uses the default of the class.
+            // Returns 0 or a negative errno.
+            int SetScheduling(Thread* thread, SchedPolicy policy, int priority, uint64_t time_slice);
+            // Set the scheduling class of every thread of the process pid (0 for the current one), or get the one of its
+            // main thread. Returns 0 or a negative errno.
+            int SetProcessScheduling(int64_t pid, SchedPolicy policy, int priority, uint64_t time_slice);
+            int GetProcessScheduling(int64_t pid, SchedPolicy* policy, int* priority, uint64_t* time_slice);
+
+            // Time slice tunables, in ms.
+            // Every runnable fair thread should get to run once in this period
+            uint64_t sched_latency = 20;
+            // Fair threads run at least this long before another one gets a turn
+            uint64_t min_granularity = 4;
+            // Default slice of round robin threads
+            uint64_t rr_timeslice = 100;
+
             IPCNamedPipe* FindNamedPipe(const char* name) {
                 for(size_t i = 0; i < named_pipes.size(); i++) {
                     IPCNamedPipe* curr = named_pipes.at(i);
@@ -84,6 +146,7 @@ namespace Kernel {
             }
 
             inline Process* CurrentProcess() { return processes.at(curr_proc); }
+            inline Thread* CurrentThread() { return current; }
 
             static Scheduler& the() {
                 static Scheduler instance;
@@ -105,6 +168,41 @@ namespace Kernel {
             // Free all memory in use by current process
             void FreeCurrentProcMem();
 
+            Thread* CreateKernelThread(void (*start)(void*), void* arg, uint64_t stack_size);
+            // Set up the kernel stack of a new thread below top, so that switching to it returns from a interrupt into frame
+            void PrepareStack(Thread* thread, Interrupts::ISRRegisters* frame, uint64_t top);
+            // The frame a user thread entered the kernel with, at the top of its kernel stack
+            inline Interrupts::ISRRegisters* UserFrame(Thread* thread) {
+                return (Interrupts::ISRRegisters*)(thread->syscall_stack_map->base + thread->syscall_stack_map->size - sizeof(Interrupts::ISRRegisters));
+            }
+            // Make a thread exit at its next return to user mode, and end the waits that would keep it from getting there.
+            // Has to be called with interrupts disabled.
+            void MarkForExit(Thread* thread);
+            // Threads that wont enter the kernel again, and can be freed
+            static inline bool IsParked(Thread* thread) {
+                return thread->blocked == Thread::BlockState::ShouldDestroy || thread->blocked == Thread::BlockState::Exited;
+            }
+            // Exit the current thread of a killed process. The last thread frees what the process used.
+            [[noreturn]] void ExitCurrent();
+            // Free a parked thread
+            void FreeThread(Thread* thread);
+            // Free the threads of a killed process. Returns false if prev, which we are running on, is one of them.
+            bool ReapProcess(Process* proc, Thread* prev);
+            // Free exited threads and killed processes
+            void Reap(Thread* prev);
+            // Find the next thread to run and point curr_proc and curr_thread at it. Returns NULL if there is none.
+            // Also sets current_slice for it.
+            Thread* PickNext();
+            // Weight of a fair or idle class thread
+            static uint64_t Weight(Thread* thread);
+            // Whether a thread that became runnable should take the CPU from the current one
+            bool Preempts(Thread* thread, Thread* curr);
+            // Call when a thread becomes runnable
+            void CheckPreempt(Thread* thread);
+            void SwitchTo(Thread* prev, Thread* next);
+            static void IdleTask(void* arg);
+            static void KernelTaskReturn();
+
             // Get the next available PID
             int64_t GetNextPid() {
                 if(processes.size() == 0) { return 1; }
@@ -119,8 +217,19 @@ namespace Kernel {
             // List of IRQs we have been waiting on
             uint64_t irq_wait_states[64];
 
-            const int timer_switch = 5;
-            int timer_curr = 0;
+            // Value the FS base MSR was last set to
+            uint64_t loaded_fs_base = 0;
+
+            // Length of the slice of the current thread in ms, 0 if it runs until it blocks
+            uint64_t current_slice = 0;
+            // Set when the current thread should switch away, checked at the next preemption point
+            volatile bool need_resched = false;
+            // Preempt count of the current thread, saved to the thread when it is switched away from
+            volatile int preempt_count = 0;
+            // The thread that yielded, it is only picked if nothing else of its standing can run
+            Thread* yielded = NULL;
+            // Fair threads that slept dont get to catch up on more than half a sched_latency of runtime below this
+            uint64_t min_vruntime = 0;
 
 
             Vector<IPCNamedPipe*> named_pipes;
@@ -128,12 +237,23 @@ namespace Kernel {
             bool first_schedule_init_done = false;
             bool first_schedule_complete = false;
 
-            bool running_proc_killed = false;
-            bool running_thread_killed = false;
+            Thread* current = NULL;
+            // Runs when nothing else can
+            Thread* idle_thread = NULL;
+            // switch_to saves the boot stack here on the first schedule, it is never switched back to
+            uint64_t boot_rsp = 0;
 
             bool init_spawned = false;
 
+            // Process all kernel threads belong to
+            Process* kernel_process = NULL;
+            int next_kernel_tid = 0;
+
+            // Protects processes against concurrent changes. Like every spinlock, it disables preemption while it is held,
+            // so the scheduler cant run on a half updated list.
             mutex_t mutex = 0;
+            inline void Lock() { acquire(&mutex); }
+            inline void Unlock() { release(&mutex); }
         };
         void SchedulerIRQCallbackWrapper(Interrupts::ISRRegisters* regs);
     }
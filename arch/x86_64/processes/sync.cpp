@@ -0,0 +1,143 @@
+#include <processes/sync.h>
+#include <processes/scheduler.h>
+#include <hardware/instructions.h>
+
+namespace Kernel {
+    void WaitQueue::wait(mutex_t* lock) {
+        Processes::Thread* thread = Processes::Scheduler::the().CurrentThread();
+        if(!thread) {
+            release(lock);
+            // The wake up might come from an IRQ handler, so let them in
+            asm volatile("sti; hlt; cli");
+            acquire(lock);
+            return;
+        }
+        Waiter waiter = { thread, false, NULL };
+        if(tail) { tail->next = &waiter; }
+        else { head = &waiter; }
+        tail = &waiter;
+        thread->wait_queue = this;
+        release(lock);
+        // Interrupts are off, so a wake up cant get lost between releasing the lock and going to sleep
+        while(!waiter.woken) { Processes::Scheduler::the().SleepCurrent(); }
+        acquire(lock);
+    }
+
+    bool WaitQueue::wakeOne() {
+        Waiter* waiter = head;
+        if(!waiter) { return false; }
+        head = waiter->next;
+        if(!head) { tail = NULL; }
+        waiter->thread->wait_queue = NULL;
+        // Once woken is set, the waiter can return and its stack can be reused
+        Processes::Thread* thread = waiter->thread;
+        waiter->woken = true;
+        Processes::Scheduler::the().WakeUp(thread);
+        return true;
+    }
+
+    void WaitQueue::wakeAll() {
+        while(wakeOne());
+    }
+
+    void Mutex::lock() {
+        // Checked even when the lock is free, so a caller that cant sleep is caught before it deadlocks under contention
+        ASSERT(!Processes::Scheduler::the().InAtomic(), "Mutex::lock called where it cant sleep");
+        unsigned long flags = save_irqdisable();
+        acquire(&spinlock);
+        // Someone else might take it between our wake up and us getting the spinlock, so check again
+        while(locked) { waiters.wait(&spinlock); }
+        locked = true;
+        release(&spinlock);
+        irqrestore(flags);
+    }
+
+    bool Mutex::tryLock() {
+        unsigned long flags = save_irqdisable();
+        acquire(&spinlock);
+        bool taken = !locked;
+        locked = true;
+        release(&spinlock);
+        irqrestore(flags);
+        return taken;
+    }
+
+    void Mutex::unlock() {
+        unsigned long flags = save_irqdisable();
+        acquire(&spinlock);
+        locked = false;
+        waiters.wakeOne();
+        release(&spinlock);
+        irqrestore(flags);
+    }
+
+    void Semaphore::down() {
+        ASSERT(!Processes::Scheduler::the().InAtomic(), "Semaphore::down called where it cant sleep");
+        unsigned long flags = save_irqdisable();
+        acquire(&spinlock);
+        while(!count) { waiters.wait(&spinlock); }
+        count--;
+        release(&spinlock);
+        irqrestore(flags);
+    }
+
+    bool Semaphore::tryDown() {
+        unsigned long flags = save_irqdisable();
+        acquire(&spinlock);
+        bool taken = count;
+        if(taken) { count--; }
+        release(&spinlock);
+        irqrestore(flags);
+        return taken;
+    }
+
+    void Semaphore::up() {
+        unsigned long flags = save_irqdisable();
+        acquire(&spinlock);
+        count++;
+        waiters.wakeOne();
+        release(&spinlock);
+        irqrestore(flags);
+    }
+
+    void RWLock::readLock() {
+        ASSERT(!Processes::Scheduler::the().InAtomic(), "RWLock::readLock called where it cant sleep");
+        unsigned long flags = save_irqdisable();
+        acquire(&spinlock);
+        while(writer || waiting_writers) { read_waiters.wait(&spinlock); }
+        readers++;
+        release(&spinlock);
+        irqrestore(flags);
+    }
+
+    void RWLock::readUnlock() {
+        unsigned long flags = save_irqdisable();
+        acquire(&spinlock);
+        readers--;
+        if(!readers) { write_waiters.wakeOne(); }
+        release(&spinlock);
+        irqrestore(flags);
+    }
+
+    void RWLock::writeLock() {
+        ASSERT(!Processes::Scheduler::the().InAtomic(), "RWLock::writeLock called where it cant sleep");
+        unsigned long flags = save_irqdisable();
+        acquire(&spinlock);
+        waiting_writers++;
+        while(writer || readers) { write_waiters.wait(&spinlock); }
+        waiting_writers--;
+        writer = true;
+        release(&spinlock);
+        irqrestore(flags);
+    }
+
+    void RWLock::writeUnlock() {
+        unsigned long flags = save_irqdisable();
+        acquire(&spinlock);
+        writer = false;
+        // Writers go first, the readers get their turn once no writer is left waiting
+        if(!write_waiters.wakeOne()) { read_waiters.wakeAll(); }
+        release(&spinlock);
+        irqrestore(flags);
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <CPP/mutex.h>
+#include <processes/process.h>
+
+namespace Kernel {
+    // Threads sleeping until something happens. This is the kernel side of what futexes are for userspace: the locks below
+    // keep their state under a short spinlock, and only go through the scheduler when they have to wait.
+    // The waiters live on the stacks of the waiting threads.
+    class WaitQueue {
+    public:
+        // Release lock, sleep until woken and take lock again. Must be called with interrupts disabled and lock held.
+        // Before scheduling starts there is nothing to switch to, so this only drops the lock until the next IRQ came in.
+        void wait(mutex_t* lock);
+        // Wake the thread that waited the longest. Returns false if there was none.
+        bool wakeOne();
+        void wakeAll();
+        inline bool empty() { return !head; }
+
+    private:
+        struct Waiter {
+            Processes::Thread* thread;
+            volatile bool woken;
+            Waiter* next;
+        };
+        // Protected by the lock of the owner
+        Waiter* head = NULL;
+        Waiter* tail = NULL;
+    };
+
+    // Sleeping mutex. Waiters sleep instead of spinning, so it can be held across I/O.
+    // The sleeping locks cant be taken from IRQ handlers, tasklets, or with interrupts or preemption disabled, and panic if they are.
+    class Mutex {
+    public:
+        void lock();
+        bool tryLock();
+        void unlock();
+
+    private:
+        mutex_t spinlock = 0;
+        bool locked = false;
+        WaitQueue waiters;
+    };
+
+    // Counting semaphore
+    class Semaphore {
+    public:
+        Semaphore(size_t _count = 0) : count(_count) { }
+        // Wait until the count is not 0 and take one. Like taking a mutex, this panics where it cant sleep.
+        void down();
+        bool tryDown();
+        // Safe to call from IRQ handlers
+        void up();
+
+    private:
+        mutex_t spinlock = 0;
+        size_t count;
+        WaitQueue waiters;
+    };
+
+    // Sleeping reader-writer lock. Any amount of readers can hold it at once, writers hold it alone.
+    // Waiting writers keep new readers out, so a steady stream of readers cant starve them.
+    class RWLock {
+    public:
+        void readLock();
+        void readUnlock();
+        void writeLock();
+        void writeUnlock();
+
+    private:
+        mutex_t spinlock = 0;
+        size_t readers = 0;
+        size_t waiting_writers = 0;
+        bool writer = false;
+        WaitQueue read_waiters;
+        WaitQueue write_waiters;
+    };
+}
+
+#endif
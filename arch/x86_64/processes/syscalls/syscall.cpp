@@ -2,6 +2,7 @@
 #include <processes/syscalls/syscall.h>
 #include <debug/klog.h>
 #include <processes/scheduler.h>
+#include <processes/futex.h>
 #include <mem/PM/physalloc.h>
 #include <mem/VM/virtmem.h>
 #include <kernel-drivers/VFS.h>
@@ -56,12 +57,8 @@ void SyscallHandler::HandleSyscall(Interrupts::ISRRegisters* regs) {
         // exit
         case 4: {
             KLog::the().printf("Process %i exited with code %i\r\n", Processes::Scheduler::the().curr_proc, regs->rbx);
+            // The thread exits on its way back to user mode, once this returns
             Processes::Scheduler::the().KillCurrentProcess();
-            // We dont want interrupts in the scheduler lol
-            // TODO: yeah we might still one somewhat accurate timer interrupts (links in with timer system rework)
-            asm volatile ("cli");
-            Processes::Scheduler::the().Schedule(regs);
-            asm volatile ("sti");
             break;
         }
         // fork
@@ -123,7 +120,7 @@ void SyscallHandler::HandleSyscall(Interrupts::ISRRegisters* regs) {
             // KLog::the().printf("set_tcb pointer=%x\n\r", regs->rbx);
             // Update FS base
             this_proc->threads.at(Processes::Scheduler::the().curr_thread)->tcb_base = regs->rbx;
-            write_msr(0xC0000100, this_proc->threads.at(Processes::Scheduler::the().curr_thread)->tcb_base);
+            Processes::Scheduler::the().SetFSBase(regs->rbx);
             break;
         }
         // istty
@@ -179,6 +176,61 @@ void SyscallHandler::HandleSyscall(Interrupts::ISRRegisters* regs) {
             if(ret != 0) { regs->rax = ret; }
             break;
         }
+        // fsync
+        case 14: {
+            // KLog::the().printf("fsync fd=%i\n\r", regs->rbx);
+            regs->rax = fsync(regs->rbx, this_proc);
+            break;
+        }
+        // sched_setattr
+        case 15: {
+            // KLog::the().printf("sched_setattr pid=%i policy=%i priority=%i slice=%i\n\r", regs->rbx, regs->rcx, regs->rdx, regs->rsi);
+            regs->rax = sched_setattr(regs->rbx, regs->rcx, (int)regs->rdx, regs->rsi);
+            break;
+        }
+        // sched_getattr
+        case 16: {
+            // KLog::the().printf("sched_getattr pid=%i\n\r", regs->rbx);
+            sched_getattr(regs);
+            break;
+        }
+        // sched_yield
+        case 17: {
+            Processes::Scheduler::the().Yield();
+            regs->rax = 0;
+            break;
+        }
+        // thread_create
+        case 18: {
+            // KLog::the().printf("thread_create entry=%x stack=%x arg=%x tcb=%x\n\r", regs->rbx, regs->rcx, regs->rdx, regs->rsi);
+            regs->rax = Processes::Scheduler::the().CreateThread(regs->rbx, regs->rcx, regs->rdx, regs->rsi);
+            break;
+        }
+        // thread_exit
+        case 19: {
+            // This never returns
+            Processes::Scheduler::the().ExitThread(regs->rbx);
+            break;
+        }
+        // thread_join
+        case 20: {
+            int64_t code = 0;
+            regs->rax = Processes::Scheduler::the().JoinThread(regs->rbx, &code);
+            if(regs->rax == 0) { regs->rbx = code; }
+            break;
+        }
+        // futex_wait
+        case 21: {
+            // KLog::the().printf("futex_wait pointer=%x expected=%i timeout=%i\n\r", regs->rbx, regs->rcx, regs->rdx);
+            regs->rax = Futex::the().wait(this_proc, regs->rbx, regs->rcx, regs->rdx);
+            break;
+        }
+        // futex_wake
+        case 22: {
+            // KLog::the().printf("futex_wake pointer=%x count=%i\n\r", regs->rbx, regs->rcx);
+            regs->rax = Futex::the().wake(this_proc, regs->rbx, regs->rcx);
+            break;
+        }
         default: KLog::the().printf("Got invalid syscall: %x\r\n", (uint64_t)regs->rax); regs->rax = -ENOSYS; break;
     }
 }
@@ -205,7 +257,7 @@ uint64_t SyscallHandler::mmap(Processes::Process* process, uint64_t requested_si
     new_obj->size = size;
     // Actually map the pages
     for(uint64_t curr = 0; curr < size; curr += 4096) {
-        uint64_t phys = PM::AllocatePages(1);
+        uint64_t phys = PM::AllocateZeroedPage();
         if(!phys) { return -EINVAL; }
         VM::MapPage(phys, current_map + curr, flags ? 0b111 : 0b101);
     }
@@ -222,23 +274,20 @@ int SyscallHandler::fork(Interrupts::ISRRegisters* regs) {
 }
 
 int64_t SyscallHandler::open(const char* path, int flags, Processes::Process* process) {
-    int64_t global_fd = VFS::the().open(process->working_dir, path, process->pid);
+    int64_t global_fd = VFS::the().open(process->working_dir, path, process->pid, flags);
     int64_t process_fd;
     if(global_fd >= 0) {
         // Create translation table
-        process_fd = process->getLowestVFSInt();
-        process->fd_translation_table->push_back(new Processes::Process::VFSTranslation(global_fd, process_fd));
+        process_fd = process->allocateFd(new Processes::Process::VFSTranslation(global_fd, 0));
     }
     return global_fd >= 0 ? process_fd : global_fd;
-    (void)flags;
 }
 
 int64_t SyscallHandler::close(int64_t fd, Processes::Process* process) {
-    Processes::Process::VFSTranslation* vfs_translation = process->getGlobalFd(fd);
+    // Removing it from the table first means only one close gets it. The global fd is closed once nothing uses it anymore.
+    Processes::Process::VFSTranslation* vfs_translation = process->takeFd(fd);
     if(vfs_translation == NULL) { return -EBADF; }
-    int ret = VFS::the().close(vfs_translation->global_fd, process->pid);
-    if(ret != 0) { return ret; }
-    process->deleteFd(vfs_translation);
+    process->putFd(vfs_translation);
     return 0;
 }
 
@@ -247,6 +296,7 @@ int64_t SyscallHandler::read(int64_t fd, void* buf, size_t count, Processes::Pro
     if(vfs_translation == NULL) { return -EBADF; }
     int64_t ret = VFS::the().pread(vfs_translation->global_fd, buf, count, vfs_translation->pos, process->pid);
     if(ret > 0) { vfs_translation->pos += ret; }
+    process->putFd(vfs_translation);
     return ret;
 }
 
@@ -255,40 +305,83 @@ int64_t SyscallHandler::write(int64_t fd, void* buf, size_t count, Processes::Pr
     if(vfs_translation == NULL) { return -EBADF; }
     int64_t ret = VFS::the().pwrite(vfs_translation->global_fd, buf, count, vfs_translation->pos, process->pid);
     if(ret > 0) { vfs_translation->pos += ret; }
+    process->putFd(vfs_translation);
+    return ret;
+}
+
+int64_t SyscallHandler::fsync(int64_t fd, Processes::Process* process) {
+    Processes::Process::VFSTranslation* vfs_translation = process->getGlobalFd(fd);
+    if(vfs_translation == NULL) { return -EBADF; }
+    int64_t ret = VFS::the().fsync(vfs_translation->global_fd, process->pid);
+    process->putFd(vfs_translation);
     return ret;
 }
 
 int64_t SyscallHandler::seek(int64_t fd, size_t offset, int whence, Processes::Process* process) {
     Processes::Process::VFSTranslation* vfs_translation = process->getGlobalFd(fd);
     if(vfs_translation == NULL) { return -EBADF; }
+    int64_t ret;
     switch(whence) {
         // SEEK_SET
         case 3: {
-            vfs_translation->pos = offset;
+            ret = vfs_translation->pos = offset;
             break;
         }
         // SEEK_CUR
         case 1: {
-            vfs_translation->pos += offset;
+            ret = vfs_translation->pos += offset;
             break;
         }
         // SEEK_END
         case 2: {
-            vfs_translation->pos = VFS::the().size(vfs_translation->global_fd, -1) - offset;
+            ret = vfs_translation->pos = VFS::the().size(vfs_translation->global_fd, -1) - offset;
             break;
         }
         default: {
-            return -EINVAL;
+            ret = -EINVAL;
+            break;
         }
     }
-    return vfs_translation->pos;
-    (void)process;
+    process->putFd(vfs_translation);
+    return ret;
 }
 
 bool SyscallHandler::isatty(int64_t fd, Processes::Process* process) {
     Processes::Process::VFSTranslation* vfs_translation = process->getGlobalFd(fd);
     if(vfs_translation == NULL) { return -EBADF; }
-    return VFS::the().isatty(vfs_translation->global_fd, process->pid);
+    bool ret = VFS::the().isatty(vfs_translation->global_fd, process->pid);
+    process->putFd(vfs_translation);
+    return ret;
+}
+
+int64_t SyscallHandler::sched_setattr(int64_t pid, uint64_t policy, int priority, uint64_t time_slice) {
+    if(policy > (uint64_t)Processes::SchedPolicy::Idle) { return -EINVAL; }
+    // Every thread of the process gets the same class
+    return Processes::Scheduler::the().SetProcessScheduling(pid, (Processes::SchedPolicy)policy, priority, time_slice);
+}
+
+void SyscallHandler::sched_getattr(Interrupts::ISRRegisters* regs) {
+    // A process reports the attributes of its main thread, the calling thread reports its own
+    Processes::SchedPolicy policy;
+    int priority;
+    uint64_t time_slice;
+    if(regs->rbx) {
+        int err = Processes::Scheduler::the().GetProcessScheduling(regs->rbx, &policy, &priority, &time_slice);
+        if(err < 0) {
+            regs->rax = err;
+            return;
+        }
+    } else {
+        // Reading our own thread needs no lock, it cannot go away under us
+        Processes::Thread* thread = Processes::Scheduler::the().CurrentThread();
+        policy = thread->policy;
+        bool realtime = policy == Processes::SchedPolicy::FIFO || policy == Processes::SchedPolicy::RoundRobin;
+        priority = realtime ? thread->rt_priority : thread->nice;
+        time_slice = thread->time_slice;
+    }
+    regs->rax = (uint64_t)policy;
+    regs->rbx = priority;
+    regs->rcx = time_slice;
 }
 
-}
\ No newline at end of file
+}
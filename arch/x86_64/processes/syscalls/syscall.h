@@ -38,13 +38,18 @@ public:
     int64_t close(int64_t fd, Processes::Process* process);
     int64_t read(int64_t fd, void* buf, size_t count, Processes::Process* process);
     int64_t write(int64_t fd, void* buf, size_t count, Processes::Process* process);
+    int64_t fsync(int64_t fd, Processes::Process* process);
     int64_t seek(int64_t fd, size_t offset, int whence, Processes::Process* process);
     bool isatty(int64_t fd, Processes::Process* process);
+    // Set the scheduling class of every thread of a process, pid 0 is the calling process
+    int64_t sched_setattr(int64_t pid, uint64_t policy, int priority, uint64_t time_slice);
 
     // These must be called from a interrupt context
     void debugWrite(Interrupts::ISRRegisters* regs, Processes::Process* process);
     void exit(Interrupts::ISRRegisters* regs, Processes::Process* process);
     int fork(Interrupts::ISRRegisters* regs); // Returns PID
+    // Returns policy, priority and time slice in rax, rbx and rcx
+    void sched_getattr(Interrupts::ISRRegisters* regs);
 private:
 
 };
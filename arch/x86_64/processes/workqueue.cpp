@@ -0,0 +1,94 @@
+#include <processes/workqueue.h>
+#include <processes/scheduler.h>
+#include <hardware/instructions.h>
+#include <timer.h>
+
+namespace Kernel {
+    void WorkQueue::Init(size_t worker_count) {
+        if(worker_count > max_workers) { worker_count = max_workers; }
+        for(size_t i = 0; i < worker_count; i++) { Processes::Scheduler::the().CreateKernelTask(Worker, this, 4); }
+        Hardware::Timer::AttachCallback(TimerCallback, this);
+    }
+
+    bool WorkQueue::queue(WorkItem* work) {
+        unsigned long flags = save_irqdisable();
+        if(work->pending) {
+            irqrestore(flags);
+            return false;
+        }
+        work->pending = true;
+        enqueue(work);
+        irqrestore(flags);
+        return true;
+    }
+
+    bool WorkQueue::queueDelayed(WorkItem* work, uint64_t delay) {
+        unsigned long flags = save_irqdisable();
+        if(work->pending) {
+            irqrestore(flags);
+            return false;
+        }
+        work->pending = true;
+        work->deadline = Hardware::Timer::GetCurrentTimestamp() + delay;
+        work->next = delayed;
+        delayed = work;
+        if(work->deadline < next_deadline) { next_deadline = work->deadline; }
+        irqrestore(flags);
+        return true;
+    }
+
+    void WorkQueue::enqueue(WorkItem* work) {
+        work->next = NULL;
+        if(tail) { tail->next = work; }
+        else { head = work; }
+        tail = work;
+        for(size_t i = 0; i < max_workers; i++) {
+            Processes::Thread* worker = workers[i];
+            if(worker && worker->blocked == Processes::Thread::BlockState::Sleeping) {
+                Processes::Scheduler::the().WakeUp(worker);
+                break;
+            }
+        }
+    }
+
+    void WorkQueue::TimerCallback(void* arg) {
+        WorkQueue* queue = (WorkQueue*)arg;
+        uint64_t now = Hardware::Timer::GetCurrentTimestamp();
+        if(now < queue->next_deadline) { return; }
+        // We are in the timer IRQ, so interrupts are already off
+        queue->next_deadline = ~0ULL;
+        WorkItem** link = &queue->delayed;
+        while(*link) {
+            WorkItem* work = *link;
+            if(work->deadline > now) {
+                if(work->deadline < queue->next_deadline) { queue->next_deadline = work->deadline; }
+                link = &work->next;
+                continue;
+            }
+            *link = work->next;
+            queue->enqueue(work);
+        }
+    }
+
+    void WorkQueue::Worker(void* arg) {
+        WorkQueue* queue = (WorkQueue*)arg;
+        unsigned long flags = save_irqdisable();
+        for(size_t i = 0; i < max_workers; i++) {
+            if(!queue->workers[i]) {
+                queue->workers[i] = Processes::Scheduler::the().CurrentThread();
+                break;
+            }
+        }
+        for(;;) {
+            while(!queue->head) { Processes::Scheduler::the().SleepCurrent(); }
+            WorkItem* work = queue->head;
+            queue->head = work->next;
+            if(!queue->head) { queue->tail = NULL; }
+            // Clear this first, so the work can queue itself again
+            work->pending = false;
+            irqrestore(flags);
+            work->func(work->data);
+            flags = save_irqdisable();
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <processes/process.h>
+
+namespace Kernel {
+    // A piece of work that runs in a kernel thread. Unlike tasklets, work items can take their time, take any lock and sleep.
+    struct WorkItem {
+        WorkItem(void (*_func)(void*), void* _data) : func(_func), data(_data) { }
+        void (*func)(void* data);
+        void* data;
+        // Set while it is queued. Queueing it again before it ran does nothing.
+        volatile bool pending = false;
+        // When delayed work gets queued
+        uint64_t deadline = 0;
+        WorkItem* next = NULL;
+    };
+
+    class WorkQueue {
+    public:
+        // Start worker_count kernel threads serving the queue. Work can be queued before this, it just wont run yet.
+        void Init(size_t worker_count);
+
+        // Queue work. Safe to call from IRQ handlers and tasklets. Returns false if it already was queued.
+        bool queue(WorkItem* work);
+        // Queue work once delay ms have passed
+        bool queueDelayed(WorkItem* work, uint64_t delay);
+
+        // The shared queue, for work that does not need workers of its own
+        static WorkQueue& system() {
+            static WorkQueue instance;
+            return instance;
+        }
+
+    private:
+        static void Worker(void* arg);
+        // Moves delayed work whose time has come to the queue
+        static void TimerCallback(void* arg);
+        // Add work to the queue and wake up a worker. Interrupts must be disabled.
+        void enqueue(WorkItem* work);
+
+        // There is only one CPU, so there is one pool of workers. Once there are more, each CPU gets its own pool.
+        static const size_t max_workers = 4;
+        Processes::Thread* volatile workers[max_workers] = { };
+
+        // Protected by disabling interrupts
+        WorkItem* head = NULL;
+        WorkItem* tail = NULL;
+        WorkItem* delayed = NULL;
+        // Earliest deadline of the delayed work
+        volatile uint64_t next_deadline = ~0ULL;
+    };
+}
+
+#endif
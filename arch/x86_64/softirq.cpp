@@ -0,0 +1,36 @@
+#include <softirq.h>
+#include <hardware/instructions.h>
+
+namespace Kernel {
+    void SoftIRQ::Schedule(Tasklet* tasklet) {
+        unsigned long flags = save_irqdisable();
+        if(!tasklet->scheduled) {
+            tasklet->scheduled = true;
+            tasklet->next = NULL;
+            if(tail) { tail->next = tasklet; }
+            else { head = tasklet; }
+            tail = tasklet;
+        }
+        irqrestore(flags);
+    }
+
+    void SoftIRQ::Run() {
+        // IRQs that come in while tasklets run leave them to the outer Run
+        if(running || !head) { return; }
+        running = true;
+        while(head) {
+            Tasklet* curr = head;
+            head = tail = NULL;
+            asm volatile("sti");
+            while(curr) {
+                Tasklet* next = curr->next;
+                // Clear this first, so the tasklet can be scheduled again while it runs
+                curr->scheduled = false;
+                curr->func(curr->data);
+                curr = next;
+            }
+            asm volatile("cli");
+        }
+        running = false;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include <stddef.h>
+
+namespace Kernel {
+    // Work a hard IRQ handler defers. Tasklets run on the way out of the hard IRQ, after the EOI and with interrupts enabled,
+    // so other IRQs (like the timer) are not held off while they run.
+    // They still run in interrupt context: they cant sleep, and cant take locks that are held with interrupts enabled.
+    struct Tasklet {
+        Tasklet(void (*_func)(void*), void* _data) : func(_func), data(_data) { }
+        void (*func)(void* data);
+        void* data;
+        // Set while it is queued. Scheduling it again before it has run does nothing.
+        volatile bool scheduled = false;
+        Tasklet* next = NULL;
+    };
+
+    class SoftIRQ {
+    public:
+        // Queue a tasklet to run after the current IRQ. Safe to call from hard IRQ handlers.
+        void Schedule(Tasklet* tasklet);
+        // Run the queued tasklets. Called at the end of the IRQ handlers, with interrupts disabled, and returns with them disabled.
+        void Run();
+        // Tasklets run on the stack of whatever was interrupted, and the scheduler lets them finish before it switches away from it
+        inline bool InSoftIRQ() { return running; }
+
+        static SoftIRQ& the() {
+            static SoftIRQ instance;
+            return instance;
+        }
+
+    private:
+        // There is only one CPU, so there is a single queue. Once there are more, this becomes per CPU.
+        Tasklet* head = NULL;
+        Tasklet* tail = NULL;
+        volatile bool running = false;
+    };
+}
+
+#endif